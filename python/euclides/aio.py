@@ -0,0 +1,231 @@
+import asyncio
+import io
+import itertools
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+import grpc
+
+from . import euclidesproto_pb2_grpc as ec_grpc
+from . import euclidesproto_pb2 as ec_proto
+
+
+class ChannelPool(object):
+    """A pool of asyncio channels used in round-robin.
+
+    A single HTTP/2 connection caps the number of concurrent streams and
+    serializes the framing on one socket, so high-throughput clients
+    spread the RPCs over a few connections.
+    """
+
+    def __init__(self, hostname, port, size=4, options=None):
+        self.hostname = hostname
+        self.port = port
+        self.size = size
+        self.options = list(options or [])
+
+        self.hostport = "{}:{}".format(hostname, port)
+
+        # Without a local subchannel pool, the channels would share the
+        # same connection to the server.
+        channel_options = self.options + [("grpc.use_local_subchannel_pool", 1)]
+        self._channels = [
+            grpc.aio.insecure_channel(target=self.hostport, options=channel_options)
+            for _ in range(size)
+        ]
+        self._stubs = [ec_grpc.SimilarStub(channel) for channel in self._channels]
+        self._next_stub = itertools.cycle(self._stubs)
+
+    def stub(self):
+        return next(self._next_stub)
+
+    async def close(self):
+        await asyncio.gather(*(channel.close() for channel in self._channels))
+
+    async def __aenter__(self):
+        return self
+
+    async def __aexit__(self, exc_type, exc_value, exc_traceback):
+        await self.close()
+
+
+class IngestStats(object):
+    def __init__(self):
+        self.added = 0
+        self.failed = 0
+        self.bytes_sent = 0
+        self.elapsed = 0.0
+
+    @property
+    def throughput(self):
+        """Images added per second."""
+        return self.added / self.elapsed if self.elapsed > 0 else 0.0
+
+    def __str__(self):
+        return ("{} images added, {} failed, {:.1f} MB sent in {:.2f}s "
+                "({:.1f} images/s)").format(self.added, self.failed,
+                                            self.bytes_sent / 1024.0 / 1024.0,
+                                            self.elapsed, self.throughput)
+
+
+class AsyncEuclidesDB(object):
+    SHUTDOWN_REGULAR = 0
+    SHUTDOWN_REFRESH = 1
+
+    def __init__(self, pool, wire_image="jpeg", timeout=None):
+        self.pool = pool
+        self.wire_image = wire_image
+        self.timeout = timeout
+
+    def encode_image(self, image):
+        bytes_img = io.BytesIO()
+        image.save(bytes_img, format=self.wire_image)
+        return bytes_img.getvalue()
+
+    async def add_image_data(self, image_id, models, image_data,
+                             metadata=b"", omit_vectors=True, collection=""):
+        request = ec_proto.AddImageRequest()
+        request.image_id = int(image_id)
+        request.models.extend(models)
+        request.image_data = image_data
+        request.image_metadata = metadata
+        request.omit_vectors = omit_vectors
+        request.collection = collection
+        return await self.pool.stub().AddImage(request, timeout=self.timeout)
+
+    async def add_image(self, image_id, models, image, omit_vectors=True,
+                        collection=""):
+        return await self.add_image_data(image_id, models, self.encode_image(image),
+                                         omit_vectors=omit_vectors,
+                                         collection=collection)
+
+    async def remove_image(self, image_id, collection=""):
+        request = ec_proto.RemoveImageRequest()
+        request.image_id = int(image_id)
+        request.collection = collection
+        return await self.pool.stub().RemoveImage(request, timeout=self.timeout)
+
+    async def find_similar_image_data(self, image_data, models, top_k=5,
+                                      collection=""):
+        request = ec_proto.FindSimilarImageRequest()
+        request.models.extend(models)
+        request.top_k = int(top_k)
+        request.image_data = image_data
+        request.collection = collection
+        return await self.pool.stub().FindSimilarImage(request, timeout=self.timeout)
+
+    async def find_similar_image(self, image, models, top_k=5, collection=""):
+        return await self.find_similar_image_data(self.encode_image(image),
+                                                  models, top_k, collection)
+
+    async def find_similar_image_by_id(self, image_id, models, top_k=5,
+                                       collection=""):
+        request = ec_proto.FindSimilarImageByIdRequest()
+        request.models.extend(models)
+        request.top_k = int(top_k)
+        request.image_id = int(image_id)
+        request.collection = collection
+        return await self.pool.stub().FindSimilarImageById(request, timeout=self.timeout)
+
+    async def find_similar_by_vector(self, vectors, model, top_k=5,
+                                     collection=""):
+        request = ec_proto.FindSimilarByVectorRequest()
+        request.top_k = int(top_k)
+        request.collection = collection
+        for vector in vectors:
+            query = request.queries.add()
+            query.model = model
+            query.features.extend(vector)
+        return await self.pool.stub().FindSimilarByVector(request, timeout=self.timeout)
+
+    async def find_within_radius(self, image, models, radius, max_results=100,
+                                 collection=""):
+        request = ec_proto.FindWithinRadiusRequest()
+        request.collection = collection
+        request.models.extend(models)
+        request.radius = float(radius)
+        request.max_results = int(max_results)
+        request.image_data = self.encode_image(image)
+        return await self.pool.stub().FindWithinRadius(request, timeout=self.timeout)
+
+    async def reload_models(self):
+        request = ec_proto.ReloadModelsRequest()
+        return await self.pool.stub().ReloadModels(request, timeout=self.timeout)
+
+    async def refresh_collection(self, collection):
+        request = ec_proto.RefreshCollectionRequest()
+        request.collection = collection
+        return await self.pool.stub().RefreshCollection(request, timeout=self.timeout)
+
+    async def list_collections(self):
+        request = ec_proto.ListCollectionsRequest()
+        reply = await self.pool.stub().ListCollections(request, timeout=self.timeout)
+        return list(reply.collections)
+
+    async def get_slow_queries(self):
+        request = ec_proto.GetSlowQueriesRequest()
+        return await self.pool.stub().GetSlowQueries(request, timeout=self.timeout)
+
+    async def __shutdown(self, shutdown_type):
+        request = ec_proto.ShutdownRequest()
+        request.shutdown_type = shutdown_type
+        return await self.pool.stub().Shutdown(request, timeout=self.timeout)
+
+    async def refresh_index(self):
+        return await self.__shutdown(AsyncEuclidesDB.SHUTDOWN_REFRESH)
+
+    async def shutdown(self):
+        return await self.__shutdown(AsyncEuclidesDB.SHUTDOWN_REGULAR)
+
+    async def add_images(self, items, models, load_image, window=64,
+                         read_workers=8, on_error=None, collection=""):
+        """Add many images keeping a window of RPCs in-flight.
+
+        The images are read and encoded by a thread pool while the previous
+        ones are being sent, so the disk, the client CPU and the server are
+        all kept busy.
+
+        :param items: iterable of (image_id, source) pairs
+        :param models: the model spaces where the images are added
+        :param load_image: function called on a worker thread with the
+                           source, returning the encoded image bytes
+        :param window: maximum number of RPCs in-flight
+        :param read_workers: number of threads reading and encoding images
+        :param on_error: optional callback called with (image_id, exception)
+        :param collection: the collection where the images are added
+        :return: the IngestStats with the throughput
+        """
+        loop = asyncio.get_event_loop()
+        stats = IngestStats()
+        in_flight = asyncio.Semaphore(window)
+        pending = set()
+
+        async def send(image_id, read_future):
+            try:
+                image_data = await read_future
+                await self.add_image_data(image_id, models, image_data,
+                                          collection=collection)
+                stats.added += 1
+                stats.bytes_sent += len(image_data)
+            except (grpc.aio.AioRpcError, OSError) as ex:
+                stats.failed += 1
+                if on_error is not None:
+                    on_error(image_id, ex)
+            finally:
+                in_flight.release()
+
+        start = time.perf_counter()
+        with ThreadPoolExecutor(max_workers=read_workers) as executor:
+            for image_id, source in items:
+                # Bounds both the reads ahead and the RPCs in-flight
+                await in_flight.acquire()
+                read_future = loop.run_in_executor(executor, load_image, source)
+                task = asyncio.ensure_future(send(image_id, read_future))
+                pending.add(task)
+                task.add_done_callback(pending.discard)
+
+            if pending:
+                await asyncio.gather(*pending)
+        stats.elapsed = time.perf_counter() - start
+
+        return stats
@@ -1,11 +1,10 @@
+# -*- coding: utf-8 -*-
 # Generated by the protocol buffer compiler.  DO NOT EDIT!
 # source: euclidesproto.proto
-
-import sys
-_b=sys.version_info[0]<3 and (lambda x:x) or (lambda x:x.encode('latin1'))
+"""Generated protocol buffer code."""
+from google.protobuf.internal import builder as _builder
 from google.protobuf import descriptor as _descriptor
-from google.protobuf import message as _message
-from google.protobuf import reflection as _reflection
+from google.protobuf import descriptor_pool as _descriptor_pool
 from google.protobuf import symbol_database as _symbol_database
 # @@protoc_insertion_point(imports)
 
@@ -14,679 +13,78 @@ _sym_db = _symbol_database.Default()
 
 
 
-DESCRIPTOR = _descriptor.FileDescriptor(
-  name='euclidesproto.proto',
-  package='euclidesproto',
-  syntax='proto3',
-  serialized_options=_b('\n\020euclidesdb.protoB\rEuclidesProtoP\001'),
-  serialized_pb=_b('\n\x13\x65uclidesproto.proto\x12\reuclidesproto\".\n\x12\x45uclidesDBMetadata\x12\x18\n\x10\x64\x61tabase_version\x18\x01 \x01(\x05\"L\n\x17\x46indSimilarImageRequest\x12\r\n\x05top_k\x18\x01 \x01(\x05\x12\x12\n\nimage_data\x18\x02 \x01(\x0c\x12\x0e\n\x06models\x18\x03 \x03(\t\"N\n\x1b\x46indSimilarImageByIdRequest\x12\r\n\x05top_k\x18\x01 \x01(\x05\x12\x10\n\x08image_id\x18\x02 \x01(\x05\x12\x0e\n\x06models\x18\x03 \x03(\t\"D\n\rSearchResults\x12\x11\n\ttop_k_ids\x18\x01 \x03(\x05\x12\x11\n\tdistances\x18\x02 \x03(\x02\x12\r\n\x05model\x18\x03 \x01(\t\"F\n\x15\x46indSimilarImageReply\x12-\n\x07results\x18\x01 \x03(\x0b\x32\x1c.euclidesproto.SearchResults\"_\n\x0f\x41\x64\x64ImageRequest\x12\x10\n\x08image_id\x18\x01 \x01(\x05\x12\x12\n\nimage_data\x18\x02 \x01(\x0c\x12\x16\n\x0eimage_metadata\x18\x03 \x01(\x0c\x12\x0e\n\x06models\x18\x04 \x03(\t\"&\n\x12RemoveImageRequest\x12\x10\n\x08image_id\x18\x01 \x01(\x05\"$\n\x10RemoveImageReply\x12\x10\n\x08image_id\x18\x01 \x01(\x05\"C\n\x0bItemVectors\x12\r\n\x05model\x18\x01 \x01(\t\x12\x13\n\x0bpredictions\x18\x02 \x03(\x02\x12\x10\n\x08\x66\x65\x61tures\x18\x03 \x03(\x02\"Z\n\x08ItemData\x12\x0f\n\x07item_id\x18\x01 \x01(\x05\x12\x10\n\x08metadata\x18\x02 \x01(\x0c\x12+\n\x07vectors\x18\x03 \x03(\x0b\x32\x1a.euclidesproto.ItemVectors\"<\n\rAddImageReply\x12+\n\x07vectors\x18\x01 \x03(\x0b\x32\x1a.euclidesproto.ItemVectors\"(\n\x0fShutdownRequest\x12\x15\n\rshutdown_type\x18\x01 \x01(\x05\"!\n\rShutdownReply\x12\x10\n\x08shutdown\x18\x01 \x01(\x08\x32\xc6\x03\n\x07Similar\x12J\n\x08Shutdown\x12\x1e.euclidesproto.ShutdownRequest\x1a\x1c.euclidesproto.ShutdownReply\"\x00\x12\x62\n\x10\x46indSimilarImage\x12&.euclidesproto.FindSimilarImageRequest\x1a$.euclidesproto.FindSimilarImageReply\"\x00\x12j\n\x14\x46indSimilarImageById\x12*.euclidesproto.FindSimilarImageByIdRequest\x1a$.euclidesproto.FindSimilarImageReply\"\x00\x12J\n\x08\x41\x64\x64Image\x12\x1e.euclidesproto.AddImageRequest\x1a\x1c.euclidesproto.AddImageReply\"\x00\x12S\n\x0bRemoveImage\x12!.euclidesproto.RemoveImageRequest\x1a\x1f.euclidesproto.RemoveImageReply\"\x00\x42#\n\x10\x65uclidesdb.protoB\rEuclidesProtoP\x01\x62\x06proto3')
-)
-
-
-
-
-_EUCLIDESDBMETADATA = _descriptor.Descriptor(
-  name='EuclidesDBMetadata',
-  full_name='euclidesproto.EuclidesDBMetadata',
-  filename=None,
-  file=DESCRIPTOR,
-  containing_type=None,
-  fields=[
-    _descriptor.FieldDescriptor(
-      name='database_version', full_name='euclidesproto.EuclidesDBMetadata.database_version', index=0,
-      number=1, type=5, cpp_type=1, label=1,
-      has_default_value=False, default_value=0,
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-  ],
-  extensions=[
-  ],
-  nested_types=[],
-  enum_types=[
-  ],
-  serialized_options=None,
-  is_extendable=False,
-  syntax='proto3',
-  extension_ranges=[],
-  oneofs=[
-  ],
-  serialized_start=38,
-  serialized_end=84,
-)
-
-
-_FINDSIMILARIMAGEREQUEST = _descriptor.Descriptor(
-  name='FindSimilarImageRequest',
-  full_name='euclidesproto.FindSimilarImageRequest',
-  filename=None,
-  file=DESCRIPTOR,
-  containing_type=None,
-  fields=[
-    _descriptor.FieldDescriptor(
-      name='top_k', full_name='euclidesproto.FindSimilarImageRequest.top_k', index=0,
-      number=1, type=5, cpp_type=1, label=1,
-      has_default_value=False, default_value=0,
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-    _descriptor.FieldDescriptor(
-      name='image_data', full_name='euclidesproto.FindSimilarImageRequest.image_data', index=1,
-      number=2, type=12, cpp_type=9, label=1,
-      has_default_value=False, default_value=_b(""),
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-    _descriptor.FieldDescriptor(
-      name='models', full_name='euclidesproto.FindSimilarImageRequest.models', index=2,
-      number=3, type=9, cpp_type=9, label=3,
-      has_default_value=False, default_value=[],
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-  ],
-  extensions=[
-  ],
-  nested_types=[],
-  enum_types=[
-  ],
-  serialized_options=None,
-  is_extendable=False,
-  syntax='proto3',
-  extension_ranges=[],
-  oneofs=[
-  ],
-  serialized_start=86,
-  serialized_end=162,
-)
-
-
-_FINDSIMILARIMAGEBYIDREQUEST = _descriptor.Descriptor(
-  name='FindSimilarImageByIdRequest',
-  full_name='euclidesproto.FindSimilarImageByIdRequest',
-  filename=None,
-  file=DESCRIPTOR,
-  containing_type=None,
-  fields=[
-    _descriptor.FieldDescriptor(
-      name='top_k', full_name='euclidesproto.FindSimilarImageByIdRequest.top_k', index=0,
-      number=1, type=5, cpp_type=1, label=1,
-      has_default_value=False, default_value=0,
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-    _descriptor.FieldDescriptor(
-      name='image_id', full_name='euclidesproto.FindSimilarImageByIdRequest.image_id', index=1,
-      number=2, type=5, cpp_type=1, label=1,
-      has_default_value=False, default_value=0,
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-    _descriptor.FieldDescriptor(
-      name='models', full_name='euclidesproto.FindSimilarImageByIdRequest.models', index=2,
-      number=3, type=9, cpp_type=9, label=3,
-      has_default_value=False, default_value=[],
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-  ],
-  extensions=[
-  ],
-  nested_types=[],
-  enum_types=[
-  ],
-  serialized_options=None,
-  is_extendable=False,
-  syntax='proto3',
-  extension_ranges=[],
-  oneofs=[
-  ],
-  serialized_start=164,
-  serialized_end=242,
-)
-
-
-_SEARCHRESULTS = _descriptor.Descriptor(
-  name='SearchResults',
-  full_name='euclidesproto.SearchResults',
-  filename=None,
-  file=DESCRIPTOR,
-  containing_type=None,
-  fields=[
-    _descriptor.FieldDescriptor(
-      name='top_k_ids', full_name='euclidesproto.SearchResults.top_k_ids', index=0,
-      number=1, type=5, cpp_type=1, label=3,
-      has_default_value=False, default_value=[],
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-    _descriptor.FieldDescriptor(
-      name='distances', full_name='euclidesproto.SearchResults.distances', index=1,
-      number=2, type=2, cpp_type=6, label=3,
-      has_default_value=False, default_value=[],
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-    _descriptor.FieldDescriptor(
-      name='model', full_name='euclidesproto.SearchResults.model', index=2,
-      number=3, type=9, cpp_type=9, label=1,
-      has_default_value=False, default_value=_b("").decode('utf-8'),
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-  ],
-  extensions=[
-  ],
-  nested_types=[],
-  enum_types=[
-  ],
-  serialized_options=None,
-  is_extendable=False,
-  syntax='proto3',
-  extension_ranges=[],
-  oneofs=[
-  ],
-  serialized_start=244,
-  serialized_end=312,
-)
-
-
-_FINDSIMILARIMAGEREPLY = _descriptor.Descriptor(
-  name='FindSimilarImageReply',
-  full_name='euclidesproto.FindSimilarImageReply',
-  filename=None,
-  file=DESCRIPTOR,
-  containing_type=None,
-  fields=[
-    _descriptor.FieldDescriptor(
-      name='results', full_name='euclidesproto.FindSimilarImageReply.results', index=0,
-      number=1, type=11, cpp_type=10, label=3,
-      has_default_value=False, default_value=[],
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-  ],
-  extensions=[
-  ],
-  nested_types=[],
-  enum_types=[
-  ],
-  serialized_options=None,
-  is_extendable=False,
-  syntax='proto3',
-  extension_ranges=[],
-  oneofs=[
-  ],
-  serialized_start=314,
-  serialized_end=384,
-)
-
-
-_ADDIMAGEREQUEST = _descriptor.Descriptor(
-  name='AddImageRequest',
-  full_name='euclidesproto.AddImageRequest',
-  filename=None,
-  file=DESCRIPTOR,
-  containing_type=None,
-  fields=[
-    _descriptor.FieldDescriptor(
-      name='image_id', full_name='euclidesproto.AddImageRequest.image_id', index=0,
-      number=1, type=5, cpp_type=1, label=1,
-      has_default_value=False, default_value=0,
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-    _descriptor.FieldDescriptor(
-      name='image_data', full_name='euclidesproto.AddImageRequest.image_data', index=1,
-      number=2, type=12, cpp_type=9, label=1,
-      has_default_value=False, default_value=_b(""),
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-    _descriptor.FieldDescriptor(
-      name='image_metadata', full_name='euclidesproto.AddImageRequest.image_metadata', index=2,
-      number=3, type=12, cpp_type=9, label=1,
-      has_default_value=False, default_value=_b(""),
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-    _descriptor.FieldDescriptor(
-      name='models', full_name='euclidesproto.AddImageRequest.models', index=3,
-      number=4, type=9, cpp_type=9, label=3,
-      has_default_value=False, default_value=[],
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-  ],
-  extensions=[
-  ],
-  nested_types=[],
-  enum_types=[
-  ],
-  serialized_options=None,
-  is_extendable=False,
-  syntax='proto3',
-  extension_ranges=[],
-  oneofs=[
-  ],
-  serialized_start=386,
-  serialized_end=481,
-)
-
-
-_REMOVEIMAGEREQUEST = _descriptor.Descriptor(
-  name='RemoveImageRequest',
-  full_name='euclidesproto.RemoveImageRequest',
-  filename=None,
-  file=DESCRIPTOR,
-  containing_type=None,
-  fields=[
-    _descriptor.FieldDescriptor(
-      name='image_id', full_name='euclidesproto.RemoveImageRequest.image_id', index=0,
-      number=1, type=5, cpp_type=1, label=1,
-      has_default_value=False, default_value=0,
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-  ],
-  extensions=[
-  ],
-  nested_types=[],
-  enum_types=[
-  ],
-  serialized_options=None,
-  is_extendable=False,
-  syntax='proto3',
-  extension_ranges=[],
-  oneofs=[
-  ],
-  serialized_start=483,
-  serialized_end=521,
-)
-
-
-_REMOVEIMAGEREPLY = _descriptor.Descriptor(
-  name='RemoveImageReply',
-  full_name='euclidesproto.RemoveImageReply',
-  filename=None,
-  file=DESCRIPTOR,
-  containing_type=None,
-  fields=[
-    _descriptor.FieldDescriptor(
-      name='image_id', full_name='euclidesproto.RemoveImageReply.image_id', index=0,
-      number=1, type=5, cpp_type=1, label=1,
-      has_default_value=False, default_value=0,
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-  ],
-  extensions=[
-  ],
-  nested_types=[],
-  enum_types=[
-  ],
-  serialized_options=None,
-  is_extendable=False,
-  syntax='proto3',
-  extension_ranges=[],
-  oneofs=[
-  ],
-  serialized_start=523,
-  serialized_end=559,
-)
-
-
-_ITEMVECTORS = _descriptor.Descriptor(
-  name='ItemVectors',
-  full_name='euclidesproto.ItemVectors',
-  filename=None,
-  file=DESCRIPTOR,
-  containing_type=None,
-  fields=[
-    _descriptor.FieldDescriptor(
-      name='model', full_name='euclidesproto.ItemVectors.model', index=0,
-      number=1, type=9, cpp_type=9, label=1,
-      has_default_value=False, default_value=_b("").decode('utf-8'),
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-    _descriptor.FieldDescriptor(
-      name='predictions', full_name='euclidesproto.ItemVectors.predictions', index=1,
-      number=2, type=2, cpp_type=6, label=3,
-      has_default_value=False, default_value=[],
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-    _descriptor.FieldDescriptor(
-      name='features', full_name='euclidesproto.ItemVectors.features', index=2,
-      number=3, type=2, cpp_type=6, label=3,
-      has_default_value=False, default_value=[],
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-  ],
-  extensions=[
-  ],
-  nested_types=[],
-  enum_types=[
-  ],
-  serialized_options=None,
-  is_extendable=False,
-  syntax='proto3',
-  extension_ranges=[],
-  oneofs=[
-  ],
-  serialized_start=561,
-  serialized_end=628,
-)
-
-
-_ITEMDATA = _descriptor.Descriptor(
-  name='ItemData',
-  full_name='euclidesproto.ItemData',
-  filename=None,
-  file=DESCRIPTOR,
-  containing_type=None,
-  fields=[
-    _descriptor.FieldDescriptor(
-      name='item_id', full_name='euclidesproto.ItemData.item_id', index=0,
-      number=1, type=5, cpp_type=1, label=1,
-      has_default_value=False, default_value=0,
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-    _descriptor.FieldDescriptor(
-      name='metadata', full_name='euclidesproto.ItemData.metadata', index=1,
-      number=2, type=12, cpp_type=9, label=1,
-      has_default_value=False, default_value=_b(""),
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-    _descriptor.FieldDescriptor(
-      name='vectors', full_name='euclidesproto.ItemData.vectors', index=2,
-      number=3, type=11, cpp_type=10, label=3,
-      has_default_value=False, default_value=[],
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-  ],
-  extensions=[
-  ],
-  nested_types=[],
-  enum_types=[
-  ],
-  serialized_options=None,
-  is_extendable=False,
-  syntax='proto3',
-  extension_ranges=[],
-  oneofs=[
-  ],
-  serialized_start=630,
-  serialized_end=720,
-)
-
-
-_ADDIMAGEREPLY = _descriptor.Descriptor(
-  name='AddImageReply',
-  full_name='euclidesproto.AddImageReply',
-  filename=None,
-  file=DESCRIPTOR,
-  containing_type=None,
-  fields=[
-    _descriptor.FieldDescriptor(
-      name='vectors', full_name='euclidesproto.AddImageReply.vectors', index=0,
-      number=1, type=11, cpp_type=10, label=3,
-      has_default_value=False, default_value=[],
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-  ],
-  extensions=[
-  ],
-  nested_types=[],
-  enum_types=[
-  ],
-  serialized_options=None,
-  is_extendable=False,
-  syntax='proto3',
-  extension_ranges=[],
-  oneofs=[
-  ],
-  serialized_start=722,
-  serialized_end=782,
-)
-
-
-_SHUTDOWNREQUEST = _descriptor.Descriptor(
-  name='ShutdownRequest',
-  full_name='euclidesproto.ShutdownRequest',
-  filename=None,
-  file=DESCRIPTOR,
-  containing_type=None,
-  fields=[
-    _descriptor.FieldDescriptor(
-      name='shutdown_type', full_name='euclidesproto.ShutdownRequest.shutdown_type', index=0,
-      number=1, type=5, cpp_type=1, label=1,
-      has_default_value=False, default_value=0,
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-  ],
-  extensions=[
-  ],
-  nested_types=[],
-  enum_types=[
-  ],
-  serialized_options=None,
-  is_extendable=False,
-  syntax='proto3',
-  extension_ranges=[],
-  oneofs=[
-  ],
-  serialized_start=784,
-  serialized_end=824,
-)
-
-
-_SHUTDOWNREPLY = _descriptor.Descriptor(
-  name='ShutdownReply',
-  full_name='euclidesproto.ShutdownReply',
-  filename=None,
-  file=DESCRIPTOR,
-  containing_type=None,
-  fields=[
-    _descriptor.FieldDescriptor(
-      name='shutdown', full_name='euclidesproto.ShutdownReply.shutdown', index=0,
-      number=1, type=8, cpp_type=7, label=1,
-      has_default_value=False, default_value=False,
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR),
-  ],
-  extensions=[
-  ],
-  nested_types=[],
-  enum_types=[
-  ],
-  serialized_options=None,
-  is_extendable=False,
-  syntax='proto3',
-  extension_ranges=[],
-  oneofs=[
-  ],
-  serialized_start=826,
-  serialized_end=859,
-)
-
-_FINDSIMILARIMAGEREPLY.fields_by_name['results'].message_type = _SEARCHRESULTS
-_ITEMDATA.fields_by_name['vectors'].message_type = _ITEMVECTORS
-_ADDIMAGEREPLY.fields_by_name['vectors'].message_type = _ITEMVECTORS
-DESCRIPTOR.message_types_by_name['EuclidesDBMetadata'] = _EUCLIDESDBMETADATA
-DESCRIPTOR.message_types_by_name['FindSimilarImageRequest'] = _FINDSIMILARIMAGEREQUEST
-DESCRIPTOR.message_types_by_name['FindSimilarImageByIdRequest'] = _FINDSIMILARIMAGEBYIDREQUEST
-DESCRIPTOR.message_types_by_name['SearchResults'] = _SEARCHRESULTS
-DESCRIPTOR.message_types_by_name['FindSimilarImageReply'] = _FINDSIMILARIMAGEREPLY
-DESCRIPTOR.message_types_by_name['AddImageRequest'] = _ADDIMAGEREQUEST
-DESCRIPTOR.message_types_by_name['RemoveImageRequest'] = _REMOVEIMAGEREQUEST
-DESCRIPTOR.message_types_by_name['RemoveImageReply'] = _REMOVEIMAGEREPLY
-DESCRIPTOR.message_types_by_name['ItemVectors'] = _ITEMVECTORS
-DESCRIPTOR.message_types_by_name['ItemData'] = _ITEMDATA
-DESCRIPTOR.message_types_by_name['AddImageReply'] = _ADDIMAGEREPLY
-DESCRIPTOR.message_types_by_name['ShutdownRequest'] = _SHUTDOWNREQUEST
-DESCRIPTOR.message_types_by_name['ShutdownReply'] = _SHUTDOWNREPLY
-_sym_db.RegisterFileDescriptor(DESCRIPTOR)
-
-EuclidesDBMetadata = _reflection.GeneratedProtocolMessageType('EuclidesDBMetadata', (_message.Message,), dict(
-  DESCRIPTOR = _EUCLIDESDBMETADATA,
-  __module__ = 'euclidesproto_pb2'
-  # @@protoc_insertion_point(class_scope:euclidesproto.EuclidesDBMetadata)
-  ))
-_sym_db.RegisterMessage(EuclidesDBMetadata)
-
-FindSimilarImageRequest = _reflection.GeneratedProtocolMessageType('FindSimilarImageRequest', (_message.Message,), dict(
-  DESCRIPTOR = _FINDSIMILARIMAGEREQUEST,
-  __module__ = 'euclidesproto_pb2'
-  # @@protoc_insertion_point(class_scope:euclidesproto.FindSimilarImageRequest)
-  ))
-_sym_db.RegisterMessage(FindSimilarImageRequest)
-
-FindSimilarImageByIdRequest = _reflection.GeneratedProtocolMessageType('FindSimilarImageByIdRequest', (_message.Message,), dict(
-  DESCRIPTOR = _FINDSIMILARIMAGEBYIDREQUEST,
-  __module__ = 'euclidesproto_pb2'
-  # @@protoc_insertion_point(class_scope:euclidesproto.FindSimilarImageByIdRequest)
-  ))
-_sym_db.RegisterMessage(FindSimilarImageByIdRequest)
-
-SearchResults = _reflection.GeneratedProtocolMessageType('SearchResults', (_message.Message,), dict(
-  DESCRIPTOR = _SEARCHRESULTS,
-  __module__ = 'euclidesproto_pb2'
-  # @@protoc_insertion_point(class_scope:euclidesproto.SearchResults)
-  ))
-_sym_db.RegisterMessage(SearchResults)
-
-FindSimilarImageReply = _reflection.GeneratedProtocolMessageType('FindSimilarImageReply', (_message.Message,), dict(
-  DESCRIPTOR = _FINDSIMILARIMAGEREPLY,
-  __module__ = 'euclidesproto_pb2'
-  # @@protoc_insertion_point(class_scope:euclidesproto.FindSimilarImageReply)
-  ))
-_sym_db.RegisterMessage(FindSimilarImageReply)
-
-AddImageRequest = _reflection.GeneratedProtocolMessageType('AddImageRequest', (_message.Message,), dict(
-  DESCRIPTOR = _ADDIMAGEREQUEST,
-  __module__ = 'euclidesproto_pb2'
-  # @@protoc_insertion_point(class_scope:euclidesproto.AddImageRequest)
-  ))
-_sym_db.RegisterMessage(AddImageRequest)
-
-RemoveImageRequest = _reflection.GeneratedProtocolMessageType('RemoveImageRequest', (_message.Message,), dict(
-  DESCRIPTOR = _REMOVEIMAGEREQUEST,
-  __module__ = 'euclidesproto_pb2'
-  # @@protoc_insertion_point(class_scope:euclidesproto.RemoveImageRequest)
-  ))
-_sym_db.RegisterMessage(RemoveImageRequest)
-
-RemoveImageReply = _reflection.GeneratedProtocolMessageType('RemoveImageReply', (_message.Message,), dict(
-  DESCRIPTOR = _REMOVEIMAGEREPLY,
-  __module__ = 'euclidesproto_pb2'
-  # @@protoc_insertion_point(class_scope:euclidesproto.RemoveImageReply)
-  ))
-_sym_db.RegisterMessage(RemoveImageReply)
-
-ItemVectors = _reflection.GeneratedProtocolMessageType('ItemVectors', (_message.Message,), dict(
-  DESCRIPTOR = _ITEMVECTORS,
-  __module__ = 'euclidesproto_pb2'
-  # @@protoc_insertion_point(class_scope:euclidesproto.ItemVectors)
-  ))
-_sym_db.RegisterMessage(ItemVectors)
-
-ItemData = _reflection.GeneratedProtocolMessageType('ItemData', (_message.Message,), dict(
-  DESCRIPTOR = _ITEMDATA,
-  __module__ = 'euclidesproto_pb2'
-  # @@protoc_insertion_point(class_scope:euclidesproto.ItemData)
-  ))
-_sym_db.RegisterMessage(ItemData)
-
-AddImageReply = _reflection.GeneratedProtocolMessageType('AddImageReply', (_message.Message,), dict(
-  DESCRIPTOR = _ADDIMAGEREPLY,
-  __module__ = 'euclidesproto_pb2'
-  # @@protoc_insertion_point(class_scope:euclidesproto.AddImageReply)
-  ))
-_sym_db.RegisterMessage(AddImageReply)
-
-ShutdownRequest = _reflection.GeneratedProtocolMessageType('ShutdownRequest', (_message.Message,), dict(
-  DESCRIPTOR = _SHUTDOWNREQUEST,
-  __module__ = 'euclidesproto_pb2'
-  # @@protoc_insertion_point(class_scope:euclidesproto.ShutdownRequest)
-  ))
-_sym_db.RegisterMessage(ShutdownRequest)
-
-ShutdownReply = _reflection.GeneratedProtocolMessageType('ShutdownReply', (_message.Message,), dict(
-  DESCRIPTOR = _SHUTDOWNREPLY,
-  __module__ = 'euclidesproto_pb2'
-  # @@protoc_insertion_point(class_scope:euclidesproto.ShutdownReply)
-  ))
-_sym_db.RegisterMessage(ShutdownReply)
-
-
-DESCRIPTOR._options = None
-
-_SIMILAR = _descriptor.ServiceDescriptor(
-  name='Similar',
-  full_name='euclidesproto.Similar',
-  file=DESCRIPTOR,
-  index=0,
-  serialized_options=None,
-  serialized_start=862,
-  serialized_end=1316,
-  methods=[
-  _descriptor.MethodDescriptor(
-    name='Shutdown',
-    full_name='euclidesproto.Similar.Shutdown',
-    index=0,
-    containing_service=None,
-    input_type=_SHUTDOWNREQUEST,
-    output_type=_SHUTDOWNREPLY,
-    serialized_options=None,
-  ),
-  _descriptor.MethodDescriptor(
-    name='FindSimilarImage',
-    full_name='euclidesproto.Similar.FindSimilarImage',
-    index=1,
-    containing_service=None,
-    input_type=_FINDSIMILARIMAGEREQUEST,
-    output_type=_FINDSIMILARIMAGEREPLY,
-    serialized_options=None,
-  ),
-  _descriptor.MethodDescriptor(
-    name='FindSimilarImageById',
-    full_name='euclidesproto.Similar.FindSimilarImageById',
-    index=2,
-    containing_service=None,
-    input_type=_FINDSIMILARIMAGEBYIDREQUEST,
-    output_type=_FINDSIMILARIMAGEREPLY,
-    serialized_options=None,
-  ),
-  _descriptor.MethodDescriptor(
-    name='AddImage',
-    full_name='euclidesproto.Similar.AddImage',
-    index=3,
-    containing_service=None,
-    input_type=_ADDIMAGEREQUEST,
-    output_type=_ADDIMAGEREPLY,
-    serialized_options=None,
-  ),
-  _descriptor.MethodDescriptor(
-    name='RemoveImage',
-    full_name='euclidesproto.Similar.RemoveImage',
-    index=4,
-    containing_service=None,
-    input_type=_REMOVEIMAGEREQUEST,
-    output_type=_REMOVEIMAGEREPLY,
-    serialized_options=None,
-  ),
-])
-_sym_db.RegisterServiceDescriptor(_SIMILAR)
-
-DESCRIPTOR.services_by_name['Similar'] = _SIMILAR
-
+DESCRIPTOR = _descriptor_pool.Default().AddSerializedFile(b'\n\x13\x65uclidesproto.proto\x12\reuclidesproto\".\n\x12\x45uclidesDBMetadata\x12\x18\n\x10\x64\x61tabase_version\x18\x01 \x01(\x05\"X\n\rSearchOptions\x12\x0e\n\x06nprobe\x18\x01 \x01(\x05\x12\x11\n\tef_search\x18\x02 \x01(\x05\x12\x10\n\x08search_k\x18\x03 \x01(\x05\x12\x12\n\ntimeout_ms\x18\x04 \x01(\x05\"\x96\x01\n\x17\x46indSimilarImageRequest\x12\r\n\x05top_k\x18\x01 \x01(\x05\x12\x12\n\nimage_data\x18\x02 \x01(\x0c\x12\x0e\n\x06models\x18\x03 \x03(\t\x12\x34\n\x0esearch_options\x18\x04 \x01(\x0b\x32\x1c.euclidesproto.SearchOptions\x12\x12\n\ncollection\x18\x05 \x01(\t\"\x98\x01\n\x1b\x46indSimilarImageByIdRequest\x12\r\n\x05top_k\x18\x01 \x01(\x05\x12\x10\n\x08image_id\x18\x02 \x01(\x05\x12\x0e\n\x06models\x18\x03 \x03(\t\x12\x34\n\x0esearch_options\x18\x04 \x01(\x0b\x32\x1c.euclidesproto.SearchOptions\x12\x12\n\ncollection\x18\x05 \x01(\t\"\xac\x01\n\x17\x46indWithinRadiusRequest\x12\x0e\n\x06radius\x18\x01 \x01(\x02\x12\x13\n\x0bmax_results\x18\x02 \x01(\x05\x12\x12\n\nimage_data\x18\x03 \x01(\x0c\x12\x0e\n\x06models\x18\x04 \x03(\t\x12\x34\n\x0esearch_options\x18\x05 \x01(\x0b\x32\x1c.euclidesproto.SearchOptions\x12\x12\n\ncollection\x18\x06 \x01(\t\".\n\x0bVectorQuery\x12\r\n\x05model\x18\x01 \x01(\t\x12\x10\n\x08\x66\x65\x61tures\x18\x02 \x03(\x02\"\xa2\x01\n\x1a\x46indSimilarByVectorRequest\x12\r\n\x05top_k\x18\x01 \x01(\x05\x12+\n\x07queries\x18\x02 \x03(\x0b\x32\x1a.euclidesproto.VectorQuery\x12\x34\n\x0esearch_options\x18\x03 \x01(\x0b\x32\x1c.euclidesproto.SearchOptions\x12\x12\n\ncollection\x18\x04 \x01(\t\"D\n\rSearchResults\x12\x11\n\ttop_k_ids\x18\x01 \x03(\x05\x12\x11\n\tdistances\x18\x02 \x03(\x02\x12\r\n\x05model\x18\x03 \x01(\t\"W\n\x15\x46indSimilarImageReply\x12-\n\x07results\x18\x01 \x03(\x0b\x32\x1c.euclidesproto.SearchResults\x12\x0f\n\x07partial\x18\x02 \x01(\x08\"\x89\x01\n\x0f\x41\x64\x64ImageRequest\x12\x10\n\x08image_id\x18\x01 \x01(\x05\x12\x12\n\nimage_data\x18\x02 \x01(\x0c\x12\x16\n\x0eimage_metadata\x18\x03 \x01(\x0c\x12\x0e\n\x06models\x18\x04 \x03(\t\x12\x14\n\x0comit_vectors\x18\x05 \x01(\x08\x12\x12\n\ncollection\x18\x06 \x01(\t\":\n\x12RemoveImageRequest\x12\x10\n\x08image_id\x18\x01 \x01(\x05\x12\x12\n\ncollection\x18\x02 \x01(\t\"$\n\x10RemoveImageReply\x12\x10\n\x08image_id\x18\x01 \x01(\x05\"z\n\x0bItemVectors\x12\r\n\x05model\x18\x01 \x01(\t\x12\x13\n\x0bpredictions\x18\x02 \x03(\x02\x12\x10\n\x08\x66\x65\x61tures\x18\x03 \x03(\x02\x12\x1a\n\x12prediction_classes\x18\x04 \x03(\x05\x12\x19\n\x11prediction_scores\x18\x05 \x03(\x02\"Z\n\x08ItemData\x12\x0f\n\x07item_id\x18\x01 \x01(\x05\x12\x10\n\x08metadata\x18\x02 \x01(\x0c\x12+\n\x07vectors\x18\x03 \x03(\x0b\x32\x1a.euclidesproto.ItemVectors\"<\n\rAddImageReply\x12+\n\x07vectors\x18\x01 \x03(\x0b\x32\x1a.euclidesproto.ItemVectors\"\x15\n\x13ReloadModelsRequest\"#\n\x11ReloadModelsReply\x12\x0e\n\x06models\x18\x01 \x03(\t\".\n\x18RefreshCollectionRequest\x12\x12\n\ncollection\x18\x01 \x01(\t\"+\n\x16RefreshCollectionReply\x12\x11\n\trefreshed\x18\x01 \x01(\x08\"\x18\n\x16ListCollectionsRequest\"+\n\x14ListCollectionsReply\x12\x13\n\x0b\x63ollections\x18\x01 \x03(\t\"\x17\n\x15GetSlowQueriesRequest\"A\n\nTraceStage\x12\x0c\n\x04name\x18\x01 \x01(\t\x12\x10\n\x08start_ms\x18\x02 \x01(\x01\x12\x13\n\x0b\x64uration_ms\x18\x03 \x01(\x01\"\\\n\tSlowQuery\x12\x0f\n\x07request\x18\x01 \x01(\t\x12\x13\n\x0b\x64uration_ms\x18\x02 \x01(\x01\x12)\n\x06stages\x18\x03 \x03(\x0b\x32\x19.euclidesproto.TraceStage\"@\n\x13GetSlowQueriesReply\x12)\n\x07queries\x18\x01 \x03(\x0b\x32\x18.euclidesproto.SlowQuery\"(\n\x12GetSnapshotRequest\x12\x12\n\ncollection\x18\x01 \x01(\t\"X\n\rSnapshotChunk\x12\r\n\x05\x65poch\x18\x01 \x01(\t\x12\x10\n\x08sequence\x18\x02 \x01(\x04\x12&\n\x05items\x18\x03 \x03(\x0b\x32\x17.euclidesproto.ItemData\"Q\n\x14StreamChangesRequest\x12\x12\n\ncollection\x18\x01 \x01(\t\x12\r\n\x05\x65poch\x18\x02 \x01(\t\x12\x16\n\x0e\x61\x66ter_sequence\x18\x03 \x01(\x04\"\xbe\x01\n\x0b\x43hangeEvent\x12\x33\n\x04type\x18\x01 \x01(\x0e\x32%.euclidesproto.ChangeEvent.ChangeType\x12\x10\n\x08sequence\x18\x02 \x01(\x04\x12\x0f\n\x07item_id\x18\x03 \x01(\x05\x12%\n\x04item\x18\x04 \x01(\x0b\x32\x17.euclidesproto.ItemData\"0\n\nChangeType\x12\x07\n\x03PUT\x10\x00\x12\n\n\x06REMOVE\x10\x01\x12\r\n\tHEARTBEAT\x10\x02\"(\n\x0fShutdownRequest\x12\x15\n\rshutdown_type\x18\x01 \x01(\x05\"!\n\rShutdownReply\x12\x10\n\x08shutdown\x18\x01 \x01(\x08\x32\xbc\t\n\x07Similar\x12J\n\x08Shutdown\x12\x1e.euclidesproto.ShutdownRequest\x1a\x1c.euclidesproto.ShutdownReply\"\x00\x12\x62\n\x10\x46indSimilarImage\x12&.euclidesproto.FindSimilarImageRequest\x1a$.euclidesproto.FindSimilarImageReply\"\x00\x12j\n\x14\x46indSimilarImageById\x12*.euclidesproto.FindSimilarImageByIdRequest\x1a$.euclidesproto.FindSimilarImageReply\"\x00\x12\x62\n\x10\x46indWithinRadius\x12&.euclidesproto.FindWithinRadiusRequest\x1a$.euclidesproto.FindSimilarImageReply\"\x00\x12h\n\x13\x46indSimilarByVector\x12).euclidesproto.FindSimilarByVectorRequest\x1a$.euclidesproto.FindSimilarImageReply\"\x00\x12J\n\x08\x41\x64\x64Image\x12\x1e.euclidesproto.AddImageRequest\x1a\x1c.euclidesproto.AddImageReply\"\x00\x12S\n\x0bRemoveImage\x12!.euclidesproto.RemoveImageRequest\x1a\x1f.euclidesproto.RemoveImageReply\"\x00\x12V\n\x0cReloadModels\x12\".euclidesproto.ReloadModelsRequest\x1a .euclidesproto.ReloadModelsReply\"\x00\x12\\\n\x0eGetSlowQueries\x12$.euclidesproto.GetSlowQueriesRequest\x1a\".euclidesproto.GetSlowQueriesReply\"\x00\x12\x65\n\x11RefreshCollection\x12\'.euclidesproto.RefreshCollectionRequest\x1a%.euclidesproto.RefreshCollectionReply\"\x00\x12_\n\x0fListCollections\x12%.euclidesproto.ListCollectionsRequest\x1a#.euclidesproto.ListCollectionsReply\"\x00\x12R\n\x0bGetSnapshot\x12!.euclidesproto.GetSnapshotRequest\x1a\x1c.euclidesproto.SnapshotChunk\"\x00\x30\x01\x12T\n\rStreamChanges\x12#.euclidesproto.StreamChangesRequest\x1a\x1a.euclidesproto.ChangeEvent\"\x00\x30\x01\x42&\n\x10\x65uclidesdb.protoB\rEuclidesProtoP\x01\xf8\x01\x01\x62\x06proto3')
+
+_builder.BuildMessageAndEnumDescriptors(DESCRIPTOR, globals())
+_builder.BuildTopDescriptorsAndMessages(DESCRIPTOR, 'euclidesproto_pb2', globals())
+if _descriptor._USE_C_DESCRIPTORS == False:
+
+  DESCRIPTOR._options = None
+  DESCRIPTOR._serialized_options = b'\n\020euclidesdb.protoB\rEuclidesProtoP\001\370\001\001'
+  _EUCLIDESDBMETADATA._serialized_start=38
+  _EUCLIDESDBMETADATA._serialized_end=84
+  _SEARCHOPTIONS._serialized_start=86
+  _SEARCHOPTIONS._serialized_end=174
+  _FINDSIMILARIMAGEREQUEST._serialized_start=177
+  _FINDSIMILARIMAGEREQUEST._serialized_end=327
+  _FINDSIMILARIMAGEBYIDREQUEST._serialized_start=330
+  _FINDSIMILARIMAGEBYIDREQUEST._serialized_end=482
+  _FINDWITHINRADIUSREQUEST._serialized_start=485
+  _FINDWITHINRADIUSREQUEST._serialized_end=657
+  _VECTORQUERY._serialized_start=659
+  _VECTORQUERY._serialized_end=705
+  _FINDSIMILARBYVECTORREQUEST._serialized_start=708
+  _FINDSIMILARBYVECTORREQUEST._serialized_end=870
+  _SEARCHRESULTS._serialized_start=872
+  _SEARCHRESULTS._serialized_end=940
+  _FINDSIMILARIMAGEREPLY._serialized_start=942
+  _FINDSIMILARIMAGEREPLY._serialized_end=1029
+  _ADDIMAGEREQUEST._serialized_start=1032
+  _ADDIMAGEREQUEST._serialized_end=1169
+  _REMOVEIMAGEREQUEST._serialized_start=1171
+  _REMOVEIMAGEREQUEST._serialized_end=1229
+  _REMOVEIMAGEREPLY._serialized_start=1231
+  _REMOVEIMAGEREPLY._serialized_end=1267
+  _ITEMVECTORS._serialized_start=1269
+  _ITEMVECTORS._serialized_end=1391
+  _ITEMDATA._serialized_start=1393
+  _ITEMDATA._serialized_end=1483
+  _ADDIMAGEREPLY._serialized_start=1485
+  _ADDIMAGEREPLY._serialized_end=1545
+  _RELOADMODELSREQUEST._serialized_start=1547
+  _RELOADMODELSREQUEST._serialized_end=1568
+  _RELOADMODELSREPLY._serialized_start=1570
+  _RELOADMODELSREPLY._serialized_end=1605
+  _REFRESHCOLLECTIONREQUEST._serialized_start=1607
+  _REFRESHCOLLECTIONREQUEST._serialized_end=1653
+  _REFRESHCOLLECTIONREPLY._serialized_start=1655
+  _REFRESHCOLLECTIONREPLY._serialized_end=1698
+  _LISTCOLLECTIONSREQUEST._serialized_start=1700
+  _LISTCOLLECTIONSREQUEST._serialized_end=1724
+  _LISTCOLLECTIONSREPLY._serialized_start=1726
+  _LISTCOLLECTIONSREPLY._serialized_end=1769
+  _GETSLOWQUERIESREQUEST._serialized_start=1771
+  _GETSLOWQUERIESREQUEST._serialized_end=1794
+  _TRACESTAGE._serialized_start=1796
+  _TRACESTAGE._serialized_end=1861
+  _SLOWQUERY._serialized_start=1863
+  _SLOWQUERY._serialized_end=1955
+  _GETSLOWQUERIESREPLY._serialized_start=1957
+  _GETSLOWQUERIESREPLY._serialized_end=2021
+  _GETSNAPSHOTREQUEST._serialized_start=2023
+  _GETSNAPSHOTREQUEST._serialized_end=2063
+  _SNAPSHOTCHUNK._serialized_start=2065
+  _SNAPSHOTCHUNK._serialized_end=2153
+  _STREAMCHANGESREQUEST._serialized_start=2155
+  _STREAMCHANGESREQUEST._serialized_end=2236
+  _CHANGEEVENT._serialized_start=2239
+  _CHANGEEVENT._serialized_end=2429
+  _CHANGEEVENT_CHANGETYPE._serialized_start=2381
+  _CHANGEEVENT_CHANGETYPE._serialized_end=2429
+  _SHUTDOWNREQUEST._serialized_start=2431
+  _SHUTDOWNREQUEST._serialized_end=2471
+  _SHUTDOWNREPLY._serialized_start=2473
+  _SHUTDOWNREPLY._serialized_end=2506
+  _SIMILAR._serialized_start=2509
+  _SIMILAR._serialized_end=3721
 # @@protoc_insertion_point(module_scope)
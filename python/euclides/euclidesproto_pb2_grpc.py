@@ -29,6 +29,16 @@ class SimilarStub(object):
         request_serializer=euclidesproto__pb2.FindSimilarImageByIdRequest.SerializeToString,
         response_deserializer=euclidesproto__pb2.FindSimilarImageReply.FromString,
         )
+    self.FindWithinRadius = channel.unary_unary(
+        '/euclidesproto.Similar/FindWithinRadius',
+        request_serializer=euclidesproto__pb2.FindWithinRadiusRequest.SerializeToString,
+        response_deserializer=euclidesproto__pb2.FindSimilarImageReply.FromString,
+        )
+    self.FindSimilarByVector = channel.unary_unary(
+        '/euclidesproto.Similar/FindSimilarByVector',
+        request_serializer=euclidesproto__pb2.FindSimilarByVectorRequest.SerializeToString,
+        response_deserializer=euclidesproto__pb2.FindSimilarImageReply.FromString,
+        )
     self.AddImage = channel.unary_unary(
         '/euclidesproto.Similar/AddImage',
         request_serializer=euclidesproto__pb2.AddImageRequest.SerializeToString,
@@ -39,6 +49,36 @@ class SimilarStub(object):
         request_serializer=euclidesproto__pb2.RemoveImageRequest.SerializeToString,
         response_deserializer=euclidesproto__pb2.RemoveImageReply.FromString,
         )
+    self.ReloadModels = channel.unary_unary(
+        '/euclidesproto.Similar/ReloadModels',
+        request_serializer=euclidesproto__pb2.ReloadModelsRequest.SerializeToString,
+        response_deserializer=euclidesproto__pb2.ReloadModelsReply.FromString,
+        )
+    self.GetSlowQueries = channel.unary_unary(
+        '/euclidesproto.Similar/GetSlowQueries',
+        request_serializer=euclidesproto__pb2.GetSlowQueriesRequest.SerializeToString,
+        response_deserializer=euclidesproto__pb2.GetSlowQueriesReply.FromString,
+        )
+    self.RefreshCollection = channel.unary_unary(
+        '/euclidesproto.Similar/RefreshCollection',
+        request_serializer=euclidesproto__pb2.RefreshCollectionRequest.SerializeToString,
+        response_deserializer=euclidesproto__pb2.RefreshCollectionReply.FromString,
+        )
+    self.ListCollections = channel.unary_unary(
+        '/euclidesproto.Similar/ListCollections',
+        request_serializer=euclidesproto__pb2.ListCollectionsRequest.SerializeToString,
+        response_deserializer=euclidesproto__pb2.ListCollectionsReply.FromString,
+        )
+    self.GetSnapshot = channel.unary_stream(
+        '/euclidesproto.Similar/GetSnapshot',
+        request_serializer=euclidesproto__pb2.GetSnapshotRequest.SerializeToString,
+        response_deserializer=euclidesproto__pb2.SnapshotChunk.FromString,
+        )
+    self.StreamChanges = channel.unary_stream(
+        '/euclidesproto.Similar/StreamChanges',
+        request_serializer=euclidesproto__pb2.StreamChangesRequest.SerializeToString,
+        response_deserializer=euclidesproto__pb2.ChangeEvent.FromString,
+        )
 
 
 class SimilarServicer(object):
@@ -66,6 +106,20 @@ class SimilarServicer(object):
     context.set_details('Method not implemented!')
     raise NotImplementedError('Method not implemented!')
 
+  def FindWithinRadius(self, request, context):
+    # missing associated documentation comment in .proto file
+    pass
+    context.set_code(grpc.StatusCode.UNIMPLEMENTED)
+    context.set_details('Method not implemented!')
+    raise NotImplementedError('Method not implemented!')
+
+  def FindSimilarByVector(self, request, context):
+    # missing associated documentation comment in .proto file
+    pass
+    context.set_code(grpc.StatusCode.UNIMPLEMENTED)
+    context.set_details('Method not implemented!')
+    raise NotImplementedError('Method not implemented!')
+
   def AddImage(self, request, context):
     # missing associated documentation comment in .proto file
     pass
@@ -80,6 +134,48 @@ class SimilarServicer(object):
     context.set_details('Method not implemented!')
     raise NotImplementedError('Method not implemented!')
 
+  def ReloadModels(self, request, context):
+    # missing associated documentation comment in .proto file
+    pass
+    context.set_code(grpc.StatusCode.UNIMPLEMENTED)
+    context.set_details('Method not implemented!')
+    raise NotImplementedError('Method not implemented!')
+
+  def GetSlowQueries(self, request, context):
+    # missing associated documentation comment in .proto file
+    pass
+    context.set_code(grpc.StatusCode.UNIMPLEMENTED)
+    context.set_details('Method not implemented!')
+    raise NotImplementedError('Method not implemented!')
+
+  def RefreshCollection(self, request, context):
+    # missing associated documentation comment in .proto file
+    pass
+    context.set_code(grpc.StatusCode.UNIMPLEMENTED)
+    context.set_details('Method not implemented!')
+    raise NotImplementedError('Method not implemented!')
+
+  def ListCollections(self, request, context):
+    # missing associated documentation comment in .proto file
+    pass
+    context.set_code(grpc.StatusCode.UNIMPLEMENTED)
+    context.set_details('Method not implemented!')
+    raise NotImplementedError('Method not implemented!')
+
+  def GetSnapshot(self, request, context):
+    # missing associated documentation comment in .proto file
+    pass
+    context.set_code(grpc.StatusCode.UNIMPLEMENTED)
+    context.set_details('Method not implemented!')
+    raise NotImplementedError('Method not implemented!')
+
+  def StreamChanges(self, request, context):
+    # missing associated documentation comment in .proto file
+    pass
+    context.set_code(grpc.StatusCode.UNIMPLEMENTED)
+    context.set_details('Method not implemented!')
+    raise NotImplementedError('Method not implemented!')
+
 
 def add_SimilarServicer_to_server(servicer, server):
   rpc_method_handlers = {
@@ -98,6 +194,16 @@ def add_SimilarServicer_to_server(servicer, server):
           request_deserializer=euclidesproto__pb2.FindSimilarImageByIdRequest.FromString,
           response_serializer=euclidesproto__pb2.FindSimilarImageReply.SerializeToString,
       ),
+      'FindWithinRadius': grpc.unary_unary_rpc_method_handler(
+          servicer.FindWithinRadius,
+          request_deserializer=euclidesproto__pb2.FindWithinRadiusRequest.FromString,
+          response_serializer=euclidesproto__pb2.FindSimilarImageReply.SerializeToString,
+      ),
+      'FindSimilarByVector': grpc.unary_unary_rpc_method_handler(
+          servicer.FindSimilarByVector,
+          request_deserializer=euclidesproto__pb2.FindSimilarByVectorRequest.FromString,
+          response_serializer=euclidesproto__pb2.FindSimilarImageReply.SerializeToString,
+      ),
       'AddImage': grpc.unary_unary_rpc_method_handler(
           servicer.AddImage,
           request_deserializer=euclidesproto__pb2.AddImageRequest.FromString,
@@ -108,6 +214,36 @@ def add_SimilarServicer_to_server(servicer, server):
           request_deserializer=euclidesproto__pb2.RemoveImageRequest.FromString,
           response_serializer=euclidesproto__pb2.RemoveImageReply.SerializeToString,
       ),
+      'ReloadModels': grpc.unary_unary_rpc_method_handler(
+          servicer.ReloadModels,
+          request_deserializer=euclidesproto__pb2.ReloadModelsRequest.FromString,
+          response_serializer=euclidesproto__pb2.ReloadModelsReply.SerializeToString,
+      ),
+      'GetSlowQueries': grpc.unary_unary_rpc_method_handler(
+          servicer.GetSlowQueries,
+          request_deserializer=euclidesproto__pb2.GetSlowQueriesRequest.FromString,
+          response_serializer=euclidesproto__pb2.GetSlowQueriesReply.SerializeToString,
+      ),
+      'RefreshCollection': grpc.unary_unary_rpc_method_handler(
+          servicer.RefreshCollection,
+          request_deserializer=euclidesproto__pb2.RefreshCollectionRequest.FromString,
+          response_serializer=euclidesproto__pb2.RefreshCollectionReply.SerializeToString,
+      ),
+      'ListCollections': grpc.unary_unary_rpc_method_handler(
+          servicer.ListCollections,
+          request_deserializer=euclidesproto__pb2.ListCollectionsRequest.FromString,
+          response_serializer=euclidesproto__pb2.ListCollectionsReply.SerializeToString,
+      ),
+      'GetSnapshot': grpc.unary_stream_rpc_method_handler(
+          servicer.GetSnapshot,
+          request_deserializer=euclidesproto__pb2.GetSnapshotRequest.FromString,
+          response_serializer=euclidesproto__pb2.SnapshotChunk.SerializeToString,
+      ),
+      'StreamChanges': grpc.unary_stream_rpc_method_handler(
+          servicer.StreamChanges,
+          request_deserializer=euclidesproto__pb2.StreamChangesRequest.FromString,
+          response_serializer=euclidesproto__pb2.ChangeEvent.SerializeToString,
+      ),
   }
   generic_handler = grpc.method_handlers_generic_handler(
       'euclidesproto.Similar', rpc_method_handlers)
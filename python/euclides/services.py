@@ -36,40 +36,84 @@ class EuclidesDB(object):
         self.stub = ec_grpc.SimilarStub(self.channel._channel)
         self.wire_image = wire_image
 
-    def add_image(self, image_id, models, image):
+    def add_image(self, image_id, models, image, collection=""):
         bytes_img = io.BytesIO()
         image.save(bytes_img, format=self.wire_image)
         request = ec_proto.AddImageRequest()
         request.image_id = int(image_id)
         request.models.extend(models)
         request.image_data = bytes_img.getvalue()
+        request.collection = collection
         reply = self.stub.AddImage(request)
         return reply
 
-    def remove_image(self, image_id):
+    def remove_image(self, image_id, collection=""):
         request = ec_proto.RemoveImageRequest()
         request.image_id = int(image_id)
+        request.collection = collection
         reply = self.stub.RemoveImage(request)
         return reply
 
-    def find_similar_image(self, image, models, top_k=5):
+    def find_similar_image(self, image, models, top_k=5, collection=""):
         bytes_img = io.BytesIO()
         image.save(bytes_img, format=self.wire_image)
         request = ec_proto.FindSimilarImageRequest()
         request.models.extend(models)
         request.top_k = int(top_k)
         request.image_data = bytes_img.getvalue()
+        request.collection = collection
         reply = self.stub.FindSimilarImage(request)
         return reply
 
-    def find_similar_image_by_id(self, image_id, models, top_k=5):
+    def find_similar_image_by_id(self, image_id, models, top_k=5, collection=""):
         request = ec_proto.FindSimilarImageByIdRequest()
         request.models.extend(models)
         request.top_k = int(top_k)
         request.image_id = image_id
+        request.collection = collection
         reply = self.stub.FindSimilarImageById(request)
         return reply
 
+    def find_similar_by_vector(self, vectors, model, top_k=5, collection=""):
+        """Search with feature vectors, one result per vector."""
+        request = ec_proto.FindSimilarByVectorRequest()
+        request.top_k = int(top_k)
+        request.collection = collection
+        for vector in vectors:
+            query = request.queries.add()
+            query.model = model
+            query.features.extend(vector)
+        reply = self.stub.FindSimilarByVector(request)
+        return reply
+
+    def refresh_collection(self, collection):
+        """Rebuild the indexes of a collection without a restart."""
+        request = ec_proto.RefreshCollectionRequest()
+        request.collection = collection
+        reply = self.stub.RefreshCollection(request)
+        return reply
+
+    def list_collections(self):
+        request = ec_proto.ListCollectionsRequest()
+        reply = self.stub.ListCollections(request)
+        return list(reply.collections)
+
+    def get_slow_queries(self):
+        """The slowest requests with the time of their stages."""
+        request = ec_proto.GetSlowQueriesRequest()
+        reply = self.stub.GetSlowQueries(request)
+        return reply
+
+    def stream_changes(self, epoch, after_sequence, collection=""):
+        """Iterate over the changes of a collection after a sequence."""
+        request = ec_proto.StreamChangesRequest()
+        request.collection = collection
+        request.epoch = epoch
+        request.after_sequence = after_sequence
+        for event in self.stub.StreamChanges(request):
+            if event.type != ec_proto.ChangeEvent.HEARTBEAT:
+                yield event
+
     def __shutdown(self, shutdown_type):
         request = ec_proto.ShutdownRequest()
         request.shutdown_type = shutdown_type
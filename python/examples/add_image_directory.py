@@ -1,8 +1,10 @@
 import argparse
+import asyncio
+import io
 import json
 from pathlib import Path
 
-import euclides
+from euclides.aio import ChannelPool, AsyncEuclidesDB
 
 from PIL import Image
 import numpy as np
@@ -17,11 +19,39 @@ def center_crop(image, new_height, new_width):
     return image.crop((left, top, right, bottom))
 
 
-def add_image(db, id_item, filepath):
+def load_image(filepath):
+    # Runs on the reader threads, overlapped with the RPCs in-flight
     image = Image.open(filepath)
     image.thumbnail((300, 300), Image.ANTIALIAS)
     image = center_crop(image, 224, 224)
-    return db.add_image(id_item, ["resnet18"], image)
+    bytes_img = io.BytesIO()
+    image.convert("RGB").save(bytes_img, format="jpeg")
+    return bytes_img.getvalue()
+
+
+async def add_directory(args):
+    path = Path(args.directory)
+    items_dict = {}
+    items = []
+    for id_item, pfile in enumerate(sorted(path.glob(args.pattern))):
+        items_dict[pfile.name] = id_item
+        items.append((id_item, pfile.absolute()))
+
+    def report_error(id_item, ex):
+        print("Error adding item", id_item, ex)
+
+    async with ChannelPool("localhost", 50000, size=args.channels) as pool:
+        db = AsyncEuclidesDB(pool)
+        stats = await db.add_images(items, ["resnet18"], load_image,
+                                    window=args.window,
+                                    read_workers=args.read_workers,
+                                    on_error=report_error)
+        print(stats)
+
+        with open(args.output, "w") as fhandle:
+            json.dump(items_dict, fhandle)
+
+        await db.refresh_index()
 
 
 def run_main():
@@ -33,23 +63,15 @@ def run_main():
                         help='Image file pattern (ex. *.jpg).')
     parser.add_argument('--output', dest='output', type=str, required=True,
                         help='Output filename with IDs (ex. output.json).')
+    parser.add_argument('--window', dest='window', type=int, default=64,
+                        help='Maximum number of requests in-flight.')
+    parser.add_argument('--channels', dest='channels', type=int, default=4,
+                        help='Number of connections to the server.')
+    parser.add_argument('--read-workers', dest='read_workers', type=int, default=8,
+                        help='Number of threads reading the images.')
     args = parser.parse_args()
 
-    channel = euclides.Channel("localhost", 50000)
-    db = euclides.EuclidesDB(channel)
-
-    path = Path(args.directory)
-    items_dict = {}
-    for id_item, pfile in enumerate(path.glob(args.pattern)):
-        print("Adding file", pfile.name)
-        add_image(db, id_item, pfile.absolute())
-        items_dict[pfile.name] = id_item
-
-    with open(args.output, "w") as fhandle:
-        json.dump(items_dict, fhandle)
-
-    db.refresh_index()
-    channel.close()
+    asyncio.run(add_directory(args))
 
 
 if __name__ == "__main__":
@@ -0,0 +1,121 @@
+#include "admissioncontrol.hpp"
+
+#include <grpc++/resource_quota.h>
+
+#include <easylogging++.h>
+
+
+AdmissionSemaphore::AdmissionSemaphore(int64_t capacity)
+: mCapacity(capacity), mAvailable(capacity)
+{ }
+
+Admission AdmissionSemaphore::acquire(int64_t amount, const std::chrono::milliseconds &max_wait)
+{
+    // It would never be admitted, fail fast
+    if(amount > mCapacity)
+        return Admission::OVER_CAPACITY;
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    const bool acquired = mCondition.wait_for(lock, max_wait,
+                                              [this, amount]{ return mAvailable >= amount; });
+    if(!acquired)
+        return Admission::TIMED_OUT;
+
+    mAvailable -= amount;
+    return Admission::ADMITTED;
+}
+
+void AdmissionSemaphore::release(int64_t amount)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mAvailable += amount;
+    }
+    mCondition.notify_all();
+}
+
+namespace {
+    std::unique_ptr<AdmissionSemaphore> make_semaphore(int64_t capacity)
+    {
+        if(capacity <= 0)
+            return std::unique_ptr<AdmissionSemaphore>();
+        return std::unique_ptr<AdmissionSemaphore>(new AdmissionSemaphore(capacity));
+    }
+}
+
+AdmissionController::AdmissionController(int max_search, int max_add, int max_remove,
+                                         int64_t max_image_bytes, int max_wait_ms,
+                                         int64_t grpc_memory_bytes)
+: mSearchSemaphore(make_semaphore(max_search)),
+  mAddSemaphore(make_semaphore(max_add)),
+  mRemoveSemaphore(make_semaphore(max_remove)),
+  mImageSemaphore(make_semaphore(max_image_bytes)),
+  mMaxWait(max_wait_ms),
+  mGrpcMemoryBytes(grpc_memory_bytes)
+{ }
+
+Admission AdmissionController::admit(const std::unique_ptr<AdmissionSemaphore> &semaphore,
+                                     int64_t amount, AdmissionGuard *guard)
+{
+    // No limit configured
+    if(semaphore == nullptr)
+        return Admission::ADMITTED;
+
+    const Admission admission = semaphore->acquire(amount, mMaxWait);
+    if(admission == Admission::ADMITTED)
+        guard->reset(semaphore.get(), amount);
+    return admission;
+}
+
+bool AdmissionController::admitRequest(RequestType type, AdmissionGuard *guard)
+{
+    switch(type)
+    {
+        case RequestType::SEARCH:
+            return admit(mSearchSemaphore, 1, guard) == Admission::ADMITTED;
+        case RequestType::ADD:
+            return admit(mAddSemaphore, 1, guard) == Admission::ADMITTED;
+        case RequestType::REMOVE:
+            return admit(mRemoveSemaphore, 1, guard) == Admission::ADMITTED;
+    }
+    return true;
+}
+
+Admission AdmissionController::admitImageBytes(int64_t bytes, AdmissionGuard *guard)
+{
+    return admit(mImageSemaphore, bytes, guard);
+}
+
+void AdmissionController::configureServer(grpc::ServerBuilder &builder) const
+{
+    if(mGrpcMemoryBytes <= 0)
+        return;
+
+    // The quota bounds the memory gRPC uses for the incoming messages
+    grpc::ResourceQuota quota("euclidesdb");
+    quota.Resize(static_cast<size_t>(mGrpcMemoryBytes));
+    builder.SetResourceQuota(quota);
+}
+
+AdmissionController::AdmissionControllerPtr
+AdmissionController::build_admission_controller(const INIReader &conf_reader)
+{
+    const int max_search = \
+        static_cast<int>(conf_reader.GetInteger("admission", "max_in_flight_search", 0));
+    const int max_add = \
+        static_cast<int>(conf_reader.GetInteger("admission", "max_in_flight_add", 0));
+    const int max_remove = \
+        static_cast<int>(conf_reader.GetInteger("admission", "max_in_flight_remove", 0));
+    const int64_t max_image_mb = conf_reader.GetInteger("admission", "max_image_memory_mb", 0);
+    const int max_wait_ms = \
+        static_cast<int>(conf_reader.GetInteger("admission", "max_wait_ms", 100));
+    const int64_t grpc_memory_mb = conf_reader.GetInteger("admission", "grpc_memory_mb", 0);
+
+    LOG(INFO) << "Admission control: search=" << max_search << ", add=" << max_add
+              << ", remove=" << max_remove << ", image memory=" << max_image_mb << "MB"
+              << ", max wait=" << max_wait_ms << "ms (0 means unlimited).";
+
+    return std::make_shared<AdmissionController>(max_search, max_add, max_remove,
+                                                  max_image_mb << 20, max_wait_ms,
+                                                  grpc_memory_mb << 20);
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include <grpc++/grpc++.h>
+#include <INIReader.h>
+
+/**
+ * The result of admitting units into a semaphore.
+ */
+enum class Admission
+{
+    ADMITTED,
+    TIMED_OUT,      // Not enough units were released before max_wait
+    OVER_CAPACITY   // More units than the capacity, it can never be admitted
+};
+
+
+/**
+ * A counting semaphore where each acquire can take many units, it is
+ * used both for the number of requests in-flight and for memory bytes.
+ */
+class AdmissionSemaphore
+{
+public:
+    explicit AdmissionSemaphore(int64_t capacity);
+
+    /**
+     * Acquire units from the semaphore, waiting at most max_wait.
+     * @param amount number of units
+     * @param max_wait maximum time waiting for the units
+     * @return ADMITTED if the units were acquired, TIMED_OUT or
+     *         OVER_CAPACITY otherwise
+     */
+    Admission acquire(int64_t amount, const std::chrono::milliseconds &max_wait);
+    void release(int64_t amount);
+
+    int64_t capacity() const { return mCapacity; }
+
+private:
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    const int64_t mCapacity;
+    int64_t mAvailable;
+};
+
+
+/**
+ * Release the acquired units when it goes out of scope.
+ */
+class AdmissionGuard
+{
+public:
+    AdmissionGuard()
+    : mSemaphore(nullptr), mAmount(0)
+    { }
+
+    ~AdmissionGuard() { reset(); }
+
+    AdmissionGuard(const AdmissionGuard&) = delete;
+    AdmissionGuard &operator=(const AdmissionGuard&) = delete;
+
+    void reset(AdmissionSemaphore *semaphore=nullptr, int64_t amount=0)
+    {
+        if(mSemaphore != nullptr)
+            mSemaphore->release(mAmount);
+        mSemaphore = semaphore;
+        mAmount = amount;
+    }
+
+private:
+    AdmissionSemaphore *mSemaphore;
+    int64_t mAmount;
+};
+
+
+enum class RequestType : int
+{
+    SEARCH,
+    ADD,
+    REMOVE,
+};
+
+
+/**
+ * Admission control in front of the gRPC service. It limits the number
+ * of requests in-flight of each type and the memory of the decoded
+ * images. Requests wait a bounded time for capacity and then they are
+ * rejected, so the server degrades predictably under traffic spikes.
+ */
+class AdmissionController
+{
+public:
+    typedef std::shared_ptr<AdmissionController> AdmissionControllerPtr;
+
+public:
+    /**
+     * Construct the admission controller, limits equal to zero
+     * mean unlimited.
+     * @param max_search maximum search requests in-flight
+     * @param max_add maximum add requests in-flight
+     * @param max_remove maximum remove requests in-flight
+     * @param max_image_bytes maximum bytes of decoded images in memory
+     * @param max_wait_ms maximum time a request waits for capacity
+     * @param grpc_memory_bytes memory quota of the gRPC server
+     */
+    AdmissionController(int max_search, int max_add, int max_remove,
+                        int64_t max_image_bytes, int max_wait_ms,
+                        int64_t grpc_memory_bytes);
+
+    /**
+     * Admit a new request.
+     * @param type the type of the request
+     * @param guard guard releasing the request slot
+     * @return true if admitted, false if it must be rejected
+     */
+    bool admitRequest(RequestType type, AdmissionGuard *guard);
+
+    /**
+     * Admit the decoded bytes of an image.
+     * @param bytes the decoded image size in bytes
+     * @param guard guard releasing the bytes
+     * @return ADMITTED, TIMED_OUT if the memory wasn't released in time,
+     *         or OVER_CAPACITY if the image is larger than the whole limit
+     */
+    Admission admitImageBytes(int64_t bytes, AdmissionGuard *guard);
+
+    /**
+     * Apply the gRPC resource quota into the server builder.
+     * @param builder the server builder
+     */
+    void configureServer(grpc::ServerBuilder &builder) const;
+
+    static AdmissionControllerPtr build_admission_controller(const INIReader &conf_reader);
+
+private:
+    Admission admit(const std::unique_ptr<AdmissionSemaphore> &semaphore,
+                    int64_t amount, AdmissionGuard *guard);
+
+    std::unique_ptr<AdmissionSemaphore> mSearchSemaphore;
+    std::unique_ptr<AdmissionSemaphore> mAddSemaphore;
+    std::unique_ptr<AdmissionSemaphore> mRemoveSemaphore;
+    std::unique_ptr<AdmissionSemaphore> mImageSemaphore;
+    std::chrono::milliseconds mMaxWait;
+    int64_t mGrpcMemoryBytes;
+};
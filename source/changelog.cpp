@@ -0,0 +1,116 @@
+#include "changelog.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <random>
+#include <sstream>
+
+namespace {
+
+/**
+ * Collect the item changes of a write batch, keys that aren't item ids
+ * are skipped.
+ */
+class ChangeCollector : public leveldb::WriteBatch::Handler
+{
+public:
+    explicit ChangeCollector(std::vector<ChangeRecord> *records)
+    : mRecords(records)
+    { }
+
+    void Put(const leveldb::Slice &key, const leveldb::Slice &value) override
+    {
+        if(key.size() != sizeof(int))
+            return;
+        mRecords->push_back({0, false, itemId(key), value.ToString()});
+    }
+
+    void Delete(const leveldb::Slice &key) override
+    {
+        if(key.size() != sizeof(int))
+            return;
+        mRecords->push_back({0, true, itemId(key), std::string()});
+    }
+
+private:
+    static int itemId(const leveldb::Slice &key)
+    {
+        int id = 0;
+        std::copy(key.data(), key.data() + sizeof(int), reinterpret_cast<char*>(&id));
+        return id;
+    }
+
+    std::vector<ChangeRecord> *mRecords;
+};
+
+std::string random_epoch()
+{
+    std::random_device device;
+    std::ostringstream epoch;
+    epoch << std::hex << std::setfill('0');
+    for(int i=0; i<2; i++)
+        epoch << std::setw(8) << device();
+    return epoch.str();
+}
+
+}
+
+ChangeLog::ChangeLog(size_t capacity)
+: mCapacity(capacity), mEpoch(random_epoch()), mLastSequence(0)
+{ }
+
+void ChangeLog::append(const leveldb::WriteBatch &batch)
+{
+    std::vector<ChangeRecord> records;
+    ChangeCollector collector(&records);
+    batch.Iterate(&collector);
+    if(records.empty())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for(ChangeRecord &record : records)
+        {
+            record.mSequence = ++mLastSequence;
+            mRecords.push_back(std::move(record));
+        }
+
+        while(mRecords.size() > mCapacity)
+            mRecords.pop_front();
+    }
+
+    mCondition.notify_all();
+}
+
+uint64_t ChangeLog::lastSequence() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mLastSequence;
+}
+
+ChangeLogStatus ChangeLog::readChanges(uint64_t after_sequence, size_t max_records,
+                                       int timeout_ms, std::vector<ChangeRecord> *records) const
+{
+    records->clear();
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    mCondition.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                        [&]{ return mLastSequence != after_sequence; });
+
+    // A follower ahead of the log comes from another epoch
+    if(after_sequence > mLastSequence)
+        return ChangeLogStatus::TRUNCATED;
+
+    const uint64_t first_sequence = mRecords.empty() ? mLastSequence + 1
+                                                     : mRecords.front().mSequence;
+    if(after_sequence + 1 < first_sequence)
+        return ChangeLogStatus::TRUNCATED;
+
+    const size_t first = static_cast<size_t>(after_sequence + 1 - first_sequence);
+    const size_t last = std::min(mRecords.size(), first + max_records);
+    for(size_t i=first; i<last; i++)
+        records->push_back(mRecords[i]);
+
+    return ChangeLogStatus::OK;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <leveldb/write_batch.h>
+
+
+/**
+ * A change of an item, numbered with the sequence of the change log.
+ */
+struct ChangeRecord
+{
+    uint64_t mSequence;
+    bool mRemoved;
+    int mItemId;
+    std::string mItemData;      // The serialized ItemData, empty for removals
+};
+
+
+enum class ChangeLogStatus
+{
+    OK,
+    // The requested changes were already dropped from the log
+    TRUNCATED,
+};
+
+
+/**
+ * The log of the most recent item changes of a database, which replicas
+ * use to follow the primary. The log is kept in memory and its sequence
+ * restarts with the server, so each log has a random epoch: followers of
+ * another epoch, or too far behind, have to bootstrap from a snapshot.
+ */
+class ChangeLog
+{
+public:
+    typedef std::shared_ptr<ChangeLog> ChangeLogPtr;
+
+public:
+    /**
+     * @param capacity the number of changes kept in the log
+     */
+    explicit ChangeLog(size_t capacity);
+
+    /**
+     * Append the item changes of a committed write batch, the batches
+     * must be appended in the same order they were committed.
+     * @param batch the committed batch
+     */
+    void append(const leveldb::WriteBatch &batch);
+
+    /**
+     * @return the sequence of the last change, 0 if there are no changes
+     */
+    uint64_t lastSequence() const;
+
+    const std::string &getEpoch() const
+    { return mEpoch; }
+
+    /**
+     * Get the changes after a sequence, waiting for new ones if needed.
+     * @param after_sequence the sequence of the last change already applied
+     * @param max_records maximum number of changes returned
+     * @param timeout_ms how long to wait for new changes
+     * @param records returns the changes, empty if the wait timed out
+     * @return TRUNCATED if the changes after the sequence aren't available
+     */
+    ChangeLogStatus readChanges(uint64_t after_sequence, size_t max_records,
+                                int timeout_ms, std::vector<ChangeRecord> *records) const;
+
+private:
+    size_t mCapacity;
+    std::string mEpoch;
+
+    mutable std::mutex mMutex;
+    mutable std::condition_variable mCondition;
+    std::deque<ChangeRecord> mRecords;
+    uint64_t mLastSequence;
+};
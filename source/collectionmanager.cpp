@@ -0,0 +1,237 @@
+#include "collectionmanager.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <exception>
+#include <sys/stat.h>
+
+#include <tinydir.h>
+#include <easylogging++.h>
+
+namespace {
+    const size_t k_max_collection_name = 64;
+    const int k_default_max_collections = 100;
+}
+
+
+CollectionManager::CollectionManager(const INIReader &conf_reader,
+                                     const TorchManager::TorchManagerPtr &torch_manager,
+                                     const DatabaseOptions &db_options,
+                                     const std::string &collections_path,
+                                     int max_collections,
+                                     const CollectionPtr &default_collection)
+: mConfReader(conf_reader), mTorchManager(torch_manager),
+  mDatabaseOptions(db_options), mCollectionsPath(collections_path),
+  mMaxCollections(max_collections)
+{
+    mCollections[""] = default_collection;
+    if(mCollectionsPath.empty())
+        return;
+
+    mkdir(mCollectionsPath.c_str(), 0755);
+
+    tinydir_dir dir;
+    if (tinydir_open(&dir, mCollectionsPath.c_str()) == -1)
+        LOG(FATAL) << "Unable to open the collections directory " << mCollectionsPath << ".";
+
+    std::vector<std::string> names;
+    while (dir.has_next)
+    {
+        tinydir_file file;
+        if (tinydir_readfile(&dir, &file) == -1)
+            LOG(FATAL) << "Error reading file.";
+
+        const std::string filename = std::string(file.name);
+        const bool is_dir = file.is_dir;
+        if (tinydir_next(&dir) == -1)
+            LOG(FATAL) << "Error getting next file.";
+
+        if(is_dir && valid_collection_name(filename))
+            names.push_back(filename);
+    }
+    tinydir_close(&dir);
+
+    for(const std::string &name : names)
+        mCollections[name] = openCollection(name);
+
+    LOG(INFO) << "Opened " << names.size() << " collections.";
+}
+
+bool CollectionManager::valid_collection_name(const std::string &name)
+{
+    if(name.empty() || name.size() > k_max_collection_name)
+        return false;
+
+    return std::all_of(name.begin(), name.end(), [](char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '-';
+    });
+}
+
+std::string CollectionManager::collectionPath(const std::string &name) const
+{
+    return mCollectionsPath + "/" + name;
+}
+
+CollectionPtr CollectionManager::openCollection(const std::string &name)
+{
+    StorageBackend::StorageBackendPtr storage = \
+        StorageBackend::build_storage_backend(mConfReader, collectionPath(name));
+
+    CollectionPtr collection = std::make_shared<Collection>();
+    collection->mName = name;
+    collection->mDatabaseManager = std::make_shared<DatabaseManager>(storage, mDatabaseOptions);
+    collection->mSearchEngine = \
+        SearchEngine::build_search_engine(mConfReader, mTorchManager,
+                                          collection->mDatabaseManager);
+
+    LOG(INFO) << "Collection " << name << " opened.";
+    return collection;
+}
+
+CollectionPtr CollectionManager::getCollection(const std::string &name, bool create,
+                                               std::string *error)
+{
+    std::shared_ptr<std::promise<CollectionPtr>> opened;
+    std::shared_future<CollectionPtr> opening;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        std::unordered_map<std::string, CollectionPtr>::const_iterator pair = mCollections.find(name);
+        if(pair != mCollections.end())
+            return pair->second;
+
+        if(!create || mCollectionsPath.empty() || !valid_collection_name(name))
+            return nullptr;
+
+        std::unordered_map<std::string, std::shared_future<CollectionPtr>>::const_iterator \
+            pending = mOpening.find(name);
+        if(pending != mOpening.end())
+        {
+            opening = pending->second;
+        }
+        else
+        {
+            // The default collection isn't counted
+            const int collections = static_cast<int>(mCollections.size() + mOpening.size()) - 1;
+            if(mMaxCollections > 0 && collections >= mMaxCollections)
+            {
+                LOG(WARNING) << "Cannot create the collection " << name << ", there are already "
+                             << collections << " collections (max_collections).";
+                return nullptr;
+            }
+
+            opened = std::make_shared<std::promise<CollectionPtr>>();
+            opening = opened->get_future().share();
+            mOpening[name] = opening;
+        }
+    }
+
+    // Another request is creating the collection
+    if(opened == nullptr)
+    {
+        try
+        {
+            return opening.get();
+        }
+        catch(const std::exception &e)
+        {
+            if(error != nullptr)
+                *error = e.what();
+            return nullptr;
+        }
+    }
+
+    // A new collection is empty, so its search engine is set up right
+    // away, the lookups of other collections aren't blocked meanwhile.
+    // When it can't be opened, the requests waiting for it fail and the
+    // next request tries again.
+    CollectionPtr collection;
+    try
+    {
+        collection = openCollection(name);
+    }
+    catch(const std::exception &e)
+    {
+        LOG(ERROR) << "Unable to open the collection " << name << ": " << e.what();
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mOpening.erase(name);
+        }
+        opened->set_exception(std::current_exception());
+        if(error != nullptr)
+            *error = e.what();
+        return nullptr;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mCollections[name] = collection;
+        mOpening.erase(name);
+    }
+    opened->set_value(collection);
+    return collection;
+}
+
+std::shared_ptr<std::mutex> CollectionManager::refreshMutex(const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    std::shared_ptr<std::mutex> &refresh_mutex = mRefreshMutexes[name];
+    if(refresh_mutex == nullptr)
+        refresh_mutex = std::make_shared<std::mutex>();
+    return refresh_mutex;
+}
+
+bool CollectionManager::refreshCollection(const std::string &name)
+{
+    if(getCollection(name) == nullptr)
+        return false;
+
+    // Refreshes of different collections run in parallel
+    std::shared_ptr<std::mutex> refresh_mutex = refreshMutex(name);
+    std::lock_guard<std::mutex> refresh_lock(*refresh_mutex);
+    CollectionPtr collection = getCollection(name);
+
+    // Engines updated in place (or without indexes) are always fresh
+    if(!collection->mSearchEngine->requireRefresh())
+        return true;
+
+    // Only this collection is scanned, the requests keep using the
+    // current indexes until the new ones are built.
+    CollectionPtr refreshed = std::make_shared<Collection>(*collection);
+    refreshed->mSearchEngine = \
+        SearchEngine::build_search_engine(mConfReader, mTorchManager,
+                                          collection->mDatabaseManager);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    mCollections[name] = refreshed;
+    return true;
+}
+
+std::vector<std::string> CollectionManager::getCollectionList() const
+{
+    std::vector<std::string> names;
+    std::lock_guard<std::mutex> lock(mMutex);
+    for(const auto &pair : mCollections)
+        if(!pair.first.empty())
+            names.push_back(pair.first);
+
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+CollectionManager::CollectionManagerPtr
+CollectionManager::build_collection_manager(const INIReader &conf_reader,
+                                            const TorchManager::TorchManagerPtr &torch_manager,
+                                            const DatabaseOptions &db_options,
+                                            const CollectionPtr &default_collection)
+{
+    const std::string collections_path = conf_reader.Get("database", "collections_path", "");
+    if(collections_path.empty())
+        LOG(INFO) << "No collections_path, only the default collection is available.";
+
+    const int max_collections = static_cast<int>(
+        conf_reader.GetInteger("database", "max_collections", k_default_max_collections));
+
+    return std::make_shared<CollectionManager>(conf_reader, torch_manager, db_options,
+                                               collections_path, max_collections,
+                                               default_collection);
+}
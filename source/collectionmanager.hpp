@@ -0,0 +1,144 @@
+#pragma once
+
+#include <array>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <INIReader.h>
+
+#include "torchmanager.hpp"
+#include "databasemanager.hpp"
+#include "searchengine.hpp"
+
+
+/**
+ * Striped locks on the item ids. A write holds the lock of its item while
+ * it updates the storage and then the search engine, so the writes of
+ * the same item reach both in the same order.
+ */
+class ItemLocks
+{
+public:
+    std::mutex &get(int item_id)
+    { return mMutexes[static_cast<unsigned int>(item_id) % mMutexes.size()]; }
+
+private:
+    std::array<std::mutex, 1024> mMutexes;
+};
+
+
+/**
+ * A collection of items with its own storage and search indexes. The
+ * default collection (with an empty name) is the database of db_path.
+ */
+struct Collection
+{
+    Collection()
+    : mItemLocks(std::make_shared<ItemLocks>())
+    { }
+
+    std::string mName;
+    DatabaseManager::DatabaseManagerPtr mDatabaseManager;
+    SearchEngine::SearchEnginePtr mSearchEngine;
+
+    // Shared with the refreshed copies of the collection
+    std::shared_ptr<ItemLocks> mItemLocks;
+};
+typedef std::shared_ptr<Collection> CollectionPtr;
+
+
+/**
+ * The collections of the server. Each collection is a separate database
+ * in a sub-directory of the collections path, with its own search engine,
+ * so scans and index refreshes only touch the items of a collection.
+ */
+class CollectionManager
+{
+public:
+    typedef std::shared_ptr<CollectionManager> CollectionManagerPtr;
+
+public:
+    /**
+     * Construct the collection manager, opening the existing collections.
+     * @param conf_reader the configuration used to create the storage
+     *                    and search engine of each collection
+     * @param torch_manager the torch manager
+     * @param db_options the database options of the collections
+     * @param collections_path the directory of the collections, or empty
+     *                         to only have the default collection
+     * @param max_collections maximum number of collections, new ones
+     *                        aren't created past it, 0 for no limit
+     * @param default_collection the default collection
+     */
+    CollectionManager(const INIReader &conf_reader,
+                      const TorchManager::TorchManagerPtr &torch_manager,
+                      const DatabaseOptions &db_options,
+                      const std::string &collections_path,
+                      int max_collections,
+                      const CollectionPtr &default_collection);
+
+    /**
+     * Get a collection, requests keep using the collection they got even
+     * if its index is refreshed in the meantime. A new collection is
+     * opened without blocking the lookups of the other collections.
+     * @param name the name of the collection, empty for the default one
+     * @param create if the collection should be created when not found
+     * @param error if not nullptr, returns the reason when a new collection
+     *              can't be opened
+     * @return the collection, or nullptr if it wasn't found (or the name
+     *         isn't valid, or there are already max_collections, or it
+     *         can't be opened)
+     */
+    CollectionPtr getCollection(const std::string &name, bool create=false,
+                                std::string *error=nullptr);
+
+    /**
+     * Rebuild the search indexes of a collection while the server is
+     * running, the new indexes are swapped in when they are ready. Search
+     * engines that don't require a refresh are left untouched.
+     * @param name the name of the collection
+     * @return true if the collection was refreshed, false if not found
+     */
+    bool refreshCollection(const std::string &name);
+
+    /**
+     * @return the names of the collections, without the default one
+     */
+    std::vector<std::string> getCollectionList() const;
+
+    /**
+     * Collection names are used as directory names, so only letters,
+     * digits, '_' and '-' are accepted.
+     */
+    static bool valid_collection_name(const std::string &name);
+
+    static CollectionManagerPtr build_collection_manager(const INIReader &conf_reader,
+                                                         const TorchManager::TorchManagerPtr &torch_manager,
+                                                         const DatabaseOptions &db_options,
+                                                         const CollectionPtr &default_collection);
+
+private:
+    CollectionPtr openCollection(const std::string &name);
+    std::string collectionPath(const std::string &name) const;
+    std::shared_ptr<std::mutex> refreshMutex(const std::string &name);
+
+    INIReader mConfReader;
+    TorchManager::TorchManagerPtr mTorchManager;
+    DatabaseOptions mDatabaseOptions;
+    std::string mCollectionsPath;
+    int mMaxCollections;
+
+    mutable std::mutex mMutex;
+    std::unordered_map<std::string, CollectionPtr> mCollections;
+
+    // The collections being created, other requests for them wait on
+    // the future instead of holding mMutex
+    std::unordered_map<std::string, std::shared_future<CollectionPtr>> mOpening;
+
+    // Refreshes of the same collection are serialized
+    std::unordered_map<std::string, std::shared_ptr<std::mutex>> mRefreshMutexes;
+};
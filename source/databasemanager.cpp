@@ -1,21 +1,49 @@
 #include "databasemanager.hpp"
+#include "tracing.hpp"
+
+#include <chrono>
 
 #include <easylogging++.h>
 
 std::string DatabaseManager::kDatabaseMetadataKey = "__euclidesdb_metadata";
 
-DatabaseManager::DatabaseManager(const std::string &db_path)
-: mDb(nullptr)
+namespace {
+
+// Shortest interval between periodic syncs, shorter ones would keep the
+// sync thread busy without improving the durability of the writes
+const int k_min_sync_interval_ms = 10;
+
+/**
+ * Append the operations of a write batch into another one, this is
+ * used to merge the batches of a commit group.
+ */
+class BatchAppender : public leveldb::WriteBatch::Handler
 {
-    leveldb::Options options;
-    options.create_if_missing = true;
-    options.compression = leveldb::CompressionType::kSnappyCompression;
+public:
+    explicit BatchAppender(leveldb::WriteBatch *batch)
+    : mBatch(batch)
+    { }
+
+    void Put(const leveldb::Slice &key, const leveldb::Slice &value) override
+    {
+        mBatch->Put(key, value);
+    }
 
-    leveldb::Status status = leveldb::DB::Open(options, db_path, &mDb);
+    void Delete(const leveldb::Slice &key) override
+    {
+        mBatch->Delete(key);
+    }
+
+private:
+    leveldb::WriteBatch *mBatch;
+};
 
-    if(!status.ok())
-        LOG(FATAL) << "Unable to create or load the database. Is it already opened ?";
+}
 
+DatabaseManager::DatabaseManager(const StorageBackend::StorageBackendPtr &storage,
+                                 const DatabaseOptions &options)
+: mStorage(storage), mOptions(options), mUnsyncedWrites(false), mStopSync(false)
+{
     euclidesproto::EuclidesDBMetadata db_metadata;
     if(!getDatabaseMetadata(db_metadata))
     {
@@ -32,50 +60,176 @@ DatabaseManager::DatabaseManager(const std::string &db_path)
 
     LOG(INFO) << "Database Version " << db_metadata.database_version()
               << " detected.";
+
+    if(mOptions.mChangeLogSize > 0)
+        mChangeLog = std::make_shared<ChangeLog>(static_cast<size_t>(mOptions.mChangeLogSize));
+
+    if(mOptions.mDurability == DurabilityType::PERIODIC)
+    {
+        if(mOptions.mSyncIntervalMs < k_min_sync_interval_ms)
+        {
+            LOG(WARNING) << "The sync_interval_ms " << mOptions.mSyncIntervalMs
+                         << " is too short, using " << k_min_sync_interval_ms << " ms.";
+            mOptions.mSyncIntervalMs = k_min_sync_interval_ms;
+        }
+        mSyncThread = std::thread(&DatabaseManager::periodicSync, this);
+    }
 }
 
 DatabaseManager::~DatabaseManager()
 {
-    if(mDb)
-        delete mDb;
+    if(mSyncThread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mSyncMutex);
+            mStopSync = true;
+        }
+        mSyncCondition.notify_all();
+        mSyncThread.join();
+    }
+}
+
+bool DatabaseManager::commitWrite(leveldb::WriteBatch *batch)
+{
+    TRACE_SCOPE("DatabaseManager::commitWrite");
+    PendingWrite pending(batch);
+
+    std::unique_lock<std::mutex> lock(mWriteMutex);
+    mWriteQueue.push_back(&pending);
+    while(!pending.mDone && &pending != mWriteQueue.front())
+        mWriteCondition.wait(lock);
+
+    // Another leader already committed our batch
+    if(pending.mDone)
+        return pending.mOk;
+
+    // We're the leader, give other writers a chance to join the group
+    if(mOptions.mCommitWindowUs > 0)
+    {
+        lock.unlock();
+        std::this_thread::sleep_for(std::chrono::microseconds(mOptions.mCommitWindowUs));
+        lock.lock();
+    }
+
+    const std::vector<PendingWrite*> group(mWriteQueue.begin(), mWriteQueue.end());
+    lock.unlock();
+
+    leveldb::WriteBatch group_batch;
+    leveldb::WriteBatch *commit_batch = batch;
+    if(group.size() > 1)
+    {
+        BatchAppender appender(&group_batch);
+        for(PendingWrite *write : group)
+            write->mBatch->Iterate(&appender);
+        commit_batch = &group_batch;
+    }
+
+    const bool sync = (mOptions.mDurability == DurabilityType::SYNC);
+    const bool ok = mStorage->write(commit_batch, sync);
+    if(!ok)
+        LOG(ERROR) << "Error committing " << group.size() << " writes.";
+
+    // Still the leader, so the changes are logged in the commit order
+    if(ok && mChangeLog)
+        for(PendingWrite *write : group)
+            mChangeLog->append(*write->mBatch);
+
+    lock.lock();
+    for(PendingWrite *write : group)
+    {
+        write->mOk = ok;
+        write->mDone = true;
+        mWriteQueue.pop_front();
+    }
+    mUnsyncedWrites = true;
+    lock.unlock();
+
+    mWriteCondition.notify_all();
+    return pending.mOk;
+}
+
+void DatabaseManager::periodicSync()
+{
+    std::unique_lock<std::mutex> lock(mSyncMutex);
+    const std::chrono::milliseconds interval(mOptions.mSyncIntervalMs);
+
+    while(!mSyncCondition.wait_for(lock, interval, [this]{ return mStopSync; }))
+    {
+        {
+            std::lock_guard<std::mutex> write_lock(mWriteMutex);
+            if(!mUnsyncedWrites)
+                continue;
+            mUnsyncedWrites = false;
+        }
+
+        if(!mStorage->sync())
+            LOG(ERROR) << "Error syncing the database.";
+    }
 }
 
 bool DatabaseManager::getItemDataByKey(int id,
                                        euclidesproto::ItemData &item_data)
 {
+    TRACE_SCOPE("DatabaseManager::getItemDataByKey");
     std::string value;
     leveldb::Slice key((char*)&id, sizeof(int));
-    auto s = mDb->Get(leveldb::ReadOptions(), key, &value);
-    if(s.IsNotFound())
+    if(!mStorage->get(key, &value))
         return false;
 
     item_data.ParseFromString(value);
     return true;
 }
 
+int DatabaseManager::getItemsDataByKeys(const std::vector<int> &ids,
+                                        std::vector<euclidesproto::ItemData> *items,
+                                        std::vector<bool> *found)
+{
+    TRACE_SCOPE("DatabaseManager::getItemsDataByKeys");
+    std::vector<std::string> keys;
+    keys.reserve(ids.size());
+    for(const int id : ids)
+        keys.emplace_back(reinterpret_cast<const char*>(&id), sizeof(int));
+
+    std::vector<std::string> values;
+    mStorage->multiGet(keys, &values, found);
+
+    int total_found = 0;
+    items->resize(ids.size());
+    for(size_t i=0; i<ids.size(); i++)
+    {
+        if(!(*found)[i])
+            continue;
+        (*items)[i].ParseFromString(values[i]);
+        total_found++;
+    }
+
+    return total_found;
+}
+
 bool DatabaseManager::addItemData(const euclidesproto::ItemData &item_data)
 {
     const std::string &serialized_data = item_data.SerializeAsString();
     const int id = item_data.item_id();
     leveldb::Slice key((char*)&id, sizeof(int));
 
-    auto s = mDb->Put(leveldb::WriteOptions(), key, serialized_data);
-    return s.ok();
+    leveldb::WriteBatch batch;
+    batch.Put(key, serialized_data);
+    return commitWrite(&batch);
 }
 
 DatabaseManager::DatabaseIterator DatabaseManager::newIterator(bool fill_cache)
 {
-    leveldb::ReadOptions roptions;
-    roptions.fill_cache = fill_cache;
-    DatabaseManager::DatabaseIterator it(mDb->NewIterator(roptions));
+    DatabaseManager::DatabaseIterator it(mStorage->newIterator(fill_cache));
     return it;
 }
 
 bool DatabaseManager::removeItem(int id)
 {
     leveldb::Slice key((char*)&id, sizeof(int));
-    auto s = mDb->Delete(leveldb::WriteOptions(), key);
-    return s.ok();
+
+    leveldb::WriteBatch batch;
+    batch.Delete(key);
+    return commitWrite(&batch);
 }
 
 bool DatabaseManager::getDatabaseMetadata(euclidesproto::EuclidesDBMetadata &metadata)
@@ -83,8 +237,7 @@ bool DatabaseManager::getDatabaseMetadata(euclidesproto::EuclidesDBMetadata &met
     leveldb::Slice db_metadata_key(DatabaseManager::kDatabaseMetadataKey);
     std::string db_metadata;
 
-    auto s = mDb->Get(leveldb::ReadOptions(), db_metadata_key, &db_metadata);
-    if(s.IsNotFound())
+    if(!mStorage->get(db_metadata_key, &db_metadata))
         return false;
 
     metadata.ParseFromString(db_metadata);
@@ -94,6 +247,5 @@ bool DatabaseManager::getDatabaseMetadata(euclidesproto::EuclidesDBMetadata &met
 bool DatabaseManager::setDatabaseMetadata(euclidesproto::EuclidesDBMetadata &metadata)
 {
     leveldb::Slice key(DatabaseManager::kDatabaseMetadataKey);
-    auto s = mDb->Put(leveldb::WriteOptions(), key, metadata.SerializeAsString());
-    return s.ok();
+    return mStorage->put(key, metadata.SerializeAsString());
 }
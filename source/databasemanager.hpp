@@ -1,16 +1,54 @@
 #pragma once
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 #include <leveldb/db.h>
+#include <leveldb/write_batch.h>
 
 #include "euclidesproto.grpc.pb.h"
+#include "storagebackend.hpp"
+#include "changelog.hpp"
 
 #define EUCLIDES_DATABASE_VERSION 1
 
+enum class DurabilityType: int
+{
+    // Writes are only flushed to the OS, fastest but not crash-safe
+    NONE,
+    // Every commit group is synced to disk before being acknowledged
+    SYNC,
+    // The log is synced to disk periodically by a background thread
+    PERIODIC,
+};
+
+struct DatabaseOptions
+{
+    DatabaseOptions()
+    : mDurability(DurabilityType::NONE), mSyncIntervalMs(1000),
+      mCommitWindowUs(0), mChangeLogSize(0)
+    { }
+
+    DurabilityType mDurability;
+
+    // Interval between syncs for the periodic durability
+    int mSyncIntervalMs;
+
+    // Time the leader of a commit group waits for other writers to join
+    int mCommitWindowUs;
+
+    // Number of recent changes kept for the replicas, 0 disables the log
+    int mChangeLogSize;
+};
+
 class DatabaseManager
 {
 public:
-    DatabaseManager(const std::string &db_path);
+    DatabaseManager(const StorageBackend::StorageBackendPtr &storage,
+                    const DatabaseOptions &options=DatabaseOptions());
     ~DatabaseManager();
 
 public:
@@ -18,6 +56,17 @@ public:
     typedef std::shared_ptr<leveldb::Iterator> DatabaseIterator;
 
     bool getItemDataByKey(int id, euclidesproto::ItemData &item_data);
+
+    /**
+     * Get the data of many items with a single batched read.
+     * @param ids the item ids
+     * @param items returns the item data, in the same order of the ids
+     * @param found returns, for each id, if the item was found
+     * @return the number of items found
+     */
+    int getItemsDataByKeys(const std::vector<int> &ids,
+                           std::vector<euclidesproto::ItemData> *items,
+                           std::vector<bool> *found);
     bool addItemData(const euclidesproto::ItemData &item_data);
     bool removeItem(int item_id);
     bool getDatabaseMetadata(euclidesproto::EuclidesDBMetadata &metadata);
@@ -25,7 +74,52 @@ public:
 
     DatabaseIterator newIterator(bool fill_cache=true);
 
+    /**
+     * @return the directory of the database storage
+     */
+    std::string getPath() const
+    { return mStorage->getPath(); }
+
+    /**
+     * @return the log of the recent changes, nullptr if it's disabled
+     */
+    ChangeLog::ChangeLogPtr getChangeLog() const
+    { return mChangeLog; }
+
 private:
-    leveldb::DB* mDb;
+    struct PendingWrite
+    {
+        PendingWrite(leveldb::WriteBatch *batch)
+        : mBatch(batch), mDone(false), mOk(false)
+        { }
+
+        leveldb::WriteBatch *mBatch;
+        bool mDone;
+        bool mOk;
+    };
+
+    /**
+     * Commit a write batch. Concurrent writes are coalesced into a
+     * single LevelDB write: the first writer in the queue becomes the
+     * leader and commits the batches of all writers queued behind it.
+     * @param batch the batch to commit
+     * @return true if the batch was committed, false otherwise
+     */
+    bool commitWrite(leveldb::WriteBatch *batch);
+    void periodicSync();
+
+    StorageBackend::StorageBackendPtr mStorage;
+    DatabaseOptions mOptions;
     static std::string kDatabaseMetadataKey;
+    ChangeLog::ChangeLogPtr mChangeLog;
+
+    std::mutex mWriteMutex;
+    std::condition_variable mWriteCondition;
+    std::deque<PendingWrite*> mWriteQueue;
+    bool mUnsyncedWrites;
+
+    std::mutex mSyncMutex;
+    std::condition_variable mSyncCondition;
+    bool mStopSync;
+    std::thread mSyncThread;
 };
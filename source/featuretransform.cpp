@@ -0,0 +1,173 @@
+#include "featuretransform.hpp"
+
+#include <cstdio>
+
+#include <faiss/index_io.h>
+#include <faiss/FaissException.h>
+#include <easylogging++.h>
+
+namespace {
+
+const std::string k_tmp_suffix = ".tmp";
+
+/**
+ * Parse a transform description into its type ("PCA", "PCAW" or "OPQ"),
+ * the number of OPQ subquantizers and the reduced dimension.
+ */
+bool parse_description(const std::string &description, std::string *type,
+                       int *subquantizers, int *output_dim)
+{
+    int consumed = 0;
+    *subquantizers = 0;
+    if(sscanf(description.c_str(), "PCAW%d%n", output_dim, &consumed) == 1)
+        *type = "PCAW";
+    else if(sscanf(description.c_str(), "PCA%d%n", output_dim, &consumed) == 1)
+        *type = "PCA";
+    else if(sscanf(description.c_str(), "OPQ%d_%d%n", subquantizers, output_dim, &consumed) == 2)
+        *type = "OPQ";
+    else
+        return false;
+
+    return consumed == static_cast<int>(description.size()) && *output_dim > 0;
+}
+
+}
+
+
+FeatureTransform::FeatureTransform(const std::string &description, int input_dim)
+: mDescription(description)
+{
+    std::string error;
+    if(!validate(description, input_dim, &error))
+        LOG(FATAL) << error;
+
+    std::string type;
+    int subquantizers = 0, output_dim = 0;
+    parse_description(description, &type, &subquantizers, &output_dim);
+    if(type == "OPQ")
+    {
+        mTransform.reset(new faiss::OPQMatrix(input_dim, subquantizers, output_dim));
+    }
+    else
+    {
+        const float eigen_power = (type == "PCAW") ? -0.5f : 0.0f;
+        mTransform.reset(new faiss::PCAMatrix(input_dim, output_dim, eigen_power));
+    }
+}
+
+bool FeatureTransform::validate(const std::string &description, int input_dim,
+                                std::string *error)
+{
+    std::string type;
+    int subquantizers = 0, output_dim = 0;
+    if(!parse_description(description, &type, &subquantizers, &output_dim))
+    {
+        *error = "Invalid feature transform: " + description;
+        return false;
+    }
+
+    // Reduced vectors are recognized by their size
+    if(output_dim >= input_dim)
+    {
+        *error = "The feature transform " + description + " must reduce the " +
+                 std::to_string(input_dim) + " dimensions of the features.";
+        return false;
+    }
+
+    if(type == "OPQ" && (subquantizers <= 0 || output_dim % subquantizers != 0))
+    {
+        *error = "The OPQ dimension must be a multiple of the subquantizers: " + description;
+        return false;
+    }
+
+    return true;
+}
+
+void FeatureTransform::train(int n, const float *features)
+{
+    mTransform->train(n, features);
+}
+
+void FeatureTransform::apply(int n, const float *features, float *reduced) const
+{
+    mTransform->apply_noalloc(n, features, reduced);
+}
+
+const float *FeatureTransform::reduce(const float *features, int size,
+                                      std::vector<float> *buffer) const
+{
+    if(size == mTransform->d_out)
+        return features;
+    if(size != mTransform->d_in)
+        return nullptr;
+
+    buffer->resize(mTransform->d_out);
+    apply(1, features, buffer->data());
+    return buffer->data();
+}
+
+bool FeatureTransform::isTrained() const
+{
+    return mTransform->is_trained;
+}
+
+int FeatureTransform::getInputDim() const
+{
+    return mTransform->d_in;
+}
+
+int FeatureTransform::getOutputDim() const
+{
+    return mTransform->d_out;
+}
+
+const std::string &FeatureTransform::getDescription() const
+{
+    return mDescription;
+}
+
+bool FeatureTransform::save(const std::string &file_name) const
+{
+    try
+    {
+        faiss::write_VectorTransform(mTransform.get(), (file_name + k_tmp_suffix).c_str());
+    }
+    catch(const faiss::FaissException &ex)
+    {
+        LOG(ERROR) << "Cannot write the feature transform " << file_name << ": " << ex.what();
+        return false;
+    }
+
+    if(std::rename((file_name + k_tmp_suffix).c_str(), file_name.c_str()) != 0)
+    {
+        LOG(ERROR) << "Cannot rename the feature transform " << file_name << ".";
+        return false;
+    }
+    return true;
+}
+
+bool FeatureTransform::load(const std::string &file_name)
+{
+    std::unique_ptr<faiss::VectorTransform> transform;
+    try
+    {
+        transform.reset(faiss::read_VectorTransform(file_name.c_str()));
+    }
+    catch(const faiss::FaissException &ex)
+    {
+        LOG(ERROR) << "Cannot read the feature transform " << file_name << ": " << ex.what();
+        return false;
+    }
+
+    if(!transform->is_trained || transform->d_in != mTransform->d_in ||
+       transform->d_out != mTransform->d_out)
+    {
+        LOG(ERROR) << "The feature transform " << file_name << " doesn't match "
+                   << mDescription << " on " << mTransform->d_in << " dimensions.";
+        return false;
+    }
+
+    mTransform.swap(transform);
+    return true;
+}
+
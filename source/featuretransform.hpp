@@ -0,0 +1,88 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <faiss/VectorTransform.h>
+
+
+/**
+ * A learned transform that reduces the dimension of the features of a
+ * model (PCA or OPQ), shared by all the search engines. The database
+ * vectors are mapped to the reduced space before indexing and the query
+ * vectors before searching, so the search cost of every engine scales
+ * with the reduced dimension.
+ */
+class FeatureTransform
+{
+public:
+    typedef std::shared_ptr<FeatureTransform> FeatureTransformPtr;
+
+public:
+    /**
+     * Create an untrained transform.
+     * @param description the transform: "PCA<d>", "PCAW<d>" (whitened)
+     *                    or "OPQ<M>_<d>", where d is the reduced dimension
+     * @param input_dim the dimension of the model features
+     */
+    FeatureTransform(const std::string &description, int input_dim);
+
+    /**
+     * Check a transform description before creating the transform.
+     * @param description the transform description
+     * @param input_dim the dimension of the model features
+     * @param error returns the reason when the description is invalid
+     * @return true if the description is valid, false otherwise
+     */
+    static bool validate(const std::string &description, int input_dim,
+                         std::string *error);
+
+    /**
+     * Train the transform.
+     * @param n number of training vectors
+     * @param features the [n, input_dim] training vectors
+     */
+    void train(int n, const float *features);
+
+    /**
+     * Map vectors to the reduced space.
+     * @param n number of vectors
+     * @param features the [n, input_dim] vectors
+     * @param reduced returns the [n, output_dim] vectors
+     */
+    void apply(int n, const float *features, float *reduced) const;
+
+    /**
+     * Get the vector of an item in the reduced space, the vectors stored
+     * already reduced are returned as they are.
+     * @param features the stored vector
+     * @param size the size of the stored vector
+     * @param buffer the storage of the reduced vector, if needed
+     * @return the reduced vector, or nullptr if the size matches neither
+     *         the input nor the output dimension
+     */
+    const float *reduce(const float *features, int size, std::vector<float> *buffer) const;
+
+    bool isTrained() const;
+    int getInputDim() const;
+    int getOutputDim() const;
+    const std::string &getDescription() const;
+
+    /**
+     * Write the transform to a file.
+     * @return true if the transform was written, false otherwise
+     */
+    bool save(const std::string &file_name) const;
+
+    /**
+     * Read a trained transform, it must match the description and the
+     * dimension of the model.
+     * @return true if the transform was read, false otherwise
+     */
+    bool load(const std::string &file_name);
+
+private:
+    std::string mDescription;
+    std::unique_ptr<faiss::VectorTransform> mTransform;
+};
@@ -4,6 +4,7 @@
 #include <vector>
 #include <thread>
 #include <future>
+#include <chrono>
 
 #include <torch/torch.h>
 #include <torch/script.h>
@@ -17,13 +18,24 @@
 #include "similarservice.hpp"
 #include "torchmanager.hpp"
 #include "databasemanager.hpp"
+#include "storagebackend.hpp"
 
 #include "searchengine.hpp"
+#include "collectionmanager.hpp"
+#include "admissioncontrol.hpp"
+#include "tracing.hpp"
+#include "replica.hpp"
 
 #include <easylogging++.h>
 
 INITIALIZE_EASYLOGGINGPP
 
+namespace {
+    // Time given to the requests in progress at shutdown, after which
+    // they (and the change streams of the replicas) are cancelled
+    const int k_shutdown_grace_s = 5;
+}
+
 void euclidesdb_init(const std::string &log_file_path)
 {
     el::Configurations defaultConf;
@@ -39,8 +51,10 @@ void euclidesdb_init(const std::string &log_file_path)
 
 void RunServer(const string &server_address,
         const TorchManager::TorchManagerPtr &torch_manager,
-        const DatabaseManager::DatabaseManagerPtr &database_manager,
-        const SearchEngine::SearchEnginePtr &search_engine)
+        const CollectionManager::CollectionManagerPtr &collections,
+        const AdmissionController::AdmissionControllerPtr &admission,
+        const Tracer::TracerPtr &tracer,
+        bool read_only)
 {
     while(true) // Main loop waiting for shutdowns
     {
@@ -49,11 +63,14 @@ void RunServer(const string &server_address,
 
         grpc::ServerBuilder builder;
         SimilarServiceImpl service(torch_manager,
-                                   database_manager,
-                                   search_engine,
+                                   collections,
+                                   admission,
+                                   tracer,
+                                   read_only,
                                    std::move(shutdown_request));
 
         builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+        admission->configureServer(builder);
         builder.RegisterService(&service);
 
         std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
@@ -67,7 +84,8 @@ void RunServer(const string &server_address,
         if(shut_reason == ShutdownType::REGULAR_SHUTDOWN)
         {
             LOG(INFO) << "Regular shutdown requested, shutting down...";
-            server->Shutdown();
+            server->Shutdown(std::chrono::system_clock::now() +
+                             std::chrono::seconds(k_shutdown_grace_s));
             thread_server.join();
             break;
         }
@@ -75,9 +93,13 @@ void RunServer(const string &server_address,
         if(shut_reason == ShutdownType::REFRESH_INDEX)
         {
             LOG(INFO) << "Refresh index requested, shutting down...";
-            server->Shutdown();
+            server->Shutdown(std::chrono::system_clock::now() +
+                             std::chrono::seconds(k_shutdown_grace_s));
             thread_server.join();
-            search_engine->setup();
+
+            // Only the default collection, the other collections are
+            // refreshed online with the RefreshCollection call.
+            collections->getCollection("")->mSearchEngine->setup();
         }
     }
 }
@@ -118,24 +140,72 @@ int main(int argc, char** argv)
     if(server_address.empty())
         LOG(FATAL) << "You need to specify a address for the server.";
 
-    const std::string db_path = conf_reader.Get("database", "db_path", "");
-    if(db_path.empty())
-        LOG(FATAL) << "You need to specify a database directory path.";
+    // Intra-op threads used by the model inference. The OpenMP thread
+    // count only applies to the thread that sets it, so it is applied by
+    // the torch manager on the gRPC thread running each forward.
+    const int intra_op_threads = static_cast<int>(conf_reader.GetInteger("server", "intra_op_threads", 0));
+    if(intra_op_threads > 0)
+        LOG(INFO) << "Using " << intra_op_threads << " intra-op threads.";
 
-    TorchManager::TorchManagerPtr torch_manager = std::make_shared<TorchManager>();
+    const bool lazy_loading = conf_reader.GetBoolean("models", "lazy_loading", false);
+    const int idle_timeout = static_cast<int>(conf_reader.GetInteger("models", "idle_timeout", 0));
+
+    TorchManager::TorchManagerPtr torch_manager = \
+        std::make_shared<TorchManager>(lazy_loading, idle_timeout, intra_op_threads);
     torch_manager->populateFromDir(model_path);
 
     if(torch_manager->size() <= 0)
         LOG(FATAL) << "No models found !";
 
+    DatabaseOptions db_options;
+    const std::string durability = conf_reader.Get("database", "durability", "none");
+    if(durability == "sync")
+        db_options.mDurability = DurabilityType::SYNC;
+    else if(durability == "periodic")
+        db_options.mDurability = DurabilityType::PERIODIC;
+    else if(durability != "none")
+        LOG(FATAL) << "Unknown database durability: " << durability;
+    db_options.mSyncIntervalMs = \
+        static_cast<int>(conf_reader.GetInteger("database", "sync_interval_ms", 1000));
+    db_options.mCommitWindowUs = \
+        static_cast<int>(conf_reader.GetInteger("database", "commit_window_us", 0));
+    db_options.mChangeLogSize = \
+        static_cast<int>(conf_reader.GetInteger("replication", "changelog_size", 0));
+
+    StorageBackend::StorageBackendPtr storage = \
+        StorageBackend::build_storage_backend(conf_reader);
+
     DatabaseManager::DatabaseManagerPtr database_manager = \
-        std::make_shared<DatabaseManager>(db_path);
+        std::make_shared<DatabaseManager>(storage, db_options);
+
+    // Feature transforms without a persisted file are trained with the
+    // items of the default collection, before the indexes are built
+    torch_manager->trainTransforms(database_manager);
 
-    SearchEngine::SearchEnginePtr search_engine = \
+    CollectionPtr default_collection = std::make_shared<Collection>();
+    default_collection->mDatabaseManager = database_manager;
+    default_collection->mSearchEngine = \
         SearchEngine::build_search_engine(conf_reader, torch_manager, database_manager);
 
+    CollectionManager::CollectionManagerPtr collections = \
+        CollectionManager::build_collection_manager(conf_reader, torch_manager,
+                                                    db_options, default_collection);
+
+    AdmissionController::AdmissionControllerPtr admission = \
+        AdmissionController::build_admission_controller(conf_reader);
+
+    Tracer::TracerPtr tracer = Tracer::build_tracer(conf_reader);
+
+    ReplicaFollower::ReplicaFollowerPtr replica = \
+        ReplicaFollower::build_replica_follower(conf_reader, collections);
+    if(replica)
+        replica->start();
+
     RunServer(server_address, torch_manager,
-              database_manager, search_engine);
+              collections, admission, tracer, replica != nullptr);
+
+    if(replica)
+        replica->stop();
 
     google::protobuf::ShutdownProtobufLibrary();
     return 0;
@@ -0,0 +1,305 @@
+#include "replica.hpp"
+
+#include <algorithm>
+#include <sstream>
+
+#include <easylogging++.h>
+
+using namespace euclidesproto;
+
+namespace {
+    // Wait before reconnecting to the primary after an error
+    const int k_retry_ms = 2000;
+
+    std::string collection_label(const std::string &collection)
+    {
+        return collection.empty() ? std::string("default") : collection;
+    }
+}
+
+
+ReplicaFollower::ReplicaFollower(const std::string &primary_address,
+                                 const std::vector<std::string> &collections,
+                                 const CollectionManager::CollectionManagerPtr &collection_manager,
+                                 int refresh_interval_s)
+: mPrimaryAddress(primary_address), mCollectionNames(collections),
+  mCollectionManager(collection_manager), mRefreshInterval(refresh_interval_s),
+  mStop(false)
+{
+    std::shared_ptr<grpc::Channel> channel = \
+        grpc::CreateChannel(mPrimaryAddress, grpc::InsecureChannelCredentials());
+    mStub = Similar::NewStub(channel);
+}
+
+ReplicaFollower::~ReplicaFollower()
+{
+    stop();
+}
+
+void ReplicaFollower::start()
+{
+    for(const std::string &collection : mCollectionNames)
+        mThreads.emplace_back(&ReplicaFollower::follow, this, collection);
+
+    LOG(INFO) << "Following " << mCollectionNames.size()
+              << " collections of the primary " << mPrimaryAddress << ".";
+}
+
+void ReplicaFollower::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStop = true;
+        for(grpc::ClientContext *context : mCalls)
+            context->TryCancel();
+    }
+    mCondition.notify_all();
+
+    for(std::thread &thread : mThreads)
+        thread.join();
+    mThreads.clear();
+}
+
+bool ReplicaFollower::registerCall(grpc::ClientContext *context)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if(mStop)
+        return false;
+    mCalls.insert(context);
+    return true;
+}
+
+void ReplicaFollower::unregisterCall(grpc::ClientContext *context)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mCalls.erase(context);
+}
+
+bool ReplicaFollower::waitRetry()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    return !mCondition.wait_for(lock, std::chrono::milliseconds(k_retry_ms),
+                                [this]{ return mStop; });
+}
+
+void ReplicaFollower::follow(const std::string &collection)
+{
+    FollowState state;
+    while(true)
+    {
+        if(state.mEpoch.empty() && !bootstrap(collection, &state))
+        {
+            if(!waitRetry())
+                break;
+            continue;
+        }
+
+        const grpc::Status status = streamChanges(collection, &state);
+        if(status.error_code() == grpc::StatusCode::OUT_OF_RANGE)
+        {
+            LOG(WARNING) << "Collection " << collection_label(collection)
+                         << " needs a new snapshot: " << status.error_message();
+            state.mEpoch.clear();
+            continue;
+        }
+
+        if(!status.ok())
+            LOG(WARNING) << "Change stream of the collection " << collection_label(collection)
+                         << " failed: " << status.error_message() << ", retrying.";
+        if(!waitRetry())
+            break;
+    }
+}
+
+bool ReplicaFollower::bootstrap(const std::string &collection, FollowState *state)
+{
+    std::string error;
+    CollectionPtr local = mCollectionManager->getCollection(collection, true, &error);
+    if(local == nullptr)
+    {
+        LOG(ERROR) << "Cannot create the local collection " << collection_label(collection)
+                   << (error.empty() ? "." : ": " + error);
+        return false;
+    }
+
+    grpc::ClientContext context;
+    if(!registerCall(&context))
+        return false;
+
+    GetSnapshotRequest request;
+    request.set_collection(collection);
+    std::unique_ptr<grpc::ClientReader<SnapshotChunk>> reader(mStub->GetSnapshot(&context, request));
+
+    std::unordered_set<int> snapshot_ids;
+    std::string epoch;
+    uint64_t sequence = 0;
+    bool applied = true, searchable = true;
+
+    SnapshotChunk chunk;
+    while(reader->Read(&chunk))
+    {
+        epoch = chunk.epoch();
+        sequence = chunk.sequence();
+        for(const ItemData &item : chunk.items())
+        {
+            snapshot_ids.insert(item.item_id());
+            applied = local->mDatabaseManager->addItemData(item) && applied;
+            searchable = local->mSearchEngine->addItem(item) && searchable;
+        }
+    }
+
+    const grpc::Status status = reader->Finish();
+    unregisterCall(&context);
+
+    if(!status.ok() || epoch.empty())
+    {
+        LOG(WARNING) << "Cannot get the snapshot of the collection " << collection_label(collection)
+                     << ": " << status.error_message();
+        return false;
+    }
+
+    if(!applied)
+    {
+        LOG(ERROR) << "Error applying the snapshot of the collection "
+                   << collection_label(collection) << ".";
+        return false;
+    }
+
+    // The items removed on the primary while this replica was away
+    std::vector<int> stale_ids;
+    DatabaseManager::DatabaseIterator it(local->mDatabaseManager->newIterator(false));
+    for (it->SeekToFirst(); it->Valid(); it->Next())
+    {
+        if(it->key().size() != sizeof(int))
+            continue;
+
+        int id = 0;
+        std::copy(it->key().data(), it->key().data() + sizeof(int), reinterpret_cast<char*>(&id));
+        if(snapshot_ids.count(id) == 0)
+            stale_ids.push_back(id);
+    }
+    it.reset();
+
+    for(const int id : stale_ids)
+    {
+        local->mDatabaseManager->removeItem(id);
+        searchable = local->mSearchEngine->removeItem(id) && searchable;
+    }
+
+    LOG(INFO) << "Collection " << collection_label(collection) << " bootstrapped with "
+              << snapshot_ids.size() << " items at sequence " << sequence
+              << ", " << stale_ids.size() << " stale items removed.";
+
+    state->mEpoch = epoch;
+    state->mSequence = sequence;
+    state->mDirty = !searchable;
+    state->mLastRefresh = std::chrono::steady_clock::time_point();
+    refreshIfNeeded(collection, state);
+    return true;
+}
+
+grpc::Status ReplicaFollower::streamChanges(const std::string &collection, FollowState *state)
+{
+    if(mCollectionManager->getCollection(collection) == nullptr)
+        return grpc::Status(grpc::StatusCode::OUT_OF_RANGE, "the local collection is missing");
+
+    grpc::ClientContext context;
+    if(!registerCall(&context))
+        return grpc::Status::CANCELLED;
+
+    StreamChangesRequest request;
+    request.set_collection(collection);
+    request.set_epoch(state->mEpoch);
+    request.set_after_sequence(state->mSequence);
+    std::unique_ptr<grpc::ClientReader<ChangeEvent>> reader(mStub->StreamChanges(&context, request));
+
+    ChangeEvent event;
+    while(reader->Read(&event))
+    {
+        // The collection is looked up again since refreshes replace it
+        CollectionPtr local = mCollectionManager->getCollection(collection);
+        bool applied = true, searchable = true;
+        switch(event.type())
+        {
+        case ChangeEvent::PUT:
+            applied = local->mDatabaseManager->addItemData(event.item());
+            searchable = applied && local->mSearchEngine->addItem(event.item());
+            break;
+        case ChangeEvent::REMOVE:
+            applied = local->mDatabaseManager->removeItem(event.item_id());
+            searchable = applied && local->mSearchEngine->removeItem(event.item_id());
+            break;
+        default:
+            break;
+        }
+
+        // The stream resumes from the last change applied
+        if(!applied)
+        {
+            LOG(ERROR) << "Error applying the change " << event.sequence() << ".";
+            context.TryCancel();
+            break;
+        }
+
+        // Engines updated in place don't need a refresh
+        if(event.type() != ChangeEvent::HEARTBEAT)
+        {
+            state->mSequence = event.sequence();
+            state->mDirty = state->mDirty || !searchable;
+        }
+
+        refreshIfNeeded(collection, state);
+    }
+
+    const grpc::Status status = reader->Finish();
+    unregisterCall(&context);
+    return status;
+}
+
+void ReplicaFollower::refreshIfNeeded(const std::string &collection, FollowState *state)
+{
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if(!state->mDirty || now - state->mLastRefresh < mRefreshInterval)
+        return;
+
+    mCollectionManager->refreshCollection(collection);
+    state->mDirty = false;
+    state->mLastRefresh = now;
+
+    LOG(INFO) << "Refreshed the indexes of the collection " << collection_label(collection)
+              << " at sequence " << state->mSequence << ".";
+}
+
+ReplicaFollower::ReplicaFollowerPtr
+ReplicaFollower::build_replica_follower(const INIReader &conf_reader,
+                                        const CollectionManager::CollectionManagerPtr &collection_manager)
+{
+    const std::string primary_address = conf_reader.Get("replication", "primary_address", "");
+    if(primary_address.empty())
+        return nullptr;
+
+    // The default collection is always followed
+    std::vector<std::string> collections(1, "");
+    std::stringstream stream(conf_reader.Get("replication", "follow_collections", ""));
+    std::string name;
+    while(std::getline(stream, name, ','))
+    {
+        name.erase(0, name.find_first_not_of(" \t"));
+        name.erase(name.find_last_not_of(" \t") + 1);
+        if(name.empty())
+            continue;
+
+        if(!CollectionManager::valid_collection_name(name))
+            LOG(FATAL) << "Invalid collection name in follow_collections: " << name;
+        collections.push_back(name);
+    }
+
+    const int refresh_interval = \
+        static_cast<int>(conf_reader.GetInteger("replication", "refresh_interval", 10));
+
+    LOG(INFO) << "Replica of " << primary_address << ", refreshing the indexes every "
+              << refresh_interval << " seconds.";
+
+    return std::make_shared<ReplicaFollower>(primary_address, collections,
+                                             collection_manager, refresh_interval);
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <grpc++/grpc++.h>
+#include <INIReader.h>
+
+#include "euclidesproto.grpc.pb.h"
+#include "collectionmanager.hpp"
+
+
+/**
+ * Keeps the collections of a replica in sync with the primary. Each
+ * collection is bootstrapped from a snapshot of the primary and then
+ * follows its change stream, applying the changes to the local database
+ * and search engine. Search engines that can't be updated in place have
+ * their indexes rebuilt online, at most once every refresh interval.
+ */
+class ReplicaFollower
+{
+public:
+    typedef std::shared_ptr<ReplicaFollower> ReplicaFollowerPtr;
+
+public:
+    /**
+     * @param primary_address the address of the primary server
+     * @param collections the names of the collections followed
+     * @param collection_manager the local collections
+     * @param refresh_interval_s minimum time between index refreshes
+     */
+    ReplicaFollower(const std::string &primary_address,
+                    const std::vector<std::string> &collections,
+                    const CollectionManager::CollectionManagerPtr &collection_manager,
+                    int refresh_interval_s);
+    ~ReplicaFollower();
+
+    /**
+     * Start following the primary, with a thread for each collection.
+     */
+    void start();
+
+    /**
+     * Stop following the primary, cancelling the streams in progress.
+     */
+    void stop();
+
+    /**
+     * Build the follower from the [replication] section.
+     * @return the follower, or nullptr if this server isn't a replica
+     */
+    static ReplicaFollowerPtr build_replica_follower(const INIReader &conf_reader,
+                                                     const CollectionManager::CollectionManagerPtr &collection_manager);
+
+private:
+    /**
+     * The position of a collection in the change stream of the primary,
+     * an empty epoch means that a snapshot is required.
+     */
+    struct FollowState
+    {
+        FollowState()
+        : mSequence(0), mDirty(false)
+        { }
+
+        std::string mEpoch;
+        uint64_t mSequence;
+        bool mDirty;
+        std::chrono::steady_clock::time_point mLastRefresh;
+    };
+
+    void follow(const std::string &collection);
+
+    /**
+     * Replace the items of a local collection with a snapshot of the primary.
+     * @return true if the snapshot was applied, false otherwise
+     */
+    bool bootstrap(const std::string &collection, FollowState *state);
+
+    /**
+     * Apply the change stream of the primary until it fails or is cancelled.
+     * @return the status of the stream, OUT_OF_RANGE if a new snapshot is required
+     */
+    grpc::Status streamChanges(const std::string &collection, FollowState *state);
+
+    /**
+     * Rebuild the indexes of a collection if it changed and the refresh
+     * interval elapsed.
+     */
+    void refreshIfNeeded(const std::string &collection, FollowState *state);
+
+    /**
+     * Wait before reconnecting to the primary.
+     * @return false if the follower was stopped
+     */
+    bool waitRetry();
+
+    bool registerCall(grpc::ClientContext *context);
+    void unregisterCall(grpc::ClientContext *context);
+
+    std::string mPrimaryAddress;
+    std::vector<std::string> mCollectionNames;
+    CollectionManager::CollectionManagerPtr mCollectionManager;
+    std::chrono::seconds mRefreshInterval;
+    std::unique_ptr<euclidesproto::Similar::Stub> mStub;
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    bool mStop;
+    std::unordered_set<grpc::ClientContext*> mCalls;
+    std::vector<std::thread> mThreads;
+};
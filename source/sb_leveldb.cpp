@@ -0,0 +1,103 @@
+#include "sb_leveldb.hpp"
+
+#include <algorithm>
+
+#include <easylogging++.h>
+
+
+SBLevelDB::SBLevelDB(const std::string &db_path, int block_cache_mb,
+                     int write_buffer_mb, int bloom_bits_per_key,
+                     bool compression)
+: mPath(db_path), mDb(nullptr), mBlockCache(nullptr), mFilterPolicy(nullptr)
+{
+    leveldb::Options options;
+    options.create_if_missing = true;
+    options.compression = compression ?
+                          leveldb::CompressionType::kSnappyCompression :
+                          leveldb::CompressionType::kNoCompression;
+    options.write_buffer_size = static_cast<size_t>(write_buffer_mb) << 20;
+
+    if(block_cache_mb > 0)
+    {
+        mBlockCache = leveldb::NewLRUCache(static_cast<size_t>(block_cache_mb) << 20);
+        options.block_cache = mBlockCache;
+    }
+
+    if(bloom_bits_per_key > 0)
+    {
+        mFilterPolicy = leveldb::NewBloomFilterPolicy(bloom_bits_per_key);
+        options.filter_policy = mFilterPolicy;
+    }
+
+    leveldb::Status status = leveldb::DB::Open(options, db_path, &mDb);
+
+    if(!status.ok())
+        LOG(FATAL) << "Unable to create or load the database. Is it already opened ?";
+}
+
+SBLevelDB::~SBLevelDB()
+{
+    // The database must be closed before releasing its cache and filter
+    if(mDb)
+        delete mDb;
+    if(mBlockCache)
+        delete mBlockCache;
+    if(mFilterPolicy)
+        delete mFilterPolicy;
+}
+
+bool SBLevelDB::get(const leveldb::Slice &key, std::string *value)
+{
+    auto s = mDb->Get(leveldb::ReadOptions(), key, value);
+    return s.ok();
+}
+
+void SBLevelDB::multiGet(const std::vector<std::string> &keys,
+                         std::vector<std::string> *values,
+                         std::vector<bool> *found)
+{
+    values->assign(keys.size(), std::string());
+    found->assign(keys.size(), false);
+
+    std::vector<size_t> order(keys.size());
+    for(size_t i=0; i<order.size(); i++)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [&keys](size_t a, size_t b) {
+        return keys[a] < keys[b];
+    });
+
+    leveldb::ReadOptions roptions;
+    roptions.snapshot = mDb->GetSnapshot();
+    for(const size_t i : order)
+        (*found)[i] = mDb->Get(roptions, keys[i], &(*values)[i]).ok();
+    mDb->ReleaseSnapshot(roptions.snapshot);
+}
+
+bool SBLevelDB::write(leveldb::WriteBatch *batch, bool sync)
+{
+    leveldb::WriteOptions woptions;
+    woptions.sync = sync;
+    auto s = mDb->Write(woptions, batch);
+    if(!s.ok())
+        LOG(ERROR) << "Error writing into the database: " << s.ToString();
+    return s.ok();
+}
+
+bool SBLevelDB::sync()
+{
+    // A synced empty batch flushes the LevelDB log to disk
+    leveldb::WriteBatch empty_batch;
+    return write(&empty_batch, true);
+}
+
+leveldb::Iterator *SBLevelDB::newIterator(bool fill_cache)
+{
+    leveldb::ReadOptions roptions;
+    roptions.fill_cache = fill_cache;
+    return mDb->NewIterator(roptions);
+}
+
+std::string SBLevelDB::getPath() const
+{
+    return mPath;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "storagebackend.hpp"
+
+#include <leveldb/db.h>
+#include <leveldb/cache.h>
+#include <leveldb/filter_policy.h>
+
+/**
+ * The LevelDB storage backend, this is the default EuclidesDB storage.
+ */
+class SBLevelDB : public StorageBackend
+{
+public:
+    /**
+     * Open (or create) the LevelDB database.
+     * @param db_path the database directory path
+     * @param block_cache_mb size of the uncompressed block cache
+     * @param write_buffer_mb size of the memtable before being flushed
+     * @param bloom_bits_per_key bits per key of the bloom filter, or
+     *                           zero to disable the filter
+     * @param compression if the blocks should be compressed with snappy
+     */
+    SBLevelDB(const std::string &db_path, int block_cache_mb,
+              int write_buffer_mb, int bloom_bits_per_key,
+              bool compression);
+    ~SBLevelDB();
+
+    bool get(const leveldb::Slice &key, std::string *value) override;
+
+    /**
+     * Get many keys from a single snapshot, reading them in the key
+     * order so the lookups walk the table blocks sequentially.
+     */
+    void multiGet(const std::vector<std::string> &keys,
+                  std::vector<std::string> *values,
+                  std::vector<bool> *found) override;
+    bool write(leveldb::WriteBatch *batch, bool sync) override;
+    bool sync() override;
+    leveldb::Iterator *newIterator(bool fill_cache) override;
+    std::string getPath() const override;
+
+private:
+    std::string mPath;
+    leveldb::DB *mDb;
+    leveldb::Cache *mBlockCache;
+    const leveldb::FilterPolicy *mFilterPolicy;
+};
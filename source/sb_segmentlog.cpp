@@ -0,0 +1,744 @@
+#include "sb_segmentlog.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <tinydir.h>
+#include <easylogging++.h>
+
+namespace {
+    const uint32_t k_record_end = 0;
+    const uint32_t k_record_put = 1;
+    const uint32_t k_record_delete = 2;
+
+    // Record header: type, key size, value size and the CRC32 of the
+    // first three fields, the key and the value
+    const uint64_t k_header_size = 4 * sizeof(uint32_t);
+
+    // Each segment starts with the magic of its record format
+    const char k_segment_magic[8] = {'E', 'U', 'C', 'S', 'E', 'G', '0', '2'};
+    const uint64_t k_segment_header_size = sizeof(k_segment_magic);
+
+    const std::string k_segment_prefix = "segment_";
+    const std::string k_segment_suffix = ".log";
+
+    // Compacted segments are written aside and renamed over the original
+    const std::string k_compaction_suffix = ".compact";
+
+    /**
+     * Make the creation, rename and removal of the files of a directory
+     * durable.
+     */
+    bool sync_directory(const std::string &path)
+    {
+        const int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+        if(fd < 0)
+            return false;
+        const bool synced = (fsync(fd) == 0);
+        close(fd);
+        return synced;
+    }
+
+    std::vector<uint32_t> crc32_table()
+    {
+        std::vector<uint32_t> table(256);
+        for(uint32_t i=0; i<256; i++)
+        {
+            uint32_t crc = i;
+            for(int bit=0; bit<8; bit++)
+                crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : (crc >> 1);
+            table[i] = crc;
+        }
+        return table;
+    }
+
+    uint32_t crc32_update(uint32_t crc, const char *data, size_t size)
+    {
+        static const std::vector<uint32_t> table = crc32_table();
+        crc = ~crc;
+        for(size_t i=0; i<size; i++)
+            crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+        return ~crc;
+    }
+
+    /**
+     * The checksum of a record, over its header fields, key and value.
+     */
+    uint32_t record_crc(const uint32_t *header, const char *key, const char *value)
+    {
+        uint32_t crc = crc32_update(0, reinterpret_cast<const char*>(header), 3 * sizeof(uint32_t));
+        crc = crc32_update(crc, key, header[1]);
+        return crc32_update(crc, value, header[2]);
+    }
+
+    std::string segment_filename(const std::string &path, uint32_t segment_id)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "%08u", segment_id);
+        return path + "/" + k_segment_prefix + name + k_segment_suffix;
+    }
+
+    /**
+     * Get the id of a segment from its file name, segment_<id>.log.
+     * @return true if the name is a segment file name, false otherwise
+     */
+    bool parse_segment_filename(const std::string &filename, uint32_t *segment_id)
+    {
+        if(filename.size() <= k_segment_prefix.size() + k_segment_suffix.size() ||
+           filename.compare(0, k_segment_prefix.size(), k_segment_prefix) != 0)
+            return false;
+
+        const char *id_start = filename.c_str() + k_segment_prefix.size();
+        if(*id_start < '0' || *id_start > '9')
+            return false;
+
+        char *id_end = nullptr;
+        errno = 0;
+        const unsigned long id = std::strtoul(id_start, &id_end, 10);
+        if(errno != 0 || id == 0 || id > UINT32_MAX || id_end == id_start ||
+           k_segment_suffix != id_end)
+            return false;
+
+        *segment_id = static_cast<uint32_t>(id);
+        return true;
+    }
+
+    uint64_t record_size(uint32_t key_size, uint32_t value_size)
+    {
+        return k_header_size + key_size + value_size;
+    }
+}
+
+struct SBSegmentLog::Segment
+{
+    Segment()
+    : mId(0), mFd(-1), mData(nullptr), mCapacity(0), mSize(0),
+      mDeadBytes(0)
+    { }
+
+    // The files of compacted segments are removed (or replaced) right
+    // away, the iterators and readers still using them keep the mapping
+    ~Segment()
+    {
+        if(mData != nullptr)
+            munmap(mData, mCapacity);
+        if(mFd >= 0)
+            close(mFd);
+    }
+
+    const char *value(const RecordLocation &location) const
+    {
+        return mData + location.mOffset + k_header_size + location.mKeySize;
+    }
+
+    uint32_t mId;
+    std::string mPath;
+    int mFd;
+    char *mData;
+    uint64_t mCapacity;
+    uint64_t mSize;
+    uint64_t mDeadBytes;
+};
+
+/**
+ * Apply the operations of a write batch into the segment log.
+ */
+class SegmentLogBatchHandler : public leveldb::WriteBatch::Handler
+{
+public:
+    explicit SegmentLogBatchHandler(SBSegmentLog *segment_log)
+    : mSegmentLog(segment_log)
+    { }
+
+    void Put(const leveldb::Slice &key, const leveldb::Slice &value) override
+    {
+        mSegmentLog->appendPut(key, value);
+    }
+
+    void Delete(const leveldb::Slice &key) override
+    {
+        mSegmentLog->appendDelete(key);
+    }
+
+private:
+    SBSegmentLog *mSegmentLog;
+};
+
+/**
+ * Iterator over a snapshot of the index, it keeps a reference to the
+ * segments so they are not removed by compactions while iterating.
+ */
+class SegmentLogIterator : public leveldb::Iterator
+{
+public:
+    typedef std::vector<std::pair<std::string, SBSegmentLog::RecordLocation>> entries_t;
+
+    SegmentLogIterator(entries_t &&entries, SBSegmentLog::segmentmap_t &&segments)
+    : mEntries(std::move(entries)), mSegments(std::move(segments)),
+      mPosition(mEntries.size())
+    { }
+
+    bool Valid() const override { return mPosition < mEntries.size(); }
+    void SeekToFirst() override { mPosition = 0; }
+    void SeekToLast() override { mPosition = mEntries.empty() ? 0 : mEntries.size() - 1; }
+    void Next() override { mPosition++; }
+    void Prev() override { mPosition = (mPosition == 0) ? mEntries.size() : mPosition - 1; }
+
+    void Seek(const leveldb::Slice &target) override
+    {
+        const std::string target_key = target.ToString();
+        auto found = std::lower_bound(mEntries.begin(), mEntries.end(), target_key,
+            [](const entries_t::value_type &entry, const std::string &key) {
+                return entry.first < key;
+            });
+        mPosition = static_cast<size_t>(found - mEntries.begin());
+    }
+
+    leveldb::Slice key() const override
+    {
+        return leveldb::Slice(mEntries[mPosition].first);
+    }
+
+    leveldb::Slice value() const override
+    {
+        const SBSegmentLog::RecordLocation &location = mEntries[mPosition].second;
+        const SBSegmentLog::SegmentPtr &segment = mSegments.at(location.mSegmentId);
+        return leveldb::Slice(segment->value(location), location.mValueSize);
+    }
+
+    leveldb::Status status() const override { return leveldb::Status::OK(); }
+
+private:
+    entries_t mEntries;
+    SBSegmentLog::segmentmap_t mSegments;
+    size_t mPosition;
+};
+
+
+SBSegmentLog::SBSegmentLog(const std::string &db_path, int segment_size_mb,
+                           double compaction_ratio, int compaction_interval)
+: mPath(db_path), mSegmentSize(static_cast<uint64_t>(segment_size_mb) << 20),
+  mCompactionRatio(compaction_ratio), mCompactionInterval(compaction_interval),
+  mStopCompaction(false)
+{
+    mkdir(mPath.c_str(), 0755);
+
+    tinydir_dir dir;
+    if (tinydir_open(&dir, mPath.c_str()) == -1)
+        LOG(FATAL) << "Unable to open the database directory " << mPath << ".";
+
+    std::vector<uint32_t> segment_ids;
+    while (dir.has_next)
+    {
+        tinydir_file file;
+        if (tinydir_readfile(&dir, &file) == -1)
+            LOG(FATAL) << "Error reading file.";
+
+        const std::string filename = std::string(file.name);
+        if (tinydir_next(&dir) == -1)
+            LOG(FATAL) << "Error getting next file.";
+
+        // A compaction interrupted by a crash leaves its output behind,
+        // the original segment is still in place
+        if(filename.size() > k_compaction_suffix.size() &&
+           filename.compare(filename.size() - k_compaction_suffix.size(),
+                            k_compaction_suffix.size(), k_compaction_suffix) == 0)
+        {
+            LOG(INFO) << "Removing the interrupted compaction " << filename << ".";
+            unlink(file.path);
+            continue;
+        }
+
+        uint32_t segment_id = 0;
+        if(!parse_segment_filename(filename, &segment_id))
+        {
+            if(filename.compare(0, k_segment_prefix.size(), k_segment_prefix) == 0)
+                LOG(WARNING) << "Skipping the unknown file " << filename
+                             << " in the database directory.";
+            continue;
+        }
+
+        segment_ids.push_back(segment_id);
+    }
+    tinydir_close(&dir);
+
+    // Segments must be replayed in the order they were written
+    std::sort(segment_ids.begin(), segment_ids.end());
+    for(uint32_t segment_id : segment_ids)
+    {
+        SegmentPtr segment = openSegment(segment_id, 0);
+        mSegments[segment_id] = segment;
+        recoverSegment(segment);
+        mActiveSegment = segment;
+    }
+
+    if(mActiveSegment == nullptr)
+    {
+        mActiveSegment = openSegment(1, mSegmentSize);
+        mSegments[mActiveSegment->mId] = mActiveSegment;
+    }
+
+    LOG(INFO) << "Segment log opened with " << mSegments.size()
+              << " segments and " << mIndex.size() << " records.";
+
+    if(mCompactionInterval > 0)
+        mCompactionThread = std::thread(&SBSegmentLog::compactionLoop, this);
+}
+
+SBSegmentLog::~SBSegmentLog()
+{
+    if(mCompactionThread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mCompactionMutex);
+            mStopCompaction = true;
+        }
+        mCompactionCondition.notify_all();
+        mCompactionThread.join();
+    }
+
+    sync();
+}
+
+SBSegmentLog::SegmentPtr SBSegmentLog::openSegment(uint32_t segment_id, uint64_t capacity,
+                                                   const std::string &suffix)
+{
+    SegmentPtr segment = std::make_shared<Segment>();
+    segment->mId = segment_id;
+    segment->mPath = segment_filename(mPath, segment_id) + suffix;
+
+    segment->mFd = open(segment->mPath.c_str(), O_RDWR | O_CREAT, 0644);
+    if(segment->mFd < 0)
+        LOG(FATAL) << "Unable to open the segment " << segment->mPath << ".";
+
+    // New segments are pre-allocated, zeroes mark the end of the records
+    const bool is_new = (capacity > 0);
+    if(is_new)
+    {
+        if(ftruncate(segment->mFd, static_cast<off_t>(capacity)) != 0)
+            LOG(FATAL) << "Unable to allocate the segment " << segment->mPath << ".";
+
+        // The synced writes into the segment need its directory entry
+        // durable too, compacted segments are synced when renamed
+        if(suffix.empty() && !sync_directory(mPath))
+            LOG(FATAL) << "Unable to sync the database directory " << mPath << ".";
+    }
+    else
+    {
+        struct stat file_stat;
+        fstat(segment->mFd, &file_stat);
+        capacity = static_cast<uint64_t>(file_stat.st_size);
+
+        // A crash right after creating the file leaves it empty
+        if(capacity < k_segment_header_size)
+            return openSegment(segment_id, mSegmentSize, suffix);
+    }
+
+    segment->mCapacity = capacity;
+    void *data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, segment->mFd, 0);
+    if(data == MAP_FAILED)
+        LOG(FATAL) << "Unable to map the segment " << segment->mPath << ".";
+    segment->mData = static_cast<char*>(data);
+    segment->mSize = k_segment_header_size;
+
+    // A pre-allocated segment might not have its magic yet after a crash
+    static const char zeroes[k_segment_header_size] = {0};
+    if(is_new || std::memcmp(segment->mData, zeroes, k_segment_header_size) == 0)
+        std::memcpy(segment->mData, k_segment_magic, k_segment_header_size);
+    else if(std::memcmp(segment->mData, k_segment_magic, k_segment_header_size) != 0)
+        LOG(FATAL) << "The segment " << segment->mPath << " has an unsupported format.";
+
+    return segment;
+}
+
+void SBSegmentLog::recoverSegment(const SegmentPtr &segment)
+{
+    uint64_t offset = k_segment_header_size;
+    while(offset + k_header_size <= segment->mCapacity)
+    {
+        uint32_t header[4];
+        std::memcpy(header, segment->mData + offset, k_header_size);
+        const uint32_t type = header[0];
+        const uint64_t size = record_size(header[1], header[2]);
+
+        // End of records
+        if(type == k_record_end && header[1] == 0 && header[2] == 0 && header[3] == 0)
+            break;
+
+        // A record torn by a crash (or corrupted) ends the segment, the
+        // tail is cleared so it is never read back as records
+        const char *key_data = segment->mData + offset + k_header_size;
+        if((type != k_record_put && type != k_record_delete) ||
+           offset + size > segment->mCapacity ||
+           record_crc(header, key_data, key_data + header[1]) != header[3])
+        {
+            LOG(WARNING) << "Invalid record at offset " << offset << " of the segment "
+                         << segment->mPath << ", truncating the segment.";
+            std::memset(segment->mData + offset, 0, segment->mCapacity - offset);
+            msync(segment->mData, segment->mCapacity, MS_SYNC);
+            break;
+        }
+
+        const leveldb::Slice key(key_data, header[1]);
+        auto found = mIndex.find(key.ToString());
+        if(found != mIndex.end())
+        {
+            markDead(found->second);
+            mIndex.erase(found);
+        }
+
+        if(type == k_record_put)
+        {
+            RecordLocation location = {segment->mId, offset, header[1], header[2]};
+            mIndex[key.ToString()] = location;
+        }
+        else
+        {
+            segment->mDeadBytes += size;
+        }
+
+        offset += size;
+    }
+
+    segment->mSize = offset;
+}
+
+SBSegmentLog::RecordLocation SBSegmentLog::appendRecord(uint32_t type,
+                                                       const leveldb::Slice &key,
+                                                       const leveldb::Slice &value)
+{
+    const uint64_t size = record_size(key.size(), value.size());
+
+    // Seal the active segment when it is full
+    if(mActiveSegment->mSize + size > mActiveSegment->mCapacity)
+    {
+        msync(mActiveSegment->mData, mActiveSegment->mSize, MS_SYNC);
+        const uint32_t segment_id = mActiveSegment->mId + 1;
+        mActiveSegment = openSegment(segment_id, std::max(mSegmentSize, size + k_segment_header_size));
+        mSegments[segment_id] = mActiveSegment;
+    }
+
+    const uint64_t offset = mActiveSegment->mSize;
+    uint32_t header[4] = {type, static_cast<uint32_t>(key.size()),
+                          static_cast<uint32_t>(value.size()), 0};
+    header[3] = record_crc(header, key.data(), value.data());
+    char *record = mActiveSegment->mData + offset;
+    std::memcpy(record, header, k_header_size);
+    std::memcpy(record + k_header_size, key.data(), key.size());
+    std::memcpy(record + k_header_size + key.size(), value.data(), value.size());
+    mActiveSegment->mSize += size;
+
+    RecordLocation location = {mActiveSegment->mId, offset,
+                               header[1], header[2]};
+    return location;
+}
+
+void SBSegmentLog::markDead(const RecordLocation &location)
+{
+    auto segment = mSegments.find(location.mSegmentId);
+    if(segment != mSegments.end())
+        segment->second->mDeadBytes += record_size(location.mKeySize, location.mValueSize);
+}
+
+void SBSegmentLog::appendPut(const leveldb::Slice &key, const leveldb::Slice &value)
+{
+    const RecordLocation location = appendRecord(k_record_put, key, value);
+    const std::string key_str = key.ToString();
+
+    auto found = mIndex.find(key_str);
+    if(found != mIndex.end())
+    {
+        markDead(found->second);
+        found->second = location;
+        return;
+    }
+
+    mIndex[key_str] = location;
+}
+
+void SBSegmentLog::appendDelete(const leveldb::Slice &key)
+{
+    auto found = mIndex.find(key.ToString());
+    if(found == mIndex.end())
+        return;
+
+    markDead(found->second);
+    mIndex.erase(found);
+
+    // Tombstones are only needed until the deleted record is compacted
+    const RecordLocation location = appendRecord(k_record_delete, key, leveldb::Slice());
+    markDead(location);
+}
+
+bool SBSegmentLog::get(const leveldb::Slice &key, std::string *value)
+{
+    SegmentPtr segment;
+    RecordLocation location;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto found = mIndex.find(key.ToString());
+        if(found == mIndex.end())
+            return false;
+
+        location = found->second;
+        segment = mSegments[location.mSegmentId];
+    }
+
+    // Records are immutable, the copy doesn't need the lock
+    value->assign(segment->value(location), location.mValueSize);
+    return true;
+}
+
+void SBSegmentLog::multiGet(const std::vector<std::string> &keys,
+                            std::vector<std::string> *values,
+                            std::vector<bool> *found)
+{
+    values->assign(keys.size(), std::string());
+    found->assign(keys.size(), false);
+
+    // All the locations are resolved under a single lock
+    std::vector<SegmentPtr> segments(keys.size());
+    std::vector<RecordLocation> locations(keys.size());
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for(size_t i=0; i<keys.size(); i++)
+        {
+            auto location = mIndex.find(keys[i]);
+            if(location == mIndex.end())
+                continue;
+
+            locations[i] = location->second;
+            segments[i] = mSegments[location->second.mSegmentId];
+            (*found)[i] = true;
+        }
+    }
+
+    for(size_t i=0; i<keys.size(); i++)
+        if((*found)[i])
+            (*values)[i].assign(segments[i]->value(locations[i]), locations[i].mValueSize);
+}
+
+bool SBSegmentLog::write(leveldb::WriteBatch *batch, bool sync)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    SegmentLogBatchHandler handler(this);
+    const leveldb::Status s = batch->Iterate(&handler);
+    if(!s.ok())
+    {
+        LOG(ERROR) << "Error writing into the database: " << s.ToString();
+        return false;
+    }
+
+    if(sync)
+        return msync(mActiveSegment->mData, mActiveSegment->mSize, MS_SYNC) == 0;
+
+    return true;
+}
+
+bool SBSegmentLog::sync()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return msync(mActiveSegment->mData, mActiveSegment->mSize, MS_SYNC) == 0;
+}
+
+leveldb::Iterator *SBSegmentLog::newIterator(bool fill_cache)
+{
+    SegmentLogIterator::entries_t entries;
+    segmentmap_t segments;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        entries.assign(mIndex.begin(), mIndex.end());
+        segments = mSegments;
+    }
+
+    return new SegmentLogIterator(std::move(entries), std::move(segments));
+}
+
+std::string SBSegmentLog::getPath() const
+{
+    return mPath;
+}
+
+void SBSegmentLog::compact()
+{
+    std::lock_guard<std::mutex> compaction_lock(mCompactMutex);
+
+    std::vector<SegmentPtr> candidates;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for(const auto &pair : mSegments)
+        {
+            const SegmentPtr &segment = pair.second;
+            if(segment == mActiveSegment || segment->mSize <= k_segment_header_size)
+                continue;
+
+            const double dead_ratio = static_cast<double>(segment->mDeadBytes) /
+                                      static_cast<double>(segment->mSize);
+            if(dead_ratio >= mCompactionRatio)
+                candidates.push_back(segment);
+        }
+    }
+
+    std::sort(candidates.begin(), candidates.end(),
+              [](const SegmentPtr &a, const SegmentPtr &b) { return a->mId < b->mId; });
+
+    for(const SegmentPtr &segment : candidates)
+    {
+        // The files of the compacted segments are removed durably, so
+        // the segments in the map are the ones on disk
+        bool is_oldest = false;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            is_oldest = std::min_element(mSegments.begin(), mSegments.end(),
+                [](const segmentmap_t::value_type &a, const segmentmap_t::value_type &b) {
+                    return a.first < b.first;
+                })->first == segment->mId;
+        }
+
+        compactSegment(segment, is_oldest);
+    }
+}
+
+void SBSegmentLog::compactSegment(const SegmentPtr &segment, bool is_oldest)
+{
+    TIMED_SCOPE(timerCompaction, "SegmentCompaction");
+
+    // A record copied into the compacted segment
+    struct CopiedRecord
+    {
+        uint64_t mOffset;
+        uint64_t mNewOffset;
+        uint64_t mSize;
+        uint32_t mKeySize;
+        bool mPut;
+    };
+
+    // The live records are selected under the lock, sealed segments are
+    // immutable so the copy and the file operations run without it
+    std::vector<CopiedRecord> copied;
+    uint64_t compacted_size = k_segment_header_size;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        uint64_t offset = k_segment_header_size;
+        while(offset < segment->mSize)
+        {
+            uint32_t header[4];
+            std::memcpy(header, segment->mData + offset, k_header_size);
+            const uint64_t size = record_size(header[1], header[2]);
+            const leveldb::Slice key(segment->mData + offset + k_header_size, header[1]);
+            auto found = mIndex.find(key.ToString());
+
+            // Only the latest record of a key is live, and tombstones are
+            // only needed while an older segment might have the record
+            const bool live_put = (header[0] == k_record_put && found != mIndex.end() &&
+                                   found->second.mSegmentId == segment->mId &&
+                                   found->second.mOffset == offset);
+            const bool needed_delete = (header[0] == k_record_delete && !is_oldest &&
+                                        found == mIndex.end());
+            if(live_put || needed_delete)
+            {
+                copied.push_back({offset, compacted_size, size, header[1], live_put});
+                compacted_size += size;
+            }
+
+            offset += size;
+        }
+    }
+
+    // The records that replaced the dropped ones must be durable before
+    // the segment is, otherwise a crash would lose both. Sealed segments
+    // are synced when sealed, only the active one can be behind.
+    if(!sync())
+    {
+        LOG(ERROR) << "Unable to sync the active segment, skipping the compaction of segment "
+                   << segment->mId << ".";
+        return;
+    }
+
+    // The compacted segment is written aside and renamed over the original
+    // one, a crash leaves either of them, both replay to the same records
+    const std::string segment_path = segment_filename(mPath, segment->mId);
+    SegmentPtr compacted;
+    if(!copied.empty())
+    {
+        compacted = openSegment(segment->mId, compacted_size, k_compaction_suffix);
+        for(const CopiedRecord &record : copied)
+            std::memcpy(compacted->mData + record.mNewOffset,
+                        segment->mData + record.mOffset, record.mSize);
+        compacted->mSize = compacted_size;
+
+        if(msync(compacted->mData, compacted->mCapacity, MS_SYNC) != 0 ||
+           std::rename(compacted->mPath.c_str(), segment_path.c_str()) != 0)
+        {
+            LOG(ERROR) << "Unable to write the compacted segment " << compacted->mPath << ".";
+            unlink(compacted->mPath.c_str());
+            return;
+        }
+        compacted->mPath = segment_path;
+    }
+    else if(unlink(segment_path.c_str()) != 0)
+    {
+        LOG(ERROR) << "Unable to remove the segment " << segment_path << ".";
+        return;
+    }
+
+    // Tombstones dropped from the oldest segment must never be outlived
+    // by the records they deleted
+    if(!sync_directory(mPath))
+        LOG(FATAL) << "Unable to sync the database directory " << mPath << ".";
+
+    // Records overwritten or deleted during the copy are dead in the
+    // compacted segment, the other ones now point to their copy
+    uint64_t live_records = 0;
+    std::lock_guard<std::mutex> lock(mMutex);
+    if(compacted == nullptr)
+    {
+        mSegments.erase(segment->mId);
+    }
+    else
+    {
+        for(const CopiedRecord &record : copied)
+        {
+            const leveldb::Slice key(segment->mData + record.mOffset + k_header_size,
+                                     record.mKeySize);
+            auto found = mIndex.find(key.ToString());
+            if(record.mPut && found != mIndex.end() &&
+               found->second.mSegmentId == segment->mId &&
+               found->second.mOffset == record.mOffset)
+            {
+                found->second.mOffset = record.mNewOffset;
+                live_records++;
+                continue;
+            }
+            compacted->mDeadBytes += record.mSize;
+        }
+        mSegments[segment->mId] = compacted;
+    }
+
+    LOG(INFO) << "Compacted segment " << segment->mId << ", "
+              << live_records << " live records rewritten.";
+}
+
+void SBSegmentLog::compactionLoop()
+{
+    std::unique_lock<std::mutex> lock(mCompactionMutex);
+    const std::chrono::seconds interval(mCompactionInterval);
+
+    while(!mCompactionCondition.wait_for(lock, interval, [this]{ return mStopCompaction; }))
+    {
+        lock.unlock();
+        compact();
+        lock.lock();
+    }
+}
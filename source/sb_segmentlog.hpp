@@ -0,0 +1,100 @@
+#pragma once
+
+#include "storagebackend.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+/**
+ * This is an append-only storage backend. Records are appended to
+ * memory-mapped segment files and an in-memory index keeps the location
+ * of the latest record of each key, so point lookups are a single memory
+ * copy and scans read the vectors directly from the mapped segments,
+ * without any decompression or compaction overhead of LevelDB.
+ * Deleted and overwritten records are reclaimed by a background
+ * compaction that rewrites the live records of the segments with too
+ * many dead records.
+ */
+class SBSegmentLog : public StorageBackend
+{
+public:
+    struct Segment;
+    typedef std::shared_ptr<Segment> SegmentPtr;
+    typedef std::unordered_map<uint32_t, SegmentPtr> segmentmap_t;
+
+    struct RecordLocation
+    {
+        uint32_t mSegmentId;
+        uint64_t mOffset;
+        uint32_t mKeySize;
+        uint32_t mValueSize;
+    };
+    typedef std::map<std::string, RecordLocation> recordindex_t;
+
+public:
+    /**
+     * Open (or create) the segment log.
+     * @param db_path the database directory path
+     * @param segment_size_mb size of each segment file
+     * @param compaction_ratio ratio of dead records that triggers the
+     *                         compaction of a segment
+     * @param compaction_interval interval in seconds between compactions,
+     *                            zero disables the background compaction
+     */
+    SBSegmentLog(const std::string &db_path, int segment_size_mb,
+                 double compaction_ratio, int compaction_interval);
+    ~SBSegmentLog();
+
+    bool get(const leveldb::Slice &key, std::string *value) override;
+    void multiGet(const std::vector<std::string> &keys,
+                  std::vector<std::string> *values,
+                  std::vector<bool> *found) override;
+    bool write(leveldb::WriteBatch *batch, bool sync) override;
+    bool sync() override;
+    leveldb::Iterator *newIterator(bool fill_cache) override;
+    std::string getPath() const override;
+
+    /**
+     * Rewrite the live records of the sealed segments whose ratio of
+     * dead records is above the compaction ratio. The records are copied
+     * without blocking the reads and writes, and the compacted segment
+     * replaces the original one atomically.
+     */
+    void compact();
+
+private:
+    friend class SegmentLogBatchHandler;
+
+    void appendPut(const leveldb::Slice &key, const leveldb::Slice &value);
+    void appendDelete(const leveldb::Slice &key);
+    SegmentPtr openSegment(uint32_t segment_id, uint64_t capacity,
+                           const std::string &suffix="");
+    void recoverSegment(const SegmentPtr &segment);
+    RecordLocation appendRecord(uint32_t type, const leveldb::Slice &key,
+                                const leveldb::Slice &value);
+    void markDead(const RecordLocation &location);
+    void compactSegment(const SegmentPtr &segment, bool is_oldest);
+    void compactionLoop();
+
+    std::string mPath;
+    uint64_t mSegmentSize;
+    double mCompactionRatio;
+    int mCompactionInterval;
+
+    std::mutex mMutex;
+    recordindex_t mIndex;
+    segmentmap_t mSegments;
+    SegmentPtr mActiveSegment;
+
+    // Serializes the compactions
+    std::mutex mCompactMutex;
+
+    std::mutex mCompactionMutex;
+    std::condition_variable mCompactionCondition;
+    bool mStopCompaction;
+    std::thread mCompactionThread;
+};
@@ -1,23 +1,50 @@
 #include "se_annoy.hpp"
+#include "tracing.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <easylogging++.h>
 
+namespace {
+    const int k_range_search_initial_k = 64;
+
+    /**
+     * Map the Annoy ids of the results to item ids, dropping the results
+     * without an item instead of throwing (e.g. from OpenMP threads).
+     */
+    void map_item_ids(const std::unordered_map<int, int> &id_mapping,
+                      std::vector<int> *ids, std::vector<float> *distances)
+    {
+        size_t kept = 0;
+        for(size_t i=0; i<ids->size(); i++)
+        {
+            std::unordered_map<int, int>::const_iterator item = id_mapping.find((*ids)[i]);
+            if(item == id_mapping.end())
+                continue;
+
+            (*ids)[kept] = item->second;
+            (*distances)[kept] = (*distances)[i];
+            kept++;
+        }
+        ids->resize(kept);
+        distances->resize(kept);
+    }
+}
+
 
 SEAnnoy::SEAnnoy(const TorchManager::TorchManagerPtr &torch_manager,
                  const DatabaseManager::DatabaseManagerPtr &database_manager,
-                 int tree_factor)
-: SearchEngine(torch_manager, database_manager), mTreeFactor(tree_factor)
-{
-    std::vector<std::string> model_list = mTorchManager->getModuleList();
+                 int tree_factor, int rerank_factor)
+: SearchEngine(torch_manager, database_manager), mTreeFactor(tree_factor),
+  mRerankFactor(rerank_factor)
+{ }
 
-    for(const std::string &model_name : model_list)
-    {
-        TorchModelProp props = mTorchManager->getModuleProps(model_name);
-        const int feat_dim = props.getFeatureDim();
-        AnnoyPtr annoy_index = \
-                std::make_shared<AnnoyIndex<int, float, Angular, Kiss32Random>>(feat_dim);
-        mAnnoyMap[model_name] = annoy_index;
-    }
+SEAnnoy::AnnoyPtr SEAnnoy::findIndex(const std::string &model_name) const
+{
+    std::unordered_map<std::string, AnnoyPtr>::const_iterator pair = mAnnoyMap.find(model_name);
+    if(pair == mAnnoyMap.end())
+        return nullptr;
+    return pair->second;
 }
 
 void SEAnnoy::setup()
@@ -31,13 +58,23 @@ void SEAnnoy::setup()
     mIdMapping.clear();
     mIdMapping.reserve(mTorchManager->size());
 
-    std::vector<std::string> model_list = mTorchManager->getModuleList();
+    std::vector<std::string> model_list = getModelList();
     for(const std::string &model_name : model_list)
     {
         index_id_counter[model_name] = 0;
+
+        // Models can be added at runtime, so indexes are created here
+        if(mAnnoyMap.find(model_name) == mAnnoyMap.end())
+        {
+            const int feat_dim = mTorchManager->getIndexDim(model_name);
+            mAnnoyMap[model_name] = \
+                std::make_shared<AnnoyIndex<int, float, Angular, Kiss32Random>>(feat_dim);
+        }
+
         mAnnoyMap[model_name]->reinitialize();
     }
 
+    std::vector<float> reduced;
     DatabaseManager::DatabaseIterator it(mDatabaseManager->newIterator());
     for (it->SeekToFirst(); it->Valid(); it->Next())
     {
@@ -46,8 +83,14 @@ void SEAnnoy::setup()
 
         for(auto &vector : *item_data.mutable_vectors())
         {
-            const float *feature_data = vector.mutable_features()->data();
             const std::string &model_name = vector.model();
+            if(!servesModel(model_name) || mAnnoyMap.find(model_name) == mAnnoyMap.end())
+                continue;
+
+            const float *feature_data = indexFeatures(vector, mAnnoyMap[model_name]->get_f(), &reduced);
+            if(feature_data == nullptr)
+                continue;
+
             mAnnoyMap[model_name]->add_item(index_id_counter[model_name], feature_data);
             total_items++;
 
@@ -68,22 +111,154 @@ void SEAnnoy::setup()
     return;
 }
 
-void
+bool
 SEAnnoy::search(const std::string &model_name,
                 const torch::Tensor &features_tensor,
                 int top_k,
                 std::vector<int> *top_ids,
-                std::vector<float> *distances)
+                std::vector<float> *distances,
+                const SearchParameters &params)
 {
-    AnnoyPtr index = mAnnoyMap[model_name];
+    TRACE_SCOPE("SEAnnoy::search");
+    AnnoyPtr index = findIndex(model_name);
+    if(index == nullptr)
+        return true;
+
+    // A single Annoy query can't be interrupted, only skipped
+    if(params.expired())
+        return false;
+
     const float *raw_features = features_tensor[0].data<float>();
-    const int size = features_tensor.sizes()[1];
-    index->get_nns_by_vector(raw_features, size, top_k, top_ids, distances);
 
-    idmapping_t &id_mapping = mIdMapping[model_name];
+    // Annoy uses -1 as the default search_k (top_k * number of trees)
+    const size_t search_k = (params.mSearchK > 0) ?
+                             static_cast<size_t>(params.mSearchK) :
+                             static_cast<size_t>(-1);
+    const bool rerank = mRerankFactor > 1;
+    const int candidates_k = rerank ? top_k * mRerankFactor : top_k;
+    index->get_nns_by_vector(raw_features, candidates_k, search_k, top_ids, distances);
+
+    map_item_ids(mIdMapping[model_name], top_ids, distances);
+
+    if(rerank && !top_ids->empty())
+    {
+        const std::vector<int> candidates(*top_ids);
+        rerankExact(model_name, raw_features, index->get_f(), candidates, top_k,
+                    RerankMetric::ANGULAR, top_ids, distances);
+    }
+
+    return true;
+}
+
+bool
+SEAnnoy::searchBatch(const std::string &model_name,
+                     const torch::Tensor &features_tensor,
+                     int top_k,
+                     std::vector<std::vector<int>> *top_ids,
+                     std::vector<std::vector<float>> *distances,
+                     const SearchParameters &params)
+{
+    TRACE_SCOPE("SEAnnoy::searchBatch");
+    AnnoyPtr index = findIndex(model_name);
+    if(index == nullptr)
+        return true;
+
+    const idmapping_t &id_mapping = mIdMapping[model_name];
+    const torch::Tensor queries = features_tensor.contiguous();
+    const int n = static_cast<int>(queries.size(0));
+    const int dim = static_cast<int>(queries.size(1));
+    const float *raw_features = queries.data<float>();
+
+    const size_t search_k = (params.mSearchK > 0) ?
+                             static_cast<size_t>(params.mSearchK) :
+                             static_cast<size_t>(-1);
+
+    const bool rerank = mRerankFactor > 1;
+    const int candidates_k = rerank ? top_k * mRerankFactor : top_k;
+
+    top_ids->assign(n, std::vector<int>());
+    distances->assign(n, std::vector<float>());
+
+    // Annoy queries are read-only, so they can run in parallel. Once
+    // the deadline expires the remaining queries are left empty.
+    std::atomic<bool> complete(true);
+    #pragma omp parallel for schedule(dynamic)
+    for(int i=0; i<n; i++)
+    {
+        if(!complete.load(std::memory_order_relaxed))
+            continue;
+
+        if(params.expired())
+        {
+            complete = false;
+            continue;
+        }
+
+        std::vector<int> &query_ids = (*top_ids)[i];
+        index->get_nns_by_vector(raw_features + i * dim, candidates_k, search_k,
+                                 &query_ids, &(*distances)[i]);
+        map_item_ids(id_mapping, &query_ids, &(*distances)[i]);
+
+        if(rerank && !query_ids.empty())
+        {
+            const std::vector<int> candidates(query_ids);
+            rerankExact(model_name, raw_features + i * dim, dim, candidates, top_k,
+                        RerankMetric::ANGULAR, &query_ids, &(*distances)[i]);
+        }
+    }
+
+    return complete;
+}
+
+bool SEAnnoy::rangeSearch(const std::string &model_name,
+                          const torch::Tensor &features_tensor,
+                          float radius, int max_results,
+                          std::vector<int> *top_ids,
+                          std::vector<float> *distances,
+                          const SearchParameters &params)
+{
+    TRACE_SCOPE("SEAnnoy::rangeSearch");
+    AnnoyPtr index = findIndex(model_name);
+    if(index == nullptr)
+        return true;
+
+    const float *raw_features = features_tensor[0].data<float>();
+    const int total_items = index->get_n_items();
+    const int maximum_k = std::min(max_results, total_items);
+
+    // Annoy has no native range search, so we expand the number of
+    // neighbors until the farthest one falls outside of the radius, or
+    // until the deadline expires, keeping the last expansion.
+    bool complete = true;
+    int k = std::min(k_range_search_initial_k, maximum_k);
+    while(k > 0)
+    {
+        if(params.expired())
+        {
+            complete = false;
+            break;
+        }
+
+        top_ids->clear();
+        distances->clear();
+        index->get_nns_by_vector(raw_features, k, static_cast<size_t>(-1),
+                                 top_ids, distances);
+
+        if(distances->empty() || distances->back() > radius || k >= maximum_k)
+            break;
+
+        k = std::min(k * 2, maximum_k);
+    }
+
+    // Results are sorted by distance, drop the ones outside of the radius
+    const auto outside = std::upper_bound(distances->begin(), distances->end(), radius);
+    const size_t within_size = static_cast<size_t>(outside - distances->begin());
+    top_ids->resize(within_size);
+    distances->resize(within_size);
+
+    map_item_ids(mIdMapping[model_name], top_ids, distances);
 
-    for(auto &item : *top_ids)
-        item = id_mapping[item];
+    return complete;
 }
 
 bool SEAnnoy::requireRefresh()
@@ -12,24 +12,51 @@ public:
     typedef std::shared_ptr<SEAnnoy> SEAnnoyPtr;
 
 public:
+    /**
+     * Construct the Annoy search engine.
+     * @param torch_manager an instance of the torch manager
+     * @param database_manager an instance of the database manager
+     * @param tree_factor the number of trees per feature dimension
+     * @param rerank_factor if greater than one, rerank_factor * top_k
+     *                      candidates are fetched from the index and
+     *                      reranked with their exact stored features
+     */
     SEAnnoy(const TorchManager::TorchManagerPtr &torch_manager,
             const DatabaseManager::DatabaseManagerPtr &database_manager,
-            int tree_factor = 2);
+            int tree_factor = 2, int rerank_factor = 0);
     ~SEAnnoy();
 
     void setup() override;
     bool requireRefresh() override;
 
-    void search(const std::string &model_name,
+    bool search(const std::string &model_name,
                 const torch::Tensor &features_tensor,
                 int top_k, std::vector<int> *top_ids,
-                std::vector<float> *distances) override;
+                std::vector<float> *distances,
+                const SearchParameters &params) override;
+
+    bool searchBatch(const std::string &model_name,
+                     const torch::Tensor &features_tensor,
+                     int top_k,
+                     std::vector<std::vector<int>> *top_ids,
+                     std::vector<std::vector<float>> *distances,
+                     const SearchParameters &params) override;
+
+    bool rangeSearch(const std::string &model_name,
+                     const torch::Tensor &features_tensor,
+                     float radius, int max_results,
+                     std::vector<int> *top_ids,
+                     std::vector<float> *distances,
+                     const SearchParameters &params) override;
 
 private:
     typedef std::shared_ptr<AnnoyIndex<int, float, Angular, Kiss32Random>> AnnoyPtr;
     typedef std::unordered_map<int, int> idmapping_t;
 
+    AnnoyPtr findIndex(const std::string &model_name) const;
+
     int mTreeFactor;
+    int mRerankFactor;
     std::unordered_map<std::string, AnnoyPtr> mAnnoyMap;
     std::unordered_map<std::string, idmapping_t> mIdMapping;
 };
\ No newline at end of file
@@ -0,0 +1,557 @@
+#include "se_binary.hpp"
+#include "tracing.hpp"
+
+#include <algorithm>
+#include <queue>
+#include <random>
+
+#include <easylogging++.h>
+
+// The Hamming distances use the POPCNT instruction when the CPU has it,
+// it is only enabled on the functions selected at runtime, so the server
+// still runs on CPUs without it
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define EUCLIDES_POPCNT_DISPATCH
+#define EUCLIDES_POPCNT_TARGET __attribute__((target("popcnt")))
+#else
+#define EUCLIDES_POPCNT_TARGET
+#endif
+
+namespace {
+    // Features sampled from each model to learn its binarization
+    const int k_train_samples = 65536;
+
+    // Number of rotations learned by ITQ
+    const int k_itq_iterations = 50;
+
+    // Seed of the projections, so the codes are the same on every setup
+    const unsigned int k_seed = 1234;
+
+    // Number of features encoded at once in the setup
+    const int k_encode_block = 4096;
+
+    // Number of codes scanned by each parallel task
+    const int k_scan_block = 16384;
+
+    typedef std::priority_queue<std::pair<int, int>> code_heap_t;
+
+    typedef void (*scan_code_range_t)(const uint64_t *codes, int words, const uint64_t *query,
+                                      int begin, int end, int k, code_heap_t *heap);
+    typedef void (*within_code_range_t)(const uint64_t *codes, int words, const uint64_t *query,
+                                        int begin, int end, int max_distance,
+                                        std::vector<std::pair<int, int>> *within);
+
+    /**
+     * Scan a range of codes keeping the k nearest ones in a max-heap. The
+     * number of words is a template parameter for the common code sizes, so
+     * the popcount loop is unrolled, with zero for any other size.
+     * @param codes the codes, words per code
+     * @param words number of 64-bit words per code
+     * @param query the code of the query
+     * @param begin first code scanned
+     * @param end end of the scanned range
+     * @param k number of nearest codes
+     * @param heap the heap of (distance, position) pairs
+     */
+    template<int WORDS>
+    inline __attribute__((always_inline))
+    void scan_code_range_impl(const uint64_t *codes, int words, const uint64_t *query,
+                              int begin, int end, int k, code_heap_t *heap)
+    {
+        const int code_words = (WORDS > 0) ? WORDS : words;
+        for(int i=begin; i<end; i++)
+        {
+            const uint64_t *code = codes + static_cast<size_t>(i) * code_words;
+            int distance = 0;
+            for(int w=0; w<code_words; w++)
+                distance += __builtin_popcountll(code[w] ^ query[w]);
+
+            if(static_cast<int>(heap->size()) < k)
+                heap->emplace(distance, i);
+            else if(distance < heap->top().first)
+            {
+                heap->pop();
+                heap->emplace(distance, i);
+            }
+        }
+    }
+
+    /**
+     * Collect the (distance, position) of the codes of a range within a
+     * Hamming distance of the query.
+     */
+    inline __attribute__((always_inline))
+    void within_code_range_impl(const uint64_t *codes, int words, const uint64_t *query,
+                                int begin, int end, int max_distance,
+                                std::vector<std::pair<int, int>> *within)
+    {
+        for(int i=begin; i<end; i++)
+        {
+            const uint64_t *code = codes + static_cast<size_t>(i) * words;
+            int distance = 0;
+            for(int w=0; w<words; w++)
+                distance += __builtin_popcountll(code[w] ^ query[w]);
+            if(distance <= max_distance)
+                within->emplace_back(distance, i);
+        }
+    }
+
+    template<int WORDS>
+    void scan_code_range(const uint64_t *codes, int words, const uint64_t *query,
+                         int begin, int end, int k, code_heap_t *heap)
+    {
+        scan_code_range_impl<WORDS>(codes, words, query, begin, end, k, heap);
+    }
+
+    template<int WORDS>
+    EUCLIDES_POPCNT_TARGET
+    void scan_code_range_popcnt(const uint64_t *codes, int words, const uint64_t *query,
+                                int begin, int end, int k, code_heap_t *heap)
+    {
+        scan_code_range_impl<WORDS>(codes, words, query, begin, end, k, heap);
+    }
+
+    void within_code_range(const uint64_t *codes, int words, const uint64_t *query,
+                           int begin, int end, int max_distance,
+                           std::vector<std::pair<int, int>> *within)
+    {
+        within_code_range_impl(codes, words, query, begin, end, max_distance, within);
+    }
+
+    EUCLIDES_POPCNT_TARGET
+    void within_code_range_popcnt(const uint64_t *codes, int words, const uint64_t *query,
+                                  int begin, int end, int max_distance,
+                                  std::vector<std::pair<int, int>> *within)
+    {
+        within_code_range_impl(codes, words, query, begin, end, max_distance, within);
+    }
+
+    bool cpu_has_popcnt()
+    {
+#ifdef EUCLIDES_POPCNT_DISPATCH
+        static const bool has_popcnt = __builtin_cpu_supports("popcnt");
+        return has_popcnt;
+#else
+        return false;
+#endif
+    }
+
+    /**
+     * Choose the scan of the code size and of the CPU.
+     */
+    scan_code_range_t select_scan_code_range(int words)
+    {
+        const bool popcnt = cpu_has_popcnt();
+        switch(words)
+        {
+        case 1: return popcnt ? scan_code_range_popcnt<1> : scan_code_range<1>;
+        case 2: return popcnt ? scan_code_range_popcnt<2> : scan_code_range<2>;
+        case 3: return popcnt ? scan_code_range_popcnt<3> : scan_code_range<3>;
+        case 4: return popcnt ? scan_code_range_popcnt<4> : scan_code_range<4>;
+        default: return popcnt ? scan_code_range_popcnt<0> : scan_code_range<0>;
+        }
+    }
+
+    within_code_range_t select_within_code_range()
+    {
+        return cpu_has_popcnt() ? within_code_range_popcnt : within_code_range;
+    }
+
+    /**
+     * Fill a (rows x cols) tensor with standard normal values from a seeded
+     * generator, independent of the libtorch global generator.
+     */
+    torch::Tensor seeded_randn(int rows, int cols, std::mt19937 *generator)
+    {
+        std::normal_distribution<float> distribution(0.0f, 1.0f);
+        torch::Tensor values = torch::empty({rows, cols}, torch::kFloat);
+        float *raw_values = values.data<float>();
+        for(int i=0; i<rows * cols; i++)
+            raw_values[i] = distribution(*generator);
+        return values;
+    }
+}
+
+
+SEBinary::SEBinary(const TorchManager::TorchManagerPtr &torch_manager,
+                   const DatabaseManager::DatabaseManagerPtr &database_manager,
+                   int bits, BinarizationMethod method, int rerank_factor,
+                   RerankMetric rerank_metric)
+: SearchEngine(torch_manager, database_manager),
+  mBits(bits), mMethod(method), mRerankFactor(rerank_factor),
+  mRerankMetric(rerank_metric)
+{
+    if(mBits <= 0 || mBits % 64 != 0)
+        LOG(FATAL) << "The binary search engine bits must be a multiple of 64.";
+}
+
+SEBinary::BinaryIndexPtr SEBinary::findIndex(const std::string &model_name) const
+{
+    std::unordered_map<std::string, BinaryIndexPtr>::const_iterator pair = mIndexMap.find(model_name);
+    if(pair == mIndexMap.end())
+        return nullptr;
+    return pair->second;
+}
+
+void SEBinary::trainIndex(const BinaryIndexPtr &index, const torch::Tensor &sample) const
+{
+    const int dim = index->mDim;
+    std::mt19937 generator(k_seed);
+
+    index->mMean = sample.mean(0);
+    const torch::Tensor centered = sample - index->mMean;
+
+    // ITQ needs the codes to be shorter than the features
+    const bool itq = mMethod == BinarizationMethod::ITQ && mBits <= dim;
+    if(mMethod == BinarizationMethod::ITQ && !itq)
+        LOG(WARNING) << "ITQ needs at most " << dim << " bits, "
+                     << "using sign random projections.";
+
+    if(!itq)
+    {
+        index->mProjection = seeded_randn(dim, mBits, &generator);
+        return;
+    }
+
+    // PCA to the number of bits, the eigenvalues are in ascending order
+    const torch::Tensor covariance = centered.t().mm(centered) / sample.size(0);
+    const torch::Tensor eigenvectors = std::get<1>(torch::symeig(covariance, true));
+    const torch::Tensor pca = eigenvectors.narrow(1, dim - mBits, mBits);
+    const torch::Tensor projected = centered.mm(pca);
+
+    // Rotation minimizing the quantization error ||B - VR||, alternating
+    // the codes B and the orthogonal rotation R (Procrustes problem).
+    torch::Tensor rotation = std::get<0>(torch::svd(seeded_randn(mBits, mBits, &generator)));
+    for(int iteration=0; iteration<k_itq_iterations; iteration++)
+    {
+        const torch::Tensor codes = projected.mm(rotation).ge(0).toType(torch::kFloat) * 2 - 1;
+        const auto usv = torch::svd(projected.t().mm(codes));
+        rotation = std::get<0>(usv).mm(std::get<2>(usv).t());
+    }
+
+    index->mProjection = pca.mm(rotation).contiguous();
+}
+
+void SEBinary::encode(const BinaryIndexPtr &index, const torch::Tensor &features,
+                      uint64_t *codes) const
+{
+    const int n = static_cast<int>(features.size(0));
+    const torch::Tensor signs = \
+        (features - index->mMean).mm(index->mProjection).gt(0).toType(torch::kByte).contiguous();
+    const uint8_t *raw_signs = signs.data<uint8_t>();
+
+    std::fill(codes, codes + static_cast<size_t>(n) * index->mWords, 0);
+    for(int i=0; i<n; i++)
+    {
+        const uint8_t *item_signs = raw_signs + static_cast<size_t>(i) * mBits;
+        uint64_t *code = codes + static_cast<size_t>(i) * index->mWords;
+        for(int b=0; b<mBits; b++)
+            if(item_signs[b])
+                code[b / 64] |= uint64_t(1) << (b % 64);
+    }
+}
+
+void SEBinary::setup()
+{
+    TIMED_SCOPE(timerSetup, "SEBinary Setup");
+
+    std::unordered_map<std::string, BinaryIndexPtr> index_map;
+    std::unordered_map<std::string, std::vector<float>> samples;
+    std::unordered_map<std::string, int> seen;
+
+    for(const std::string &model_name : getModelList())
+    {
+        BinaryIndexPtr index = std::make_shared<BinaryIndex>();
+        index->mDim = mTorchManager->getIndexDim(model_name);
+        index->mWords = mBits / 64;
+        index_map[model_name] = index;
+        seen[model_name] = 0;
+    }
+
+    // First pass, a uniform sample of each model (reservoir sampling)
+    std::vector<float> reduced;
+    std::mt19937 generator(k_seed);
+    DatabaseManager::DatabaseIterator it(mDatabaseManager->newIterator());
+    for (it->SeekToFirst(); it->Valid(); it->Next())
+    {
+        euclidesproto::ItemData item_data;
+        item_data.ParseFromString(it->value().ToString());
+
+        for(const auto &vector : item_data.vectors())
+        {
+            std::unordered_map<std::string, BinaryIndexPtr>::const_iterator pair = \
+                index_map.find(vector.model());
+            if(pair == index_map.end())
+                continue;
+
+            const int dim = pair->second->mDim;
+            const float *features = indexFeatures(vector, dim, &reduced);
+            if(features == nullptr)
+                continue;
+
+            std::vector<float> &sample = samples[vector.model()];
+            int &count = seen[vector.model()];
+
+            int slot = count;
+            if(count >= k_train_samples)
+                slot = std::uniform_int_distribution<int>(0, count)(generator);
+            count++;
+
+            if(slot >= k_train_samples)
+                continue;
+            if(slot * dim >= static_cast<int>(sample.size()))
+                sample.resize(static_cast<size_t>(slot + 1) * dim);
+            std::copy(features, features + dim, sample.begin() + static_cast<size_t>(slot) * dim);
+        }
+    }
+
+    for(auto &pair : index_map)
+    {
+        const int count = seen[pair.first];
+        if(count <= 0)
+            continue;
+
+        std::vector<float> &sample = samples[pair.first];
+        const int dim = pair.second->mDim;
+        const torch::Tensor sample_tensor = \
+            torch::from_blob(sample.data(), {static_cast<long>(sample.size() / dim), dim},
+                             torch::kFloat);
+        trainIndex(pair.second, sample_tensor);
+        pair.second->mCodes.reserve(static_cast<size_t>(count) * pair.second->mWords);
+        pair.second->mIds.reserve(count);
+    }
+    samples.clear();
+
+    // Second pass, the features are binarized in blocks
+    std::unordered_map<std::string, std::vector<float>> blocks;
+    auto flush_block = [this](const BinaryIndexPtr &index, std::vector<float> *block)
+    {
+        const long count = static_cast<long>(block->size() / index->mDim);
+        if(count <= 0)
+            return;
+
+        const size_t offset = index->mCodes.size();
+        index->mCodes.resize(offset + count * index->mWords);
+        encode(index, torch::from_blob(block->data(), {count, index->mDim}, torch::kFloat),
+               index->mCodes.data() + offset);
+        block->clear();
+    };
+
+    int total_items = 0;
+    DatabaseManager::DatabaseIterator encode_it(mDatabaseManager->newIterator());
+    for (encode_it->SeekToFirst(); encode_it->Valid(); encode_it->Next())
+    {
+        euclidesproto::ItemData item_data;
+        item_data.ParseFromString(encode_it->value().ToString());
+
+        for(const auto &vector : item_data.vectors())
+        {
+            std::unordered_map<std::string, BinaryIndexPtr>::const_iterator pair = \
+                index_map.find(vector.model());
+            if(pair == index_map.end())
+                continue;
+
+            const BinaryIndexPtr &index = pair->second;
+            const float *features = indexFeatures(vector, index->mDim, &reduced);
+            if(features == nullptr)
+                continue;
+
+            std::vector<float> &block = blocks[vector.model()];
+            block.insert(block.end(), features, features + index->mDim);
+            index->mIds.push_back(item_data.item_id());
+            total_items++;
+
+            if(static_cast<int>(block.size()) == k_encode_block * index->mDim)
+                flush_block(index, &block);
+        }
+    }
+
+    for(auto &pair : blocks)
+        flush_block(index_map[pair.first], &pair.second);
+
+    mIndexMap.swap(index_map);
+    LOG(INFO) << "Added " << total_items << " items into the binary index, "
+              << mBits << " bits per item.";
+}
+
+bool SEBinary::requireRefresh()
+{
+    return true;
+}
+
+void SEBinary::scanCodes(const BinaryIndexPtr &index, const uint64_t *query, int k,
+                         std::vector<std::pair<int, int>> *nearest) const
+{
+    const int n = index->size();
+    const int num_blocks = (n + k_scan_block - 1) / k_scan_block;
+    const uint64_t *codes = index->mCodes.data();
+    const int words = index->mWords;
+
+    const scan_code_range_t scan = select_scan_code_range(words);
+
+    nearest->clear();
+
+    // Each thread keeps the nearest codes of its blocks, then they are merged
+    #pragma omp parallel if(num_blocks > 1)
+    {
+        code_heap_t heap;
+
+        #pragma omp for schedule(static) nowait
+        for(int block=0; block<num_blocks; block++)
+        {
+            const int begin = block * k_scan_block;
+            const int end = std::min(n, begin + k_scan_block);
+            scan(codes, words, query, begin, end, k, &heap);
+        }
+
+        #pragma omp critical
+        while(!heap.empty())
+        {
+            nearest->push_back(heap.top());
+            heap.pop();
+        }
+    }
+
+    const size_t total = std::min(nearest->size(), static_cast<size_t>(k));
+    std::partial_sort(nearest->begin(), nearest->begin() + total, nearest->end());
+    nearest->resize(total);
+}
+
+bool SEBinary::search(const std::string &model_name,
+                      const torch::Tensor &features_tensor,
+                      int top_k,
+                      std::vector<int> *top_ids,
+                      std::vector<float> *distances,
+                      const SearchParameters &params)
+{
+    std::vector<std::vector<int>> batch_ids;
+    std::vector<std::vector<float>> batch_distances;
+    const bool complete = searchBatch(model_name, features_tensor.reshape({1, -1}),
+                                      top_k, &batch_ids, &batch_distances, params);
+
+    if(batch_ids.empty())
+        return complete;
+
+    top_ids->swap(batch_ids[0]);
+    distances->swap(batch_distances[0]);
+    return complete;
+}
+
+bool SEBinary::searchBatch(const std::string &model_name,
+                           const torch::Tensor &features_tensor,
+                           int top_k,
+                           std::vector<std::vector<int>> *top_ids,
+                           std::vector<std::vector<float>> *distances,
+                           const SearchParameters &params)
+{
+    TRACE_SCOPE("SEBinary::searchBatch");
+    BinaryIndexPtr index = findIndex(model_name);
+    if(index == nullptr || index->size() <= 0 || top_k <= 0)
+        return true;
+
+    const torch::Tensor queries = features_tensor.toType(torch::kFloat).contiguous();
+    const int n = static_cast<int>(queries.size(0));
+    const float *raw_queries = queries.data<float>();
+
+    std::vector<uint64_t> query_codes(static_cast<size_t>(n) * index->mWords);
+    encode(index, queries, query_codes.data());
+
+    // Without reranking the distances are the Hamming distances
+    const bool rerank = mRerankFactor > 1;
+    const int search_k = rerank ? top_k * mRerankFactor : top_k;
+
+    top_ids->assign(n, std::vector<int>());
+    distances->assign(n, std::vector<float>());
+
+    // A scan of the codes can't be interrupted, the deadline is checked
+    // between queries.
+    bool complete = true;
+    std::vector<std::pair<int, int>> nearest;
+    for(int q=0; q<n; q++)
+    {
+        if(params.expired())
+        {
+            complete = false;
+            break;
+        }
+
+        scanCodes(index, query_codes.data() + static_cast<size_t>(q) * index->mWords,
+                  search_k, &nearest);
+
+        std::vector<int> &query_ids = (*top_ids)[q];
+        std::vector<float> &query_distances = (*distances)[q];
+        query_ids.reserve(nearest.size());
+        query_distances.reserve(nearest.size());
+        for(const auto &distance_position : nearest)
+        {
+            query_ids.push_back(index->mIds[distance_position.second]);
+            query_distances.push_back(static_cast<float>(distance_position.first));
+        }
+
+        if(rerank && !query_ids.empty())
+        {
+            const std::vector<int> candidates(query_ids);
+            rerankExact(model_name, raw_queries + static_cast<size_t>(q) * index->mDim,
+                        index->mDim, candidates, top_k, mRerankMetric,
+                        &query_ids, &query_distances);
+        }
+    }
+
+    return complete;
+}
+
+bool SEBinary::rangeSearch(const std::string &model_name,
+                           const torch::Tensor &features_tensor,
+                           float radius, int max_results,
+                           std::vector<int> *top_ids,
+                           std::vector<float> *distances,
+                           const SearchParameters &params)
+{
+    TRACE_SCOPE("SEBinary::rangeSearch");
+    BinaryIndexPtr index = findIndex(model_name);
+    if(index == nullptr || index->size() <= 0)
+        return true;
+
+    if(params.expired())
+        return false;
+
+    const torch::Tensor query = features_tensor.toType(torch::kFloat).reshape({1, -1});
+    std::vector<uint64_t> query_code(index->mWords);
+    encode(index, query, query_code.data());
+
+    const int n = index->size();
+    const int num_blocks = (n + k_scan_block - 1) / k_scan_block;
+    const int max_distance = static_cast<int>(radius);
+    const within_code_range_t within_range = select_within_code_range();
+    std::vector<std::pair<int, int>> within;
+
+    #pragma omp parallel if(num_blocks > 1)
+    {
+        std::vector<std::pair<int, int>> thread_within;
+
+        #pragma omp for schedule(static) nowait
+        for(int block=0; block<num_blocks; block++)
+        {
+            const int begin = block * k_scan_block;
+            within_range(index->mCodes.data(), index->mWords, query_code.data(),
+                         begin, std::min(n, begin + k_scan_block), max_distance,
+                         &thread_within);
+        }
+
+        #pragma omp critical
+        within.insert(within.end(), thread_within.begin(), thread_within.end());
+    }
+
+    const size_t total = std::min(within.size(), static_cast<size_t>(max_results));
+    std::partial_sort(within.begin(), within.begin() + total, within.end());
+    within.resize(total);
+
+    top_ids->clear();
+    distances->clear();
+    for(const auto &distance_position : within)
+    {
+        top_ids->push_back(index->mIds[distance_position.second]);
+        distances->push_back(static_cast<float>(distance_position.first));
+    }
+    return true;
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "searchengine.hpp"
+
+
+/**
+ * How the features are binarized into codes.
+ */
+enum class BinarizationMethod
+{
+    SIGN_RANDOM_PROJECTION,     // Signs of random gaussian projections
+    ITQ                         // PCA followed by the Iterative Quantization rotation
+};
+
+
+class SEBinary : public SearchEngine
+{
+public:
+    typedef std::shared_ptr<SEBinary> SEBinaryPtr;
+
+public:
+    /**
+     * Construct the binary code search engine, where items are compared
+     * by the Hamming distance of their codes.
+     * @param torch_manager an instance of the torch manager
+     * @param database_manager an instance of the database manager
+     * @param bits number of bits of each code, a multiple of 64
+     * @param method how the features are binarized
+     * @param rerank_factor if greater than one, rerank_factor * top_k
+     *                      candidates are fetched from the codes and
+     *                      reranked with their exact stored features
+     * @param rerank_metric the metric of the rerank
+     */
+    SEBinary(const TorchManager::TorchManagerPtr &torch_manager,
+             const DatabaseManager::DatabaseManagerPtr &database_manager,
+             int bits, BinarizationMethod method, int rerank_factor=0,
+             RerankMetric rerank_metric=RerankMetric::L2_SQUARED);
+
+    void setup() override;
+    bool requireRefresh() override;
+
+    bool search(const std::string &model_name,
+                const torch::Tensor &features_tensor,
+                int top_k, std::vector<int> *top_ids,
+                std::vector<float> *distances,
+                const SearchParameters &params) override;
+
+    bool searchBatch(const std::string &model_name,
+                     const torch::Tensor &features_tensor,
+                     int top_k,
+                     std::vector<std::vector<int>> *top_ids,
+                     std::vector<std::vector<float>> *distances,
+                     const SearchParameters &params) override;
+
+    /**
+     * Search the items within a radius, in bits of Hamming distance.
+     */
+    bool rangeSearch(const std::string &model_name,
+                     const torch::Tensor &features_tensor,
+                     float radius, int max_results,
+                     std::vector<int> *top_ids,
+                     std::vector<float> *distances,
+                     const SearchParameters &params) override;
+
+private:
+    /**
+     * The codes of a model space, stored contiguously with mWords 64-bit
+     * words per item, and the transform that binarizes the features.
+     */
+    struct BinaryIndex
+    {
+        int mDim;
+        int mWords;
+        torch::Tensor mMean;        // (dim) mean of the features
+        torch::Tensor mProjection;  // (dim x bits) projection of the features
+        std::vector<uint64_t> mCodes;
+        std::vector<int> mIds;
+
+        int size() const { return static_cast<int>(mIds.size()); }
+    };
+    typedef std::shared_ptr<BinaryIndex> BinaryIndexPtr;
+
+    BinaryIndexPtr findIndex(const std::string &model_name) const;
+
+    /**
+     * Learn the binarization of a model from a sample of its features.
+     * @param index the index, with the dimension set
+     * @param sample the (n x dim) sample of features
+     */
+    void trainIndex(const BinaryIndexPtr &index, const torch::Tensor &sample) const;
+
+    /**
+     * Binarize features into codes.
+     * @param index the trained index
+     * @param features the (n x dim) features
+     * @param codes the n * mWords returning words
+     */
+    void encode(const BinaryIndexPtr &index, const torch::Tensor &features,
+                uint64_t *codes) const;
+
+    /**
+     * Scan all the codes of an index for the nearest codes of a query.
+     * @param index the index
+     * @param query the code of the query
+     * @param k number of nearest codes
+     * @param nearest returns the (distance, position) pairs, nearest first
+     */
+    void scanCodes(const BinaryIndexPtr &index, const uint64_t *query, int k,
+                   std::vector<std::pair<int, int>> *nearest) const;
+
+    int mBits;
+    BinarizationMethod mMethod;
+    int mRerankFactor;
+    RerankMetric mRerankMetric;
+    std::unordered_map<std::string, BinaryIndexPtr> mIndexMap;
+};
@@ -0,0 +1,217 @@
+#include "se_composite.hpp"
+
+#include <cmath>
+#include <easylogging++.h>
+
+namespace {
+    const std::string k_model_section_prefix = "model:";
+    const std::string k_nlist_placeholder = "{nlist}";
+}
+
+
+SEComposite::SEComposite(const TorchManager::TorchManagerPtr &torch_manager,
+                         const DatabaseManager::DatabaseManagerPtr &database_manager,
+                         const INIReader &conf_reader)
+: SearchEngine(torch_manager, database_manager),
+  mConfReader(conf_reader), mHasAutoEngines(false)
+{ }
+
+bool SEComposite::has_model_sections(const INIReader &conf_reader)
+{
+    for(const std::string &section : conf_reader.Sections())
+        if(section.compare(0, k_model_section_prefix.size(), k_model_section_prefix) == 0)
+            return true;
+    return false;
+}
+
+std::string SEComposite::model_section(const std::string &model_name)
+{
+    return k_model_section_prefix + model_name;
+}
+
+SearchEngine::SearchEnginePtr SEComposite::findEngine(const std::string &model_name) const
+{
+    std::unordered_map<std::string, SearchEnginePtr>::const_iterator pair = mEngineMap.find(model_name);
+    if(pair == mEngineMap.end())
+        return nullptr;
+    return pair->second;
+}
+
+std::string SEComposite::selectAutoEngine(const std::string &section, int total_items,
+                                          std::string *index_type) const
+{
+    const long exact_max_items = mConfReader.GetInteger(section, "auto_exact_max_items",
+        mConfReader.GetInteger("auto", "exact_max_items", 10000));
+    const long flat_max_items = mConfReader.GetInteger(section, "auto_flat_max_items",
+        mConfReader.GetInteger("auto", "flat_max_items", 200000));
+
+    if(total_items <= exact_max_items)
+        return "exact_disk";
+
+    if(total_items <= flat_max_items)
+    {
+        *index_type = "Flat";
+        return "faiss";
+    }
+
+    // The usual rule of thumb for the number of IVF lists is ~4*sqrt(n)
+    *index_type = mConfReader.Get(section, "auto_index_type",
+        mConfReader.Get("auto", "index_type", "IVF" + k_nlist_placeholder + ",Flat"));
+    const size_t placeholder = index_type->find(k_nlist_placeholder);
+    if(placeholder != std::string::npos)
+    {
+        const int nlist = static_cast<int>(4.0 * std::sqrt(static_cast<double>(total_items)));
+        index_type->replace(placeholder, k_nlist_placeholder.size(), std::to_string(nlist));
+    }
+    return "faiss";
+}
+
+void SEComposite::setup()
+{
+    TIMED_SCOPE(timerSetup, "SEComposite Setup");
+
+    const std::string default_engine = mConfReader.Get("server", "search_engine", "");
+    const std::vector<std::string> model_list = getModelList();
+
+    // Engine type of each model, before creating the engines
+    std::unordered_map<std::string, std::string> model_engine;
+    mHasAutoEngines = false;
+    for(const std::string &model_name : model_list)
+    {
+        const std::string se_engine = mConfReader.Get(model_section(model_name),
+                                                      "search_engine", default_engine);
+        model_engine[model_name] = se_engine;
+        if(se_engine == "auto")
+            mHasAutoEngines = true;
+    }
+
+    // The automatic selection needs the number of items of each model
+    std::unordered_map<std::string, int> model_items;
+    if(mHasAutoEngines)
+    {
+        DatabaseManager::DatabaseIterator it(mDatabaseManager->newIterator(false));
+        for (it->SeekToFirst(); it->Valid(); it->Next())
+        {
+            euclidesproto::ItemData item_data;
+            item_data.ParseFromString(it->value().ToString());
+            for(const auto &vector : item_data.vectors())
+                model_items[vector.model()]++;
+        }
+    }
+
+    mEngineMap.clear();
+    mEngines.clear();
+
+    std::vector<std::string> default_models;
+    for(const std::string &model_name : model_list)
+    {
+        const std::string section = model_section(model_name);
+        const bool has_section = mConfReader.Sections().count(section) > 0;
+        std::string se_engine = model_engine[model_name];
+        std::string index_type;
+
+        if(se_engine == "auto")
+        {
+            se_engine = selectAutoEngine(section, model_items[model_name], &index_type);
+            LOG(INFO) << "Model " << model_name << " has " << model_items[model_name]
+                      << " items, selected the " << se_engine << " search engine "
+                      << (index_type.empty() ? "" : "with index " + index_type) << ".";
+        }
+        else if(!has_section)
+        {
+            default_models.push_back(model_name);
+            continue;
+        }
+
+        SearchEnginePtr engine = create_search_engine(mConfReader, se_engine, section,
+                                                      mTorchManager, mDatabaseManager,
+                                                      index_type);
+        engine->setModels({model_name});
+        mEngineMap[model_name] = engine;
+        mEngines.push_back(engine);
+    }
+
+    if(!default_models.empty())
+    {
+        SearchEnginePtr engine = create_search_engine(mConfReader, default_engine, "",
+                                                      mTorchManager, mDatabaseManager);
+        engine->setModels(default_models);
+        for(const std::string &model_name : default_models)
+            mEngineMap[model_name] = engine;
+        mEngines.push_back(engine);
+    }
+
+    for(const SearchEnginePtr &engine : mEngines)
+        engine->setup();
+}
+
+bool SEComposite::requireRefresh()
+{
+    if(mHasAutoEngines)
+        return true;
+
+    for(const SearchEnginePtr &engine : mEngines)
+        if(engine->requireRefresh())
+            return true;
+    return false;
+}
+
+bool SEComposite::addItem(const euclidesproto::ItemData &item_data)
+{
+    bool searchable = !mHasAutoEngines;
+    for(const SearchEnginePtr &engine : mEngines)
+        searchable = engine->addItem(item_data) && searchable;
+    return searchable;
+}
+
+bool SEComposite::removeItem(int item_id)
+{
+    bool removed = !mHasAutoEngines;
+    for(const SearchEnginePtr &engine : mEngines)
+        removed = engine->removeItem(item_id) && removed;
+    return removed;
+}
+
+bool SEComposite::search(const std::string &model_name,
+                         const torch::Tensor &features_tensor,
+                         int top_k, std::vector<int> *top_ids,
+                         std::vector<float> *distances,
+                         const SearchParameters &params)
+{
+    SearchEnginePtr engine = findEngine(model_name);
+    if(engine == nullptr)
+        return true;
+    return engine->search(model_name, features_tensor, top_k,
+                          top_ids, distances, params);
+}
+
+bool SEComposite::searchBatch(const std::string &model_name,
+                              const torch::Tensor &features_tensor,
+                              int top_k,
+                              std::vector<std::vector<int>> *top_ids,
+                              std::vector<std::vector<float>> *distances,
+                              const SearchParameters &params)
+{
+    SearchEnginePtr engine = findEngine(model_name);
+    if(engine == nullptr)
+        return true;
+    return engine->searchBatch(model_name, features_tensor, top_k,
+                               top_ids, distances, params);
+}
+
+bool SEComposite::rangeSearch(const std::string &model_name,
+                              const torch::Tensor &features_tensor,
+                              float radius, int max_results,
+                              std::vector<int> *top_ids,
+                              std::vector<float> *distances,
+                              const SearchParameters &params)
+{
+    SearchEnginePtr engine = findEngine(model_name);
+    if(engine == nullptr)
+        return true;
+    return engine->rangeSearch(model_name, features_tensor, radius, max_results,
+                               top_ids, distances, params);
+}
+
+SEComposite::~SEComposite()
+{ }
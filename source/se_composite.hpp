@@ -0,0 +1,95 @@
+#pragma once
+
+#include "searchengine.hpp"
+
+#include <memory>
+
+/**
+ * This search engine routes each model space to its own search engine, so
+ * models with a few items can use an exact search while the large ones use
+ * an approximate index. The engine of a model and its parameters are set
+ * in a [model:<name>] section of the configuration, models without it use
+ * the engine of the server section. The "auto" engine is selected by the
+ * number of items of the model every time the engine is set up.
+ */
+class SEComposite : public SearchEngine
+{
+public:
+    typedef std::shared_ptr<SEComposite> SECompositePtr;
+
+public:
+    /**
+     * Construct the composite search engine (SE).
+     * @param torch_manager an instance of the torch manager
+     * @param database_manager an instance of the database manager
+     * @param conf_reader the configuration with the engine of each model
+     */
+    SEComposite(const TorchManager::TorchManagerPtr &torch_manager,
+                const DatabaseManager::DatabaseManagerPtr &database_manager,
+                const INIReader &conf_reader);
+    ~SEComposite();
+
+    /**
+     * Select the engine of each model and set them up. Models sharing the
+     * default engine are served by a single engine instance.
+     */
+    void setup() override;
+
+    /**
+     * @return true if any engine requires a refresh or if the engines are
+     *         selected automatically, since the selection depends on the
+     *         number of items
+     */
+    bool requireRefresh() override;
+    bool addItem(const euclidesproto::ItemData &item_data) override;
+    bool removeItem(int item_id) override;
+
+    bool search(const std::string &model_name,
+                const torch::Tensor &features_tensor,
+                int top_k, std::vector<int> *top_ids,
+                std::vector<float> *distances,
+                const SearchParameters &params) override;
+
+    bool searchBatch(const std::string &model_name,
+                     const torch::Tensor &features_tensor,
+                     int top_k,
+                     std::vector<std::vector<int>> *top_ids,
+                     std::vector<std::vector<float>> *distances,
+                     const SearchParameters &params) override;
+
+    bool rangeSearch(const std::string &model_name,
+                     const torch::Tensor &features_tensor,
+                     float radius, int max_results,
+                     std::vector<int> *top_ids,
+                     std::vector<float> *distances,
+                     const SearchParameters &params) override;
+
+    /**
+     * Check if the configuration has per-model engine sections.
+     * @param conf_reader the configuration
+     * @return true if any [model:<name>] section exists
+     */
+    static bool has_model_sections(const INIReader &conf_reader);
+
+    /**
+     * @param model_name the name of the model
+     * @return the name of the configuration section of the model
+     */
+    static std::string model_section(const std::string &model_name);
+
+private:
+    SearchEnginePtr findEngine(const std::string &model_name) const;
+
+    /**
+     * Select the engine for a model by its number of items: exact search
+     * for small models, a Faiss flat index for medium ones and the
+     * configured large index (IVF by default) for the others.
+     */
+    std::string selectAutoEngine(const std::string &section, int total_items,
+                                 std::string *index_type) const;
+
+    INIReader mConfReader;
+    bool mHasAutoEngines;
+    std::unordered_map<std::string, SearchEnginePtr> mEngineMap;
+    std::vector<SearchEnginePtr> mEngines;
+};
@@ -1,28 +1,64 @@
 #include "se_faissfactory.hpp"
+#include "tracing.hpp"
+
+#include <algorithm>
 
 #include <faiss/AutoTune.h>
+#include <faiss/IndexIVF.h>
+#include <faiss/IndexHNSW.h>
+#include <faiss/VectorTransform.h>
+#include <faiss/AuxIndexStructures.h>
+#include <faiss/FaissException.h>
 #include <easylogging++.h>
 
+namespace {
+
+// Number of queries of a batch searched between deadline checks
+const long k_deadline_query_chunk = 256;
+
+/**
+ * Search an IVF index with a per-call nprobe. The coarse quantizer is
+ * queried for the nprobe closest lists and then the inverted lists are
+ * scanned with search_preassigned(), leaving the index untouched.
+ */
+void search_ivf(const faiss::IndexIVF *index_ivf, long n, const float *queries,
+                int top_k, int nprobe, float *distances, long *labels)
+{
+    nprobe = std::min(nprobe, static_cast<int>(index_ivf->nlist));
+
+    std::vector<long> coarse_ids(n * nprobe);
+    std::vector<float> coarse_distances(n * nprobe);
+    index_ivf->quantizer->search(n, queries, nprobe,
+                                 coarse_distances.data(), coarse_ids.data());
+
+    faiss::IVFSearchParameters ivf_params;
+    ivf_params.nprobe = nprobe;
+    ivf_params.max_codes = index_ivf->max_codes;
+    index_ivf->search_preassigned(n, queries, top_k,
+                                  coarse_ids.data(), coarse_distances.data(),
+                                  distances, labels, false, &ivf_params);
+}
+
+}
+
 
 SEFaissFactory::SEFaissFactory(const TorchManager::TorchManagerPtr &torch_manager,
                                const DatabaseManager::DatabaseManagerPtr &database_manager,
                                const std::string &index_type,
-                               const FaissMetricType &metric_type)
+                               const FaissMetricType &metric_type,
+                               int rerank_factor)
 : SearchEngine(torch_manager, database_manager),
-  mIndexType(index_type)
-{
-    faiss::MetricType faiss_mtype = static_cast<faiss::MetricType>(metric_type);
-    std::vector<std::string> model_list = mTorchManager->getModuleList();
+  mIndexType(index_type),
+  mMetricType(static_cast<faiss::MetricType>(metric_type)),
+  mRerankFactor(rerank_factor)
+{ }
 
-    for(const std::string &model_name : model_list)
-    {
-        TorchModelProp props = mTorchManager->getModuleProps(model_name);
-        const int feat_dim = props.getFeatureDim();
-        FaissIndexPtr faiss_index(
-                faiss::index_factory(feat_dim, index_type.c_str(), faiss_mtype));
-
-        mFaissMap[model_name] = faiss_index;
-    }
+SEFaissFactory::FaissIndexPtr SEFaissFactory::findIndex(const std::string &model_name) const
+{
+    std::unordered_map<std::string, FaissIndexPtr>::const_iterator pair = mFaissMap.find(model_name);
+    if(pair == mFaissMap.end())
+        return nullptr;
+    return pair->second;
 }
 
 void SEFaissFactory::setup()
@@ -36,14 +72,25 @@ void SEFaissFactory::setup()
     mIdMapping.clear();
     mIdMapping.reserve(mTorchManager->size());
 
-    std::vector<std::string> model_list = mTorchManager->getModuleList();
+    std::vector<std::string> model_list = getModelList();
     for(const std::string &model_name : model_list)
     {
         index_id_counter[model_name] = 0;
+
+        // Models can be added at runtime, so indexes are created here
+        if(mFaissMap.find(model_name) == mFaissMap.end())
+        {
+            const int feat_dim = mTorchManager->getIndexDim(model_name);
+            FaissIndexPtr faiss_index(
+                    faiss::index_factory(feat_dim, mIndexType.c_str(), mMetricType));
+            mFaissMap[model_name] = faiss_index;
+        }
+
         mFaissMap[model_name]->reset();
     }
 
     std::unordered_map<std::string,std::vector<float>> model_items;
+    std::vector<float> reduced;
 
     DatabaseManager::DatabaseIterator it(mDatabaseManager->newIterator());
     for (it->SeekToFirst(); it->Valid(); it->Next())
@@ -53,12 +100,17 @@ void SEFaissFactory::setup()
 
         for(auto &vector : *item_data.mutable_vectors())
         {
-            const float *feature_data = vector.mutable_features()->data();
             const std::string &model_name = vector.model();
+            if(!servesModel(model_name) || mFaissMap.find(model_name) == mFaissMap.end())
+                continue;
+
+            const int feat_dim = static_cast<int>(mFaissMap[model_name]->d);
+            const float *feature_data = indexFeatures(vector, feat_dim, &reduced);
+            if(feature_data == nullptr)
+                continue;
 
             const std::vector<float>::const_iterator end_vec = model_items[model_name].end();
-            model_items[model_name].insert(end_vec, feature_data,
-                                           feature_data + vector.features_size());
+            model_items[model_name].insert(end_vec, feature_data, feature_data + feat_dim);
             total_items++;
 
             idmapping_t &id_mapping = mIdMapping[model_name];
@@ -92,32 +144,226 @@ bool SEFaissFactory::requireRefresh()
     return true;
 }
 
-void SEFaissFactory::search(const std::string &model_name,
+bool SEFaissFactory::search(const std::string &model_name,
                             const torch::Tensor &features_tensor,
                             int top_k,
                             std::vector<int> *top_ids,
-                            std::vector<float> *distances)
+                            std::vector<float> *distances,
+                            const SearchParameters &params)
 {
-    FaissIndexPtr index = mFaissMap[model_name];
+    // A single query is a batch of one, the deadline is checked before
+    // the Faiss search since it can't be interrupted.
+    std::vector<std::vector<int>> batch_ids;
+    std::vector<std::vector<float>> batch_distances;
+    const bool complete = searchBatch(model_name, features_tensor.reshape({1, -1}),
+                                      top_k, &batch_ids, &batch_distances, params);
+
+    if(batch_ids.empty())
+        return complete;
+
+    top_ids->swap(batch_ids[0]);
+    distances->swap(batch_distances[0]);
+    return complete;
+}
+
+bool SEFaissFactory::searchBatch(const std::string &model_name,
+                                 const torch::Tensor &features_tensor,
+                                 int top_k,
+                                 std::vector<std::vector<int>> *top_ids,
+                                 std::vector<std::vector<float>> *distances,
+                                 const SearchParameters &params)
+{
+    TRACE_SCOPE("SEFaissFactory::searchBatch");
+    FaissIndexPtr index = findIndex(model_name);
+    if(index == nullptr)
+        return true;
+
+    const torch::Tensor queries = features_tensor.contiguous();
+    const long n = queries.size(0);
+    const long dim = queries.size(1);
+    const float *raw_queries = queries.data<float>();
+
+    // With reranking, more candidates are fetched from the (compressed)
+    // index and only the top_k closest by their exact features are kept.
+    const bool rerank = mRerankFactor > 1;
+    const int search_k = rerank ? top_k * mRerankFactor : top_k;
+
+    // Queries go in large chunks, so Faiss can use BLAS for exhaustive
+    // indexes and scan the inverted lists in parallel, the deadline is
+    // checked between chunks. Unsearched queries are marked with -1.
+    std::vector<long> item_ids(n * search_k, -1);
+    std::vector<float> item_distances(n * search_k);
+    bool complete = true;
+    for(long start=0; start<n; start+=k_deadline_query_chunk)
+    {
+        if(params.expired())
+        {
+            complete = false;
+            break;
+        }
+
+        const long chunk = std::min(k_deadline_query_chunk, n - start);
+        search_index(index, chunk, raw_queries + start * dim, search_k,
+                     item_distances.data() + start * search_k,
+                     item_ids.data() + start * search_k, params, &mHNSWMutex);
+    }
+
+    const RerankMetric rerank_metric = (mMetricType == faiss::MetricType::METRIC_L2) ?
+                                       RerankMetric::L2_SQUARED :
+                                       RerankMetric::INNER_PRODUCT;
+
+    idmapping_t &id_mapping = mIdMapping[model_name];
+    top_ids->assign(n, std::vector<int>());
+    distances->assign(n, std::vector<float>());
+    for(long i=0; i<n; i++)
+    {
+        std::vector<int> &query_ids = (*top_ids)[i];
+        std::vector<float> &query_distances = (*distances)[i];
+        query_ids.reserve(search_k);
+        query_distances.reserve(search_k);
+        for(int j=0; j<search_k; j++)
+        {
+            // Faiss returns -1 when there are less than search_k items
+            const long item_id = item_ids[i * search_k + j];
+            if(item_id < 0)
+                break;
+            query_ids.push_back(id_mapping[item_id]);
+            query_distances.push_back(item_distances[i * search_k + j]);
+        }
+
+        if(rerank && !query_ids.empty())
+        {
+            const std::vector<int> candidates(query_ids);
+            rerankExact(model_name, raw_queries + i * dim, static_cast<int>(dim),
+                        candidates, top_k, rerank_metric, &query_ids, &query_distances);
+        }
+    }
+
+    return complete;
+}
+
+bool SEFaissFactory::rangeSearch(const std::string &model_name,
+                                 const torch::Tensor &features_tensor,
+                                 float radius, int max_results,
+                                 std::vector<int> *top_ids,
+                                 std::vector<float> *distances,
+                                 const SearchParameters &params)
+{
+    TRACE_SCOPE("SEFaissFactory::rangeSearch");
+    FaissIndexPtr index = findIndex(model_name);
+    if(index == nullptr)
+        return true;
+
+    if(params.expired())
+        return false;
+
     const float *raw_features = features_tensor[0].data<float>();
+    const bool is_l2 = (mMetricType == faiss::MetricType::METRIC_L2);
 
-    std::shared_ptr<long> item_ids(new long[top_k], std::default_delete<long[]>());
-    std::shared_ptr<float> item_distances(new float[top_k], std::default_delete<float[]>());
+    // Inner product results are similarities, the larger the closer
+    auto is_closer = [is_l2](const std::pair<float, long> &a,
+                             const std::pair<float, long> &b) {
+        return is_l2 ? a < b : a > b;
+    };
 
-    index->search(1, raw_features, top_k, item_distances.get(), item_ids.get());
+    std::vector<std::pair<float, long>> results;
+    try
+    {
+        faiss::RangeSearchResult range_result(1);
+        index->range_search(1, raw_features, radius, &range_result);
 
-    const int maximum_k = std::min(top_k, static_cast<int>(index->ntotal));
-    const long *item_ids_deref = item_ids.get();
-    const float *distances_deref = item_distances.get();
+        const size_t total = range_result.lims[1];
+        results.reserve(total);
+        for(size_t i=0; i<total; i++)
+            results.emplace_back(range_result.distances[i], range_result.labels[i]);
 
-    for(int i=0; i<maximum_k; i++)
+        const size_t maximum_results = std::min(total, static_cast<size_t>(max_results));
+        std::partial_sort(results.begin(), results.begin() + maximum_results,
+                          results.end(), is_closer);
+        results.resize(maximum_results);
+    }
+    catch(const faiss::FaissException &ex)
     {
-        top_ids->push_back(item_ids_deref[i]);
-        distances->push_back(distances_deref[i]);
+        // Not all index types implement range search, since the results
+        // are capped, a k-NN search with k = max_results is equivalent.
+        const int k = std::min(max_results, static_cast<int>(index->ntotal));
+        std::vector<long> item_ids(k);
+        std::vector<float> item_distances(k);
+        search_index(index, 1, raw_features, k,
+                     item_distances.data(), item_ids.data(), params, &mHNSWMutex);
+
+        for(int i=0; i<k; i++)
+        {
+            const bool within = is_l2 ? item_distances[i] <= radius :
+                                        item_distances[i] >= radius;
+            if(item_ids[i] < 0 || !within)
+                break;
+            results.emplace_back(item_distances[i], item_ids[i]);
+        }
     }
 
     idmapping_t &id_mapping = mIdMapping[model_name];
-    for(auto &item : *top_ids)
-        item = id_mapping[item];
+    for(const auto &result : results)
+    {
+        top_ids->push_back(id_mapping[result.second]);
+        distances->push_back(result.first);
+    }
+
+    return true;
 }
 
+void SEFaissFactory::search_index(const FaissIndexPtr &index, long n, const float *queries,
+                                  int top_k, float *distances, long *labels,
+                                  const SearchParameters &params, SharedMutex *hnsw_mutex)
+{
+    // Indexes such as "PCA80,IVF4096,Flat" wrap the IVF on a pre-transform
+    const faiss::Index *search_index = index.get();
+    const faiss::IndexPreTransform *index_pt = \
+        dynamic_cast<const faiss::IndexPreTransform*>(search_index);
+    if(index_pt != nullptr)
+        search_index = index_pt->index;
+
+    const faiss::IndexIVF *index_ivf = dynamic_cast<const faiss::IndexIVF*>(search_index);
+    if(params.mNprobe > 0 && index_ivf != nullptr)
+    {
+        const float *transformed = queries;
+        if(index_pt != nullptr)
+            transformed = index_pt->apply_chain(n, queries);
+
+        search_ivf(index_ivf, n, transformed, top_k, params.mNprobe,
+                   distances, labels);
+
+        if(transformed != queries)
+            delete[] transformed;
+        return;
+    }
+
+    faiss::IndexHNSW *index_hnsw = \
+        dynamic_cast<faiss::IndexHNSW*>(const_cast<faiss::Index*>(search_index));
+    if(index_hnsw != nullptr)
+    {
+        {
+            // The overrides only change efSearch under the exclusive lock,
+            // so under the shared one it is the default of the index and
+            // the searches with the default efSearch run concurrently
+            SharedLock lock(*hnsw_mutex);
+            if(params.mEfSearch <= 0 || params.mEfSearch == index_hnsw->hnsw.efSearch)
+            {
+                index->search(n, queries, top_k, distances, labels);
+                return;
+            }
+        }
+
+        // This Faiss version has no per-call HNSW parameters and efSearch
+        // is read from the index on every search, so an override excludes
+        // the other searches while it is set.
+        std::lock_guard<SharedMutex> lock(*hnsw_mutex);
+        const int default_ef = index_hnsw->hnsw.efSearch;
+        index_hnsw->hnsw.efSearch = params.mEfSearch;
+        index->search(n, queries, top_k, distances, labels);
+        index_hnsw->hnsw.efSearch = default_ef;
+        return;
+    }
+
+    index->search(n, queries, top_k, distances, labels);
+}
@@ -6,6 +6,7 @@
 #include <faiss/Index.h>
 
 #include "searchengine.hpp"
+#include "sharedmutex.hpp"
 
 
 enum class FaissMetricType : int
@@ -21,24 +22,66 @@ public:
     typedef std::shared_ptr<faiss::Index> FaissIndexPtr;
 
 public:
+    /**
+     * Construct the Faiss search engine.
+     * @param torch_manager an instance of the torch manager
+     * @param database_manager an instance of the database manager
+     * @param index_type the Faiss index factory string
+     * @param metric_type the metric of the index
+     * @param rerank_factor if greater than one, rerank_factor * top_k
+     *                      candidates are fetched from the index and
+     *                      reranked with their exact stored features
+     */
     SEFaissFactory(const TorchManager::TorchManagerPtr &torch_manager,
                    const DatabaseManager::DatabaseManagerPtr &database_manager,
                    const std::string &index_type,
-                   const FaissMetricType &metric_type);
+                   const FaissMetricType &metric_type,
+                   int rerank_factor=0);
 
     void setup() override;
 
     bool requireRefresh() override;
 
-    void search(const std::string &model_name,
+    bool search(const std::string &model_name,
                 const torch::Tensor &features_tensor,
                 int top_k, std::vector<int> *top_ids,
-                std::vector<float> *distances) override;
+                std::vector<float> *distances,
+                const SearchParameters &params) override;
+
+    bool searchBatch(const std::string &model_name,
+                     const torch::Tensor &features_tensor,
+                     int top_k,
+                     std::vector<std::vector<int>> *top_ids,
+                     std::vector<std::vector<float>> *distances,
+                     const SearchParameters &params) override;
+
+    bool rangeSearch(const std::string &model_name,
+                     const torch::Tensor &features_tensor,
+                     float radius, int max_results,
+                     std::vector<int> *top_ids,
+                     std::vector<float> *distances,
+                     const SearchParameters &params) override;
+
+    /**
+     * Search an index applying the per-request parameters. The IVF
+     * nprobe is applied per call without touching the shared index, the
+     * HNSW efSearch (which is an index attribute) is only overridden under
+     * the exclusive lock, the other searches share the lock.
+     * @param hnsw_mutex the lock of the HNSW indexes of the engine
+     */
+    static void search_index(const FaissIndexPtr &index, long n, const float *queries,
+                             int top_k, float *distances, long *labels,
+                             const SearchParameters &params, SharedMutex *hnsw_mutex);
 
 private:
     typedef std::unordered_map<int, int> idmapping_t;
 
+    FaissIndexPtr findIndex(const std::string &model_name) const;
+
     std::string mIndexType;
+    faiss::MetricType mMetricType;
+    int mRerankFactor;
+    SharedMutex mHNSWMutex;
     std::unordered_map<std::string, FaissIndexPtr> mFaissMap;
     std::unordered_map<std::string, idmapping_t> mIdMapping;
 };
\ No newline at end of file
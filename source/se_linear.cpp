@@ -1,8 +1,45 @@
 #include "se_linear.hpp"
+#include "tracing.hpp"
 
 #include <queue>
+#include <cmath>
+#include <algorithm>
+#include <limits>
 #include <easylogging++.h>
 
+// BLAS single precision matrix multiplication (Fortran interface)
+#ifndef FINTEGER
+#define FINTEGER int
+#endif
+
+extern "C" {
+int sgemm_(const char *transa, const char *transb, FINTEGER *m, FINTEGER *n,
+           FINTEGER *k, const float *alpha, const float *a, FINTEGER *lda,
+           const float *b, FINTEGER *ldb, float *beta, float *c, FINTEGER *ldc);
+}
+
+namespace {
+    // Number of dimensions accumulated between early-out checks
+    const int k_early_out_block = 64;
+
+    // Number of database vectors compared at once in the batch search
+    const int k_linear_block_size = 1024;
+}
+
+/**
+ * Compute the squared l2-norm of a vector.
+ * @param x the vector
+ * @param size size of the vector
+ * @return the squared norm
+ */
+float l2_squared_norm(const float *x, int size)
+{
+    float norm = 0.0f;
+    for(int i=0; i<size; i++)
+        norm += x[i] * x[i];
+    return norm;
+}
+
 
 struct IdDistance
 {
@@ -25,6 +62,42 @@ struct IdDistance
 };
 
 
+/**
+ * Accumulate the p-norm distance between two vectors, stopping as soon as
+ * the accumulated value exceeds the threshold.
+ * @param a first vector
+ * @param b second vector (scaled by b_scale)
+ * @param size size of the vectors
+ * @param pnorm the p-norm used for the distance
+ * @param b_scale scale applied to the elements of b (for normalization)
+ * @param threshold the maximum distance accepted
+ * @param distance the returned distance, only valid when within threshold
+ * @return true if the distance is within the threshold, false otherwise
+ */
+bool distance_within(const float *a, const float *b, int size, int pnorm,
+                     float b_scale, float threshold, float *distance)
+{
+    const double threshold_p = std::pow(static_cast<double>(threshold), pnorm);
+    double accum = 0.0;
+
+    for(int start=0; start<size; start+=k_early_out_block)
+    {
+        const int end = std::min(start + k_early_out_block, size);
+        for(int i=start; i<end; i++)
+        {
+            const double diff = std::fabs(a[i] - b[i] * b_scale);
+            accum += (pnorm == 1) ? diff : (pnorm == 2) ? diff * diff :
+                                           std::pow(diff, pnorm);
+        }
+
+        if(accum > threshold_p)
+            return false;
+    }
+
+    *distance = static_cast<float>(std::pow(accum, 1.0 / pnorm));
+    return *distance <= threshold;
+}
+
 SELinear::SELinear(const TorchManager::TorchManagerPtr &torch_manager,
                    const DatabaseManager::DatabaseManagerPtr &database_manager,
                    bool normalize, int norm)
@@ -38,19 +111,135 @@ void SELinear::setup()
     LOG(INFO) << "Using exact_disk linear search.";
 }
 
-void
+bool
 SELinear::search(const std::string &model_name,
                  const torch::Tensor &features_tensor,
                  int top_k, std::vector<int> *top_ids,
-                 std::vector<float> *distances)
+                 std::vector<float> *distances,
+                 const SearchParameters &params)
 {
-    // Using the heap we can get O(nlogk) instead of O(nlogn) if we just sort it
-    std::priority_queue<IdDistance, std::vector<IdDistance>, std::greater<IdDistance>> pri_queue;
+    std::vector<std::vector<int>> batch_ids;
+    std::vector<std::vector<float>> batch_distances;
+
+    const bool complete = searchBatch(model_name, features_tensor.reshape({1, -1}),
+                                      top_k, &batch_ids, &batch_distances, params);
 
+    if(batch_ids.empty())
+        return complete;
+
+    top_ids->swap(batch_ids[0]);
+    distances->swap(batch_distances[0]);
+    return complete;
+}
+
+bool
+SELinear::searchBatch(const std::string &model_name,
+                      const torch::Tensor &features_tensor,
+                      int top_k,
+                      std::vector<std::vector<int>> *top_ids,
+                      std::vector<std::vector<float>> *distances,
+                      const SearchParameters &params)
+{
+    TRACE_SCOPE("SELinear::searchBatch");
     if(top_k <= 0)
-        return;
+        return true;
+
+    torch::Tensor queries = features_tensor.toType(at::kFloat).contiguous();
+    if(mNormalize)
+    {
+        // Zero queries are kept as they are, like the zero vectors of the
+        // items, instead of dividing by a zero norm
+        torch::Tensor query_norms = queries.norm(2, 1, true);
+        query_norms.masked_fill_(query_norms == 0, 1.0);
+        queries = queries / query_norms;
+    }
+    queries = queries.contiguous();
+
+    const int n = static_cast<int>(queries.size(0));
+    const int dim = static_cast<int>(queries.size(1));
+    const float *raw_queries = queries.data<float>();
+
+    std::vector<float> query_norms(n);
+    for(int i=0; i<n; i++)
+        query_norms[i] = l2_squared_norm(raw_queries + i * dim, dim);
+
+    // Using one max-heap per query we get O(nlogk), the top of each
+    // heap is the worst item kept for that query.
+    std::vector<std::priority_queue<IdDistance>> queues(n);
+
+    // Contiguous block of database vectors compared at once
+    std::vector<float> block;
+    block.reserve(k_linear_block_size * dim);
+    std::vector<int> block_ids;
+    block_ids.reserve(k_linear_block_size);
+    std::vector<float> block_norms;
+    block_norms.reserve(k_linear_block_size);
+    std::vector<float> block_ip(k_linear_block_size * n);
+
+    auto push_result = [&queues, top_k](int query, int id, float distance)
+    {
+        std::priority_queue<IdDistance> &pri_queue = queues[query];
+        const IdDistance id_dist(id, distance);
+        const int queue_size = static_cast<int>(pri_queue.size());
+        if(queue_size < top_k || id_dist < pri_queue.top())
+        {
+            if (queue_size == top_k)
+                pri_queue.pop();
+            pri_queue.push(id_dist);
+        }
+    };
+
+    auto flush_block = [&]()
+    {
+        const int block_size = static_cast<int>(block_ids.size());
+        if(block_size <= 0)
+            return;
+
+        if(mPnorm == 2)
+        {
+            // ||q - x||^2 = ||q||^2 + ||x||^2 - 2 * <q, x>, where the
+            // inner products are a (block_size x n) matrix product.
+            float one = 1.0f, zero = 0.0f;
+            FINTEGER m = block_size, nq = n, k = dim;
+            sgemm_("Transpose", "Not transpose", &m, &nq, &k, &one,
+                   block.data(), &k, raw_queries, &k, &zero,
+                   block_ip.data(), &m);
 
-    // Iterate on all elements in database
+            for(int q=0; q<n; q++)
+            {
+                const float *query_ip = block_ip.data() + q * block_size;
+                for(int j=0; j<block_size; j++)
+                {
+                    const float dist2 = query_norms[q] + block_norms[j] - 2.0f * query_ip[j];
+                    push_result(q, block_ids[j], std::sqrt(std::max(dist2, 0.0f)));
+                }
+            }
+        }
+        else
+        {
+            const float no_threshold = std::numeric_limits<float>::max();
+            for(int q=0; q<n; q++)
+                for(int j=0; j<block_size; j++)
+                {
+                    float distance = 0.0;
+                    distance_within(raw_queries + q * dim, block.data() + j * dim,
+                                    dim, mPnorm, 1.0f, no_threshold, &distance);
+                    push_result(q, block_ids[j], distance);
+                }
+        }
+
+        block.clear();
+        block_ids.clear();
+        block_norms.clear();
+    };
+
+    // Iterate on all elements in database, the deadline is checked after
+    // every block so an expired request keeps the items compared so far.
+    // Stored features are reduced like the queries, if the model has a transform
+    const FeatureTransform::FeatureTransformPtr transform = mTorchManager->getTransform(model_name);
+    std::vector<float> reduced;
+
+    bool complete = true;
     DatabaseManager::DatabaseIterator it(mDatabaseManager->newIterator());
     for (it->SeekToFirst(); it->Valid(); it->Next())
     {
@@ -58,61 +247,166 @@ SELinear::search(const std::string &model_name,
         item_data.ParseFromString(it->value().ToString());
 
         // Iterate on every vector in the database
-        for (auto &vector : *item_data.mutable_vectors())
+        for (const auto &vector : item_data.vectors())
         {
             // Skip if not searching for this model space
-            const std::string &item_model_name = vector.model();
-            if(model_name != item_model_name)
+            if(model_name != vector.model())
                 continue;
 
-            float *raw_vector = vector.mutable_features()->mutable_data();
-            const int features_size = vector.mutable_features()->size();
-
-            torch::Tensor squeeze_tensor = features_tensor.squeeze(0);
-            torch::Tensor tensor = torch::from_blob(raw_vector, {features_size});
-            tensor = tensor.toType(at::kFloat);
-
-            if(tensor.sizes() != squeeze_tensor.sizes())
+            const float *raw_vector = indexFeatures(transform, vector, dim, &reduced);
+            if(raw_vector == nullptr)
             {
                 LOG(ERROR) << "Different tensor sizes to compare. "
-                           << "Size on database " << tensor.sizes() << ", "
-                           << "size returned from model " << squeeze_tensor.sizes();
+                           << "Size on database " << vector.features_size() << ", "
+                           << "size returned from model " << dim;
                 continue;
             }
 
-            float distance = 0.0;
+            float norm = l2_squared_norm(raw_vector, dim);
+            const size_t offset = block.size();
+            block.insert(block.end(), raw_vector, raw_vector + dim);
 
             // Should we normalize vectors ?
-            if(mNormalize)
+            if(mNormalize && norm > 0.0f)
+            {
+                const float scale = 1.0f / std::sqrt(norm);
+                for(int i=0; i<dim; i++)
+                    block[offset + i] *= scale;
+                norm = 1.0f;
+            }
+
+            block_ids.push_back(item_data.item_id());
+            block_norms.push_back(norm);
+
+            if(static_cast<int>(block_ids.size()) == k_linear_block_size)
             {
-                const torch::Tensor norm_db_tensor = tensor / tensor.norm();
-                const torch::Tensor norm_search_tensor = squeeze_tensor / squeeze_tensor.norm();
-                distance = norm_db_tensor.dist(norm_search_tensor, mPnorm).item<float>();
+                flush_block();
+                complete = !params.expired();
             }
-            else
+        }
+
+        if(!complete)
+        {
+            LOG(WARNING) << "Search deadline expired, returning partial results.";
+            break;
+        }
+    }
+    flush_block();
+
+    // Pop from the heaps (farthest first) to the returning lists
+    // of top-k ids and distances.
+    top_ids->assign(n, std::vector<int>());
+    distances->assign(n, std::vector<float>());
+    for(int q=0; q<n; q++)
+    {
+        std::priority_queue<IdDistance> &pri_queue = queues[q];
+        const size_t total = pri_queue.size();
+        (*top_ids)[q].resize(total);
+        (*distances)[q].resize(total);
+        for(size_t i=total; i>0; i--)
+        {
+            (*top_ids)[q][i - 1] = pri_queue.top().mId;
+            (*distances)[q][i - 1] = pri_queue.top().mDistance;
+            pri_queue.pop();
+        }
+    }
+
+    return complete;
+}
+
+bool
+SELinear::rangeSearch(const std::string &model_name,
+                      const torch::Tensor &features_tensor,
+                      float radius, int max_results,
+                      std::vector<int> *top_ids,
+                      std::vector<float> *distances,
+                      const SearchParameters &params)
+{
+    TRACE_SCOPE("SELinear::rangeSearch");
+    // Max-heap with the closest items, the top is the worst one kept
+    std::priority_queue<IdDistance> pri_queue;
+
+    if(max_results <= 0)
+        return true;
+
+    torch::Tensor search_tensor = features_tensor.squeeze(0).toType(at::kFloat).contiguous();
+    if(mNormalize)
+        search_tensor = search_tensor / search_tensor.norm();
+    const float *raw_search = search_tensor.data<float>();
+    const int search_size = static_cast<int>(search_tensor.size(0));
+
+    const FeatureTransform::FeatureTransformPtr transform = mTorchManager->getTransform(model_name);
+    std::vector<float> reduced;
+
+    bool complete = true;
+    int items_compared = 0;
+
+    DatabaseManager::DatabaseIterator it(mDatabaseManager->newIterator());
+    for (it->SeekToFirst(); it->Valid(); it->Next())
+    {
+        // Check the deadline with the same granularity of the batch search
+        if(++items_compared % k_linear_block_size == 0 && params.expired())
+        {
+            LOG(WARNING) << "Radius search deadline expired, returning partial results.";
+            complete = false;
+            break;
+        }
+
+        euclidesproto::ItemData item_data;
+        item_data.ParseFromString(it->value().ToString());
+
+        for (const auto &vector : item_data.vectors())
+        {
+            if(model_name != vector.model())
+                continue;
+
+            const float *raw_vector = indexFeatures(transform, vector, search_size, &reduced);
+            if(raw_vector == nullptr)
             {
-                distance = tensor.dist(squeeze_tensor, mPnorm).item<float>();
+                LOG(ERROR) << "Different tensor sizes to compare. "
+                           << "Size on database " << vector.features_size() << ", "
+                           << "size returned from model " << search_size;
+                continue;
             }
 
-            const IdDistance id_dist(item_data.item_id(), distance);
-            const int queue_size = static_cast<int>(pri_queue.size());
-            if(queue_size < top_k || id_dist < pri_queue.top())
+            float scale = 1.0f;
+            if(mNormalize)
             {
-                if (queue_size == top_k)
-                    pri_queue.pop();
-                pri_queue.push(id_dist);
+                double norm = 0.0;
+                for(int i=0; i<search_size; i++)
+                    norm += raw_vector[i] * raw_vector[i];
+                if(norm > 0.0)
+                    scale = static_cast<float>(1.0 / std::sqrt(norm));
             }
+
+            // Once we have max_results, only closer items are relevant
+            const int queue_size = static_cast<int>(pri_queue.size());
+            const float threshold = (queue_size < max_results) ?
+                                    radius : pri_queue.top().mDistance;
+
+            float distance = 0.0;
+            if(!distance_within(raw_search, raw_vector, search_size, mPnorm,
+                                scale, threshold, &distance))
+                continue;
+
+            if (queue_size == max_results)
+                pri_queue.pop();
+            pri_queue.push(IdDistance(item_data.item_id(), distance));
         }
     }
 
-    // Pop from the heap to the returning list of top-k ids
-    // and distances.
-    while (!pri_queue.empty()) {
-        const IdDistance &item_dist = pri_queue.top();
-        top_ids->push_back(item_dist.mId);
-        distances->push_back(item_dist.mDistance);
+    // The max-heap pops the farthest first, fill the results backwards
+    const size_t total = pri_queue.size();
+    top_ids->resize(total);
+    distances->resize(total);
+    for(size_t i=total; i>0; i--)
+    {
+        (*top_ids)[i - 1] = pri_queue.top().mId;
+        (*distances)[i - 1] = pri_queue.top().mDistance;
         pri_queue.pop();
     }
+
+    return complete;
 }
 
 bool SELinear::requireRefresh()
@@ -120,5 +414,15 @@ bool SELinear::requireRefresh()
     return false;
 }
 
+bool SELinear::addItem(const euclidesproto::ItemData &item_data)
+{
+    return true;
+}
+
+bool SELinear::removeItem(int item_id)
+{
+    return true;
+}
+
 SELinear::~SELinear()
 { }
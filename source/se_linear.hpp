@@ -44,18 +44,73 @@ public:
     bool requireRefresh() override;
 
     /**
-     * Perform a linear and exact search on the database.
+     * The items are always searched in the database, so they are
+     * searchable as soon as they are stored.
+     * @return true
+     */
+    bool addItem(const euclidesproto::ItemData &item_data) override;
+    bool removeItem(int item_id) override;
+
+    /**
+     * Perform a linear and exact search on the database, this is a batch
+     * search with a single query.
      *
      * @param model_name the name of the model space to search
      * @param features_tensor current feature vector to search
      * @param top_k number of top k items to search for
      * @param top_ids return top k item ids
      * @param distances returns the distance for each item
+     * @param params per-request search parameters, only the deadline applies
+     * @return false if the deadline expired before the scan finished
      */
-    void search(const std::string &model_name,
+    bool search(const std::string &model_name,
                 const torch::Tensor &features_tensor,
                 int top_k, std::vector<int> *top_ids,
-                std::vector<float> *distances) override;
+                std::vector<float> *distances,
+                const SearchParameters &params) override;
+
+    /**
+     * Perform a linear and exact search on the database for a batch of
+     * queries. The database is read in blocks and, for the euclidean
+     * distance, each block is compared with all queries at once using
+     * a BLAS matrix multiplication.
+     *
+     * @param model_name the name of the model space to search
+     * @param features_tensor the [N, d] matrix with one query per row
+     * @param top_k number of top k items to search for
+     * @param top_ids return N lists of top k item ids
+     * @param distances returns N lists with the distance for each item
+     * @param params per-request search parameters, the deadline is checked
+     *               after every block of database vectors
+     * @return false if the deadline expired before the scan finished
+     */
+    bool searchBatch(const std::string &model_name,
+                     const torch::Tensor &features_tensor,
+                     int top_k,
+                     std::vector<std::vector<int>> *top_ids,
+                     std::vector<std::vector<float>> *distances,
+                     const SearchParameters &params) override;
+
+    /**
+     * Perform a linear and exact radius search on the database. The
+     * distance computation of each item stops as soon as it exceeds
+     * the radius (or the worst distance kept when max_results is reached).
+     *
+     * @param model_name the name of the model space to search
+     * @param features_tensor current feature vector to search
+     * @param radius the maximum distance of the returned items
+     * @param max_results maximum number of items returned
+     * @param top_ids return the item ids sorted by distance
+     * @param distances returns the distance for each item
+     * @param params per-request search parameters, only the deadline applies
+     * @return false if the deadline expired before the scan finished
+     */
+    bool rangeSearch(const std::string &model_name,
+                     const torch::Tensor &features_tensor,
+                     float radius, int max_results,
+                     std::vector<int> *top_ids,
+                     std::vector<float> *distances,
+                     const SearchParameters &params) override;
 private:
     bool mNormalize;
     int mPnorm;
@@ -0,0 +1,297 @@
+#include "se_partitioned.hpp"
+#include "tracing.hpp"
+
+#include <algorithm>
+#include <unordered_set>
+
+#include <faiss/AutoTune.h>
+#include <faiss/FaissException.h>
+#include <easylogging++.h>
+
+namespace {
+
+// The partition of the items without stored predictions
+const int k_unclassified = -1;
+
+}
+
+
+SEPartitioned::SEPartitioned(const TorchManager::TorchManagerPtr &torch_manager,
+                             const DatabaseManager::DatabaseManagerPtr &database_manager,
+                             const std::string &index_type,
+                             const FaissMetricType &metric_type,
+                             int assign_classes, int probe_classes)
+: SearchEngine(torch_manager, database_manager),
+  mIndexType(index_type),
+  mMetricType(static_cast<faiss::MetricType>(metric_type)),
+  mAssignClasses(std::max(assign_classes, 1)),
+  mProbeClasses(std::max(probe_classes, 1))
+{ }
+
+void SEPartitioned::setup()
+{
+    TIMED_SCOPE(timerSetup, "SEPartitioned Setup");
+
+    std::unordered_map<std::string, int> model_dims;
+    for(const std::string &model_name : getModelList())
+        model_dims[model_name] = mTorchManager->getIndexDim(model_name);
+
+    // The features and item ids of each partition, by model
+    typedef std::unordered_map<int, std::pair<std::vector<float>, std::vector<int>>> partition_items_t;
+    std::unordered_map<std::string, partition_items_t> model_items;
+    int total_items = 0;
+    std::vector<float> reduced;
+
+    DatabaseManager::DatabaseIterator it(mDatabaseManager->newIterator());
+    for (it->SeekToFirst(); it->Valid(); it->Next())
+    {
+        euclidesproto::ItemData item_data;
+        item_data.ParseFromString(it->value().ToString());
+
+        for(const auto &vector : item_data.vectors())
+        {
+            std::unordered_map<std::string, int>::const_iterator dim = \
+                model_dims.find(vector.model());
+            if(dim == model_dims.end())
+                continue;
+
+            const float *features = indexFeatures(vector, dim->second, &reduced);
+            if(features == nullptr)
+                continue;
+
+            std::vector<int> classes = item_top_classes(vector, mAssignClasses);
+            if(classes.empty())
+                classes.push_back(k_unclassified);
+
+            partition_items_t &partitions = model_items[vector.model()];
+            for(const int class_id : classes)
+            {
+                std::pair<std::vector<float>, std::vector<int>> &partition = partitions[class_id];
+                partition.first.insert(partition.first.end(), features,
+                                       features + dim->second);
+                partition.second.push_back(item_data.item_id());
+            }
+            total_items++;
+        }
+    }
+    it.reset();
+
+    mPartitions.clear();
+    size_t total_partitions = 0;
+    for(auto &pair_model : model_items)
+    {
+        const int dim = model_dims[pair_model.first];
+        partitions_t &partitions = mPartitions[pair_model.first];
+        for(auto &pair_partition : pair_model.second)
+        {
+            PartitionPtr partition = std::make_shared<Partition>();
+            partition->mIds.swap(pair_partition.second.second);
+            partition->mIndex = buildIndex(dim, static_cast<int>(partition->mIds.size()),
+                                           pair_partition.second.first.data());
+            partitions[pair_partition.first] = partition;
+
+            // Release the features as soon as they are indexed
+            std::vector<float>().swap(pair_partition.second.first);
+        }
+        total_partitions += partitions.size();
+    }
+
+    LOG(INFO) << "Added " << total_items << " items into " << total_partitions
+              << " class partitions.";
+}
+
+bool SEPartitioned::requireRefresh()
+{
+    return true;
+}
+
+SEPartitioned::FaissIndexPtr SEPartitioned::buildIndex(int dim, int n, const float *features) const
+{
+    FaissIndexPtr index(faiss::index_factory(dim, mIndexType.c_str(), mMetricType));
+    try
+    {
+        if(!index->is_trained)
+            index->train(n, features);
+        index->add(n, features);
+    }
+    catch(const faiss::FaissException &ex)
+    {
+        // Small classes can't train e.g. an IVF index with many lists
+        LOG(WARNING) << "Cannot build a " << mIndexType << " index with " << n
+                     << " vectors, using a flat index: " << ex.what();
+        index.reset(faiss::index_factory(dim, "Flat", mMetricType));
+        index->add(n, features);
+    }
+    return index;
+}
+
+std::vector<SEPartitioned::Partition*>
+SEPartitioned::routeQuery(const partitions_t &partitions, const std::vector<int> *classes) const
+{
+    std::vector<Partition*> routed;
+    if(classes == nullptr || classes->empty())
+    {
+        for(const auto &pair : partitions)
+            routed.push_back(pair.second.get());
+        return routed;
+    }
+
+    // Classes without items are skipped, so the query always probes
+    // probe_classes partitions when there are enough of them
+    for(const int class_id : *classes)
+    {
+        if(static_cast<int>(routed.size()) >= mProbeClasses)
+            break;
+
+        partitions_t::const_iterator pair = partitions.find(class_id);
+        if(pair != partitions.end() && class_id != k_unclassified)
+            routed.push_back(pair->second.get());
+    }
+
+    partitions_t::const_iterator unclassified = partitions.find(k_unclassified);
+    if(unclassified != partitions.end())
+        routed.push_back(unclassified->second.get());
+
+    return routed;
+}
+
+bool SEPartitioned::search(const std::string &model_name,
+                           const torch::Tensor &features_tensor,
+                           int top_k,
+                           std::vector<int> *top_ids,
+                           std::vector<float> *distances,
+                           const SearchParameters &params)
+{
+    std::vector<std::vector<int>> batch_ids;
+    std::vector<std::vector<float>> batch_distances;
+    const bool complete = searchBatch(model_name, features_tensor.reshape({1, -1}),
+                                      top_k, &batch_ids, &batch_distances, params);
+
+    if(batch_ids.empty())
+        return complete;
+
+    top_ids->swap(batch_ids[0]);
+    distances->swap(batch_distances[0]);
+    return complete;
+}
+
+bool SEPartitioned::searchBatch(const std::string &model_name,
+                                const torch::Tensor &features_tensor,
+                                int top_k,
+                                std::vector<std::vector<int>> *top_ids,
+                                std::vector<std::vector<float>> *distances,
+                                const SearchParameters &params)
+{
+    TRACE_SCOPE("SEPartitioned::searchBatch");
+    std::unordered_map<std::string, partitions_t>::const_iterator model = \
+        mPartitions.find(model_name);
+    if(model == mPartitions.end())
+        return true;
+
+    const torch::Tensor queries = features_tensor.contiguous();
+    const long n = queries.size(0);
+    const long dim = queries.size(1);
+    const float *raw_queries = queries.data<float>();
+
+    // The queries routed to each partition are searched together, so
+    // Faiss can still use BLAS for the flat partitions
+    const bool has_classes = static_cast<long>(params.mQueryClasses.size()) == n;
+    std::unordered_map<Partition*, std::vector<long>> partition_queries;
+    for(long i=0; i<n; i++)
+        for(Partition *partition : routeQuery(model->second,
+                                              has_classes ? &params.mQueryClasses[i] : nullptr))
+            partition_queries[partition].push_back(i);
+
+    std::vector<std::vector<std::pair<float, int>>> candidates(n);
+    bool complete = true;
+    for(const auto &pair : partition_queries)
+    {
+        if(params.expired())
+        {
+            complete = false;
+            break;
+        }
+
+        const Partition &partition = *pair.first;
+        const std::vector<long> &query_ids = pair.second;
+        const long routed = static_cast<long>(query_ids.size());
+        const int k = std::min(top_k, static_cast<int>(partition.mIds.size()));
+
+        std::vector<float> routed_queries(routed * dim);
+        for(long q=0; q<routed; q++)
+            std::copy(raw_queries + query_ids[q] * dim, raw_queries + (query_ids[q] + 1) * dim,
+                      routed_queries.begin() + q * dim);
+
+        std::vector<long> labels(routed * k);
+        std::vector<float> label_distances(routed * k);
+        partition.mIndex->search(routed, routed_queries.data(), k,
+                                 label_distances.data(), labels.data());
+
+        for(long q=0; q<routed; q++)
+            for(int j=0; j<k; j++)
+            {
+                // Faiss returns -1 when there are less than k items
+                const long label = labels[q * k + j];
+                if(label < 0)
+                    break;
+                candidates[query_ids[q]].emplace_back(label_distances[q * k + j],
+                                                      partition.mIds[label]);
+            }
+    }
+
+    // Inner product results are similarities, the larger the closer
+    const bool is_l2 = (mMetricType == faiss::MetricType::METRIC_L2);
+    auto is_closer = [is_l2](const std::pair<float, int> &a,
+                             const std::pair<float, int> &b) {
+        return is_l2 ? a < b : a > b;
+    };
+
+    top_ids->assign(n, std::vector<int>());
+    distances->assign(n, std::vector<float>());
+    for(long i=0; i<n; i++)
+    {
+        std::vector<std::pair<float, int>> &query_candidates = candidates[i];
+        std::sort(query_candidates.begin(), query_candidates.end(), is_closer);
+
+        // Items assigned to several classes can be found more than once
+        std::unordered_set<int> seen;
+        for(const auto &candidate : query_candidates)
+        {
+            if(static_cast<int>((*top_ids)[i].size()) >= top_k)
+                break;
+            if(!seen.insert(candidate.second).second)
+                continue;
+            (*top_ids)[i].push_back(candidate.second);
+            (*distances)[i].push_back(candidate.first);
+        }
+    }
+
+    return complete;
+}
+
+bool SEPartitioned::rangeSearch(const std::string &model_name,
+                                const torch::Tensor &features_tensor,
+                                float radius, int max_results,
+                                std::vector<int> *top_ids,
+                                std::vector<float> *distances,
+                                const SearchParameters &params)
+{
+    TRACE_SCOPE("SEPartitioned::rangeSearch");
+    std::vector<int> knn_ids;
+    std::vector<float> knn_distances;
+    const bool complete = search(model_name, features_tensor, max_results,
+                                 &knn_ids, &knn_distances, params);
+
+    const bool is_l2 = (mMetricType == faiss::MetricType::METRIC_L2);
+    for(size_t i=0; i<knn_ids.size(); i++)
+    {
+        const bool within = is_l2 ? knn_distances[i] <= radius :
+                                    knn_distances[i] >= radius;
+        if(!within)
+            break;
+        top_ids->push_back(knn_ids[i]);
+        distances->push_back(knn_distances[i]);
+    }
+
+    return complete;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <faiss/Index.h>
+
+#include "searchengine.hpp"
+#include "se_faissfactory.hpp"
+
+
+/**
+ * The class-partitioned search engine, which groups the items by the top
+ * classes predicted by the model and builds one index per class. A query
+ * is routed to the partitions of its own top predicted classes, so only
+ * a fraction of the items are scanned. Items without stored predictions
+ * go into a partition that is always searched, and queries without
+ * predictions (e.g. raw vectors) search all the partitions.
+ */
+class SEPartitioned : public SearchEngine
+{
+public:
+    typedef std::shared_ptr<SEPartitioned> SEPartitionedPtr;
+    typedef std::shared_ptr<faiss::Index> FaissIndexPtr;
+
+public:
+    /**
+     * Construct the partitioned search engine.
+     * @param torch_manager an instance of the torch manager
+     * @param database_manager an instance of the database manager
+     * @param index_type the Faiss index factory string of each partition
+     * @param metric_type the metric of the indexes
+     * @param assign_classes number of top classes an item is assigned to
+     * @param probe_classes number of top classes of a query searched
+     */
+    SEPartitioned(const TorchManager::TorchManagerPtr &torch_manager,
+                  const DatabaseManager::DatabaseManagerPtr &database_manager,
+                  const std::string &index_type,
+                  const FaissMetricType &metric_type,
+                  int assign_classes, int probe_classes);
+
+    void setup() override;
+
+    bool requireRefresh() override;
+
+    bool search(const std::string &model_name,
+                const torch::Tensor &features_tensor,
+                int top_k, std::vector<int> *top_ids,
+                std::vector<float> *distances,
+                const SearchParameters &params) override;
+
+    bool searchBatch(const std::string &model_name,
+                     const torch::Tensor &features_tensor,
+                     int top_k,
+                     std::vector<std::vector<int>> *top_ids,
+                     std::vector<std::vector<float>> *distances,
+                     const SearchParameters &params) override;
+
+    /**
+     * Search the items within a radius, as a k-NN search with
+     * k = max_results filtered by the radius.
+     */
+    bool rangeSearch(const std::string &model_name,
+                     const torch::Tensor &features_tensor,
+                     float radius, int max_results,
+                     std::vector<int> *top_ids,
+                     std::vector<float> *distances,
+                     const SearchParameters &params) override;
+
+private:
+    /**
+     * The index of the items of a class, with the item id of each
+     * position of the index.
+     */
+    struct Partition
+    {
+        FaissIndexPtr mIndex;
+        std::vector<int> mIds;
+    };
+    typedef std::shared_ptr<Partition> PartitionPtr;
+
+    // The partitions of a model space by class
+    typedef std::unordered_map<int, PartitionPtr> partitions_t;
+
+    /**
+     * Choose the partitions searched by a query: the ones of its first
+     * probe_classes classes that have items, plus the unclassified items.
+     * @param partitions the partitions of the model space
+     * @param classes the top classes of the query, or nullptr if unknown
+     * @return the partitions to search
+     */
+    std::vector<Partition*> routeQuery(const partitions_t &partitions,
+                                       const std::vector<int> *classes) const;
+
+    /**
+     * Build the index of a set of vectors, falling back to a flat index
+     * if the index type can't be trained with them.
+     */
+    FaissIndexPtr buildIndex(int dim, int n, const float *features) const;
+
+    std::string mIndexType;
+    faiss::MetricType mMetricType;
+    int mAssignClasses;
+    int mProbeClasses;
+    std::unordered_map<std::string, partitions_t> mPartitions;
+};
@@ -0,0 +1,917 @@
+#include "se_segmented.hpp"
+#include "tracing.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <sys/stat.h>
+
+#include <faiss/AutoTune.h>
+#include <faiss/index_io.h>
+#include <faiss/utils.h>
+#include <faiss/FaissException.h>
+#include <tinydir.h>
+#include <easylogging++.h>
+
+namespace {
+
+// Items fetched from the database at once when merging segments
+const size_t k_merge_fetch_block = 4096;
+
+const std::string k_index_suffix = ".index";
+const std::string k_ids_suffix = ".ids";
+const std::string k_tmp_suffix = ".tmp";
+
+/**
+ * FNV-1a hash of the features of an item, used to recognize the items
+ * whose persisted version is still the current one.
+ */
+uint64_t features_hash(const float *features, int dim)
+{
+    const unsigned char *bytes = reinterpret_cast<const unsigned char*>(features);
+    uint64_t hash = 14695981039346656037ULL;
+    for(size_t i=0; i<dim * sizeof(float); i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool ends_with(const std::string &value, const std::string &suffix)
+{
+    return value.size() >= suffix.size() &&
+           value.compare(value.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+/**
+ * Get the id of a segment from the name of its ids file, <id>.ids.
+ * @return true if the name is a segment ids file name, false otherwise
+ */
+bool parse_segment_filename(const std::string &filename, uint64_t *segment_id)
+{
+    if(filename.size() <= k_ids_suffix.size() || filename[0] < '0' || filename[0] > '9')
+        return false;
+
+    char *id_end = nullptr;
+    errno = 0;
+    const unsigned long long id = std::strtoull(filename.c_str(), &id_end, 10);
+    if(errno != 0 || id == 0 || k_ids_suffix != id_end)
+        return false;
+
+    *segment_id = static_cast<uint64_t>(id);
+    return true;
+}
+
+/**
+ * Create a directory and its missing parents.
+ */
+void make_directories(const std::string &path)
+{
+    for(size_t slash = path.find('/', 1); slash != std::string::npos;
+        slash = path.find('/', slash + 1))
+        mkdir(path.substr(0, slash).c_str(), 0755);
+    mkdir(path.c_str(), 0755);
+}
+
+}
+
+
+SESegmented::SESegmented(const TorchManager::TorchManagerPtr &torch_manager,
+                         const DatabaseManager::DatabaseManagerPtr &database_manager,
+                         const std::string &index_type,
+                         const FaissMetricType &metric_type,
+                         int memtable_size, int merge_factor,
+                         const std::string &segments_path)
+: SearchEngine(torch_manager, database_manager),
+  mIndexType(index_type),
+  mMetricType(static_cast<faiss::MetricType>(metric_type)),
+  mMemtableSize(std::max(memtable_size, 1)),
+  mMergeFactor(std::max(merge_factor, 2)),
+  mSegmentsPath(segments_path),
+  mNextSegmentId(1),
+  mStopTasks(false)
+{
+    mTaskThread = std::thread(&SESegmented::backgroundLoop, this);
+}
+
+SESegmented::~SESegmented()
+{
+    {
+        std::lock_guard<std::mutex> lock(mTaskMutex);
+        mStopTasks = true;
+    }
+    mTaskCondition.notify_all();
+    mTaskThread.join();
+}
+
+uint64_t SESegmented::nextSegmentId()
+{
+    std::lock_guard<std::mutex> lock(mSegmentIdMutex);
+    return mNextSegmentId++;
+}
+
+SESegmented::SegmentSpacePtr SESegmented::findSpace(const std::string &model_name) const
+{
+    SharedLock lock(mSpacesMutex);
+    std::unordered_map<std::string, SegmentSpacePtr>::const_iterator pair = mSpaces.find(model_name);
+    if(pair == mSpaces.end())
+        return nullptr;
+    return pair->second;
+}
+
+void SESegmented::trackLoadingWrite(const SegmentSpacePtr &space, int item_id)
+{
+    if(space->mLoading)
+        space->mLoadingWrites.insert(item_id);
+}
+
+void SESegmented::setup()
+{
+    TIMED_SCOPE(timerSetup, "SESegmented Setup");
+    std::lock_guard<std::mutex> setup_lock(mSetupMutex);
+    make_directories(mSegmentsPath);
+
+    // Models can be added at runtime, the spaces already open are up to date
+    std::unordered_map<std::string, SegmentSpacePtr> new_spaces;
+    std::unordered_map<uint64_t, SegmentPtr> loaded_segments;
+    for(const std::string &model_name : getModelList())
+    {
+        if(findSpace(model_name) != nullptr)
+            continue;
+
+        SegmentSpacePtr space = std::make_shared<SegmentSpace>();
+        space->mModelName = model_name;
+        space->mDim = mTorchManager->getIndexDim(model_name);
+        space->mPath = mSegmentsPath + "/" + model_name;
+        mkdir(space->mPath.c_str(), 0755);
+
+        tinydir_dir dir;
+        if (tinydir_open(&dir, space->mPath.c_str()) == -1)
+            LOG(FATAL) << "Unable to open the segments directory " << space->mPath << ".";
+
+        std::vector<uint64_t> segment_ids;
+        while (dir.has_next)
+        {
+            tinydir_file file;
+            if (tinydir_readfile(&dir, &file) == -1)
+                LOG(FATAL) << "Error reading file.";
+
+            const std::string filename = std::string(file.name);
+            if (tinydir_next(&dir) == -1)
+                LOG(FATAL) << "Error getting next file.";
+
+            // A segment persist interrupted by a crash leaves its
+            // temporary files behind, the segment is rebuilt anyway
+            if(ends_with(filename, k_tmp_suffix))
+            {
+                LOG(INFO) << "Removing the interrupted segment file " << filename << ".";
+                std::remove(file.path);
+                continue;
+            }
+
+            uint64_t segment_id = 0;
+            if(parse_segment_filename(filename, &segment_id))
+                segment_ids.push_back(segment_id);
+            else if(ends_with(filename, k_ids_suffix))
+                LOG(WARNING) << "Skipping the unknown file " << filename
+                             << " in the segments directory.";
+        }
+        tinydir_close(&dir);
+
+        std::sort(segment_ids.begin(), segment_ids.end());
+        for(const uint64_t segment_id : segment_ids)
+        {
+            SegmentPtr segment = loadSegment(space->mPath, segment_id);
+            if(segment == nullptr || segment->mIndex->d != space->mDim)
+                continue;
+            space->mSegments.push_back(segment);
+            loaded_segments[segment_id] = segment;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mSegmentIdMutex);
+            if(!segment_ids.empty())
+                mNextSegmentId = std::max(mNextSegmentId, segment_ids.back() + 1);
+        }
+        space->mMemtable = std::make_shared<Memtable>(nextSegmentId(), mMemtableSize, space->mDim);
+        new_spaces[model_name] = space;
+    }
+
+    if(new_spaces.empty())
+        return;
+
+    // The new spaces get the writes from now on, so the items written
+    // after the scan snapshot are in the space even if the scan misses them
+    {
+        std::lock_guard<SharedMutex> lock(mSpacesMutex);
+        for(const auto &pair : new_spaces)
+            mSpaces[pair.first] = pair.second;
+    }
+
+    // The persisted entries of each item, by model
+    std::unordered_map<std::string, std::unordered_map<int, std::vector<location_t>>> entries;
+    for(const auto &pair : new_spaces)
+    {
+        std::unordered_map<int, std::vector<location_t>> &model_entries = entries[pair.first];
+        for(const SegmentPtr &segment : pair.second->mSegments)
+            for(int i=0; i<segment->size(); i++)
+                model_entries[segment->mIds[i]].emplace_back(segment->mId, i);
+    }
+
+    // An item is located in a segment if the segment has its current
+    // features, the others go into the memtables.
+    int total_segment_items = 0, total_memtable_items = 0;
+    std::vector<float> reduced;
+    DatabaseManager::DatabaseIterator it(mDatabaseManager->newIterator(false));
+    for (it->SeekToFirst(); it->Valid(); it->Next())
+    {
+        euclidesproto::ItemData item_data;
+        item_data.ParseFromString(it->value().ToString());
+
+        for(const auto &vector : item_data.vectors())
+        {
+            std::unordered_map<std::string, SegmentSpacePtr>::const_iterator pair = \
+                new_spaces.find(vector.model());
+            if(pair == new_spaces.end())
+                continue;
+
+            const SegmentSpacePtr &space = pair->second;
+            const float *features = indexFeatures(vector, space->mDim, &reduced);
+            if(features == nullptr)
+                continue;
+
+            const uint64_t hash = features_hash(features, space->mDim);
+            const std::vector<location_t> &candidates = entries[vector.model()][item_data.item_id()];
+
+            std::lock_guard<std::mutex> lock(space->mMutex);
+
+            // The writes applied to the space are newer than the snapshot
+            if(space->mLoadingWrites.count(item_data.item_id()) > 0)
+                continue;
+
+            bool located = false;
+            for(const location_t &location : candidates)
+            {
+                if(loaded_segments[location.first]->mHashes[location.second] != hash)
+                    continue;
+                space->mLocations[item_data.item_id()] = location;
+                located = true;
+                break;
+            }
+
+            if(located)
+                total_segment_items++;
+            else
+            {
+                appendVector(space, item_data.item_id(), features, hash);
+                total_memtable_items++;
+            }
+        }
+    }
+    it.reset();
+
+    for(const auto &pair : new_spaces)
+    {
+        const SegmentSpacePtr &space = pair.second;
+        std::lock_guard<std::mutex> lock(space->mMutex);
+
+        std::unordered_map<uint64_t, int> live;
+        for(const auto &location : space->mLocations)
+            live[location.second.first]++;
+        for(const SegmentPtr &segment : space->mSegments)
+            if(segment->size() > live[segment->mId])
+                space->mStale[segment->mId] = segment->size() - live[segment->mId];
+
+        space->mLoading = false;
+        std::unordered_set<int>().swap(space->mLoadingWrites);
+        scheduleTask(space, nullptr);
+    }
+
+    LOG(INFO) << "Opened " << loaded_segments.size() << " segments with "
+              << total_segment_items << " items, " << total_memtable_items
+              << " items added into the memtables.";
+}
+
+bool SESegmented::requireRefresh()
+{
+    // The spaces already open are up to date
+    setup();
+    return false;
+}
+
+void SESegmented::scheduleTask(const SegmentSpacePtr &space, const MemtablePtr &memtable)
+{
+    if(memtable == nullptr)
+    {
+        if(space->mMergeScheduled)
+            return;
+        space->mMergeScheduled = true;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mTaskMutex);
+        mTasks.emplace_back(space, memtable);
+    }
+    mTaskCondition.notify_all();
+}
+
+void SESegmented::appendVector(const SegmentSpacePtr &space, int item_id,
+                               const float *features, uint64_t hash)
+{
+    // A full memtable is frozen, it's searched until its segment is sealed
+    if(space->mMemtable->mSize == space->mMemtable->mCapacity)
+    {
+        space->mSealing.push_back(space->mMemtable);
+        scheduleTask(space, space->mMemtable);
+        space->mMemtable = std::make_shared<Memtable>(nextSegmentId(), mMemtableSize, space->mDim);
+    }
+
+    Memtable &memtable = *space->mMemtable;
+    const int position = memtable.mSize;
+    std::copy(features, features + space->mDim,
+              memtable.mFeatures.begin() + static_cast<size_t>(position) * space->mDim);
+    memtable.mIds[position] = item_id;
+    memtable.mHashes[position] = hash;
+    memtable.mSize++;
+
+    dropLocation(space, item_id);
+    space->mLocations[item_id] = location_t(memtable.mId, position);
+}
+
+void SESegmented::dropLocation(const SegmentSpacePtr &space, int item_id)
+{
+    std::unordered_map<int, location_t>::iterator location = space->mLocations.find(item_id);
+    if(location == space->mLocations.end())
+        return;
+
+    const uint64_t segment_id = location->second.first;
+    const int stale = ++space->mStale[segment_id];
+    space->mLocations.erase(location);
+
+    // Segments that are mostly stale are compacted by a merge
+    for(const SegmentPtr &segment : space->mSegments)
+        if(segment->mId == segment_id && 2 * stale > segment->size())
+            scheduleTask(space, nullptr);
+}
+
+bool SESegmented::addItem(const euclidesproto::ItemData &item_data)
+{
+    SharedLock spaces_lock(mSpacesMutex);
+    for(const auto &pair : mSpaces)
+    {
+        const SegmentSpacePtr &space = pair.second;
+        std::vector<float> reduced;
+        const float *features = nullptr;
+        for(const auto &vector : item_data.vectors())
+            if(vector.model() == pair.first)
+                features = indexFeatures(vector, space->mDim, &reduced);
+
+        std::lock_guard<std::mutex> lock(space->mMutex);
+        trackLoadingWrite(space, item_data.item_id());
+        if(features == nullptr)
+        {
+            // The new version of the item doesn't have this model
+            dropLocation(space, item_data.item_id());
+            continue;
+        }
+
+        appendVector(space, item_data.item_id(), features,
+                     features_hash(features, space->mDim));
+    }
+
+    return true;
+}
+
+bool SESegmented::removeItem(int item_id)
+{
+    SharedLock spaces_lock(mSpacesMutex);
+    for(const auto &pair : mSpaces)
+    {
+        std::lock_guard<std::mutex> lock(pair.second->mMutex);
+        trackLoadingWrite(pair.second, item_id);
+        dropLocation(pair.second, item_id);
+    }
+    return true;
+}
+
+bool SESegmented::search(const std::string &model_name,
+                         const torch::Tensor &features_tensor,
+                         int top_k, std::vector<int> *top_ids,
+                         std::vector<float> *distances,
+                         const SearchParameters &params)
+{
+    std::vector<std::vector<int>> batch_ids;
+    std::vector<std::vector<float>> batch_distances;
+    const bool complete = searchBatch(model_name, features_tensor.reshape({1, -1}),
+                                      top_k, &batch_ids, &batch_distances, params);
+
+    if(batch_ids.empty())
+        return complete;
+
+    top_ids->swap(batch_ids[0]);
+    distances->swap(batch_distances[0]);
+    return complete;
+}
+
+bool SESegmented::searchBatch(const std::string &model_name,
+                              const torch::Tensor &features_tensor,
+                              int top_k,
+                              std::vector<std::vector<int>> *top_ids,
+                              std::vector<std::vector<float>> *distances,
+                              const SearchParameters &params)
+{
+    TRACE_SCOPE("SESegmented::searchBatch");
+    SegmentSpacePtr space = findSpace(model_name);
+    if(space == nullptr)
+        return true;
+
+    const torch::Tensor queries = features_tensor.contiguous();
+    const long n = queries.size(0);
+    const int dim = static_cast<int>(queries.size(1));
+    const float *raw_queries = queries.data<float>();
+    if(dim != space->mDim)
+        return true;
+
+    // The rows of the memtables up to their current size don't change,
+    // so they are scanned after releasing the lock.
+    std::vector<std::pair<MemtablePtr, int>> memtables;
+    std::vector<SegmentPtr> segments;
+    std::unordered_map<uint64_t, int> stale;
+    {
+        std::lock_guard<std::mutex> lock(space->mMutex);
+
+        // A space being loaded is searched once it has all the items
+        if(space->mLoading)
+            return true;
+
+        for(const MemtablePtr &memtable : space->mSealing)
+            memtables.emplace_back(memtable, memtable->mSize);
+        memtables.emplace_back(space->mMemtable, space->mMemtable->mSize);
+        segments = space->mSegments;
+        stale = space->mStale;
+    }
+
+    // Candidates (distance, item id) of each query with their locations
+    const bool is_l2 = (mMetricType == faiss::MetricType::METRIC_L2);
+    std::vector<std::vector<std::pair<float, int>>> candidates(n);
+    std::vector<std::vector<location_t>> locations(n);
+
+    std::vector<float> segment_distances;
+    std::vector<long> segment_labels;
+    auto collect = [&](uint64_t segment_id, int k, const std::vector<int> &ids) {
+        for(long i=0; i<n; i++)
+            for(int j=0; j<k; j++)
+            {
+                const long label = segment_labels[i * k + j];
+                if(label < 0)
+                    break;
+                candidates[i].emplace_back(segment_distances[i * k + j], ids[label]);
+                locations[i].emplace_back(segment_id, static_cast<int>(label));
+            }
+    };
+
+    // Stale entries can take the place of valid ones, so each segment is
+    // searched for as many more results.
+    bool complete = true;
+    for(const auto &pair : memtables)
+    {
+        const MemtablePtr &memtable = pair.first;
+        const int size = pair.second;
+        if(size == 0)
+            continue;
+        if(params.expired())
+        {
+            complete = false;
+            break;
+        }
+
+        const int k = std::min(size, top_k + stale[memtable->mId]);
+        segment_distances.assign(n * k, 0.0f);
+        segment_labels.assign(n * k, -1);
+        if(is_l2)
+        {
+            faiss::float_maxheap_array_t heaps = {static_cast<size_t>(n), static_cast<size_t>(k),
+                                                  segment_labels.data(), segment_distances.data()};
+            faiss::knn_L2sqr(raw_queries, memtable->mFeatures.data(), dim, n, size, &heaps);
+        }
+        else
+        {
+            faiss::float_minheap_array_t heaps = {static_cast<size_t>(n), static_cast<size_t>(k),
+                                                  segment_labels.data(), segment_distances.data()};
+            faiss::knn_inner_product(raw_queries, memtable->mFeatures.data(), dim, n, size, &heaps);
+        }
+        collect(memtable->mId, k, memtable->mIds);
+    }
+
+    for(const SegmentPtr &segment : segments)
+    {
+        if(!complete || params.expired())
+        {
+            complete = false;
+            break;
+        }
+
+        const int k = std::min(segment->size(), top_k + stale[segment->mId]);
+        if(k == 0)
+            continue;
+        segment_distances.assign(n * k, 0.0f);
+        segment_labels.assign(n * k, -1);
+        SEFaissFactory::search_index(segment->mIndex, n, raw_queries, k,
+                                     segment_distances.data(), segment_labels.data(),
+                                     params, &mHNSWMutex);
+        collect(segment->mId, k, segment->mIds);
+    }
+
+    // Only the current version of each item is kept
+    {
+        std::lock_guard<std::mutex> lock(space->mMutex);
+        for(long i=0; i<n; i++)
+        {
+            size_t valid = 0;
+            for(size_t c=0; c<candidates[i].size(); c++)
+            {
+                std::unordered_map<int, location_t>::const_iterator location = \
+                    space->mLocations.find(candidates[i][c].second);
+                if(location != space->mLocations.end() && location->second == locations[i][c])
+                    candidates[i][valid++] = candidates[i][c];
+            }
+            candidates[i].resize(valid);
+        }
+    }
+
+    top_ids->assign(n, std::vector<int>());
+    distances->assign(n, std::vector<float>());
+    for(long i=0; i<n; i++)
+    {
+        std::vector<std::pair<float, int>> &query_candidates = candidates[i];
+        const size_t maximum_k = std::min(query_candidates.size(), static_cast<size_t>(top_k));
+
+        // Inner products are similarities, the larger the closer
+        if(is_l2)
+            std::partial_sort(query_candidates.begin(), query_candidates.begin() + maximum_k,
+                              query_candidates.end());
+        else
+            std::partial_sort(query_candidates.begin(), query_candidates.begin() + maximum_k,
+                              query_candidates.end(), std::greater<std::pair<float, int>>());
+
+        for(size_t j=0; j<maximum_k; j++)
+        {
+            (*top_ids)[i].push_back(query_candidates[j].second);
+            (*distances)[i].push_back(query_candidates[j].first);
+        }
+    }
+
+    return complete;
+}
+
+bool SESegmented::rangeSearch(const std::string &model_name,
+                              const torch::Tensor &features_tensor,
+                              float radius, int max_results,
+                              std::vector<int> *top_ids,
+                              std::vector<float> *distances,
+                              const SearchParameters &params)
+{
+    TRACE_SCOPE("SESegmented::rangeSearch");
+    std::vector<int> nearest_ids;
+    std::vector<float> nearest_distances;
+    const bool complete = search(model_name, features_tensor, max_results,
+                                 &nearest_ids, &nearest_distances, params);
+
+    const bool is_l2 = (mMetricType == faiss::MetricType::METRIC_L2);
+    for(size_t i=0; i<nearest_ids.size(); i++)
+    {
+        const bool within = is_l2 ? nearest_distances[i] <= radius :
+                                    nearest_distances[i] >= radius;
+        if(!within)
+            break;
+        top_ids->push_back(nearest_ids[i]);
+        distances->push_back(nearest_distances[i]);
+    }
+
+    return complete;
+}
+
+SESegmented::FaissIndexPtr SESegmented::buildIndex(int dim, int n, const float *features) const
+{
+    FaissIndexPtr index(faiss::index_factory(dim, mIndexType.c_str(), mMetricType));
+    try
+    {
+        if(!index->is_trained)
+            index->train(n, features);
+        index->add(n, features);
+    }
+    catch(const faiss::FaissException &ex)
+    {
+        // e.g. an IVF index needs more vectors than its number of lists
+        LOG(WARNING) << "Cannot build a " << mIndexType << " index with " << n
+                     << " vectors, using a flat index: " << ex.what();
+        index.reset(faiss::index_factory(dim, "Flat", mMetricType));
+        index->add(n, features);
+    }
+    return index;
+}
+
+SESegmented::SegmentPtr SESegmented::persistSegment(const SegmentSpace &space,
+                                                    const Segment &segment) const
+{
+    const std::string prefix = space.mPath + "/" + std::to_string(segment.mId);
+    const std::string index_path = prefix + k_index_suffix;
+    const std::string ids_path = prefix + k_ids_suffix;
+
+    try
+    {
+        faiss::write_index(segment.mIndex.get(), (index_path + k_tmp_suffix).c_str());
+    }
+    catch(const faiss::FaissException &ex)
+    {
+        LOG(ERROR) << "Cannot write the segment " << index_path << ": " << ex.what();
+        return nullptr;
+    }
+
+    {
+        std::ofstream ids_file(ids_path + k_tmp_suffix, std::ios::binary | std::ios::trunc);
+        const uint64_t size = segment.mIds.size();
+        ids_file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+        ids_file.write(reinterpret_cast<const char*>(segment.mIds.data()),
+                       size * sizeof(int));
+        ids_file.write(reinterpret_cast<const char*>(segment.mHashes.data()),
+                       size * sizeof(uint64_t));
+        if(!ids_file.good())
+        {
+            LOG(ERROR) << "Cannot write the segment " << ids_path << ".";
+            return nullptr;
+        }
+    }
+
+    // The ids file is renamed last, it marks the segment as complete
+    if(std::rename((index_path + k_tmp_suffix).c_str(), index_path.c_str()) != 0 ||
+       std::rename((ids_path + k_tmp_suffix).c_str(), ids_path.c_str()) != 0)
+    {
+        LOG(ERROR) << "Cannot rename the segment " << prefix << ".";
+        return nullptr;
+    }
+
+    return loadSegment(space.mPath, segment.mId);
+}
+
+SESegmented::SegmentPtr SESegmented::loadSegment(const std::string &path, uint64_t segment_id) const
+{
+    const std::string prefix = path + "/" + std::to_string(segment_id);
+
+    std::shared_ptr<Segment> segment = std::make_shared<Segment>();
+    segment->mId = segment_id;
+
+    std::ifstream ids_file(prefix + k_ids_suffix, std::ios::binary);
+    uint64_t size = 0;
+    ids_file.read(reinterpret_cast<char*>(&size), sizeof(size));
+    segment->mIds.resize(size);
+    segment->mHashes.resize(size);
+    ids_file.read(reinterpret_cast<char*>(segment->mIds.data()), size * sizeof(int));
+    ids_file.read(reinterpret_cast<char*>(segment->mHashes.data()), size * sizeof(uint64_t));
+    if(!ids_file.good())
+    {
+        LOG(WARNING) << "Cannot read the segment " << prefix << k_ids_suffix << ".";
+        return nullptr;
+    }
+
+    // The inverted lists of IVF indexes are mapped instead of read
+    try
+    {
+        segment->mIndex.reset(faiss::read_index((prefix + k_index_suffix).c_str(),
+                                                faiss::IO_FLAG_MMAP));
+    }
+    catch(const faiss::FaissException &ex)
+    {
+        LOG(WARNING) << "Cannot read the segment " << prefix << k_index_suffix
+                     << ": " << ex.what();
+        return nullptr;
+    }
+
+    if(segment->mIndex->ntotal != static_cast<long>(size))
+    {
+        LOG(WARNING) << "The segment " << prefix << " is corrupted.";
+        return nullptr;
+    }
+
+    return segment;
+}
+
+void SESegmented::deleteSegment(const SegmentSpace &space, uint64_t segment_id) const
+{
+    const std::string prefix = space.mPath + "/" + std::to_string(segment_id);
+    std::remove((prefix + k_ids_suffix).c_str());
+    std::remove((prefix + k_index_suffix).c_str());
+}
+
+void SESegmented::backgroundLoop()
+{
+    while(true)
+    {
+        std::pair<SegmentSpacePtr, MemtablePtr> task;
+        {
+            std::unique_lock<std::mutex> lock(mTaskMutex);
+            mTaskCondition.wait(lock, [this]{ return mStopTasks || !mTasks.empty(); });
+
+            // Unsealed memtables are rebuilt from the database by the setup
+            if(mStopTasks)
+                return;
+
+            task = mTasks.front();
+            mTasks.pop_front();
+        }
+
+        if(task.second != nullptr)
+            sealMemtable(task.first, task.second);
+        mergeSegments(task.first);
+    }
+}
+
+void SESegmented::sealMemtable(const SegmentSpacePtr &space, const MemtablePtr &memtable)
+{
+    TIMED_SCOPE(timerSeal, "SESegmented Seal");
+
+    // The memtable is frozen, its positions are kept by the segment so
+    // the locations of its items stay valid.
+    const int size = memtable->mSize;
+    std::shared_ptr<Segment> built = std::make_shared<Segment>();
+    built->mId = memtable->mId;
+    built->mIndex = buildIndex(space->mDim, size, memtable->mFeatures.data());
+    built->mIds.assign(memtable->mIds.begin(), memtable->mIds.begin() + size);
+    built->mHashes.assign(memtable->mHashes.begin(), memtable->mHashes.begin() + size);
+
+    SegmentPtr segment = persistSegment(*space, *built);
+    if(segment == nullptr)
+        segment = built;
+
+    std::lock_guard<std::mutex> lock(space->mMutex);
+    space->mSealing.erase(std::remove(space->mSealing.begin(), space->mSealing.end(), memtable),
+                          space->mSealing.end());
+    space->mSegments.push_back(segment);
+
+    LOG(INFO) << "Sealed the segment " << segment->mId << " of " << space->mModelName
+              << " with " << size << " items.";
+}
+
+std::vector<SESegmented::SegmentPtr> SESegmented::selectMerge(const SegmentSpace &space) const
+{
+    std::map<int, std::vector<SegmentPtr>> tiers;
+    for(const SegmentPtr &segment : space.mSegments)
+    {
+        std::unordered_map<uint64_t, int>::const_iterator stale_pair = space.mStale.find(segment->mId);
+        const int stale = (stale_pair == space.mStale.end()) ? 0 : stale_pair->second;
+        if(2 * stale > segment->size())
+            return std::vector<SegmentPtr>(1, segment);
+
+        // Tier 0 holds the segments up to the memtable size, each tier
+        // above holds segments merge_factor times larger.
+        const double ratio = static_cast<double>(segment->size() - stale) / mMemtableSize;
+        const int tier = (ratio <= 1.0) ? 0 :
+                         static_cast<int>(std::log(ratio) / std::log(static_cast<double>(mMergeFactor)));
+        tiers[tier].push_back(segment);
+    }
+
+    for(const auto &tier : tiers)
+        if(static_cast<int>(tier.second.size()) >= mMergeFactor)
+            return std::vector<SegmentPtr>(tier.second.begin(), tier.second.begin() + mMergeFactor);
+
+    return std::vector<SegmentPtr>();
+}
+
+void SESegmented::mergeSegments(const SegmentSpacePtr &space)
+{
+    while(true)
+    {
+        // The live entries of the merged segments
+        std::vector<SegmentPtr> merged;
+        std::vector<int> entry_ids;
+        std::vector<location_t> entry_locations;
+        {
+            std::lock_guard<std::mutex> lock(space->mMutex);
+            space->mMergeScheduled = false;
+
+            // The locations are incomplete until the space is loaded, the
+            // setup schedules a merge check when it's done
+            if(space->mLoading)
+                return;
+
+            merged = selectMerge(*space);
+            if(merged.empty())
+                return;
+
+            for(const SegmentPtr &segment : merged)
+                for(int i=0; i<segment->size(); i++)
+                {
+                    std::unordered_map<int, location_t>::const_iterator location = \
+                        space->mLocations.find(segment->mIds[i]);
+                    if(location == space->mLocations.end() ||
+                       location->second != location_t(segment->mId, i))
+                        continue;
+                    entry_ids.push_back(segment->mIds[i]);
+                    entry_locations.push_back(location->second);
+                }
+        }
+
+        TIMED_SCOPE(timerMerge, "SESegmented Merge");
+
+        // The features are read from the database, which has the current
+        // version of the items that weren't changed since they were indexed
+        std::shared_ptr<Segment> built = std::make_shared<Segment>();
+        built->mId = nextSegmentId();
+        const FeatureTransform::FeatureTransformPtr transform = \
+            mTorchManager->getTransform(space->mModelName);
+        std::vector<float> features, reduced;
+        std::vector<location_t> sources;
+        for(size_t start=0; start<entry_ids.size(); start+=k_merge_fetch_block)
+        {
+            const size_t end = std::min(entry_ids.size(), start + k_merge_fetch_block);
+            const std::vector<int> block_ids(entry_ids.begin() + start, entry_ids.begin() + end);
+
+            std::vector<euclidesproto::ItemData> items;
+            std::vector<bool> found;
+            mDatabaseManager->getItemsDataByKeys(block_ids, &items, &found);
+            for(size_t i=0; i<block_ids.size(); i++)
+            {
+                if(!found[i])
+                    continue;
+
+                for(const auto &vector : items[i].vectors())
+                {
+                    if(vector.model() != space->mModelName)
+                        continue;
+
+                    const float *item_features = indexFeatures(transform, vector,
+                                                               space->mDim, &reduced);
+                    if(item_features == nullptr)
+                        continue;
+
+                    features.insert(features.end(), item_features, item_features + space->mDim);
+                    built->mIds.push_back(block_ids[i]);
+                    built->mHashes.push_back(features_hash(item_features, space->mDim));
+                    sources.push_back(entry_locations[start + i]);
+                    break;
+                }
+            }
+        }
+
+        SegmentPtr segment;
+        if(!built->mIds.empty())
+        {
+            built->mIndex = buildIndex(space->mDim, built->size(), features.data());
+            segment = persistSegment(*space, *built);
+            if(segment == nullptr)
+                segment = built;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(space->mMutex);
+
+            // Items changed during the merge are stale in the new segment
+            int stale = 0;
+            for(size_t i=0; i<sources.size(); i++)
+            {
+                std::unordered_map<int, location_t>::iterator location = \
+                    space->mLocations.find(built->mIds[i]);
+                if(location != space->mLocations.end() && location->second == sources[i])
+                    location->second = location_t(built->mId, static_cast<int>(i));
+                else
+                    stale++;
+            }
+
+            // Items gone from the database aren't searchable anymore
+            for(size_t i=0; i<entry_ids.size(); i++)
+            {
+                std::unordered_map<int, location_t>::iterator location = \
+                    space->mLocations.find(entry_ids[i]);
+                if(location != space->mLocations.end() && location->second == entry_locations[i])
+                    space->mLocations.erase(location);
+            }
+
+            for(const SegmentPtr &old_segment : merged)
+            {
+                space->mSegments.erase(std::remove(space->mSegments.begin(), space->mSegments.end(),
+                                                   old_segment),
+                                       space->mSegments.end());
+                space->mStale.erase(old_segment->mId);
+            }
+
+            if(segment != nullptr)
+            {
+                space->mSegments.push_back(segment);
+                if(stale > 0)
+                    space->mStale[segment->mId] = stale;
+            }
+        }
+
+        for(const SegmentPtr &old_segment : merged)
+            deleteSegment(*space, old_segment->mId);
+
+        LOG(INFO) << "Merged " << merged.size() << " segments of " << space->mModelName
+                  << " into the segment " << built->mId << " with " << built->size() << " items.";
+    }
+}
@@ -0,0 +1,249 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <faiss/Index.h>
+
+#include "searchengine.hpp"
+#include "se_faissfactory.hpp"
+#include "sharedmutex.hpp"
+
+
+/**
+ * The segmented search engine, which keeps its indexes up to date without
+ * rebuilding them. New vectors go into a small in-memory segment (the
+ * memtable) that is searched exactly. When it fills up it is sealed into
+ * an immutable segment with its own Faiss index, which is persisted and
+ * mapped back from disk. A background thread merges small segments into
+ * larger ones, and the removed or replaced items are dropped at query
+ * time and purged by the merges. Queries fan out across the segments of
+ * a model and the top-k of each segment are merged.
+ */
+class SESegmented : public SearchEngine
+{
+public:
+    typedef std::shared_ptr<SESegmented> SESegmentedPtr;
+    typedef std::shared_ptr<faiss::Index> FaissIndexPtr;
+
+public:
+    /**
+     * Construct the segmented search engine.
+     * @param torch_manager an instance of the torch manager
+     * @param database_manager an instance of the database manager
+     * @param index_type the Faiss index factory string of the sealed segments
+     * @param metric_type the metric of the indexes
+     * @param memtable_size number of vectors of the memtable
+     * @param merge_factor number of segments of similar size merged together
+     * @param segments_path the directory of the sealed segments
+     */
+    SESegmented(const TorchManager::TorchManagerPtr &torch_manager,
+                const DatabaseManager::DatabaseManagerPtr &database_manager,
+                const std::string &index_type,
+                const FaissMetricType &metric_type,
+                int memtable_size, int merge_factor,
+                const std::string &segments_path);
+    ~SESegmented();
+
+    /**
+     * Open the persisted segments and put the items that aren't in any
+     * segment into the memtables, which is a scan of the database but
+     * not an index rebuild.
+     */
+    void setup() override;
+
+    /**
+     * The segments are updated as items are added or removed, only the
+     * spaces of the models loaded since the setup (e.g. by ReloadModels)
+     * are opened here.
+     * @return false
+     */
+    bool requireRefresh() override;
+
+    bool addItem(const euclidesproto::ItemData &item_data) override;
+    bool removeItem(int item_id) override;
+
+    bool search(const std::string &model_name,
+                const torch::Tensor &features_tensor,
+                int top_k, std::vector<int> *top_ids,
+                std::vector<float> *distances,
+                const SearchParameters &params) override;
+
+    bool searchBatch(const std::string &model_name,
+                     const torch::Tensor &features_tensor,
+                     int top_k,
+                     std::vector<std::vector<int>> *top_ids,
+                     std::vector<std::vector<float>> *distances,
+                     const SearchParameters &params) override;
+
+    /**
+     * Search the items within a radius, as a k-NN search with
+     * k = max_results filtered by the radius.
+     */
+    bool rangeSearch(const std::string &model_name,
+                     const torch::Tensor &features_tensor,
+                     float radius, int max_results,
+                     std::vector<int> *top_ids,
+                     std::vector<float> *distances,
+                     const SearchParameters &params) override;
+
+private:
+    // The (segment id, position) of the current version of an item
+    typedef std::pair<uint64_t, int> location_t;
+
+    /**
+     * The mutable segment, its rows are preallocated so they can be
+     * scanned without a lock while new rows are appended.
+     */
+    struct Memtable
+    {
+        Memtable(uint64_t id, int capacity, int dim)
+        : mId(id), mCapacity(capacity), mSize(0),
+          mFeatures(static_cast<size_t>(capacity) * dim),
+          mIds(capacity), mHashes(capacity)
+        { }
+
+        uint64_t mId;
+        int mCapacity;
+        int mSize;
+        std::vector<float> mFeatures;
+        std::vector<int> mIds;
+        std::vector<uint64_t> mHashes;
+    };
+    typedef std::shared_ptr<Memtable> MemtablePtr;
+
+    /**
+     * An immutable segment, with the item id and features hash of each
+     * position of its index.
+     */
+    struct Segment
+    {
+        uint64_t mId;
+        FaissIndexPtr mIndex;
+        std::vector<int> mIds;
+        std::vector<uint64_t> mHashes;
+
+        int size() const { return static_cast<int>(mIds.size()); }
+    };
+    typedef std::shared_ptr<const Segment> SegmentPtr;
+
+    /**
+     * The segments of a model space. A result of a segment is valid only
+     * if the item is still located at its position, the other entries of
+     * a segment are counted as stale.
+     */
+    struct SegmentSpace
+    {
+        SegmentSpace()
+        : mDim(0), mMergeScheduled(false), mLoading(true)
+        { }
+
+        std::string mModelName;
+        int mDim;
+        std::string mPath;
+
+        std::mutex mMutex;
+        MemtablePtr mMemtable;
+        std::vector<MemtablePtr> mSealing;
+        std::vector<SegmentPtr> mSegments;
+        std::unordered_map<int, location_t> mLocations;
+        std::unordered_map<uint64_t, int> mStale;
+        bool mMergeScheduled;
+
+        // A new space receives the writes while the database is scanned
+        // to fill it, the items written meanwhile are skipped by the scan.
+        // It isn't searched until the scan is done.
+        bool mLoading;
+        std::unordered_set<int> mLoadingWrites;
+    };
+    typedef std::shared_ptr<SegmentSpace> SegmentSpacePtr;
+
+    SegmentSpacePtr findSpace(const std::string &model_name) const;
+
+    /**
+     * Record a write of an item in a space being loaded. Must be called
+     * with the space locked.
+     */
+    static void trackLoadingWrite(const SegmentSpacePtr &space, int item_id);
+
+    /**
+     * Append a vector to the memtable of a space, sealing the memtable
+     * when it's full. Must be called with the space locked.
+     */
+    void appendVector(const SegmentSpacePtr &space, int item_id,
+                      const float *features, uint64_t hash);
+
+    /**
+     * Mark the current location of an item as stale. Must be called with
+     * the space locked.
+     */
+    void dropLocation(const SegmentSpacePtr &space, int item_id);
+
+    /**
+     * Queue a background task, a seal of a frozen memtable or, without
+     * a memtable, a check for segments to merge.
+     */
+    void scheduleTask(const SegmentSpacePtr &space, const MemtablePtr &memtable);
+
+    /**
+     * Build the index of a set of vectors, falling back to a flat index
+     * if the index type can't be trained with them.
+     */
+    FaissIndexPtr buildIndex(int dim, int n, const float *features) const;
+
+    /**
+     * Write a segment to disk and map its index back.
+     * @return the segment read back, or nullptr if it couldn't be written
+     */
+    SegmentPtr persistSegment(const SegmentSpace &space, const Segment &segment) const;
+    SegmentPtr loadSegment(const std::string &path, uint64_t segment_id) const;
+    void deleteSegment(const SegmentSpace &space, uint64_t segment_id) const;
+
+    /**
+     * Background tasks: seal the frozen memtables and merge the segments.
+     */
+    void backgroundLoop();
+    void sealMemtable(const SegmentSpacePtr &space, const MemtablePtr &memtable);
+    void mergeSegments(const SegmentSpacePtr &space);
+
+    /**
+     * Choose the segments of the next merge: a segment with more stale
+     * than live entries alone, or merge_factor segments of the same size
+     * tier. Must be called with the space locked.
+     */
+    std::vector<SegmentPtr> selectMerge(const SegmentSpace &space) const;
+
+    uint64_t nextSegmentId();
+
+    std::string mIndexType;
+    faiss::MetricType mMetricType;
+    int mMemtableSize;
+    int mMergeFactor;
+    std::string mSegmentsPath;
+
+    // The efSearch overrides of the HNSW segments, see SEFaissFactory
+    SharedMutex mHNSWMutex;
+
+    std::mutex mSegmentIdMutex;
+    uint64_t mNextSegmentId;
+
+    // The spaces are only added by the setup, under the exclusive lock
+    std::mutex mSetupMutex;
+    mutable SharedMutex mSpacesMutex;
+    std::unordered_map<std::string, SegmentSpacePtr> mSpaces;
+
+    std::mutex mTaskMutex;
+    std::condition_variable mTaskCondition;
+    std::deque<std::pair<SegmentSpacePtr, MemtablePtr>> mTasks;
+    bool mStopTasks;
+    std::thread mTaskThread;
+};
@@ -2,11 +2,60 @@
 #include "euclidesproto.grpc.pb.h"
 
 #include "se_annoy.hpp"
+#include "se_binary.hpp"
 #include "se_faissfactory.hpp"
 #include "se_linear.hpp"
+#include "se_composite.hpp"
+#include "se_partitioned.hpp"
+#include "se_segmented.hpp"
+#include "tracing.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <numeric>
 #include <easylogging++.h>
 
+namespace {
+
+/**
+ * Get the last component of a path, ignoring the trailing slashes.
+ */
+std::string path_basename(std::string path)
+{
+    while(path.size() > 1 && path.back() == '/')
+        path.pop_back();
+    const size_t slash = path.find_last_of('/');
+    return (slash == std::string::npos) ? path : path.substr(slash + 1);
+}
+
+}
+
+std::vector<int> top_classes(const float *scores, int size, int top_n)
+{
+    top_n = std::max(std::min(top_n, size), 0);
+    std::vector<int> classes(size);
+    std::iota(classes.begin(), classes.end(), 0);
+
+    std::partial_sort(classes.begin(), classes.begin() + top_n, classes.end(),
+                      [scores](int a, int b) {
+                          return scores[a] > scores[b];
+                      });
+    classes.resize(top_n);
+    return classes;
+}
+
+std::vector<int> item_top_classes(const euclidesproto::ItemVectors &vectors, int top_n)
+{
+    if(vectors.predictions_size() > 0)
+        return top_classes(vectors.predictions().data(), vectors.predictions_size(), top_n);
+
+    // Sparse predictions are stored sorted by score
+    const int stored = std::min(std::max(top_n, 0), vectors.prediction_classes_size());
+    return std::vector<int>(vectors.prediction_classes().begin(),
+                            vectors.prediction_classes().begin() + stored);
+}
+
 SearchEngine::SearchEngine(const TorchManager::TorchManagerPtr &torch_manager,
                            const DatabaseManager::DatabaseManagerPtr &database_manager)
 : mTorchManager(torch_manager), mDatabaseManager(database_manager)
@@ -15,6 +64,133 @@ SearchEngine::SearchEngine(const TorchManager::TorchManagerPtr &torch_manager,
 SearchEngine::~SearchEngine()
 { }
 
+const float *SearchEngine::indexFeatures(const euclidesproto::ItemVectors &vector, int dim,
+                                         std::vector<float> *buffer) const
+{
+    return indexFeatures(mTorchManager->getTransform(vector.model()), vector, dim, buffer);
+}
+
+const float *SearchEngine::indexFeatures(const FeatureTransform::FeatureTransformPtr &transform,
+                                         const euclidesproto::ItemVectors &vector, int dim,
+                                         std::vector<float> *buffer)
+{
+    if(transform == nullptr)
+        return (vector.features_size() == dim) ? vector.features().data() : nullptr;
+
+    const float *features = transform->reduce(vector.features().data(),
+                                              vector.features_size(), buffer);
+    return (transform->getOutputDim() == dim) ? features : nullptr;
+}
+
+void SearchEngine::rerankExact(const std::string &model_name, const float *query, int dim,
+                               const std::vector<int> &candidates, int top_k,
+                               RerankMetric metric, std::vector<int> *top_ids,
+                               std::vector<float> *distances)
+{
+    TRACE_SCOPE("SearchEngine::rerankExact");
+    std::vector<euclidesproto::ItemData> items;
+    std::vector<bool> found;
+    mDatabaseManager->getItemsDataByKeys(candidates, &items, &found);
+
+    double query_norm = 0.0;
+    for(int i=0; i<dim; i++)
+        query_norm += query[i] * query[i];
+    query_norm = std::sqrt(query_norm);
+
+    // The query is in the index space, stored features may be reduced
+    FeatureTransform::FeatureTransformPtr transform = mTorchManager->getTransform(model_name);
+    std::vector<float> buffer;
+
+    std::vector<std::pair<float, int>> reranked;
+    reranked.reserve(candidates.size());
+    for(size_t c=0; c<candidates.size(); c++)
+    {
+        if(!found[c])
+            continue;
+
+        for(const auto &vector : items[c].vectors())
+        {
+            if(vector.model() != model_name)
+                continue;
+
+            const float *features = indexFeatures(transform, vector, dim, &buffer);
+            if(features == nullptr)
+                continue;
+
+            double dot = 0.0, l2 = 0.0, norm = 0.0;
+            for(int i=0; i<dim; i++)
+            {
+                const double diff = query[i] - features[i];
+                dot += query[i] * features[i];
+                l2 += diff * diff;
+                norm += features[i] * features[i];
+            }
+
+            double distance = l2;
+            if(metric == RerankMetric::INNER_PRODUCT)
+                distance = dot;
+            else if(metric == RerankMetric::ANGULAR)
+            {
+                const double norms = query_norm * std::sqrt(norm);
+                const double cosine = (norms > 0.0) ? dot / norms : 0.0;
+                distance = std::sqrt(std::max(2.0 - 2.0 * cosine, 0.0));
+            }
+
+            reranked.emplace_back(static_cast<float>(distance), candidates[c]);
+            break;
+        }
+    }
+
+    // Inner products are similarities, the larger the closer
+    const size_t maximum_k = std::min(reranked.size(), static_cast<size_t>(top_k));
+    if(metric == RerankMetric::INNER_PRODUCT)
+        std::partial_sort(reranked.begin(), reranked.begin() + maximum_k, reranked.end(),
+                          std::greater<std::pair<float, int>>());
+    else
+        std::partial_sort(reranked.begin(), reranked.begin() + maximum_k, reranked.end());
+
+    top_ids->clear();
+    distances->clear();
+    for(size_t i=0; i<maximum_k; i++)
+    {
+        top_ids->push_back(reranked[i].second);
+        distances->push_back(reranked[i].first);
+    }
+}
+
+bool SearchEngine::addItem(const euclidesproto::ItemData &item_data)
+{
+    return false;
+}
+
+bool SearchEngine::removeItem(int item_id)
+{
+    return false;
+}
+
+void SearchEngine::setModels(const std::vector<std::string> &models)
+{
+    mModels = std::unordered_set<std::string>(models.begin(), models.end());
+}
+
+std::vector<std::string> SearchEngine::getModelList() const
+{
+    std::vector<std::string> model_list = mTorchManager->getModuleList();
+    if(mModels.empty())
+        return model_list;
+
+    std::vector<std::string> served;
+    for(const std::string &model_name : model_list)
+        if(servesModel(model_name))
+            served.push_back(model_name);
+    return served;
+}
+
+bool SearchEngine::servesModel(const std::string &model_name) const
+{
+    return mModels.empty() || mModels.count(model_name) > 0;
+}
+
 SearchEngine::SearchEnginePtr SearchEngine::build_search_engine(const INIReader &conf_reader,
                                                   const TorchManager::TorchManagerPtr &torch_manager,
                                                   const DatabaseManager::DatabaseManagerPtr &database_manager)
@@ -23,35 +199,140 @@ SearchEngine::SearchEnginePtr SearchEngine::build_search_engine(const INIReader
     if (se_engine.empty())
         LOG(FATAL) << "You need to specify a search_engine in the configuration.";
 
+    // Per-model sections or the automatic selection need one engine per model
+    SearchEngine::SearchEnginePtr searchengine;
+    if(se_engine == "auto" || SEComposite::has_model_sections(conf_reader))
+        searchengine = std::make_shared<SEComposite>(torch_manager, database_manager, conf_reader);
+    else
+        searchengine = create_search_engine(conf_reader, se_engine, "",
+                                            torch_manager, database_manager);
+
+    searchengine->setup();
+    return searchengine;
+}
+
+SearchEngine::SearchEnginePtr SearchEngine::create_search_engine(const INIReader &conf_reader,
+                                                  const std::string &se_engine,
+                                                  const std::string &model_section,
+                                                  const TorchManager::TorchManagerPtr &torch_manager,
+                                                  const DatabaseManager::DatabaseManagerPtr &database_manager,
+                                                  const std::string &index_type)
+{
+    // Parameters in the model section override the ones of the engine
+    auto get_string = [&](const std::string &name, const std::string &default_value) {
+        const std::string value = conf_reader.Get(se_engine, name, default_value);
+        return model_section.empty() ? value : conf_reader.Get(model_section, name, value);
+    };
+    auto get_integer = [&](const std::string &name, long default_value) {
+        const long value = conf_reader.GetInteger(se_engine, name, default_value);
+        return static_cast<int>(model_section.empty() ? value :
+                                conf_reader.GetInteger(model_section, name, value));
+    };
+    auto get_boolean = [&](const std::string &name, bool default_value) {
+        const bool value = conf_reader.GetBoolean(se_engine, name, default_value);
+        return model_section.empty() ? value :
+               conf_reader.GetBoolean(model_section, name, value);
+    };
+
     SearchEngine::SearchEnginePtr searchengine;
     if (se_engine == "annoy")
     {
-        const int tree_factor = static_cast<int>(conf_reader.GetInteger("annoy", "tree_factor", 2));
-        searchengine = std::make_shared<SEAnnoy>(torch_manager, database_manager, tree_factor);
+        const int tree_factor = get_integer("tree_factor", 2);
+        const int rerank_factor = get_integer("rerank_factor", 0);
+        searchengine = std::make_shared<SEAnnoy>(torch_manager, database_manager,
+                                                 tree_factor, rerank_factor);
     } else if (se_engine == "faiss")
     {
-        const std::string faiss_index_type = conf_reader.Get("faiss", "index_type", "Flat");
-        const std::string faiss_metric = conf_reader.Get("faiss", "metric", "l2");
+        const std::string faiss_index_type = index_type.empty() ?
+                                             get_string("index_type", "Flat") :
+                                             index_type;
+        const std::string faiss_metric = get_string("metric", "l2");
         FaissMetricType metric_type = (faiss_metric == "l2") ?
                                        FaissMetricType::METRIC_L2 :
                                        FaissMetricType::METRIC_INNER_PRODUCT;
+        const int rerank_factor = get_integer("rerank_factor", 0);
         searchengine = \
             std::make_shared<SEFaissFactory>(torch_manager, database_manager,
-                                             faiss_index_type, metric_type);
+                                             faiss_index_type, metric_type,
+                                             rerank_factor);
     } else if (se_engine == "exact_disk")
     {
-        const bool normalize = conf_reader.GetBoolean("exact_disk", "normalize", false);
-        const int pnorm = static_cast<int>(conf_reader.GetInteger("exact_disk", "pnorm", 2));
+        const bool normalize = get_boolean("normalize", false);
+        const int pnorm = get_integer("pnorm", 2);
 
         searchengine = \
             std::make_shared<SELinear>(torch_manager, database_manager,
                                        normalize, pnorm);
     }
+    else if (se_engine == "binary")
+    {
+        const int bits = get_integer("bits", 128);
+        const std::string method = get_string("method", "sign");
+        if(method != "sign" && method != "itq")
+            LOG(FATAL) << "Unknown binary search engine method: " << method;
+
+        const std::string rerank_metric = get_string("rerank_metric", "l2");
+        RerankMetric metric = RerankMetric::L2_SQUARED;
+        if(rerank_metric == "inner_product")
+            metric = RerankMetric::INNER_PRODUCT;
+        else if(rerank_metric == "angular")
+            metric = RerankMetric::ANGULAR;
+        else if(rerank_metric != "l2")
+            LOG(FATAL) << "Unknown rerank metric: " << rerank_metric;
+
+        const int rerank_factor = get_integer("rerank_factor", 0);
+        searchengine = \
+            std::make_shared<SEBinary>(torch_manager, database_manager, bits,
+                                       (method == "itq") ? BinarizationMethod::ITQ :
+                                                           BinarizationMethod::SIGN_RANDOM_PROJECTION,
+                                       rerank_factor, metric);
+    }
+    else if (se_engine == "segmented")
+    {
+        const std::string segmented_index_type = index_type.empty() ?
+                                                 get_string("index_type", "Flat") :
+                                                 index_type;
+        const std::string segmented_metric = get_string("metric", "l2");
+        FaissMetricType metric_type = (segmented_metric == "l2") ?
+                                       FaissMetricType::METRIC_L2 :
+                                       FaissMetricType::METRIC_INNER_PRODUCT;
+        const int memtable_size = get_integer("memtable_size", 10000);
+        const int merge_factor = get_integer("merge_factor", 4);
+
+        // Each database (e.g. of a collection) has its own segments, an
+        // explicit path is shared so it gets a directory per database
+        std::string segments_path = get_string("segments_path", "");
+        segments_path = segments_path.empty() ?
+                        database_manager->getPath() + ".segments" :
+                        segments_path + "/" + path_basename(database_manager->getPath());
+
+        searchengine = \
+            std::make_shared<SESegmented>(torch_manager, database_manager,
+                                          segmented_index_type, metric_type,
+                                          memtable_size, merge_factor,
+                                          segments_path);
+    }
+    else if (se_engine == "partitioned")
+    {
+        const std::string partitioned_index_type = index_type.empty() ?
+                                                   get_string("index_type", "Flat") :
+                                                   index_type;
+        const std::string partitioned_metric = get_string("metric", "l2");
+        FaissMetricType metric_type = (partitioned_metric == "l2") ?
+                                       FaissMetricType::METRIC_L2 :
+                                       FaissMetricType::METRIC_INNER_PRODUCT;
+        const int assign_classes = get_integer("assign_classes", 1);
+        const int probe_classes = get_integer("probe_classes", 2);
+
+        searchengine = \
+            std::make_shared<SEPartitioned>(torch_manager, database_manager,
+                                            partitioned_index_type, metric_type,
+                                            assign_classes, probe_classes);
+    }
     else
     {
         LOG(FATAL) << "Unknown search engine: " << se_engine;
     }
 
-    searchengine->setup();
     return searchengine;
-}
\ No newline at end of file
+}
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <chrono>
+#include <functional>
 #include <unordered_map>
+#include <unordered_set>
 #include <string>
+#include <vector>
 
 #include <INIReader.h>
 
@@ -10,6 +14,85 @@
 #include "databasemanager.hpp"
 
 
+/**
+ * Optional per-request search parameters. Every parameter defaults to -1,
+ * which means that the search engine will use its configured default.
+ * Parameters that don't apply to the selected search engine are ignored.
+ */
+struct SearchParameters
+{
+    typedef std::chrono::steady_clock::time_point deadline_t;
+
+    SearchParameters()
+    : mNprobe(-1), mEfSearch(-1), mSearchK(-1),
+      mDeadline(deadline_t::max())
+    { }
+
+    /**
+     * Check if the search should stop, engines call this periodically
+     * and return the results found so far when it expires.
+     * @return true if the deadline passed or the request was cancelled
+     */
+    bool expired() const
+    {
+        if(mIsCancelled && mIsCancelled())
+            return true;
+        return mDeadline != deadline_t::max() &&
+               std::chrono::steady_clock::now() >= mDeadline;
+    }
+
+    // Faiss IVF indexes: number of inverted lists visited
+    int mNprobe;
+
+    // Faiss HNSW indexes: size of the dynamic candidate list
+    int mEfSearch;
+
+    // Annoy: number of tree nodes inspected during the search
+    int mSearchK;
+
+    // Time after which the search stops early, max() for no deadline
+    deadline_t mDeadline;
+
+    // Optional check for the cancellation of the request
+    std::function<bool()> mIsCancelled;
+
+    // The top predicted classes of each query sorted by score, used by
+    // engines that partition the items by class, empty if unknown
+    std::vector<std::vector<int>> mQueryClasses;
+};
+
+
+/**
+ * The distance used to rerank candidates with their exact features, it
+ * must match the distance reported by the engine.
+ */
+enum class RerankMetric
+{
+    L2_SQUARED,
+    INNER_PRODUCT,
+    ANGULAR
+};
+
+
+/**
+ * Rank the classes of a model by their predicted score.
+ * @param scores the dense predictions
+ * @param size number of classes
+ * @param top_n number of classes returned
+ * @return the top_n classes sorted by score
+ */
+std::vector<int> top_classes(const float *scores, int size, int top_n);
+
+/**
+ * Get the top predicted classes of a stored item, from its dense
+ * predictions or from its sparse top-N ones.
+ * @param vectors the item vectors of a model
+ * @param top_n maximum number of classes returned
+ * @return the classes sorted by score, empty if no predictions are stored
+ */
+std::vector<int> item_top_classes(const euclidesproto::ItemVectors &vectors, int top_n);
+
+
 class SearchEngine
 {
 public:
@@ -22,18 +105,168 @@ public:
     virtual void setup() = 0;
     virtual bool requireRefresh() = 0;
 
-    virtual void search(const std::string &model_name,
+    /**
+     * Update the indexes with an item added (or replaced) in the
+     * database, engines that can't update their indexes ignore it.
+     * @param item_data the item stored
+     * @return true if the item is already searchable, false if the
+     *         indexes must be refreshed to find it
+     */
+    virtual bool addItem(const euclidesproto::ItemData &item_data);
+
+    /**
+     * Update the indexes with an item removed from the database.
+     * @param item_id the id of the removed item
+     * @return true if the item isn't searchable anymore, false if the
+     *         indexes must be refreshed
+     */
+    virtual bool removeItem(int item_id);
+
+    /**
+     * Search the top-k items for a query.
+     *
+     * @param model_name the name of the model space to search
+     * @param features_tensor current feature vector to search
+     * @param top_k number of top k items to search for
+     * @param top_ids return top k item ids
+     * @param distances returns the distance for each item
+     * @param params per-request search parameters
+     * @return false if the search stopped early and the results are partial
+     */
+    virtual bool search(const std::string &model_name,
                         const torch::Tensor &features_tensor,
                         int top_k, std::vector<int> *top_ids,
-                        std::vector<float> *distances) = 0;
+                        std::vector<float> *distances,
+                        const SearchParameters &params) = 0;
+
+    /**
+     * Search the top-k items for a batch of queries at once, engines use
+     * this to amortize the search cost among the queries (e.g. with BLAS).
+     *
+     * @param model_name the name of the model space to search
+     * @param features_tensor the [N, d] matrix with one query per row
+     * @param top_k number of top k items to search for
+     * @param top_ids return N lists of top k item ids
+     * @param distances returns N lists with the distance for each item
+     * @param params per-request search parameters
+     * @return false if the search stopped early and the results are partial
+     */
+    virtual bool searchBatch(const std::string &model_name,
+                             const torch::Tensor &features_tensor,
+                             int top_k,
+                             std::vector<std::vector<int>> *top_ids,
+                             std::vector<std::vector<float>> *distances,
+                             const SearchParameters &params) = 0;
+
+    /**
+     * Search for all the items within a radius of the query. The radius
+     * uses the same unit of the distances returned by search(), for inner
+     * product spaces it is the minimum similarity instead.
+     *
+     * @param model_name the name of the model space to search
+     * @param features_tensor current feature vector to search
+     * @param radius the maximum distance of the returned items
+     * @param max_results maximum number of items returned
+     * @param top_ids return the item ids sorted by distance
+     * @param distances returns the distance for each item
+     * @param params per-request search parameters
+     * @return false if the search stopped early and the results are partial
+     */
+    virtual bool rangeSearch(const std::string &model_name,
+                             const torch::Tensor &features_tensor,
+                             float radius, int max_results,
+                             std::vector<int> *top_ids,
+                             std::vector<float> *distances,
+                             const SearchParameters &params) = 0;
+
+    /**
+     * Restrict the engine to a set of model spaces, this is used when
+     * models have their own engines. By default an engine serves all
+     * the model spaces.
+     * @param models the names of the models served
+     */
+    void setModels(const std::vector<std::string> &models);
 
     static SearchEnginePtr build_search_engine(const INIReader &conf_reader,
                                                const TorchManager::TorchManagerPtr &torch_manager,
                                                const DatabaseManager::DatabaseManagerPtr &database_manager);
 
+    /**
+     * Create a search engine, without setting it up. The engine parameters
+     * are read from the model section (when given) and then from the
+     * section of the engine (e.g. [faiss]).
+     * @param conf_reader the configuration
+     * @param se_engine the engine type (annoy, faiss, binary, segmented,
+     *                  partitioned or exact_disk)
+     * @param model_section the per-model section, or empty
+     * @param torch_manager an instance of the torch manager
+     * @param database_manager an instance of the database manager
+     * @param index_type if not empty, overrides the Faiss index_type
+     * @return the search engine
+     */
+    static SearchEnginePtr create_search_engine(const INIReader &conf_reader,
+                                                const std::string &se_engine,
+                                                const std::string &model_section,
+                                                const TorchManager::TorchManagerPtr &torch_manager,
+                                                const DatabaseManager::DatabaseManagerPtr &database_manager,
+                                                const std::string &index_type="");
+
 protected:
+    /**
+     * Get the model spaces served by this engine.
+     * @return the names of the models
+     */
+    std::vector<std::string> getModelList() const;
+
+    /**
+     * Check if a model space is served by this engine.
+     * @param model_name the name of the model
+     * @return true if the model is served, false otherwise
+     */
+    bool servesModel(const std::string &model_name) const;
+
+    /**
+     * Get the features of a stored item in the index space of its model,
+     * reduced by the feature transform of the model when it has one.
+     * @param vector the item vectors of a model
+     * @param dim the dimension of the index space
+     * @param buffer the storage of the reduced features, if needed
+     * @return the features, or nullptr if they don't match the index space
+     */
+    const float *indexFeatures(const euclidesproto::ItemVectors &vector, int dim,
+                               std::vector<float> *buffer) const;
+
+    /**
+     * Same as above with the transform of the model already looked up,
+     * for the scans that go through many items of the same model.
+     * @param transform the trained transform of the model, or nullptr
+     */
+    static const float *indexFeatures(const FeatureTransform::FeatureTransformPtr &transform,
+                                      const euclidesproto::ItemVectors &vector, int dim,
+                                      std::vector<float> *buffer);
+
+    /**
+     * Rerank the candidates of an approximate search with the exact
+     * distance between the query and their features stored in the
+     * database, which are fetched with a single batched read.
+     *
+     * @param model_name the name of the model space searched
+     * @param query the query features
+     * @param dim the size of the query features
+     * @param candidates the candidate item ids
+     * @param top_k number of top k items to keep
+     * @param metric the distance used to rerank
+     * @param top_ids returns the top k item ids
+     * @param distances returns the exact distance for each item
+     */
+    void rerankExact(const std::string &model_name, const float *query, int dim,
+                     const std::vector<int> &candidates, int top_k,
+                     RerankMetric metric, std::vector<int> *top_ids,
+                     std::vector<float> *distances);
+
     TorchManager::TorchManagerPtr mTorchManager;
     DatabaseManager::DatabaseManagerPtr mDatabaseManager;
+    std::unordered_set<std::string> mModels;
 };
 
 
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <pthread.h>
+
+/**
+ * A readers-writer lock, since std::shared_mutex isn't available in
+ * C++11. It has the interface of std::mutex for the exclusive lock, so
+ * it works with std::lock_guard and std::unique_lock, and the shared
+ * lock is taken with SharedLock.
+ */
+class SharedMutex
+{
+public:
+    SharedMutex() { pthread_rwlock_init(&mLock, nullptr); }
+    ~SharedMutex() { pthread_rwlock_destroy(&mLock); }
+
+    SharedMutex(const SharedMutex&) = delete;
+    SharedMutex &operator=(const SharedMutex&) = delete;
+
+    void lock() { pthread_rwlock_wrlock(&mLock); }
+    void unlock() { pthread_rwlock_unlock(&mLock); }
+
+    void lock_shared() { pthread_rwlock_rdlock(&mLock); }
+    void unlock_shared() { pthread_rwlock_unlock(&mLock); }
+
+private:
+    pthread_rwlock_t mLock;
+};
+
+
+/**
+ * Hold the shared lock of a SharedMutex until it goes out of scope.
+ */
+class SharedLock
+{
+public:
+    explicit SharedLock(SharedMutex &mutex)
+    : mMutex(mutex)
+    { mMutex.lock_shared(); }
+
+    ~SharedLock() { mMutex.unlock_shared(); }
+
+    SharedLock(const SharedLock&) = delete;
+    SharedLock &operator=(const SharedLock&) = delete;
+
+private:
+    SharedMutex &mMutex;
+};
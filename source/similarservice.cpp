@@ -3,17 +3,51 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 
+#include <algorithm>
+#include <chrono>
+#include <google/protobuf/arena.h>
+
 #include <easylogging++.h>
 
+namespace {
+    // Items sent in each message of a snapshot
+    const int k_snapshot_chunk = 256;
+
+    // Changes sent in a row, and the wait for new ones before a heartbeat
+    const size_t k_stream_batch = 1024;
+    const int k_stream_wait_ms = 1000;
+
+    // Predicted classes of a query passed to the search engines, which
+    // route the query to the partitions of its top classes
+    const int k_query_classes = 64;
+}
+
 /**
  * Log and return a gRPC error.
  * @param error_msg the error message to report and return to client
  * @return the gRPC status object with the code and message
  */
-inline grpc::Status euclides_grpc_error(const std::string &error_msg)
+inline grpc::Status euclides_grpc_error(const std::string &error_msg,
+                                        grpc::StatusCode code=grpc::StatusCode::CANCELLED)
 {
     LOG(ERROR) << error_msg;
-    return grpc::Status(grpc::StatusCode::CANCELLED, error_msg);
+    return grpc::Status(code, error_msg);
+}
+
+/**
+ * Compute the memory used to decode an image, without decoding it.
+ * @param data the encoded image data
+ * @return the size in bytes or -1 if the image cannot be parsed
+ */
+int64_t decoded_image_bytes(const std::string &data)
+{
+    int x=0, y=0, c=0;
+    const stbi_uc *raw_data = reinterpret_cast<const stbi_uc*>(data.data());
+    if(!stbi_info_from_memory(raw_data, static_cast<int>(data.size()), &x, &y, &c))
+        return -1;
+
+    // The decoded 8-bit pixels plus their float tensor
+    return static_cast<int64_t>(x) * y * c * (1 + sizeof(float));
 }
 
 torch::Tensor image_from_memory(const std::string &data)
@@ -40,46 +74,313 @@ torch::Tensor image_from_memory(const std::string &data)
     return ftensor;
 }
 
+/**
+ * Convert the optional search options from a request into the search
+ * engine parameters, unset (zero) options keep the engine defaults. The
+ * search deadline is the earliest of the request deadline and the search
+ * timeout, so clients can get partial results before their own deadline.
+ * @param context the server context of the request
+ * @param options the search options from the request
+ * @return the search parameters
+ */
+SearchParameters search_params_from_options(grpc::ServerContext *context,
+                                            const SearchOptions &options)
+{
+    SearchParameters params;
+    if(options.nprobe() > 0)
+        params.mNprobe = options.nprobe();
+    if(options.ef_search() > 0)
+        params.mEfSearch = options.ef_search();
+    if(options.search_k() > 0)
+        params.mSearchK = options.search_k();
+
+    const auto steady_now = std::chrono::steady_clock::now();
+    if(options.timeout_ms() > 0)
+        params.mDeadline = steady_now + std::chrono::milliseconds(options.timeout_ms());
+
+    // Requests without deadline have an infinite one, the remaining time
+    // is moved to the steady clock to be immune to wall clock changes.
+    const gpr_timespec raw_deadline = context->raw_deadline();
+    if(gpr_time_cmp(raw_deadline, gpr_inf_future(raw_deadline.clock_type)) != 0)
+    {
+        const auto remaining = context->deadline() - std::chrono::system_clock::now();
+        const auto deadline = steady_now + \
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(remaining);
+        params.mDeadline = std::min(params.mDeadline, deadline);
+    }
+
+    params.mIsCancelled = [context]() { return context->IsCancelled(); };
+    return params;
+}
+
+/**
+ * Check out a replica of a model for a request, waiting for a free one
+ * until the deadline of the request.
+ */
+grpc::Status checkout_module(const TorchManager::TorchManagerPtr &torch_manager,
+                             const std::string &model_name,
+                             const SearchParameters &params,
+                             ModuleLease &module)
+{
+    const ModuleCheckout checkout = torch_manager->getModule(model_name, module,
+                                                             params.mDeadline,
+                                                             params.mIsCancelled);
+    if(checkout == ModuleCheckout::NOT_FOUND)
+        return euclides_grpc_error("Cannot find the module: " + model_name);
+
+    if(checkout == ModuleCheckout::TIMED_OUT)
+    {
+        if(params.mIsCancelled && params.mIsCancelled())
+            return euclides_grpc_error("Request cancelled by the client.");
+        return euclides_grpc_error("No replica of the module " + model_name +
+                                   " was free before the deadline.",
+                                   grpc::StatusCode::DEADLINE_EXCEEDED);
+    }
+
+    return grpc::Status::OK;
+}
+
+/**
+ * Copy a raw float array into a repeated field, in place.
+ * @param data the source data
+ * @param size number of elements
+ * @param field the destination repeated field
+ */
+template<typename T>
+void copy_to_field(const T *data, int size, google::protobuf::RepeatedField<T> *field)
+{
+    field->Resize(size, T());
+    std::copy(data, data + size, field->mutable_data());
+}
+
+/**
+ * Map query features to the index space of a model, the features that
+ * are already reduced are returned as they are.
+ * @param transform the trained feature transform of the model, or nullptr
+ * @param features the [N, d] query features
+ * @return the query features in the index space
+ */
+torch::Tensor index_queries(const FeatureTransform::FeatureTransformPtr &transform,
+                            const torch::Tensor &features)
+{
+    if(transform == nullptr || features.size(1) != transform->getInputDim())
+        return features;
+
+    const torch::Tensor queries = features.toType(torch::kFloat).contiguous();
+    torch::Tensor reduced = torch::empty({queries.size(0), transform->getOutputDim()},
+                                         torch::kFloat);
+    transform->apply(static_cast<int>(queries.size(0)), queries.data<float>(),
+                     reduced.data<float>());
+    return reduced;
+}
+
+/**
+ * Store the predictions of a model in the item vectors, either dense, as
+ * the top-N (class, score) pairs sorted by score or not at all.
+ * @param props the properties of the model
+ * @param predictions the dense predictions
+ * @param size number of predictions
+ * @param item_vectors the item vectors to be stored
+ */
+void store_predictions(const TorchModelProp &props, const float *predictions,
+                       int size, ItemVectors *item_vectors)
+{
+    switch(props.getPredictionStorage())
+    {
+    case PredictionStorage::DENSE:
+        copy_to_field(predictions, size, item_vectors->mutable_predictions());
+        break;
+    case PredictionStorage::SPARSE:
+    {
+        const std::vector<int> classes = \
+            top_classes(predictions, size, props.getPredictionsTopN());
+        const int top_n = static_cast<int>(classes.size());
+
+        item_vectors->mutable_prediction_classes()->Reserve(top_n);
+        item_vectors->mutable_prediction_scores()->Reserve(top_n);
+        for(int i=0; i<top_n; i++)
+        {
+            item_vectors->add_prediction_classes(classes[i]);
+            item_vectors->add_prediction_scores(predictions[classes[i]]);
+        }
+        break;
+    }
+    case PredictionStorage::NONE:
+        break;
+    }
+}
+
+/**
+ * Fill the search results of a model space in place.
+ * @param search_results the reply search results
+ * @param model_name the model space searched
+ * @param toplist the top k ids found
+ * @param distances the distance of each item
+ */
+void fill_search_results(SearchResults *search_results,
+                         const std::string &model_name,
+                         const std::vector<int> &toplist,
+                         const std::vector<float> &distances)
+{
+    search_results->set_model(model_name);
+    copy_to_field(toplist.data(), static_cast<int>(toplist.size()),
+                  search_results->mutable_top_k_ids());
+    copy_to_field(distances.data(), static_cast<int>(distances.size()),
+                  search_results->mutable_distances());
+}
+
+/**
+ * Finish a search reply, flagging it when the results are partial.
+ * @param context the server context of the request
+ * @param partial if some search stopped early or some model was skipped
+ * @param reply the search reply
+ * @return CANCELLED if the client cancelled the request, OK otherwise
+ */
+grpc::Status partial_reply_status(grpc::ServerContext *context, bool partial,
+                                  FindSimilarImageReply *reply)
+{
+    // Nobody is waiting for the reply of a cancelled request
+    if(context->IsCancelled())
+        return euclides_grpc_error("Request cancelled by the client.");
+
+    if(partial)
+        LOG(WARNING) << "Search deadline expired, replying partial results.";
+
+    reply->set_partial(partial);
+    return grpc::Status::OK;
+}
+
 SimilarServiceImpl::SimilarServiceImpl(const TorchManager::TorchManagerPtr &torch_manager,
-                                       const DatabaseManager::DatabaseManagerPtr &database_manager,
-                                       const SearchEngine::SearchEnginePtr &search_engine,
+                                       const CollectionManager::CollectionManagerPtr &collections,
+                                       const AdmissionController::AdmissionControllerPtr &admission,
+                                       const Tracer::TracerPtr &tracer,
+                                       bool read_only,
                                        std::promise<ShutdownType> shutdown_request)
 : Similar::Service(),
   mTorchManager(torch_manager),
-  mDatabaseManager(database_manager),
-  mSearchEngine(search_engine),
+  mCollections(collections),
+  mAdmission(admission),
+  mTracer(tracer),
+  mReadOnly(read_only),
   mShutdownRequest(std::move(shutdown_request))
 { }
 
+grpc::Status SimilarServiceImpl::admitRequest(RequestType type, AdmissionGuard *guard)
+{
+    if(!mAdmission->admitRequest(type, guard))
+        return euclides_grpc_error("Too many requests in-flight, try again later.",
+                                   grpc::StatusCode::RESOURCE_EXHAUSTED);
+    return grpc::Status::OK;
+}
+
+grpc::Status SimilarServiceImpl::admitImage(const std::string &image_data, AdmissionGuard *guard)
+{
+    const int64_t image_bytes = decoded_image_bytes(image_data);
+    if(image_bytes < 0)
+        return euclides_grpc_error("Undefined tensor, cannot parse image data.");
+
+    const Admission admission = mAdmission->admitImageBytes(image_bytes, guard);
+    if(admission == Admission::OVER_CAPACITY)
+        return euclides_grpc_error("The decoded image is larger than the max_image_memory_mb "
+                                   "of the server.", grpc::StatusCode::INVALID_ARGUMENT);
+    if(admission == Admission::TIMED_OUT)
+        return euclides_grpc_error("Not enough memory to decode the image, try again later.",
+                                   grpc::StatusCode::RESOURCE_EXHAUSTED);
+    return grpc::Status::OK;
+}
+
+grpc::Status SimilarServiceImpl::findCollection(const std::string &name, bool create,
+                                                CollectionPtr *collection)
+{
+    std::string error;
+    *collection = mCollections->getCollection(name, create, &error);
+    if(*collection == nullptr && !error.empty())
+        return euclides_grpc_error("Cannot open the collection " + name + ": " + error,
+                                   grpc::StatusCode::INTERNAL);
+    if(*collection == nullptr)
+        return euclides_grpc_error("Cannot find the collection: " + name);
+    return grpc::Status::OK;
+}
+
+grpc::Status SimilarServiceImpl::findChangeLog(const std::string &name,
+                                               CollectionPtr *collection,
+                                               ChangeLog::ChangeLogPtr *change_log)
+{
+    const grpc::Status found = findCollection(name, false, collection);
+    if(!found.ok())
+        return found;
+
+    *change_log = (*collection)->mDatabaseManager->getChangeLog();
+    if(*change_log == nullptr)
+        return euclides_grpc_error("The change log is disabled, set changelog_size.",
+                                   grpc::StatusCode::FAILED_PRECONDITION);
+    return grpc::Status::OK;
+}
+
 grpc::Status SimilarServiceImpl::FindSimilarImage(grpc::ServerContext* context,
         const FindSimilarImageRequest* request, FindSimilarImageReply* reply)
 {
     TIMED_SCOPE(timerFindSimilar, "FindSimilar");
+    RequestTrace request_trace(mTracer, "FindSimilarImage");
     torch::NoGradGuard nograd;
 
     if(request->top_k() <= 0)
         return euclides_grpc_error("Top K must be greater than zero.");
 
+    AdmissionGuard request_guard, image_guard;
+    grpc::Status admission = admitRequest(RequestType::SEARCH, &request_guard);
+    if(admission.ok())
+        admission = admitImage(request->image_data(), &image_guard);
+    if(!admission.ok())
+        return admission;
+
+    CollectionPtr collection;
+    const grpc::Status found = findCollection(request->collection(), false, &collection);
+    if(!found.ok())
+        return found;
+
     // TODO: refactor to return a bool instead of undefined tensor
     // upon failure.
-    torch::Tensor image_tensor = image_from_memory(request->image_data());
+    torch::Tensor image_tensor;
+    {
+        TRACE_SCOPE("Decode");
+        image_tensor = image_from_memory(request->image_data());
+    }
     if(image_tensor.type_id() == torch::UndefinedTensorId())
         return euclides_grpc_error("Undefined tensor, cannot parse image data.");
 
     std::vector<torch::jit::IValue> net_inputs;
     net_inputs.push_back(image_tensor);
 
+    const SearchParameters search_params = \
+        search_params_from_options(context, request->search_options());
+    bool partial = false;
+
     for(const std::string &model_name : request->models())
     {
+        // Inference can't be interrupted, stop before starting the next one
+        if(search_params.expired())
+        {
+            partial = true;
+            break;
+        }
+
         LOG(INFO) << "Search in model space " << model_name;
 
-        TorchManager::torchmodule_t torch_module;
-        const bool ret = mTorchManager->getModule(model_name, torch_module);
-        if(!ret)
-            return euclides_grpc_error("Cannot find the module: " + model_name);
+        ModuleLease torch_module;
+        const grpc::Status checkout = checkout_module(mTorchManager, model_name,
+                                                      search_params, torch_module);
+        if(!checkout.ok())
+            return checkout;
 
         PERFORMANCE_CHECKPOINT_WITH_ID(timerFindSimilar, "BeforeInference");
-        auto ival = torch_module->forward(net_inputs);
+        torch::jit::IValue ival;
+        {
+            TRACE_SCOPE("Inference " + model_name);
+            ival = torch_module->forward(net_inputs);
+        }
+        // The replica is free for other requests during the search
+        torch_module.release();
         PERFORMANCE_CHECKPOINT_WITH_ID(timerFindSimilar, "AfterInference");
         auto elements = ival.toTuple()->elements();
 
@@ -92,29 +393,30 @@ grpc::Status SimilarServiceImpl::FindSimilarImage(grpc::ServerContext* context,
         if(!preds.is_contiguous() || !features.is_contiguous())
             return euclides_grpc_error("Predictions and features should be contiguous.");
 
+        SearchParameters model_params = search_params;
+        model_params.mQueryClasses.assign(1, top_classes(preds[0].data<float>(),
+                                                         static_cast<int>(preds.sizes()[1]),
+                                                         k_query_classes));
+
         std::vector<int> toplist;
         std::vector<float> distances;
 
         toplist.reserve(request->top_k());
         distances.reserve(request->top_k());
 
-        mSearchEngine->search(model_name, features, request->top_k(),
-                              &toplist, &distances);
+        const torch::Tensor queries = \
+            index_queries(mTorchManager->getTransform(model_name), features);
+        if(!collection->mSearchEngine->search(model_name, queries, request->top_k(),
+                                  &toplist, &distances, model_params))
+            partial = true;
 
         LOG(INFO) << "Search on " << model_name
                   << " returned " << toplist.size() << " results.";
 
-        SearchResults *search_results = reply->add_results();
-        search_results->set_model(model_name);
-
-        google::protobuf::RepeatedField<int> rf_topk(toplist.begin(), toplist.end());
-        search_results->mutable_top_k_ids()->Swap(&rf_topk);
-
-        google::protobuf::RepeatedField<float> rf_distances(distances.begin(), distances.end());
-        search_results->mutable_distances()->Swap(&rf_distances);
+        fill_search_results(reply->add_results(), model_name, toplist, distances);
     }
 
-    return grpc::Status::OK;
+    return partial_reply_status(context, partial, reply);
 }
 
 grpc::Status SimilarServiceImpl::FindSimilarImageById(grpc::ServerContext* context,
@@ -122,24 +424,46 @@ grpc::Status SimilarServiceImpl::FindSimilarImageById(grpc::ServerContext* conte
                                                       FindSimilarImageReply* reply)
 {
     TIMED_SCOPE(timerFindSimilar, "FindSimilar");
+    RequestTrace request_trace(mTracer, "FindSimilarImageById");
     torch::NoGradGuard nograd;
 
     if(request->top_k() <= 0)
         return euclides_grpc_error("Top K must be greater than zero.");
 
+    AdmissionGuard request_guard;
+    const grpc::Status admission = admitRequest(RequestType::SEARCH, &request_guard);
+    if(!admission.ok())
+        return admission;
+
+    CollectionPtr collection;
+    const grpc::Status found = findCollection(request->collection(), false, &collection);
+    if(!found.ok())
+        return found;
+
     // 1. Get the item data from the database
-    euclidesproto::ItemData item_data;
-    bool ret = mDatabaseManager->getItemDataByKey(request->image_id(), item_data);
+    google::protobuf::Arena arena;
+    euclidesproto::ItemData &item_data = \
+        *google::protobuf::Arena::CreateMessage<euclidesproto::ItemData>(&arena);
+    bool ret = collection->mDatabaseManager->getItemDataByKey(request->image_id(), item_data);
     if(!ret)
         return euclides_grpc_error("Cannot find this item id in the database.");
 
+    const SearchParameters search_params = \
+        search_params_from_options(context, request->search_options());
+    bool partial = false;
+
     for(const std::string &model_name : request->models())
     {
+        if(search_params.expired())
+        {
+            partial = true;
+            break;
+        }
+
         LOG(INFO) << "Search in model space " << model_name;
 
-        TorchManager::torchmodule_t torch_module;
-        ret = mTorchManager->getModule(model_name, torch_module);
-        if (!ret)
+        // The module itself isn't needed, avoid loading it
+        if (!mTorchManager->hasModule(model_name))
             return euclides_grpc_error("Cannot find the module: " + model_name);
 
         int model_found = 0;
@@ -155,7 +479,11 @@ grpc::Status SimilarServiceImpl::FindSimilarImageById(grpc::ServerContext* conte
             void *features = static_cast<void*>(iv.mutable_features()->mutable_data());
             torch::Tensor features_tensor = \
                 torch::from_blob(features, {1, iv.features_size()});
-            features_tensor = features_tensor.toType(torch::kFloat);
+            features_tensor = index_queries(mTorchManager->getTransform(model_name),
+                                            features_tensor.toType(torch::kFloat));
+
+            SearchParameters model_params = search_params;
+            model_params.mQueryClasses.assign(1, item_top_classes(iv, k_query_classes));
 
             std::vector<int> toplist;
             std::vector<float> distances;
@@ -163,45 +491,254 @@ grpc::Status SimilarServiceImpl::FindSimilarImageById(grpc::ServerContext* conte
             toplist.reserve(request->top_k());
             distances.reserve(request->top_k());
 
-            mSearchEngine->search(model_name, features_tensor, request->top_k(),
-                                  &toplist, &distances);
+            if(!collection->mSearchEngine->search(model_name, features_tensor, request->top_k(),
+                                      &toplist, &distances, model_params))
+                partial = true;
 
             LOG(INFO) << "Search on " << model_name
                       << " returned " << toplist.size() << " results.";
 
-            SearchResults *search_results = reply->add_results();
-            search_results->set_model(model_name);
-
-            google::protobuf::RepeatedField<int> rf_topk(toplist.begin(), toplist.end());
-            search_results->mutable_top_k_ids()->Swap(&rf_topk);
-
-            google::protobuf::RepeatedField<float> rf_distances(distances.begin(), distances.end());
-            search_results->mutable_distances()->Swap(&rf_distances);
+            fill_search_results(reply->add_results(), model_name, toplist, distances);
         }
 
         if(model_found <= 0)
             return euclides_grpc_error("Item not found in the model space: " + model_name);
     }
 
-    return grpc::Status::OK;
+    return partial_reply_status(context, partial, reply);
 }
 
+grpc::Status SimilarServiceImpl::FindWithinRadius(grpc::ServerContext* context,
+                                                  const FindWithinRadiusRequest* request,
+                                                  FindSimilarImageReply* reply)
+{
+    TIMED_SCOPE(timerFindWithinRadius, "FindWithinRadius");
+    RequestTrace request_trace(mTracer, "FindWithinRadius");
+    torch::NoGradGuard nograd;
+
+    if(request->max_results() <= 0)
+        return euclides_grpc_error("Max results must be greater than zero.");
+
+    AdmissionGuard request_guard, image_guard;
+    grpc::Status admission = admitRequest(RequestType::SEARCH, &request_guard);
+    if(admission.ok())
+        admission = admitImage(request->image_data(), &image_guard);
+    if(!admission.ok())
+        return admission;
+
+    CollectionPtr collection;
+    const grpc::Status found = findCollection(request->collection(), false, &collection);
+    if(!found.ok())
+        return found;
+
+    torch::Tensor image_tensor;
+    {
+        TRACE_SCOPE("Decode");
+        image_tensor = image_from_memory(request->image_data());
+    }
+    if(image_tensor.type_id() == torch::UndefinedTensorId())
+        return euclides_grpc_error("Undefined tensor, cannot parse image data.");
+
+    std::vector<torch::jit::IValue> net_inputs;
+    net_inputs.push_back(image_tensor);
+
+    const SearchParameters search_params = \
+        search_params_from_options(context, request->search_options());
+    bool partial = false;
+
+    for(const std::string &model_name : request->models())
+    {
+        if(search_params.expired())
+        {
+            partial = true;
+            break;
+        }
+
+        LOG(INFO) << "Radius search in model space " << model_name;
+
+        ModuleLease torch_module;
+        const grpc::Status checkout = checkout_module(mTorchManager, model_name,
+                                                      search_params, torch_module);
+        if(!checkout.ok())
+            return checkout;
+
+        PERFORMANCE_CHECKPOINT_WITH_ID(timerFindWithinRadius, "BeforeInference");
+        torch::jit::IValue ival;
+        {
+            TRACE_SCOPE("Inference " + model_name);
+            ival = torch_module->forward(net_inputs);
+        }
+        // The replica is free for other requests during the search
+        torch_module.release();
+        PERFORMANCE_CHECKPOINT_WITH_ID(timerFindWithinRadius, "AfterInference");
+        auto elements = ival.toTuple()->elements();
+
+        const torch::Tensor &preds = elements[0].toTensor();
+        const torch::Tensor &features = elements[1].toTensor();
+        if(!preds.is_contiguous() || !features.is_contiguous())
+            return euclides_grpc_error("Predictions and features should be contiguous.");
+
+        SearchParameters model_params = search_params;
+        model_params.mQueryClasses.assign(1, top_classes(preds[0].data<float>(),
+                                                         static_cast<int>(preds.sizes()[1]),
+                                                         k_query_classes));
+
+        std::vector<int> toplist;
+        std::vector<float> distances;
+
+        const torch::Tensor queries = \
+            index_queries(mTorchManager->getTransform(model_name), features);
+        if(!collection->mSearchEngine->rangeSearch(model_name, queries, request->radius(),
+                                       request->max_results(), &toplist, &distances,
+                                       model_params))
+            partial = true;
+
+        LOG(INFO) << "Radius search on " << model_name
+                  << " returned " << toplist.size() << " results.";
+
+        fill_search_results(reply->add_results(), model_name, toplist, distances);
+    }
+
+    return partial_reply_status(context, partial, reply);
+}
+
+grpc::Status SimilarServiceImpl::FindSimilarByVector(grpc::ServerContext* context,
+                                                     const FindSimilarByVectorRequest* request,
+                                                     FindSimilarImageReply* reply)
+{
+    TIMED_SCOPE(timerFindSimilarByVector, "FindSimilarByVector");
+    RequestTrace request_trace(mTracer, "FindSimilarByVector");
+    torch::NoGradGuard nograd;
+
+    if(request->top_k() <= 0)
+        return euclides_grpc_error("Top K must be greater than zero.");
+
+    AdmissionGuard request_guard;
+    const grpc::Status admission = admitRequest(RequestType::SEARCH, &request_guard);
+    if(!admission.ok())
+        return admission;
+
+    CollectionPtr collection;
+    const grpc::Status found = findCollection(request->collection(), false, &collection);
+    if(!found.ok())
+        return found;
+
+    // Group the queries by model, so each model space is searched with a
+    // single batch, keeping the order of the first query of each model.
+    std::vector<std::string> model_order;
+    std::unordered_map<std::string, std::vector<int>> model_queries;
+    for(int i=0; i < request->queries_size(); i++)
+    {
+        const VectorQuery &query = request->queries(i);
+        const std::string &model_name = query.model();
+
+        if(model_queries.find(model_name) == model_queries.end())
+        {
+            if(!mTorchManager->hasModule(model_name))
+                return euclides_grpc_error("Cannot find the module: " + model_name);
+            model_order.push_back(model_name);
+        }
+
+        const int feature_dim = mTorchManager->getModuleProps(model_name).getFeatureDim();
+        if(query.features_size() != feature_dim)
+            return euclides_grpc_error("The model " + model_name + " has " +
+                                       std::to_string(feature_dim) + " features, but " +
+                                       std::to_string(query.features_size()) +
+                                       " were given.");
+
+        model_queries[model_name].push_back(i);
+    }
+
+    // The results follow the order of the queries
+    for(int i=0; i < request->queries_size(); i++)
+        reply->add_results()->set_model(request->queries(i).model());
+
+    const SearchParameters search_params = \
+        search_params_from_options(context, request->search_options());
+    bool partial = false;
+
+    for(const std::string &model_name : model_order)
+    {
+        if(search_params.expired())
+        {
+            partial = true;
+            break;
+        }
+
+        const std::vector<int> &query_indexes = model_queries[model_name];
+        const int n = static_cast<int>(query_indexes.size());
+        const int feature_dim = request->queries(query_indexes[0]).features_size();
+
+        torch::Tensor features = torch::empty({n, feature_dim}, torch::kFloat);
+        float *raw_features = features.data<float>();
+        for(int i=0; i<n; i++)
+        {
+            const VectorQuery &query = request->queries(query_indexes[i]);
+            std::copy(query.features().begin(), query.features().end(),
+                      raw_features + i * feature_dim);
+        }
+
+        std::vector<std::vector<int>> toplists;
+        std::vector<std::vector<float>> distances;
+        features = index_queries(mTorchManager->getTransform(model_name), features);
+        if(!collection->mSearchEngine->searchBatch(model_name, features, request->top_k(),
+                                       &toplists, &distances, search_params))
+            partial = true;
+
+        LOG(INFO) << "Batch search on " << model_name << " with " << n << " queries.";
+
+        for(int i=0; i<n && i<static_cast<int>(toplists.size()); i++)
+            fill_search_results(reply->mutable_results(query_indexes[i]), model_name,
+                                toplists[i], distances[i]);
+    }
+
+    return partial_reply_status(context, partial, reply);
+}
 
 grpc::Status
 SimilarServiceImpl::AddImage(grpc::ServerContext *context,
         const AddImageRequest *request, AddImageReply *reply)
 {
     TIMED_SCOPE(timerAddImage, "AddImage");
+    RequestTrace request_trace(mTracer, "AddImage");
+
+    if(mReadOnly)
+        return euclides_grpc_error("This server is a read-only replica.",
+                                   grpc::StatusCode::FAILED_PRECONDITION);
 
     const std::string &image_data = request->image_data();
-    torch::Tensor image_tensor = image_from_memory(image_data);
+
+    AdmissionGuard request_guard, image_guard;
+    grpc::Status admission = admitRequest(RequestType::ADD, &request_guard);
+    if(admission.ok())
+        admission = admitImage(image_data, &image_guard);
+    if(!admission.ok())
+        return admission;
+
+    // Collections are created by their first item
+    CollectionPtr collection;
+    const grpc::Status found = findCollection(request->collection(), true, &collection);
+    if(!found.ok())
+        return found;
+
+    torch::Tensor image_tensor;
+    {
+        TRACE_SCOPE("Decode");
+        image_tensor = image_from_memory(image_data);
+    }
     if(image_tensor.type_id() == torch::UndefinedTensorId())
         return euclides_grpc_error("Undefined tensor, cannot parse image data.");
 
     std::vector<torch::jit::IValue> inputs;
     inputs.push_back(image_tensor);
 
-    ItemData item_data;
+    // Only the deadline of the request applies, to the replica checkouts
+    const SearchParameters write_params = \
+        search_params_from_options(context, SearchOptions::default_instance());
+
+    // All the item vectors are allocated on the arena and freed at once
+    google::protobuf::Arena arena;
+    ItemData &item_data = *google::protobuf::Arena::CreateMessage<ItemData>(&arena);
     item_data.set_item_id(request->image_id());
     item_data.set_metadata(request->image_metadata());
 
@@ -209,15 +746,21 @@ SimilarServiceImpl::AddImage(grpc::ServerContext *context,
     for(int i=0; i < request->models_size(); i++)
     {
         const std::string &model_name = request->models(i);
-        TorchManager::torchmodule_t module;
-        const bool ret = mTorchManager->getModule(model_name, module);
-        if(!ret)
-            return euclides_grpc_error("Cannot find the module: " + model_name);
+        ModuleLease module;
+        const grpc::Status checkout = checkout_module(mTorchManager, model_name,
+                                                      write_params, module);
+        if(!checkout.ok())
+            return checkout;
 
         LOG(INFO) << "Adding image for the " << model_name << " model space.";
 
         PERFORMANCE_CHECKPOINT_WITH_ID(timerAddImage, "BeforeInference");
-        auto ival = module->forward(inputs);
+        torch::jit::IValue ival;
+        {
+            TRACE_SCOPE("Inference " + model_name);
+            ival = module->forward(inputs);
+        }
+        module.release();
         PERFORMANCE_CHECKPOINT_WITH_ID(timerAddImage, "AfterInference");
         auto elements = ival.toTuple()->elements();
 
@@ -239,28 +782,54 @@ SimilarServiceImpl::AddImage(grpc::ServerContext *context,
         const float *raw_predictions = predictions[0].data<float>();
         const float *raw_features = features[0].data<float>();
 
-        ItemVectors *reply_vectors = reply->add_vectors();
         ItemVectors *item_vectors = item_data.add_vectors();
         item_vectors->set_model(model_name);
-        reply_vectors->set_model(model_name);
-
-        const int64_t preds_size = predictions.sizes()[1];
-        google::protobuf::RepeatedField<float> rf_preds(raw_predictions,
-                                                        raw_predictions+preds_size);
-        reply_vectors->mutable_predictions()->CopyFrom(rf_preds);
-        item_vectors->mutable_predictions()->Swap(&rf_preds);
-
-        const int64_t features_size = features.sizes()[1];
-        google::protobuf::RepeatedField<float> rf_feats(raw_features,
-                                                        raw_features+features_size);
-        reply_vectors->mutable_features()->CopyFrom(rf_feats);
-        item_vectors->mutable_features()->Swap(&rf_feats);
+
+        const TorchModelProp props = mTorchManager->getModuleProps(model_name);
+        const int preds_size = static_cast<int>(predictions.sizes()[1]);
+        store_predictions(props, raw_predictions, preds_size, item_vectors);
+
+        // Models can store only the features reduced by their transform
+        const int features_size = static_cast<int>(features.sizes()[1]);
+        const FeatureTransform::FeatureTransformPtr transform = \
+            mTorchManager->getTransform(model_name);
+        const bool store_reduced = props.getStoreReduced() && transform != nullptr;
+        if(store_reduced)
+        {
+            item_vectors->mutable_features()->Resize(transform->getOutputDim(), 0.0f);
+            transform->apply(1, raw_features, item_vectors->mutable_features()->mutable_data());
+        }
+        else
+            copy_to_field(raw_features, features_size, item_vectors->mutable_features());
+
+        // Clients that don't need the vectors can skip them in the reply
+        if(!request->omit_vectors())
+        {
+            ItemVectors *reply_vectors = reply->add_vectors();
+            reply_vectors->CopyFrom(*item_vectors);
+
+            // The reply always has the dense predictions, whatever is stored
+            if(props.getPredictionStorage() != PredictionStorage::DENSE)
+                copy_to_field(raw_predictions, preds_size,
+                              reply_vectors->mutable_predictions());
+
+            // And the full features
+            if(store_reduced)
+                copy_to_field(raw_features, features_size,
+                              reply_vectors->mutable_features());
+        }
     }
 
-    const bool ret = mDatabaseManager->addItemData(item_data);
+    // Concurrent writes of the same item are applied to the indexes in
+    // the order they were stored
+    std::lock_guard<std::mutex> item_lock(collection->mItemLocks->get(item_data.item_id()));
+    const bool ret = collection->mDatabaseManager->addItemData(item_data);
     if(!ret)
         return euclides_grpc_error("Error adding item data into database.");
 
+    // Engines with incremental indexes make the item searchable right away
+    collection->mSearchEngine->addItem(item_data);
+
     return grpc::Status::OK;
 }
 
@@ -268,12 +837,31 @@ grpc::Status SimilarServiceImpl::RemoveImage(grpc::ServerContext *context, const
                                              RemoveImageReply *reply)
 {
     TIMED_SCOPE(timerRemoveImage, "RemoveImage");
+    RequestTrace request_trace(mTracer, "RemoveImage");
+
+    if(mReadOnly)
+        return euclides_grpc_error("This server is a read-only replica.",
+                                   grpc::StatusCode::FAILED_PRECONDITION);
+
+    AdmissionGuard request_guard;
+    const grpc::Status admission = admitRequest(RequestType::REMOVE, &request_guard);
+    if(!admission.ok())
+        return admission;
+
+    CollectionPtr collection;
+    const grpc::Status found = findCollection(request->collection(), false, &collection);
+    if(!found.ok())
+        return found;
 
-    const bool ret = mDatabaseManager->removeItem(request->image_id());
-    if(!ret)
     {
-        LOG(ERROR) << "Error removing item from database.";
-        return grpc::Status::CANCELLED;
+        std::lock_guard<std::mutex> item_lock(collection->mItemLocks->get(request->image_id()));
+        const bool ret = collection->mDatabaseManager->removeItem(request->image_id());
+        if(!ret)
+        {
+            LOG(ERROR) << "Error removing item from database.";
+            return grpc::Status::CANCELLED;
+        }
+        collection->mSearchEngine->removeItem(request->image_id());
     }
 
     // Return the same id
@@ -281,6 +869,200 @@ grpc::Status SimilarServiceImpl::RemoveImage(grpc::ServerContext *context, const
     return grpc::Status::OK;
 }
 
+grpc::Status
+SimilarServiceImpl::ReloadModels(grpc::ServerContext *context, const ReloadModelsRequest *request,
+                                 ReloadModelsReply *reply)
+{
+    TIMED_SCOPE(timerReloadModels, "ReloadModels");
+
+    const std::vector<std::string> loaded = mTorchManager->getModuleList();
+    std::vector<std::string> failures;
+    const std::vector<std::string> changed = mTorchManager->reloadFromDir(&failures);
+    for(const std::string &model_name : changed)
+        reply->add_models(model_name);
+
+    // The transforms of the new models are trained like at startup, the
+    // running ones keep the transform their indexes were built with
+    std::vector<std::string> added;
+    for(const std::string &model_name : changed)
+        if(std::find(loaded.begin(), loaded.end(), model_name) == loaded.end())
+            added.push_back(model_name);
+    if(!added.empty())
+        mTorchManager->trainTransforms(mCollections->getCollection("")->mDatabaseManager,
+                                       &added, &failures);
+
+    LOG(INFO) << "Reloaded " << changed.size() << " models, new models "
+              << "require an index refresh to be searched.";
+
+    // The valid models are reloaded anyway, the status lists the ones
+    // that were skipped
+    if(!failures.empty())
+    {
+        std::string error_msg = "Reloaded " + std::to_string(changed.size()) + " models, " +
+                                std::to_string(failures.size()) + " models failed:";
+        for(const std::string &failure : failures)
+            error_msg += "\n" + failure;
+        return euclides_grpc_error(error_msg, grpc::StatusCode::FAILED_PRECONDITION);
+    }
+
+    return grpc::Status::OK;
+}
+
+grpc::Status
+SimilarServiceImpl::RefreshCollection(grpc::ServerContext *context,
+                                      const RefreshCollectionRequest *request,
+                                      RefreshCollectionReply *reply)
+{
+    TIMED_SCOPE(timerRefreshCollection, "RefreshCollection");
+
+    if(!mCollections->refreshCollection(request->collection()))
+        return euclides_grpc_error("Cannot find the collection: " + request->collection());
+
+    LOG(INFO) << "Refreshed the indexes of the collection " << request->collection();
+    reply->set_refreshed(true);
+    return grpc::Status::OK;
+}
+
+grpc::Status
+SimilarServiceImpl::ListCollections(grpc::ServerContext *context,
+                                    const ListCollectionsRequest *request,
+                                    ListCollectionsReply *reply)
+{
+    for(const std::string &name : mCollections->getCollectionList())
+        reply->add_collections(name);
+    return grpc::Status::OK;
+}
+
+grpc::Status
+SimilarServiceImpl::GetSlowQueries(grpc::ServerContext *context,
+                                   const GetSlowQueriesRequest *request,
+                                   GetSlowQueriesReply *reply)
+{
+    for(const TracePtr &trace : mTracer->getSlowTraces())
+    {
+        SlowQuery *query = reply->add_queries();
+        query->set_request(trace->getName());
+        query->set_duration_ms(trace->getDurationUs() / 1000.0);
+
+        // The stage times are relative to the start of the request
+        for(const TraceSpan &span : trace->getSpans())
+        {
+            TraceStage *stage = query->add_stages();
+            stage->set_name(span.mName);
+            stage->set_start_ms((span.mStartUs - trace->getStartUs()) / 1000.0);
+            stage->set_duration_ms(span.mDurationUs / 1000.0);
+        }
+    }
+    return grpc::Status::OK;
+}
+
+grpc::Status
+SimilarServiceImpl::GetSnapshot(grpc::ServerContext *context,
+                                const GetSnapshotRequest *request,
+                                grpc::ServerWriter<SnapshotChunk> *writer)
+{
+    TIMED_SCOPE(timerGetSnapshot, "GetSnapshot");
+
+    CollectionPtr collection;
+    ChangeLog::ChangeLogPtr change_log;
+    const grpc::Status found = findChangeLog(request->collection(), &collection, &change_log);
+    if(!found.ok())
+        return found;
+
+    // The changes up to the sequence are already in the database, the
+    // iterator may also see later changes, which the replica applies
+    // again when it streams the changes after the sequence.
+    const uint64_t sequence = change_log->lastSequence();
+    DatabaseManager::DatabaseIterator it(collection->mDatabaseManager->newIterator(false));
+
+    SnapshotChunk chunk;
+    int total_items = 0;
+    for (it->SeekToFirst(); it->Valid(); it->Next())
+    {
+        if(it->key().size() != sizeof(int))
+            continue;
+
+        chunk.add_items()->ParseFromString(it->value().ToString());
+        if(chunk.items_size() < k_snapshot_chunk)
+            continue;
+
+        chunk.set_epoch(change_log->getEpoch());
+        chunk.set_sequence(sequence);
+        total_items += chunk.items_size();
+        if(!writer->Write(chunk))
+            return euclides_grpc_error("Snapshot stream closed by the replica.");
+        chunk.Clear();
+    }
+
+    // The last chunk is always sent, so empty databases have one too
+    chunk.set_epoch(change_log->getEpoch());
+    chunk.set_sequence(sequence);
+    total_items += chunk.items_size();
+    if(!writer->Write(chunk))
+        return euclides_grpc_error("Snapshot stream closed by the replica.");
+
+    LOG(INFO) << "Sent a snapshot of " << total_items << " items at sequence " << sequence << ".";
+    return grpc::Status::OK;
+}
+
+grpc::Status
+SimilarServiceImpl::StreamChanges(grpc::ServerContext *context,
+                                  const StreamChangesRequest *request,
+                                  grpc::ServerWriter<ChangeEvent> *writer)
+{
+    CollectionPtr collection;
+    ChangeLog::ChangeLogPtr change_log;
+    const grpc::Status found = findChangeLog(request->collection(), &collection, &change_log);
+    if(!found.ok())
+        return found;
+
+    if(request->epoch() != change_log->getEpoch())
+        return euclides_grpc_error("The change log epoch changed, a new snapshot is required.",
+                                   grpc::StatusCode::OUT_OF_RANGE);
+
+    LOG(INFO) << "Streaming the changes after sequence " << request->after_sequence() << ".";
+
+    uint64_t sequence = request->after_sequence();
+    std::vector<ChangeRecord> records;
+    ChangeEvent event;
+    while(!context->IsCancelled())
+    {
+        const ChangeLogStatus status = change_log->readChanges(sequence, k_stream_batch,
+                                                               k_stream_wait_ms, &records);
+        if(status == ChangeLogStatus::TRUNCATED)
+            return euclides_grpc_error("The replica is too far behind, a new snapshot is required.",
+                                       grpc::StatusCode::OUT_OF_RANGE);
+
+        // Heartbeats let idle replicas refresh their indexes, and close
+        // the stream of replicas that went away
+        if(records.empty())
+        {
+            event.Clear();
+            event.set_type(ChangeEvent::HEARTBEAT);
+            event.set_sequence(sequence);
+            if(!writer->Write(event))
+                break;
+            continue;
+        }
+
+        for(const ChangeRecord &record : records)
+        {
+            event.Clear();
+            event.set_type(record.mRemoved ? ChangeEvent::REMOVE : ChangeEvent::PUT);
+            event.set_sequence(record.mSequence);
+            event.set_item_id(record.mItemId);
+            if(!record.mRemoved)
+                event.mutable_item()->ParseFromString(record.mItemData);
+            if(!writer->Write(event))
+                return grpc::Status::CANCELLED;
+            sequence = record.mSequence;
+        }
+    }
+
+    LOG(INFO) << "Change stream closed at sequence " << sequence << ".";
+    return grpc::Status::OK;
+}
+
 grpc::Status
 SimilarServiceImpl::Shutdown(grpc::ServerContext *context, const ShutdownRequest *request, ShutdownReply *reply)
 {
@@ -291,7 +1073,7 @@ SimilarServiceImpl::Shutdown(grpc::ServerContext *context, const ShutdownRequest
     if(shutdown_type == ShutdownType::REFRESH_INDEX)
     {
         // Check if the search engine requires it
-        if(!mSearchEngine->requireRefresh())
+        if(!mCollections->getCollection("")->mSearchEngine->requireRefresh())
         {
             LOG(INFO) << "The selected search engine doesn't requires index refresh.";
             reply->set_shutdown(false);
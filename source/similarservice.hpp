@@ -11,6 +11,9 @@
 #include "torchmanager.hpp"
 #include "databasemanager.hpp"
 #include "searchengine.hpp"
+#include "admissioncontrol.hpp"
+#include "collectionmanager.hpp"
+#include "tracing.hpp"
 
 using namespace euclidesproto;
 
@@ -24,8 +27,10 @@ class SimilarServiceImpl final : public Similar::Service
 {
 public:
     SimilarServiceImpl(const TorchManager::TorchManagerPtr &torch_manager,
-                       const DatabaseManager::DatabaseManagerPtr &database_manager,
-                       const SearchEngine::SearchEnginePtr &search_engine,
+                       const CollectionManager::CollectionManagerPtr &collections,
+                       const AdmissionController::AdmissionControllerPtr &admission,
+                       const Tracer::TracerPtr &tracer,
+                       bool read_only,
                        std::promise<ShutdownType> shutdown_request);
 
 public:
@@ -35,16 +40,69 @@ public:
     grpc::Status FindSimilarImageById(grpc::ServerContext *context,
                                   const FindSimilarImageByIdRequest *request,
                                   FindSimilarImageReply *reply) override;
+    grpc::Status FindWithinRadius(grpc::ServerContext *context,
+                                  const FindWithinRadiusRequest *request,
+                                  FindSimilarImageReply *reply) override;
+    grpc::Status FindSimilarByVector(grpc::ServerContext *context,
+                                     const FindSimilarByVectorRequest *request,
+                                     FindSimilarImageReply *reply) override;
     grpc::Status AddImage(grpc::ServerContext *context, const AddImageRequest *request,
                           AddImageReply *reply) override;
     grpc::Status RemoveImage(grpc::ServerContext *context, const RemoveImageRequest *request,
                           RemoveImageReply *reply) override;
+    grpc::Status ReloadModels(grpc::ServerContext *context, const ReloadModelsRequest *request,
+                              ReloadModelsReply *reply) override;
+    grpc::Status RefreshCollection(grpc::ServerContext *context,
+                                   const RefreshCollectionRequest *request,
+                                   RefreshCollectionReply *reply) override;
+    grpc::Status ListCollections(grpc::ServerContext *context,
+                                 const ListCollectionsRequest *request,
+                                 ListCollectionsReply *reply) override;
+    grpc::Status GetSlowQueries(grpc::ServerContext *context,
+                                const GetSlowQueriesRequest *request,
+                                GetSlowQueriesReply *reply) override;
+    grpc::Status GetSnapshot(grpc::ServerContext *context,
+                             const GetSnapshotRequest *request,
+                             grpc::ServerWriter<SnapshotChunk> *writer) override;
+    grpc::Status StreamChanges(grpc::ServerContext *context,
+                               const StreamChangesRequest *request,
+                               grpc::ServerWriter<ChangeEvent> *writer) override;
     grpc::Status Shutdown(grpc::ServerContext *context, const ShutdownRequest *request,
                              ShutdownReply *reply) override;
 
 private:
+    /**
+     * Admit a request, returning RESOURCE_EXHAUSTED when rejected.
+     */
+    grpc::Status admitRequest(RequestType type, AdmissionGuard *guard);
+
+    /**
+     * Admit the memory needed to decode an image, returning
+     * RESOURCE_EXHAUSTED when rejected.
+     */
+    grpc::Status admitImage(const std::string &image_data, AdmissionGuard *guard);
+
+    /**
+     * Find the collection of a request, returning an error if it
+     * doesn't exist (and isn't created).
+     */
+    grpc::Status findCollection(const std::string &name, bool create,
+                                CollectionPtr *collection);
+
+    /**
+     * Find the change log of a collection, returning an error if the
+     * collection doesn't exist or its change log is disabled.
+     */
+    grpc::Status findChangeLog(const std::string &name,
+                               CollectionPtr *collection,
+                               ChangeLog::ChangeLogPtr *change_log);
+
     TorchManager::TorchManagerPtr mTorchManager;
-    DatabaseManager::DatabaseManagerPtr mDatabaseManager;
-    SearchEngine::SearchEnginePtr mSearchEngine;
+    CollectionManager::CollectionManagerPtr mCollections;
+    AdmissionController::AdmissionControllerPtr mAdmission;
+    Tracer::TracerPtr mTracer;
+
+    // Replicas only change their items following the primary
+    bool mReadOnly;
     std::promise<ShutdownType> mShutdownRequest;
 };
\ No newline at end of file
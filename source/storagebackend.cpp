@@ -0,0 +1,79 @@
+#include "storagebackend.hpp"
+
+#include "sb_leveldb.hpp"
+#include "sb_segmentlog.hpp"
+
+#include <easylogging++.h>
+
+StorageBackend::~StorageBackend()
+{ }
+
+void StorageBackend::multiGet(const std::vector<std::string> &keys,
+                              std::vector<std::string> *values,
+                              std::vector<bool> *found)
+{
+    values->assign(keys.size(), std::string());
+    found->assign(keys.size(), false);
+    for(size_t i=0; i<keys.size(); i++)
+        (*found)[i] = get(keys[i], &(*values)[i]);
+}
+
+bool StorageBackend::put(const leveldb::Slice &key, const leveldb::Slice &value)
+{
+    leveldb::WriteBatch batch;
+    batch.Put(key, value);
+    return write(&batch, false);
+}
+
+bool StorageBackend::remove(const leveldb::Slice &key)
+{
+    leveldb::WriteBatch batch;
+    batch.Delete(key);
+    return write(&batch, false);
+}
+
+StorageBackend::StorageBackendPtr StorageBackend::build_storage_backend(const INIReader &conf_reader,
+                                                                       const std::string &path)
+{
+    const std::string db_path = path.empty() ?
+                                conf_reader.Get("database", "db_path", "") : path;
+    if(db_path.empty())
+        LOG(FATAL) << "You need to specify a database directory path.";
+
+    const std::string backend = conf_reader.Get("database", "backend", "leveldb");
+
+    StorageBackend::StorageBackendPtr storage;
+    if(backend == "leveldb")
+    {
+        const int block_cache_mb = \
+            static_cast<int>(conf_reader.GetInteger("database", "block_cache_mb", 8));
+        const int write_buffer_mb = \
+            static_cast<int>(conf_reader.GetInteger("database", "write_buffer_mb", 4));
+        const int bloom_bits_per_key = \
+            static_cast<int>(conf_reader.GetInteger("database", "bloom_bits_per_key", 0));
+        const std::string compression = conf_reader.Get("database", "compression", "snappy");
+        if(compression != "snappy" && compression != "none")
+            LOG(FATAL) << "Unknown database compression: " << compression;
+
+        storage = std::make_shared<SBLevelDB>(db_path, block_cache_mb, write_buffer_mb,
+                                              bloom_bits_per_key, compression == "snappy");
+    } else if(backend == "segment_log")
+    {
+        const int segment_size_mb = \
+            static_cast<int>(conf_reader.GetInteger("database", "segment_size_mb", 64));
+        const double compaction_ratio = \
+            conf_reader.GetReal("database", "compaction_ratio", 0.5);
+        const int compaction_interval = \
+            static_cast<int>(conf_reader.GetInteger("database", "compaction_interval", 60));
+
+        storage = std::make_shared<SBSegmentLog>(db_path, segment_size_mb,
+                                                 compaction_ratio, compaction_interval);
+    }
+    else
+    {
+        LOG(FATAL) << "Unknown database backend: " << backend;
+    }
+
+    LOG(INFO) << "Using the " << backend << " database backend.";
+    return storage;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <INIReader.h>
+
+#include <leveldb/iterator.h>
+#include <leveldb/slice.h>
+#include <leveldb/write_batch.h>
+
+/**
+ * This is the interface for the key-value storage used by the database
+ * manager. The LevelDB types are used only as plain data types: the
+ * Slice as a byte view, the WriteBatch as a list of put/delete operations
+ * and the Iterator as the scan interface, so every backend is a drop-in
+ * replacement for the search engines that scan the database.
+ */
+class StorageBackend
+{
+public:
+    typedef std::shared_ptr<StorageBackend> StorageBackendPtr;
+
+    virtual ~StorageBackend() = 0;
+
+    /**
+     * Get the value of a key.
+     * @param key the key
+     * @param value the returning value
+     * @return true if the key was found, false otherwise
+     */
+    virtual bool get(const leveldb::Slice &key, std::string *value) = 0;
+
+    /**
+     * Get the values of many keys at once, all from the same consistent
+     * view of the storage. The default implementation calls get() for
+     * each key, backends override it to amortize the lookups.
+     * @param keys the keys
+     * @param values the returning values, in the same order of the keys
+     * @param found returns, for each key, if it was found
+     */
+    virtual void multiGet(const std::vector<std::string> &keys,
+                          std::vector<std::string> *values,
+                          std::vector<bool> *found);
+
+    /**
+     * Atomically apply all the put/delete operations of a batch.
+     * @param batch the batch of operations
+     * @param sync if the write must be synced to disk before returning
+     * @return true if the batch was applied, false otherwise
+     */
+    virtual bool write(leveldb::WriteBatch *batch, bool sync) = 0;
+
+    /**
+     * Sync all the writes to disk.
+     * @return true if the writes were synced, false otherwise
+     */
+    virtual bool sync() = 0;
+
+    /**
+     * Create an iterator to scan all the items. The iterator works
+     * on a snapshot of the storage taken when it was created, so it isn't
+     * affected by concurrent writes.
+     * @param fill_cache if the items read should be cached
+     * @return the iterator, owned by the caller
+     */
+    virtual leveldb::Iterator *newIterator(bool fill_cache) = 0;
+
+    /**
+     * @return the directory of the storage
+     */
+    virtual std::string getPath() const = 0;
+
+    bool put(const leveldb::Slice &key, const leveldb::Slice &value);
+    bool remove(const leveldb::Slice &key);
+
+    /**
+     * Build the storage backend of the configuration.
+     * @param conf_reader the configuration
+     * @param path the database path, or empty to use the configured one
+     * @return the storage backend
+     */
+    static StorageBackendPtr build_storage_backend(const INIReader &conf_reader,
+                                                   const std::string &path="");
+};
@@ -0,0 +1,70 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/stubs/common.h>
+
+#include "testing.hpp"
+
+#include <easylogging++.h>
+
+INITIALIZE_EASYLOGGINGPP
+
+namespace testing {
+    int g_failures = 0;
+}
+
+namespace {
+    const std::vector<testing::TestCase> k_test_cases = {
+        {"segmentlog_torn_write", test_segmentlog_torn_write},
+        {"segmentlog_tombstone_compaction", test_segmentlog_tombstone_compaction},
+        {"segmented_match_exact", []() { test_engine_match_exact("segmented"); }},
+        {"segmented_incremental_updates", []() { test_engine_incremental_updates("segmented"); }},
+        {"partitioned_match_exact", []() { test_engine_match_exact("partitioned"); }},
+        {"partitioned_incremental_updates", []() { test_engine_incremental_updates("partitioned"); }},
+        {"binary_match_exact", []() { test_engine_match_exact("binary"); }},
+        {"binary_incremental_updates", []() { test_engine_incremental_updates("binary"); }},
+        {"replica_catch_up", test_replica_catch_up},
+    };
+}
+
+/**
+ * Run the test case named by the first argument, or all of them.
+ * @return zero if all the expectations of the tests run hold
+ */
+int main(int argc, char** argv)
+{
+    GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+    el::Configurations log_conf;
+    log_conf.setToDefault();
+    log_conf.setGlobally(el::ConfigurationType::Format,
+                         "[EuclidesDB Tests] %datetime [%level]: %msg");
+    log_conf.setGlobally(el::ConfigurationType::ToFile, "false");
+    el::Loggers::reconfigureAllLoggers(log_conf);
+
+    const std::string selected = (argc > 1) ? argv[1] : "";
+    int failed_tests = 0, tests_run = 0;
+    for(const testing::TestCase &test_case : k_test_cases)
+    {
+        if(!selected.empty() && selected != test_case.mName)
+            continue;
+
+        const int failures = testing::g_failures;
+        test_case.mRun();
+        tests_run++;
+
+        const bool passed = (testing::g_failures == failures);
+        failed_tests += passed ? 0 : 1;
+        std::cout << (passed ? "[PASS] " : "[FAIL] ") << test_case.mName << std::endl;
+    }
+
+    if(tests_run == 0)
+    {
+        std::cerr << "Unknown test case: " << selected << std::endl;
+        return 1;
+    }
+
+    google::protobuf::ShutdownProtobufLibrary();
+    return failed_tests == 0 ? 0 : 1;
+}
@@ -0,0 +1,213 @@
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <torch/torch.h>
+#include <INIReader.h>
+
+#include "databasemanager.hpp"
+#include "sb_leveldb.hpp"
+#include "searchengine.hpp"
+#include "testing.hpp"
+
+namespace {
+    const int k_items = 500;
+    const int k_queries = 20;
+    const int k_top_k = 10;
+
+    // Two rankings are the same when they only differ by items with the
+    // same exact distance, up to the float error of each engine
+    const float k_distance_tolerance = 1e-3f;
+
+    /**
+     * The database and the engine of a test, compared with the exact one,
+     * with the features of the items stored to check the rankings. The
+     * engines are configured to return the exact results: flat indexes,
+     * the queries without classes search all the partitions and the binary
+     * codes rerank all the items.
+     */
+    struct EngineFixture
+    {
+        explicit EngineFixture(const std::string &engine_name)
+        : mEngineName(engine_name), mRng(42)
+        {
+            testing::write_file(mTempDir.path("engines.conf"),
+                "[segmented]\n"
+                "index_type=Flat\n"
+                "memtable_size=64\n"
+                "merge_factor=2\n"
+                "segments_path=" + mTempDir.path("segments") + "\n"
+                "\n"
+                "[partitioned]\n"
+                "index_type=Flat\n"
+                "assign_classes=1\n"
+                "probe_classes=2\n"
+                "\n"
+                "[binary]\n"
+                "bits=64\n"
+                "rerank_factor=100\n");
+
+            mTorchManager = testing::build_test_torch_manager();
+            mDatabaseManager = std::make_shared<DatabaseManager>(
+                std::make_shared<SBLevelDB>(mTempDir.path("db"), 8, 4, 0, false));
+
+            for(int id=0; id<k_items; id++)
+                addItem(testing::make_test_item(id, &mRng));
+
+            INIReader conf_reader(mTempDir.path("engines.conf"));
+            mExact = createEngine(conf_reader, "exact_disk");
+            mEngine = createEngine(conf_reader, mEngineName);
+        }
+
+        SearchEngine::SearchEnginePtr createEngine(const INIReader &conf_reader,
+                                                   const std::string &engine_name)
+        {
+            SearchEngine::SearchEnginePtr engine = \
+                SearchEngine::create_search_engine(conf_reader, engine_name, "",
+                                                   mTorchManager, mDatabaseManager);
+            engine->setModels({testing::k_test_model});
+            engine->setup();
+            return engine;
+        }
+
+        void addItem(const euclidesproto::ItemData &item_data)
+        {
+            EXPECT_TRUE(mDatabaseManager->addItemData(item_data));
+            const auto &features = item_data.vectors(0).features();
+            mFeatures[item_data.item_id()] = std::vector<float>(features.begin(), features.end());
+        }
+
+        void removeItem(int item_id)
+        {
+            EXPECT_TRUE(mDatabaseManager->removeItem(item_id));
+            mFeatures.erase(item_id);
+        }
+
+        float distance(int item_id, const float *query) const
+        {
+            const std::vector<float> &features = mFeatures.at(item_id);
+            float sum = 0.0f;
+            for(int i=0; i<testing::k_test_feature_dim; i++)
+                sum += (features[i] - query[i]) * (features[i] - query[i]);
+            return sum;
+        }
+
+        /**
+         * Check that the engine returns the same top-k items as the exact
+         * engine for a batch of random queries.
+         */
+        void expectSameResults()
+        {
+            std::normal_distribution<float> feature(0.0f, 1.0f);
+            std::vector<float> queries(k_queries * testing::k_test_feature_dim);
+            for(float &value : queries)
+                value = feature(mRng);
+            const torch::Tensor queries_tensor = \
+                torch::from_blob(queries.data(), {k_queries, testing::k_test_feature_dim},
+                                 torch::kFloat).clone();
+
+            const SearchParameters params;
+            std::vector<std::vector<int>> expected_ids, actual_ids;
+            std::vector<std::vector<float>> expected_distances, actual_distances;
+            EXPECT_TRUE(mExact->searchBatch(testing::k_test_model, queries_tensor, k_top_k,
+                                            &expected_ids, &expected_distances, params));
+            EXPECT_TRUE(mEngine->searchBatch(testing::k_test_model, queries_tensor, k_top_k,
+                                             &actual_ids, &actual_distances, params));
+
+            EXPECT_EQ(static_cast<size_t>(k_queries), expected_ids.size());
+            EXPECT_EQ(static_cast<size_t>(k_queries), actual_ids.size());
+            if(expected_ids.size() != actual_ids.size())
+                return;
+
+            for(size_t q=0; q<expected_ids.size(); q++)
+            {
+                const float *query = queries.data() + q * testing::k_test_feature_dim;
+                EXPECT_EQ(static_cast<size_t>(k_top_k), expected_ids[q].size());
+                EXPECT_EQ(expected_ids[q].size(), actual_ids[q].size());
+                if(expected_ids[q].size() != actual_ids[q].size())
+                    continue;
+
+                for(size_t rank=0; rank<expected_ids[q].size(); rank++)
+                {
+                    const int expected = expected_ids[q][rank];
+                    const int actual = actual_ids[q][rank];
+                    if(expected == actual)
+                        continue;
+
+                    // Removed items must never be returned
+                    const bool exists = (mFeatures.count(actual) > 0);
+                    const bool tie = exists &&
+                        std::fabs(distance(expected, query) - distance(actual, query)) <= k_distance_tolerance;
+                    if(!tie)
+                        std::cerr << mEngineName << ": query " << q << " rank " << rank
+                                  << " returned the item " << actual << " instead of "
+                                  << expected << "." << std::endl;
+                    EXPECT_TRUE(tie);
+                }
+            }
+        }
+
+        std::string mEngineName;
+        testing::TempDir mTempDir;
+        std::mt19937 mRng;
+        TorchManager::TorchManagerPtr mTorchManager;
+        DatabaseManager::DatabaseManagerPtr mDatabaseManager;
+        std::map<int, std::vector<float>> mFeatures;
+        SearchEngine::SearchEnginePtr mExact;
+        SearchEngine::SearchEnginePtr mEngine;
+    };
+}
+
+
+void test_engine_match_exact(const std::string &engine_name)
+{
+    EngineFixture fixture(engine_name);
+    fixture.expectSameResults();
+}
+
+void test_engine_incremental_updates(const std::string &engine_name)
+{
+    EngineFixture fixture(engine_name);
+
+    // Items added, replaced and removed while the engines are running,
+    // the writes are applied like the service does: to the database and
+    // then to the engines, which are refreshed if they can't be updated
+    std::vector<euclidesproto::ItemData> added;
+    for(int id=k_items; id<k_items + 100; id++)
+        added.push_back(testing::make_test_item(id, &fixture.mRng));
+    for(int id=0; id<20; id++)
+        added.push_back(testing::make_test_item(id, &fixture.mRng));
+
+    std::vector<int> removed;
+    for(int id=100; id<k_items; id+=8)
+        removed.push_back(id);
+
+    bool refresh = false;
+    for(const euclidesproto::ItemData &item_data : added)
+    {
+        fixture.addItem(item_data);
+        EXPECT_TRUE(fixture.mExact->addItem(item_data));
+        if(!fixture.mEngine->addItem(item_data))
+            refresh = true;
+    }
+
+    for(const int id : removed)
+    {
+        fixture.removeItem(id);
+        EXPECT_TRUE(fixture.mExact->removeItem(id));
+        if(!fixture.mEngine->removeItem(id))
+            refresh = true;
+    }
+
+    // The segmented engine updates its memtables in place
+    if(engine_name == "segmented")
+        EXPECT_TRUE(!refresh);
+    if(refresh)
+        fixture.mEngine->setup();
+
+    fixture.expectSameResults();
+}
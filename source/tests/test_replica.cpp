@@ -0,0 +1,158 @@
+#include <chrono>
+#include <future>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpc++/grpc++.h>
+#include <torch/torch.h>
+#include <INIReader.h>
+
+#include "admissioncontrol.hpp"
+#include "collectionmanager.hpp"
+#include "databasemanager.hpp"
+#include "replica.hpp"
+#include "sb_leveldb.hpp"
+#include "searchengine.hpp"
+#include "similarservice.hpp"
+#include "tracing.hpp"
+#include "testing.hpp"
+
+namespace {
+    // Time given to the replica to apply the snapshot and the changes
+    const std::chrono::seconds k_catch_up_timeout(20);
+    const std::chrono::milliseconds k_poll_interval(100);
+
+    // An item that only the replica has, the snapshot must remove it
+    const int k_stale_item_id = 100000;
+
+    /**
+     * Build a collection manager whose default collection is an exact
+     * search over its own database.
+     */
+    CollectionManager::CollectionManagerPtr build_collections(const INIReader &conf_reader,
+                                                              const TorchManager::TorchManagerPtr &torch_manager,
+                                                              const std::string &db_path,
+                                                              const DatabaseOptions &db_options)
+    {
+        CollectionPtr default_collection = std::make_shared<Collection>();
+        default_collection->mDatabaseManager = std::make_shared<DatabaseManager>(
+            std::make_shared<SBLevelDB>(db_path, 8, 4, 0, false), db_options);
+        default_collection->mSearchEngine = \
+            SearchEngine::create_search_engine(conf_reader, "exact_disk", "", torch_manager,
+                                               default_collection->mDatabaseManager);
+        default_collection->mSearchEngine->setup();
+
+        return CollectionManager::build_collection_manager(conf_reader, torch_manager,
+                                                           db_options, default_collection);
+    }
+
+    /**
+     * @return the serialized data of the items of a database, by item id
+     */
+    std::map<int, std::string> database_items(const DatabaseManager::DatabaseManagerPtr &database_manager)
+    {
+        std::map<int, std::string> items;
+        DatabaseManager::DatabaseIterator it(database_manager->newIterator(false));
+        for (it->SeekToFirst(); it->Valid(); it->Next())
+        {
+            if(it->key().size() != sizeof(int))
+                continue;
+
+            euclidesproto::ItemData item_data;
+            item_data.ParseFromString(it->value().ToString());
+            items[item_data.item_id()] = item_data.SerializeAsString();
+        }
+        return items;
+    }
+}
+
+
+void test_replica_catch_up()
+{
+    testing::TempDir temp_dir;
+    testing::write_file(temp_dir.path("replica.conf"), "[server]\n");
+    INIReader conf_reader(temp_dir.path("replica.conf"));
+    TorchManager::TorchManagerPtr torch_manager = testing::build_test_torch_manager();
+    std::mt19937 rng(42);
+
+    // The primary keeps a change log for its replicas
+    DatabaseOptions primary_options;
+    primary_options.mChangeLogSize = 1000;
+    CollectionManager::CollectionManagerPtr primary = \
+        build_collections(conf_reader, torch_manager, temp_dir.path("primary"), primary_options);
+    DatabaseManager::DatabaseManagerPtr primary_db = primary->getCollection("")->mDatabaseManager;
+
+    std::promise<ShutdownType> shutdown_request;
+    SimilarServiceImpl service(torch_manager, primary,
+                               AdmissionController::build_admission_controller(conf_reader),
+                               Tracer::build_tracer(conf_reader),
+                               false, std::move(shutdown_request));
+
+    int port = 0;
+    grpc::ServerBuilder builder;
+    builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(), &port);
+    builder.RegisterService(&service);
+    std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
+    EXPECT_TRUE(server != nullptr && port > 0);
+    if(server == nullptr || port <= 0)
+        return;
+
+    // Items written before the replica starts only reach it by the snapshot
+    for(int id=0; id<100; id++)
+        EXPECT_TRUE(primary_db->addItemData(testing::make_test_item(id, &rng)));
+
+    CollectionManager::CollectionManagerPtr replica = \
+        build_collections(conf_reader, torch_manager, temp_dir.path("replica"), DatabaseOptions());
+    DatabaseManager::DatabaseManagerPtr replica_db = replica->getCollection("")->mDatabaseManager;
+    EXPECT_TRUE(replica_db->addItemData(testing::make_test_item(k_stale_item_id, &rng)));
+
+    ReplicaFollower follower("127.0.0.1:" + std::to_string(port), {""}, replica, 0);
+    follower.start();
+
+    // Items added, replaced and removed after the snapshot reach it by
+    // the change stream
+    for(int id=100; id<150; id++)
+        EXPECT_TRUE(primary_db->addItemData(testing::make_test_item(id, &rng)));
+    for(int id=0; id<10; id++)
+        EXPECT_TRUE(primary_db->addItemData(testing::make_test_item(id, &rng)));
+    for(int id=10; id<20; id++)
+        EXPECT_TRUE(primary_db->removeItem(id));
+
+    const std::map<int, std::string> expected = database_items(primary_db);
+    EXPECT_EQ(static_cast<size_t>(140), expected.size());
+
+    const std::chrono::steady_clock::time_point deadline = \
+        std::chrono::steady_clock::now() + k_catch_up_timeout;
+    bool caught_up = false;
+    while(!caught_up && std::chrono::steady_clock::now() < deadline)
+    {
+        caught_up = (database_items(replica_db) == expected);
+        if(!caught_up)
+            std::this_thread::sleep_for(k_poll_interval);
+    }
+    EXPECT_TRUE(caught_up);
+
+    // The replica searches the items it received
+    euclidesproto::ItemData last_item;
+    const bool found = replica_db->getItemDataByKey(149, last_item);
+    EXPECT_TRUE(found);
+    if(found)
+    {
+        std::vector<float> query(last_item.vectors(0).features().begin(),
+                                 last_item.vectors(0).features().end());
+        std::vector<int> top_ids;
+        std::vector<float> distances;
+        replica->getCollection("")->mSearchEngine->search(
+            testing::k_test_model,
+            torch::from_blob(query.data(), {testing::k_test_feature_dim}, torch::kFloat).clone(),
+            1, &top_ids, &distances, SearchParameters());
+        EXPECT_EQ(std::vector<int>({149}), top_ids);
+    }
+
+    follower.stop();
+    server->Shutdown(std::chrono::system_clock::now() + std::chrono::seconds(1));
+}
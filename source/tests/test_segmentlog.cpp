@@ -0,0 +1,194 @@
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <leveldb/write_batch.h>
+
+#include "sb_segmentlog.hpp"
+#include "testing.hpp"
+
+namespace {
+    // The segment log record format: a header of 4 uint32 (type, key
+    // size, value size and crc) followed by the key and the value
+    const size_t k_segment_header_size = 8;
+    const size_t k_record_header_size = 4 * sizeof(uint32_t);
+
+    std::string make_key(const char *prefix, int i)
+    {
+        char key[32];
+        snprintf(key, sizeof(key), "%s_%02d", prefix, i);
+        return key;
+    }
+
+    std::string make_value(int i, size_t size)
+    {
+        return std::string(size, static_cast<char>('a' + i % 26));
+    }
+
+    void put(SBSegmentLog *log, const std::string &key, const std::string &value)
+    {
+        leveldb::WriteBatch batch;
+        batch.Put(key, value);
+        EXPECT_TRUE(log->write(&batch, true));
+    }
+
+    void remove_key(SBSegmentLog *log, const std::string &key)
+    {
+        leveldb::WriteBatch batch;
+        batch.Delete(key);
+        EXPECT_TRUE(log->write(&batch, true));
+    }
+
+    /**
+     * @return the total size of the segment files of the database
+     */
+    off_t segment_files_size(const std::string &path)
+    {
+        off_t total = 0;
+        DIR *dir = opendir(path.c_str());
+        if(dir == nullptr)
+            return total;
+
+        while(struct dirent *entry = readdir(dir))
+        {
+            const std::string name = entry->d_name;
+            if(name.compare(0, 8, "segment_") != 0)
+                continue;
+
+            struct stat file_stat;
+            if(stat((path + "/" + name).c_str(), &file_stat) == 0)
+                total += file_stat.st_size;
+        }
+        closedir(dir);
+        return total;
+    }
+}
+
+
+void test_segmentlog_torn_write()
+{
+    testing::TempDir temp_dir;
+    const std::string db_path = temp_dir.path("segmentlog");
+    const size_t value_size = 1000;
+
+    {
+        SBSegmentLog log(db_path, 1, 0.5, 0);
+        for(int i=0; i<5; i++)
+            put(&log, make_key("item", i), make_value(i, value_size));
+    }
+
+    // A crash in the middle of the last write leaves only the first half
+    // of its value on disk, the records have the same size
+    const size_t record_size = k_record_header_size + make_key("item", 0).size() + value_size;
+    const off_t last_record = static_cast<off_t>(k_segment_header_size + 4 * record_size);
+    const std::string torn_tail(record_size / 2, '\0');
+    {
+        const int fd = open((db_path + "/segment_00000001.log").c_str(), O_WRONLY);
+        EXPECT_TRUE(fd >= 0);
+        const ssize_t written = pwrite(fd, torn_tail.data(), torn_tail.size(),
+                                       last_record + static_cast<off_t>(record_size - torn_tail.size()));
+        EXPECT_EQ(static_cast<ssize_t>(torn_tail.size()), written);
+        close(fd);
+    }
+
+    // The torn record is dropped and the records before it are intact
+    {
+        SBSegmentLog log(db_path, 1, 0.5, 0);
+        std::string value;
+        for(int i=0; i<4; i++)
+        {
+            EXPECT_TRUE(log.get(make_key("item", i), &value));
+            EXPECT_EQ(make_value(i, value_size), value);
+        }
+        EXPECT_TRUE(!log.get(make_key("item", 4), &value));
+
+        // The writes go on from the end of the valid records
+        put(&log, make_key("item", 5), make_value(5, value_size));
+    }
+
+    {
+        SBSegmentLog log(db_path, 1, 0.5, 0);
+        std::string value;
+        for(int i=0; i<4; i++)
+            EXPECT_TRUE(log.get(make_key("item", i), &value));
+        EXPECT_TRUE(!log.get(make_key("item", 4), &value));
+        EXPECT_TRUE(log.get(make_key("item", 5), &value));
+        EXPECT_EQ(make_value(5, value_size), value);
+    }
+}
+
+void test_segmentlog_tombstone_compaction()
+{
+    testing::TempDir temp_dir;
+    const std::string db_path = temp_dir.path("segmentlog");
+
+    // With 1MB segments and 64KB values each segment holds 15 records:
+    // items 0-14 go into the segment 1 and items 15-29 into the segment 2
+    const size_t value_size = 64 * 1024;
+    auto expect_items = [&](SBSegmentLog *log, int first_live, int fills) {
+        std::string value;
+        for(int i=0; i<30; i++)
+        {
+            const bool live = (i >= first_live && i < 15);
+            EXPECT_EQ(live, log->get(make_key("item", i), &value));
+            if(live)
+                EXPECT_EQ(make_value(i, value_size), value);
+        }
+        for(int i=0; i<fills; i++)
+        {
+            EXPECT_TRUE(log->get(make_key("fill", i), &value));
+            EXPECT_EQ(make_value(i, value_size), value);
+        }
+    };
+
+    {
+        SBSegmentLog log(db_path, 1, 0.5, 0);
+        for(int i=0; i<30; i++)
+            put(&log, make_key("item", i), make_value(i, value_size));
+
+        // The tombstones go into the segment 2, which is sealed by the
+        // next record. Segment 2 is all dead and compacted, but it must
+        // keep the tombstones of the items 0-4 of segment 1.
+        for(int i=0; i<5; i++)
+            remove_key(&log, make_key("item", i));
+        for(int i=15; i<30; i++)
+            remove_key(&log, make_key("item", i));
+        for(int i=0; i<2; i++)
+            put(&log, make_key("fill", i), make_value(i, value_size));
+
+        const off_t size_before = segment_files_size(db_path);
+        log.compact();
+        EXPECT_TRUE(segment_files_size(db_path) < size_before);
+        expect_items(&log, 5, 2);
+    }
+
+    // The deleted items of segment 1 must not come back
+    {
+        SBSegmentLog log(db_path, 1, 0.5, 0);
+        expect_items(&log, 5, 2);
+
+        // Now segment 1 is all dead and the oldest, so it is removed and
+        // the tombstones of segment 2 aren't needed anymore
+        for(int i=5; i<15; i++)
+            remove_key(&log, make_key("item", i));
+        for(int i=2; i<30; i++)
+            put(&log, make_key("fill", i), make_value(i, value_size));
+
+        const off_t size_before = segment_files_size(db_path);
+        log.compact();
+        EXPECT_TRUE(segment_files_size(db_path) < size_before);
+        EXPECT_TRUE(access((db_path + "/segment_00000001.log").c_str(), F_OK) != 0);
+        expect_items(&log, 15, 30);
+    }
+
+    {
+        SBSegmentLog log(db_path, 1, 0.5, 0);
+        expect_items(&log, 15, 30);
+    }
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <ftw.h>
+#include <unistd.h>
+
+#include "euclidesproto.grpc.pb.h"
+#include "torchmanager.hpp"
+
+
+/**
+ * A minimal test harness, the tests are plain functions that report
+ * their failed expectations and keep going, so a run shows all of them.
+ */
+namespace testing {
+
+// Number of failed expectations of the test running
+extern int g_failures;
+
+/**
+ * A test case, registered in the list of the test runner.
+ */
+struct TestCase
+{
+    std::string mName;
+    std::function<void()> mRun;
+};
+
+inline void report_failure(const char *file, int line, const std::string &message)
+{
+    std::cerr << file << ":" << line << ": " << message << std::endl;
+    g_failures++;
+}
+
+/**
+ * A temporary directory, removed with its contents when it goes out of
+ * scope.
+ */
+class TempDir
+{
+public:
+    TempDir()
+    {
+        char path[] = "/tmp/euclidesdb_test_XXXXXX";
+        if(mkdtemp(path) == nullptr)
+        {
+            std::cerr << "Unable to create a temporary directory." << std::endl;
+            std::abort();
+        }
+        mPath = path;
+    }
+
+    ~TempDir()
+    {
+        nftw(mPath.c_str(), [](const char *path, const struct stat*, int, struct FTW*) {
+            return remove(path);
+        }, 16, FTW_DEPTH | FTW_PHYS);
+    }
+
+    TempDir(const TempDir&) = delete;
+    TempDir &operator=(const TempDir&) = delete;
+
+    std::string path(const std::string &name) const
+    { return mPath + "/" + name; }
+
+    const std::string &getPath() const
+    { return mPath; }
+
+private:
+    std::string mPath;
+};
+
+/**
+ * Write a text file, e.g. a configuration read by INIReader.
+ */
+inline void write_file(const std::string &file_name, const std::string &contents)
+{
+    std::ofstream file(file_name);
+    file << contents;
+}
+
+// The model space of the test items
+const std::string k_test_model = "test";
+const int k_test_feature_dim = 16;
+const int k_test_prediction_dim = 8;
+
+/**
+ * Build a torch manager with the test model. The model is loaded lazily
+ * and the tests never run a forward, so it has no traced module file.
+ */
+inline TorchManager::TorchManagerPtr build_test_torch_manager()
+{
+    TorchManager::TorchManagerPtr torch_manager = std::make_shared<TorchManager>(true);
+    std::string error;
+    if(!torch_manager->addModule(k_test_model, "/nonexistent/test.pth",
+                                 TorchModelProp(k_test_prediction_dim, k_test_feature_dim),
+                                 TorchModelLoadOptions(), &error))
+    {
+        std::cerr << "Unable to add the test model: " << error << std::endl;
+        std::abort();
+    }
+    return torch_manager;
+}
+
+/**
+ * Make an item of the test model with random features and predictions.
+ */
+inline euclidesproto::ItemData make_test_item(int item_id, std::mt19937 *rng)
+{
+    std::normal_distribution<float> feature(0.0f, 1.0f);
+    std::uniform_real_distribution<float> score(0.0f, 1.0f);
+
+    euclidesproto::ItemData item_data;
+    item_data.set_item_id(item_id);
+    euclidesproto::ItemVectors *vectors = item_data.add_vectors();
+    vectors->set_model(k_test_model);
+    for(int i=0; i<k_test_feature_dim; i++)
+        vectors->add_features(feature(*rng));
+    for(int i=0; i<k_test_prediction_dim; i++)
+        vectors->add_predictions(score(*rng));
+    return item_data;
+}
+
+}
+
+#define EXPECT_TRUE(condition) \
+    do { \
+        if(!(condition)) \
+            testing::report_failure(__FILE__, __LINE__, "Expected: " #condition); \
+    } while(0)
+
+#define EXPECT_EQ(expected, actual) \
+    do { \
+        if(!((expected) == (actual))) \
+            testing::report_failure(__FILE__, __LINE__, \
+                                    "Expected: " #expected " == " #actual); \
+    } while(0)
+
+// The test cases of each file
+void test_segmentlog_torn_write();
+void test_segmentlog_tombstone_compaction();
+void test_engine_match_exact(const std::string &engine_name);
+void test_engine_incremental_updates(const std::string &engine_name);
+void test_replica_catch_up();
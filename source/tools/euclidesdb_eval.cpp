@@ -0,0 +1,527 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <torch/torch.h>
+
+#include <EuclidesConfig.h>
+#include <INIReader.h>
+#include <CLI11.hpp>
+
+#include "torchmanager.hpp"
+#include "databasemanager.hpp"
+#include "storagebackend.hpp"
+#include "searchengine.hpp"
+
+#include <easylogging++.h>
+
+INITIALIZE_EASYLOGGINGPP
+
+// BLAS single precision matrix multiplication (Fortran interface)
+#ifndef FINTEGER
+#define FINTEGER int
+#endif
+
+extern "C" {
+int sgemm_(const char *transa, const char *transb, FINTEGER *m, FINTEGER *n,
+           FINTEGER *k, const float *alpha, const float *a, FINTEGER *lda,
+           const float *b, FINTEGER *ldb, float *beta, float *c, FINTEGER *ldc);
+}
+
+namespace {
+    // Number of database vectors compared at once for the ground truth
+    const int k_ground_truth_block = 4096;
+
+    // Queries run before each measurement to warm up caches
+    const int k_warmup_queries = 10;
+
+    const std::string k_run_section_prefix = "run:";
+}
+
+/**
+ * The metric used to compute the exact ground truth, it must match the
+ * metric of the engines evaluated (e.g. angular for Annoy).
+ */
+enum class EvalMetric
+{
+    L2,
+    INNER_PRODUCT,
+    ANGULAR
+};
+
+/**
+ * All the vectors of a model space, read from the database.
+ */
+struct EvalDataset
+{
+    int mDim;
+    std::vector<int> mIds;
+    std::vector<float> mVectors;
+
+    int size() const { return static_cast<int>(mIds.size()); }
+    const float *vector(int i) const { return mVectors.data() + static_cast<size_t>(i) * mDim; }
+};
+
+/**
+ * The measurements of an engine with a set of search parameters.
+ */
+struct EvalResult
+{
+    std::string mRun;
+    std::string mEngine;
+    int mNprobe;
+    int mEfSearch;
+    int mSearchK;
+    double mBuildSeconds;
+    double mRecall;
+    double mQps;
+    double mLatencyP50Ms;
+    double mLatencyP99Ms;
+};
+
+/**
+ * Parse a comma-separated list of integers, used for the parameter sweeps.
+ * @param value the list, e.g. "1,8,32"
+ * @return the integers, or a single -1 (the engine default) if empty
+ */
+std::vector<int> parse_int_list(const std::string &value)
+{
+    std::vector<int> values;
+    std::stringstream stream(value);
+    std::string item;
+    while(std::getline(stream, item, ','))
+    {
+        if(item.find_first_not_of(" \t") == std::string::npos)
+            continue;
+        values.push_back(std::stoi(item));
+    }
+
+    if(values.empty())
+        values.push_back(-1);
+    return values;
+}
+
+/**
+ * Read all the vectors of a model space from the database.
+ * @param database_manager the database manager
+ * @param model_name the model space
+ * @param dim the feature dimension of the model
+ * @param dataset the returning dataset
+ */
+void load_dataset(const DatabaseManager::DatabaseManagerPtr &database_manager,
+                  const std::string &model_name, int dim, EvalDataset *dataset)
+{
+    dataset->mDim = dim;
+    dataset->mIds.clear();
+    dataset->mVectors.clear();
+
+    DatabaseManager::DatabaseIterator it(database_manager->newIterator(false));
+    for (it->SeekToFirst(); it->Valid(); it->Next())
+    {
+        euclidesproto::ItemData item_data;
+        item_data.ParseFromString(it->value().ToString());
+
+        for(const auto &vector : item_data.vectors())
+        {
+            if(vector.model() != model_name || vector.features_size() != dim)
+                continue;
+
+            dataset->mIds.push_back(item_data.item_id());
+            dataset->mVectors.insert(dataset->mVectors.end(),
+                                     vector.features().begin(),
+                                     vector.features().end());
+        }
+    }
+}
+
+/**
+ * Compute the exact top-k neighbors of the queries by brute force, the
+ * inner products are computed in blocks with a matrix product. The query
+ * item itself is excluded from its neighbors.
+ * @param dataset the database vectors
+ * @param queries the indexes of the query vectors in the dataset
+ * @param top_k number of neighbors
+ * @param metric the distance metric
+ * @param ground_truth returns the ids of the neighbors of each query
+ */
+void compute_ground_truth(const EvalDataset &dataset, const std::vector<int> &queries,
+                          int top_k, EvalMetric metric,
+                          std::vector<std::vector<int>> *ground_truth)
+{
+    const int dim = dataset.mDim;
+    const int n = dataset.size();
+    const int nq = static_cast<int>(queries.size());
+
+    // Angular is the inner product of normalized vectors
+    std::vector<float> normalized;
+    const float *vectors = dataset.mVectors.data();
+    if(metric == EvalMetric::ANGULAR)
+    {
+        normalized = dataset.mVectors;
+        for(int i=0; i<n; i++)
+        {
+            float *x = normalized.data() + static_cast<size_t>(i) * dim;
+            float norm = 0.0f;
+            for(int j=0; j<dim; j++)
+                norm += x[j] * x[j];
+            norm = std::sqrt(norm);
+            if(norm > 0.0f)
+                for(int j=0; j<dim; j++)
+                    x[j] /= norm;
+        }
+        vectors = normalized.data();
+    }
+
+    std::vector<float> query_vectors(static_cast<size_t>(nq) * dim);
+    for(int q=0; q<nq; q++)
+        std::copy(vectors + static_cast<size_t>(queries[q]) * dim,
+                  vectors + static_cast<size_t>(queries[q] + 1) * dim,
+                  query_vectors.data() + static_cast<size_t>(q) * dim);
+
+    // The squared norm of the query is the same for all items, so the
+    // l2 ranking only needs ||x||^2 - 2 * <q, x>.
+    std::vector<float> norms(n, 0.0f);
+    if(metric == EvalMetric::L2)
+        for(int i=0; i<n; i++)
+        {
+            const float *x = vectors + static_cast<size_t>(i) * dim;
+            for(int j=0; j<dim; j++)
+                norms[i] += x[j] * x[j];
+        }
+
+    // One max-heap of (distance, index) per query
+    typedef std::pair<float, int> candidate_t;
+    std::vector<std::priority_queue<candidate_t>> heaps(nq);
+    std::vector<float> block_ip(static_cast<size_t>(k_ground_truth_block) * nq);
+
+    for(int start=0; start<n; start+=k_ground_truth_block)
+    {
+        const int block_size = std::min(k_ground_truth_block, n - start);
+        float one = 1.0f, zero = 0.0f;
+        FINTEGER m = block_size, fnq = nq, k = dim;
+        sgemm_("Transpose", "Not transpose", &m, &fnq, &k, &one,
+               vectors + static_cast<size_t>(start) * dim, &k,
+               query_vectors.data(), &k, &zero, block_ip.data(), &m);
+
+        #pragma omp parallel for
+        for(int q=0; q<nq; q++)
+        {
+            std::priority_queue<candidate_t> &heap = heaps[q];
+            const float *query_ip = block_ip.data() + static_cast<size_t>(q) * block_size;
+            for(int j=0; j<block_size; j++)
+            {
+                const int index = start + j;
+                if(index == queries[q])
+                    continue;
+
+                const float distance = (metric == EvalMetric::L2) ?
+                                       norms[index] - 2.0f * query_ip[j] :
+                                       -query_ip[j];
+                if(static_cast<int>(heap.size()) < top_k)
+                    heap.emplace(distance, index);
+                else if(distance < heap.top().first)
+                {
+                    heap.pop();
+                    heap.emplace(distance, index);
+                }
+            }
+        }
+    }
+
+    ground_truth->assign(nq, std::vector<int>());
+    for(int q=0; q<nq; q++)
+    {
+        std::vector<int> &neighbors = (*ground_truth)[q];
+        neighbors.resize(heaps[q].size());
+        for(size_t i=neighbors.size(); i>0; i--)
+        {
+            neighbors[i - 1] = dataset.mIds[heaps[q].top().second];
+            heaps[q].pop();
+        }
+    }
+}
+
+/**
+ * Search the queries one at a time, measuring the recall@k against the
+ * ground truth and the latency of each query.
+ * @param query_vectors the queries in the index space of the model
+ * @param query_dim the dimension of the index space
+ * @return the result, without the run, engine and build time
+ */
+EvalResult evaluate_search(const SearchEngine::SearchEnginePtr &search_engine,
+                           const std::string &model_name, const EvalDataset &dataset,
+                           const std::vector<int> &queries,
+                           const std::vector<float> &query_vectors, int query_dim,
+                           const std::vector<std::vector<int>> &ground_truth,
+                           int top_k, const SearchParameters &params)
+{
+    const int nq = static_cast<int>(queries.size());
+    auto query_tensor = [&](int q) {
+        float *data = const_cast<float*>(query_vectors.data()) + static_cast<size_t>(q) * query_dim;
+        return torch::from_blob(data, {1, query_dim}, torch::kFloat);
+    };
+
+    std::vector<int> top_ids;
+    std::vector<float> distances;
+    for(int q=0; q<std::min(nq, k_warmup_queries); q++)
+        search_engine->search(model_name, query_tensor(q), top_k + 1,
+                              &top_ids, &distances, params);
+
+    std::vector<double> latencies(nq);
+    double total_recall = 0.0;
+    const auto start = std::chrono::steady_clock::now();
+    for(int q=0; q<nq; q++)
+    {
+        top_ids.clear();
+        distances.clear();
+
+        // One more result since the query item is found by itself
+        const auto query_start = std::chrono::steady_clock::now();
+        search_engine->search(model_name, query_tensor(q), top_k + 1,
+                              &top_ids, &distances, params);
+        const auto query_end = std::chrono::steady_clock::now();
+        latencies[q] = std::chrono::duration<double, std::milli>(query_end - query_start).count();
+
+        const int query_id = dataset.mIds[queries[q]];
+        top_ids.erase(std::remove(top_ids.begin(), top_ids.end(), query_id), top_ids.end());
+        if(static_cast<int>(top_ids.size()) > top_k)
+            top_ids.resize(top_k);
+
+        const std::vector<int> &truth = ground_truth[q];
+        int hits = 0;
+        for(const int id : top_ids)
+            if(std::find(truth.begin(), truth.end(), id) != truth.end())
+                hits++;
+        if(!truth.empty())
+            total_recall += static_cast<double>(hits) / truth.size();
+    }
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::sort(latencies.begin(), latencies.end());
+    EvalResult result;
+    result.mNprobe = params.mNprobe;
+    result.mEfSearch = params.mEfSearch;
+    result.mSearchK = params.mSearchK;
+    result.mRecall = total_recall / nq;
+    result.mQps = elapsed > 0.0 ? nq / elapsed : 0.0;
+    result.mLatencyP50Ms = latencies[nq / 2];
+    result.mLatencyP99Ms = latencies[std::min(nq - 1, static_cast<int>(nq * 0.99))];
+    return result;
+}
+
+void print_table(const std::vector<EvalResult> &results, int top_k)
+{
+    std::printf("%-20s %-11s %7s %9s %9s %9s %9s %10s %10s %10s\n",
+                "run", "engine", "nprobe", "ef_search", "search_k", "build(s)",
+                ("recall@" + std::to_string(top_k)).c_str(), "qps", "p50(ms)", "p99(ms)");
+    for(const EvalResult &result : results)
+        std::printf("%-20s %-11s %7d %9d %9d %9.2f %9.4f %10.1f %10.3f %10.3f\n",
+                    result.mRun.c_str(), result.mEngine.c_str(), result.mNprobe,
+                    result.mEfSearch, result.mSearchK, result.mBuildSeconds,
+                    result.mRecall, result.mQps, result.mLatencyP50Ms,
+                    result.mLatencyP99Ms);
+}
+
+void write_json(const std::string &filename, const std::string &model_name,
+                int dataset_size, int num_queries, int top_k,
+                const std::vector<EvalResult> &results)
+{
+    std::ofstream output(filename);
+    if(!output.is_open())
+        LOG(FATAL) << "Cannot open the output file: " << filename;
+
+    output << "{\"model\":\"" << model_name << "\",\"items\":" << dataset_size
+           << ",\"queries\":" << num_queries << ",\"top_k\":" << top_k
+           << ",\"results\":[";
+    for(size_t i=0; i<results.size(); i++)
+    {
+        const EvalResult &result = results[i];
+        output << (i > 0 ? "," : "") << "\n{"
+               << "\"run\":\"" << result.mRun << "\","
+               << "\"engine\":\"" << result.mEngine << "\","
+               << "\"nprobe\":" << result.mNprobe << ","
+               << "\"ef_search\":" << result.mEfSearch << ","
+               << "\"search_k\":" << result.mSearchK << ","
+               << "\"build_seconds\":" << result.mBuildSeconds << ","
+               << "\"recall\":" << result.mRecall << ","
+               << "\"qps\":" << result.mQps << ","
+               << "\"latency_p50_ms\":" << result.mLatencyP50Ms << ","
+               << "\"latency_p99_ms\":" << result.mLatencyP99Ms << "}";
+    }
+    output << "\n]}" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+    CLI::App app{"EuclidesDB search engine evaluation"};
+    std::string config_filename;
+    std::string eval_filename;
+    std::string output_filename;
+    app.add_option("-c,--config", config_filename, "EuclidesDB configuration file")
+        ->required()
+        ->check(CLI::ExistingFile);
+    app.add_option("-e,--eval", eval_filename, "Evaluation configuration file")
+        ->required()
+        ->check(CLI::ExistingFile);
+    app.add_option("-o,--output", output_filename, "JSON output file");
+    CLI11_PARSE(app, argc, argv);
+
+    el::Configurations log_conf;
+    log_conf.setToDefault();
+    log_conf.setGlobally(el::ConfigurationType::Format,
+                         "[EuclidesDB Eval] %datetime [%level]: %msg");
+    log_conf.setGlobally(el::ConfigurationType::ToFile, "false");
+    el::Loggers::reconfigureAllLoggers(log_conf);
+
+    INIReader conf_reader(config_filename);
+    if(conf_reader.ParseError() < 0)
+        LOG(FATAL) << "Unable to parse the configuration file: " << config_filename;
+
+    INIReader eval_reader(eval_filename);
+    if(eval_reader.ParseError() < 0)
+        LOG(FATAL) << "Unable to parse the evaluation file: " << eval_filename;
+
+    const std::string model_name = eval_reader.Get("eval", "model", "");
+    if(model_name.empty())
+        LOG(FATAL) << "You need to specify the model to evaluate.";
+
+    const int num_queries = static_cast<int>(eval_reader.GetInteger("eval", "queries", 1000));
+    const int top_k = static_cast<int>(eval_reader.GetInteger("eval", "top_k", 10));
+    const unsigned int seed = static_cast<unsigned int>(eval_reader.GetInteger("eval", "seed", 42));
+
+    const std::string metric_name = eval_reader.Get("eval", "metric", "l2");
+    EvalMetric metric = EvalMetric::L2;
+    if(metric_name == "inner_product")
+        metric = EvalMetric::INNER_PRODUCT;
+    else if(metric_name == "angular")
+        metric = EvalMetric::ANGULAR;
+    else if(metric_name != "l2")
+        LOG(FATAL) << "Unknown evaluation metric: " << metric_name;
+
+    // Only the model properties are needed, the modules are never loaded
+    const std::string model_path = conf_reader.Get("models", "dir_path", "");
+    TorchManager::TorchManagerPtr torch_manager = std::make_shared<TorchManager>(true);
+    torch_manager->populateFromDir(model_path);
+    if(!torch_manager->hasModule(model_name))
+        LOG(FATAL) << "Cannot find the module: " << model_name;
+
+    // Collections are databases in sub-directories of the collections path
+    const std::string collection = eval_reader.Get("eval", "collection", "");
+    std::string db_path;
+    if(!collection.empty())
+        db_path = conf_reader.Get("database", "collections_path", "") + "/" + collection;
+
+    StorageBackend::StorageBackendPtr storage = \
+        StorageBackend::build_storage_backend(conf_reader, db_path);
+    DatabaseManager::DatabaseManagerPtr database_manager = \
+        std::make_shared<DatabaseManager>(storage);
+
+    // Feature transforms not trained yet are trained here, so they can
+    // be trained and evaluated offline before the server starts
+    torch_manager->trainTransforms(database_manager);
+    const FeatureTransform::FeatureTransformPtr transform = torch_manager->getTransform(model_name);
+
+    // The ground truth uses the full features, unless only the reduced
+    // ones are stored
+    EvalDataset dataset;
+    const int dim = torch_manager->getModuleProps(model_name).getFeatureDim();
+    load_dataset(database_manager, model_name, dim, &dataset);
+    if(dataset.size() == 0 && transform != nullptr)
+        load_dataset(database_manager, model_name, transform->getOutputDim(), &dataset);
+    if(dataset.size() <= top_k)
+        LOG(FATAL) << "The model space has only " << dataset.size() << " items.";
+    LOG(INFO) << "Loaded " << dataset.size() << " items of the model " << model_name;
+
+    // Sample the queries from the database, without repetition
+    std::vector<int> queries(dataset.size());
+    for(int i=0; i<dataset.size(); i++)
+        queries[i] = i;
+    std::mt19937 generator(seed);
+    std::shuffle(queries.begin(), queries.end(), generator);
+    queries.resize(std::min(num_queries, dataset.size()));
+
+    // The engines are searched in the index space of the model
+    const int query_dim = (transform == nullptr) ? dataset.mDim : transform->getOutputDim();
+    std::vector<float> query_vectors(queries.size() * query_dim);
+    for(size_t q=0; q<queries.size(); q++)
+    {
+        const float *query = dataset.vector(queries[q]);
+        if(dataset.mDim == query_dim)
+            std::copy(query, query + query_dim, query_vectors.begin() + q * query_dim);
+        else
+            transform->apply(1, query, query_vectors.data() + q * query_dim);
+    }
+
+    std::vector<std::vector<int>> ground_truth;
+    {
+        const auto start = std::chrono::steady_clock::now();
+        compute_ground_truth(dataset, queries, top_k, metric, &ground_truth);
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        LOG(INFO) << "Ground truth of " << queries.size() << " queries computed in "
+                  << elapsed << "s.";
+    }
+
+    std::vector<EvalResult> results;
+    for(const std::string &section : eval_reader.Sections())
+    {
+        if(section.compare(0, k_run_section_prefix.size(), k_run_section_prefix) != 0)
+            continue;
+
+        const std::string run_name = section.substr(k_run_section_prefix.size());
+        const std::string se_engine = eval_reader.Get(section, "search_engine", "");
+        if(se_engine.empty())
+            LOG(FATAL) << "You need to specify a search_engine for the run " << run_name;
+
+        // The run section overrides the engine parameters, like a model section
+        SearchEngine::SearchEnginePtr search_engine = \
+            SearchEngine::create_search_engine(eval_reader, se_engine, section,
+                                               torch_manager, database_manager);
+        search_engine->setModels({model_name});
+
+        LOG(INFO) << "Building the run " << run_name << " (" << se_engine << ")";
+        const auto build_start = std::chrono::steady_clock::now();
+        search_engine->setup();
+        const double build_seconds = \
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - build_start).count();
+
+        for(const int nprobe : parse_int_list(eval_reader.Get(section, "nprobe", "")))
+            for(const int ef_search : parse_int_list(eval_reader.Get(section, "ef_search", "")))
+                for(const int search_k : parse_int_list(eval_reader.Get(section, "search_k", "")))
+                {
+                    SearchParameters params;
+                    params.mNprobe = nprobe;
+                    params.mEfSearch = ef_search;
+                    params.mSearchK = search_k;
+
+                    EvalResult result = evaluate_search(search_engine, model_name, dataset,
+                                                        queries, query_vectors, query_dim,
+                                                        ground_truth, top_k, params);
+                    result.mRun = run_name;
+                    result.mEngine = se_engine;
+                    result.mBuildSeconds = build_seconds;
+                    results.push_back(result);
+                }
+    }
+
+    if(results.empty())
+        LOG(FATAL) << "No run sections found in the evaluation file.";
+
+    print_table(results, top_k);
+    if(!output_filename.empty())
+        write_json(output_filename, model_name, dataset.size(),
+                   static_cast<int>(queries.size()), top_k, results);
+
+    google::protobuf::ShutdownProtobufLibrary();
+    return 0;
+}
@@ -1,4 +1,18 @@
 #include "torchmanager.hpp"
+#include "databasemanager.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <exception>
+#include <random>
+#include <sstream>
+#include <unordered_set>
+#include <sys/stat.h>
+#include <pthread.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include <easylogging++.h>
 
@@ -7,102 +21,890 @@
 
 namespace {
     const string k_model_conf_name = "model.conf";
+    const string k_transform_file_name = "transform.faiss";
+
+    // Vectors sampled from the database to train the feature transforms,
+    // at least k_transform_min_factor times the reduced dimension
+    const size_t k_transform_train_size = 100000;
+    const int k_transform_min_factor = 4;
+
+    // Interval of the cancellation checks while waiting for a replica
+    const std::chrono::milliseconds k_checkout_poll_interval(50);
+
+    /**
+     * Get the cores the process can run on, which are restricted by its
+     * affinity mask (e.g. taskset or the cpuset of a container).
+     */
+    std::vector<int> process_cores()
+    {
+        std::vector<int> cores;
+#ifdef __linux__
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        if(sched_getaffinity(0, sizeof(cpu_set_t), &mask) == 0)
+        {
+            for(int core=0; core<CPU_SETSIZE; core++)
+                if(CPU_ISSET(core, &mask))
+                    cores.push_back(core);
+            return cores;
+        }
+#endif
+        const int total = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        for(int core=0; core<total; core++)
+            cores.push_back(core);
+        return cores;
+    }
+
+    /**
+     * Get the cores of each pinned replica, its intra-op threads or else
+     * an equal share of the free cores.
+     */
+    int replica_core_count(int replicas, int intra_op_threads, int free_cores)
+    {
+        return (intra_op_threads > 0) ? intra_op_threads :
+                                        std::max(1, free_cores / std::max(replicas, 1));
+    }
+
+#ifdef __linux__
+    /**
+     * Set the affinity of the calling thread and of the OpenMP workers of
+     * its teams. The workers are kept by the thread between its parallel
+     * regions and only inherit its affinity when they are created, so they
+     * are pinned by running a region on all of them.
+     */
+    void set_team_affinity(const cpu_set_t &cores)
+    {
+#ifdef _OPENMP
+        #pragma omp parallel
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cores);
+#endif
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cores);
+    }
+#endif
+
+    long now_seconds()
+    {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    long file_modification_time(const string &file_name)
+    {
+        struct stat file_stat;
+        if(stat(file_name.c_str(), &file_stat) != 0)
+            return -1;
+        return static_cast<long>(file_stat.st_mtime);
+    }
+
+    /**
+     * Parse a list of shapes such as "1x3x224x224 1x3x300x300".
+     * @return true if all the shapes have positive dimensions, false otherwise
+     */
+    bool parse_shapes(const string &shapes_str, std::vector<std::vector<int64_t>> *shapes)
+    {
+        std::istringstream shapes_stream(shapes_str);
+        string shape_str;
+
+        while(shapes_stream >> shape_str)
+        {
+            std::vector<int64_t> shape;
+            std::istringstream shape_stream(shape_str);
+            string dim_str;
+            while(std::getline(shape_stream, dim_str, 'x'))
+            {
+                char *end = nullptr;
+                const long long dim = std::strtoll(dim_str.c_str(), &end, 10);
+                if(dim_str.empty() || *end != '\0' || dim <= 0)
+                    return false;
+                shape.push_back(static_cast<int64_t>(dim));
+            }
+            if(shape.empty())
+                return false;
+            shapes->push_back(shape);
+        }
+
+        return true;
+    }
+}
+
+ModuleReplicaPool::ModuleReplicaPool(const std::vector<torchmodule_t> &modules, bool shared,
+                                     int intra_op_threads, const std::vector<int> &cores)
+: mModules(modules), mShared(shared), mIntraOpThreads(intra_op_threads)
+{
+    const int replicas = static_cast<int>(mModules.size());
+    mCores.resize(replicas);
+    if(!cores.empty())
+    {
+        // Replicas get disjoint shares of the cores reserved for the
+        // model, and the OpenMP team of a replica has one thread per core
+        const int replica_cores = std::max(1, static_cast<int>(cores.size()) / replicas);
+        mIntraOpThreads = replica_cores;
+        for(int r=0; r<replicas; r++)
+            for(int c=0; c<replica_cores; c++)
+                mCores[r].push_back(cores[r * replica_cores + c]);
+    }
+
+    for(int r=replicas-1; r>=0; r--)
+        mFree.push_back(r);
 }
 
-void TorchManager::addModule(const string &module_name,
-        const string &file_name)
+int ModuleReplicaPool::checkout(const deadline_t &deadline,
+                                const std::function<bool()> &is_cancelled)
 {
-    TorchManager::torchmodule_t module = \
-        std::make_shared<torch::jit::script::Module>(torch::jit::load(file_name));
+    if(mShared)
+        return 0;
 
-    if(module == nullptr)
-        LOG(FATAL) << "Unable to load module " << file_name;
+    // The wait wakes up periodically to check the cancellation, and
+    // requests without deadline only wait for a free replica
+    std::unique_lock<std::mutex> lock(mMutex);
+    while(mFree.empty())
+    {
+        if(is_cancelled && is_cancelled())
+            return -1;
+
+        const deadline_t now = std::chrono::steady_clock::now();
+        if(now >= deadline)
+            return -1;
+
+        const deadline_t wake_up = (deadline - now > k_checkout_poll_interval) ?
+                                   now + k_checkout_poll_interval : deadline;
+        mCondition.wait_until(lock, wake_up);
+    }
 
-    mModuleMap[module_name] = module;
-    LOG(INFO) << "Module " << module_name << " loaded.";
+    const int replica = mFree.back();
+    mFree.pop_back();
+    return replica;
 }
 
-bool TorchManager::getModule(const std::string &module_name, torchmodule_t &module) const
+void ModuleReplicaPool::checkin(int replica)
 {
-    modulemap_t::const_iterator pair = mModuleMap.find(module_name);
-    if(pair == mModuleMap.end())
+    if(mShared)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mFree.push_back(replica);
+    }
+    mCondition.notify_one();
+}
+
+const ModuleReplicaPool::torchmodule_t &ModuleReplicaPool::getModule(int replica) const
+{
+    return mModules[replica];
+}
+
+int ModuleReplicaPool::getIntraOpThreads() const
+{
+    return mIntraOpThreads;
+}
+
+const std::vector<int> &ModuleReplicaPool::getCores(int replica) const
+{
+    return mCores[replica];
+}
+
+ModuleLease::ModuleLease()
+: mReplica(-1), mPreviousThreads(0), mPinned(false)
+{ }
+
+ModuleLease::~ModuleLease()
+{
+    release();
+}
+
+bool ModuleLease::acquire(const ModuleReplicaPool::ModuleReplicaPoolPtr &pool,
+                          const ModuleReplicaPool::deadline_t &deadline,
+                          const std::function<bool()> &is_cancelled)
+{
+    release();
+    const int replica = pool->checkout(deadline, is_cancelled);
+    if(replica < 0)
         return false;
 
-    module = pair->second;
+    mPool = pool;
+    mReplica = replica;
+
+    // The OpenMP thread count is a setting of the calling thread, the
+    // intra-op parallel regions of the forward use it for their teams
+#ifdef _OPENMP
+    if(mPool->getIntraOpThreads() > 0)
+    {
+        mPreviousThreads = omp_get_max_threads();
+        omp_set_num_threads(mPool->getIntraOpThreads());
+    }
+#endif
+
+#ifdef __linux__
+    const std::vector<int> &cores = mPool->getCores(mReplica);
+    if(!cores.empty() &&
+       pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &mPreviousCores) == 0)
+    {
+        cpu_set_t replica_cores;
+        CPU_ZERO(&replica_cores);
+        for(const int core : cores)
+            CPU_SET(core, &replica_cores);
+        mPinned = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &replica_cores) == 0;
+        if(mPinned)
+            set_team_affinity(replica_cores);
+    }
+#endif
     return true;
 }
 
+void ModuleLease::release()
+{
+    if(mPool == nullptr)
+        return;
+
+    // The team is restored while it still has the size of the replica
+#ifdef __linux__
+    if(mPinned)
+        set_team_affinity(mPreviousCores);
+#endif
+#ifdef _OPENMP
+    if(mPreviousThreads > 0)
+        omp_set_num_threads(mPreviousThreads);
+#endif
+
+    mPool->checkin(mReplica);
+    mPool.reset();
+    mReplica = -1;
+    mPreviousThreads = 0;
+    mPinned = false;
+}
+
+torch::jit::script::Module *ModuleLease::operator->() const
+{
+    return mPool->getModule(mReplica).get();
+}
+
+TorchManager::TorchManager(bool lazy_loading, int idle_timeout, int intra_op_threads)
+: mLazyLoading(lazy_loading), mIdleTimeout(idle_timeout),
+  mIntraOpThreads(intra_op_threads), mProcessCores(process_cores()),
+  mStopIdleMonitor(false)
+{
+    if(mIdleTimeout > 0)
+        mIdleThread = std::thread(&TorchManager::idleMonitor, this);
+}
+
+TorchManager::~TorchManager()
+{
+    if(mIdleThread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mIdleMutex);
+            mStopIdleMonitor = true;
+        }
+        mIdleCondition.notify_all();
+        mIdleThread.join();
+    }
+}
+
+bool TorchManager::addModule(const string &module_name,
+                             const string &file_name,
+                             const TorchModelProp &props,
+                             const TorchModelLoadOptions &options,
+                             string *error)
+{
+    ModuleEntryPtr entry = std::make_shared<ModuleEntry>();
+    entry->mFileName = file_name;
+    entry->mProps = props;
+    entry->mOptions = options;
+    entry->mFileTime = file_modification_time(file_name);
+    entry->mLastUsed = now_seconds();
+
+    // Transforms trained before (or offline) are read back, the others
+    // are trained by trainTransforms()
+    if(!options.mFeatureTransform.empty())
+    {
+        entry->mTransform = std::make_shared<FeatureTransform>(options.mFeatureTransform,
+                                                               props.getFeatureDim());
+        if(file_modification_time(options.mTransformFileName) >= 0 &&
+           !entry->mTransform->load(options.mTransformFileName))
+        {
+            *error = "Unable to load the feature transform of the module " + module_name;
+            return false;
+        }
+    }
+
+    std::vector<int> previous_cores;
+    if(!reserveCores(module_name, options, &entry->mCores, &previous_cores, error))
+        return false;
+
+    // Load before publishing the entry, so a reload never exposes
+    // a model that isn't ready when lazy loading is disabled.
+    if(!mLazyLoading && loadModule(module_name, entry, error) == nullptr)
+    {
+        restoreCores(module_name, previous_cores);
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mModuleMap[module_name] = entry;
+    }
+
+    LOG(INFO) << "Module " << module_name << " (version "
+              << props.getVersion() << ") added.";
+    return true;
+}
+
+bool TorchManager::reserveCores(const string &module_name,
+                                const TorchModelLoadOptions &options,
+                                std::vector<int> *cores, std::vector<int> *previous,
+                                string *error)
+{
+    std::lock_guard<std::mutex> lock(mCoresMutex);
+    cores->clear();
+    previous->clear();
+    if(mPinnedCores.count(module_name) > 0)
+        *previous = mPinnedCores[module_name];
+
+    if(!options.mPinReplicas || options.mReplicas <= 0)
+    {
+        mPinnedCores.erase(module_name);
+        return true;
+    }
+
+    // Pinned replicas sharing cores would run slower than unpinned ones
+    std::unordered_set<int> reserved;
+    for(const auto &pair : mPinnedCores)
+        if(pair.first != module_name)
+            reserved.insert(pair.second.begin(), pair.second.end());
+
+    std::vector<int> free_cores;
+    for(const int core : mProcessCores)
+        if(reserved.count(core) == 0)
+            free_cores.push_back(core);
+
+    const int intra_op_threads = (options.mReplicaThreads > 0) ? options.mReplicaThreads :
+                                 mIntraOpThreads;
+    const int needed_cores = options.mReplicas * \
+        replica_core_count(options.mReplicas, intra_op_threads, static_cast<int>(free_cores.size()));
+    if(needed_cores > static_cast<int>(free_cores.size()))
+    {
+        *error = "The " + std::to_string(options.mReplicas) + " pinned replicas of the model " +
+                 module_name + " need " + std::to_string(needed_cores) + " cores, but only " +
+                 std::to_string(free_cores.size()) + " of the " +
+                 std::to_string(mProcessCores.size()) + " cores of the process are free.";
+        return false;
+    }
+
+    cores->assign(free_cores.begin(), free_cores.begin() + needed_cores);
+    mPinnedCores[module_name] = *cores;
+    return true;
+}
+
+void TorchManager::restoreCores(const string &module_name, const std::vector<int> &previous)
+{
+    std::lock_guard<std::mutex> lock(mCoresMutex);
+    if(previous.empty())
+        mPinnedCores.erase(module_name);
+    else
+        mPinnedCores[module_name] = previous;
+}
+
+ModuleReplicaPool::ModuleReplicaPoolPtr TorchManager::loadModule(const string &module_name,
+                                                                 const ModuleEntryPtr &entry,
+                                                                 string *error)
+{
+    std::lock_guard<std::mutex> lock(entry->mLoadMutex);
+
+    // Another request might have loaded it while we were waiting
+    ModuleReplicaPool::ModuleReplicaPoolPtr pool = std::atomic_load(&entry->mPool);
+    if(pool != nullptr)
+        return pool;
+
+    TIMED_SCOPE(timerLoadModule, "LoadModule");
+
+    // Each replica is loaded from the file, so they share no state
+    const TorchModelLoadOptions &options = entry->mOptions;
+    const int replicas = std::max(options.mReplicas, 1);
+    std::vector<torchmodule_t> modules;
+    try
+    {
+        for(int r=0; r<replicas; r++)
+        {
+            torchmodule_t module = \
+                std::make_shared<torch::jit::script::Module>(torch::jit::load(entry->mFileName));
+
+            // The module is only published after the warmup, so requests
+            // never hit the executor profiling and optimization passes.
+            warmupModule(module_name, entry, module);
+            modules.push_back(module);
+        }
+    }
+    catch(const std::exception &ex)
+    {
+        // A broken module file (or warmup shape) must not take down
+        // a running server, the caller reports it
+        *error = "Unable to load module " + entry->mFileName + ": " + ex.what();
+        return nullptr;
+    }
+
+    // Replicas without their own thread budget use the server one, the
+    // lease applies it to the thread running the forward
+    const int intra_op_threads = (options.mReplicaThreads > 0) ? options.mReplicaThreads :
+                                 mIntraOpThreads;
+    pool = std::make_shared<ModuleReplicaPool>(modules, options.mReplicas <= 0,
+                                               intra_op_threads, entry->mCores);
+    std::atomic_store(&entry->mPool, pool);
+
+    if(options.mReplicas > 0)
+        LOG(INFO) << "Module " << module_name << " loaded with " << replicas << " replicas.";
+    else
+        LOG(INFO) << "Module " << module_name << " loaded.";
+    return pool;
+}
+
+void TorchManager::warmupModule(const string &module_name,
+                                const ModuleEntryPtr &entry,
+                                const torchmodule_t &module)
+{
+    const TorchModelLoadOptions &options = entry->mOptions;
+    if(options.mWarmupIterations <= 0 || options.mWarmupShapes.empty())
+        return;
+
+    TIMED_SCOPE(timerWarmup, "WarmupModule");
+    torch::NoGradGuard nograd;
+
+    for(const std::vector<int64_t> &shape : options.mWarmupShapes)
+    {
+        std::vector<torch::jit::IValue> inputs;
+        inputs.push_back(torch::rand(shape));
+
+        for(int i=0; i<options.mWarmupIterations; i++)
+            module->forward(inputs);
+    }
+
+    LOG(INFO) << "Module " << module_name << " warmed up with "
+              << options.mWarmupIterations << " iterations for "
+              << options.mWarmupShapes.size() << " shapes.";
+}
+
+TorchManager::ModuleEntryPtr TorchManager::findEntry(const string &module_name) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    modulemap_t::const_iterator pair = mModuleMap.find(module_name);
+    if(pair == mModuleMap.end())
+        return nullptr;
+    return pair->second;
+}
+
+ModuleCheckout TorchManager::getModule(const std::string &module_name, ModuleLease &module,
+                                       const ModuleReplicaPool::deadline_t &deadline,
+                                       const std::function<bool()> &is_cancelled)
+{
+    ModuleEntryPtr entry = findEntry(module_name);
+    if(entry == nullptr)
+        return ModuleCheckout::NOT_FOUND;
+
+    entry->mLastUsed = now_seconds();
+    ModuleReplicaPool::ModuleReplicaPoolPtr pool = std::atomic_load(&entry->mPool);
+    if(pool == nullptr)
+    {
+        string error;
+        pool = loadModule(module_name, entry, &error);
+        if(pool == nullptr)
+        {
+            LOG(ERROR) << error;
+            return ModuleCheckout::NOT_FOUND;
+        }
+    }
+
+    if(!module.acquire(pool, deadline, is_cancelled))
+        return ModuleCheckout::TIMED_OUT;
+    return ModuleCheckout::OK;
+}
+
+bool TorchManager::hasModule(const std::string &module_name) const
+{
+    return findEntry(module_name) != nullptr;
+}
+
 void TorchManager::populateFromDir(const string &dirname)
 {
+    mModelsDir = dirname;
+    scanDir(dirname, nullptr, nullptr);
+}
+
+std::vector<std::string> TorchManager::reloadFromDir(std::vector<std::string> *failures)
+{
+    TIMED_SCOPE(timerReload, "ReloadModels");
+    std::vector<std::string> changed;
+    scanDir(mModelsDir, &changed, failures);
+    return changed;
+}
+
+void TorchManager::scanDir(const string &dirname, std::vector<std::string> *changed,
+                           std::vector<std::string> *failures)
+{
+    // At startup a bad model directory stops the server, on reloads it
+    // is skipped so the running models keep serving
+    const bool reload = (failures != nullptr);
+
     tinydir_dir dir;
     if (tinydir_open(&dir, dirname.c_str()) == -1)
-        LOG(FATAL) << "Directory for models" << dirname << " not found.";
+    {
+        if(!reload)
+            LOG(FATAL) << "Directory for models" << dirname << " not found.";
+        failures->push_back("Directory for models " + dirname + " not found.");
+        return;
+    }
 
     while (dir.has_next)
     {
         tinydir_file file;
         if (tinydir_readfile(&dir, &file) == -1)
-            LOG(FATAL) << "Error reading file.";
+        {
+            if(!reload)
+                LOG(FATAL) << "Error reading file.";
+            failures->push_back("Error reading the models directory " + dirname);
+            break;
+        }
 
         const string filename = string(file.name);
         const string filepath = string(file.path);
 
         if (tinydir_next(&dir) == -1)
-            LOG(FATAL) << "Error getting next file.";
+        {
+            if(!reload)
+                LOG(FATAL) << "Error getting next file.";
+            failures->push_back("Error reading the models directory " + dirname);
+            break;
+        }
 
-        if (filename == "." or filename == "..")
+        if (filename == "." or filename == ".." or !file.is_dir)
             continue;
 
-        if (file.is_dir)
-        {
-            const string config_filename = filepath + "/" + k_model_conf_name;
-            INIReader reader(config_filename);
-            if (reader.ParseError() < 0)
-                LOG(FATAL) << "Unable to parse the configuration file: " << config_filename;
+        string error;
+        if(scanModelDir(filepath, changed, &error))
+            continue;
+
+        if(!reload)
+            LOG(FATAL) << error;
+
+        LOG(ERROR) << "Skipping the model in " << filepath << ": " << error;
+        failures->push_back(filepath + ": " + error);
+    }
+
+    tinydir_close(&dir);
+}
+
+bool TorchManager::scanModelDir(const string &filepath, std::vector<std::string> *changed,
+                                string *error)
+{
+    const string config_filename = filepath + "/" + k_model_conf_name;
+    INIReader reader(config_filename);
+    if (reader.ParseError() < 0)
+    {
+        *error = "Unable to parse the configuration file: " + config_filename;
+        return false;
+    }
+
+    const string model_name = reader.Get("model", "name", "");
+    if(model_name.empty())
+    {
+        *error = "You need to specify a model_name for the model.";
+        return false;
+    }
+
+    const string model_filename = reader.Get("model", "filename", "");
+    if(model_filename.empty())
+    {
+        *error = "You need to specify a filename for the model.";
+        return false;
+    }
+
+    const int prediction_dim = reader.GetInteger("model", "prediction_dim", -1);
+    if(prediction_dim <= 0)
+    {
+        *error = "You need to specify a model prediction dimension.";
+        return false;
+    }
+
+    const int feature_dim = reader.GetInteger("model", "feature_dim", -1);
+    if(feature_dim <= 0)
+    {
+        *error = "You need to specify a model feature dimension.";
+        return false;
+    }
+
+    const int version = reader.GetInteger("model", "version", 1);
+
+    // Predictions can be stored as the top-N classes or skipped,
+    // since they are usually larger than the features.
+    const string storage_name = reader.Get("model", "predictions_storage", "dense");
+    PredictionStorage prediction_storage = PredictionStorage::DENSE;
+    if(storage_name == "sparse")
+        prediction_storage = PredictionStorage::SPARSE;
+    else if(storage_name == "none")
+        prediction_storage = PredictionStorage::NONE;
+    else if(storage_name != "dense")
+    {
+        *error = "Unknown predictions_storage for the model " + model_name + ": " + storage_name;
+        return false;
+    }
+
+    const int predictions_top_n = reader.GetInteger("model", "predictions_top_n", 5);
+    if(prediction_storage == PredictionStorage::SPARSE && predictions_top_n <= 0)
+    {
+        *error = "The predictions_top_n must be greater than zero.";
+        return false;
+    }
+
+    // Features can be reduced by a learned transform for all the
+    // search engines, and stored only in the reduced form.
+    const string feature_transform = reader.Get("model", "feature_transform", "");
+    const bool store_reduced = reader.GetBoolean("model", "store_reduced", false);
+    if(store_reduced && feature_transform.empty())
+    {
+        *error = "The model " + model_name + " needs a feature_transform to store reduced features.";
+        return false;
+    }
+
+    if(!feature_transform.empty() &&
+       !FeatureTransform::validate(feature_transform, feature_dim, error))
+        return false;
 
-            const string model_name = reader.Get("model", "name", "");
-            if(model_name.empty())
-                LOG(FATAL) << "You need to specify a model_name for the model.";
+    const TorchModelProp props(prediction_dim, feature_dim, version,
+                               prediction_storage, predictions_top_n,
+                               store_reduced);
 
-            const string model_filename = reader.Get("model", "filename", "");
-            if(model_filename.empty())
-                LOG(FATAL) << "You need to specify a filename for the model.";
+    TorchModelLoadOptions options;
+    options.mWarmupIterations = reader.GetInteger("model", "warmup_iterations", 0);
+    if(!parse_shapes(reader.Get("model", "warmup_shapes", ""), &options.mWarmupShapes))
+    {
+        *error = "Invalid warmup_shapes for the model " + model_name + ".";
+        return false;
+    }
+
+    // Replicas let concurrent requests run their forwards in
+    // parallel, each with its own intra-op threads and cores
+    options.mReplicas = reader.GetInteger("model", "replicas", 0);
+    options.mReplicaThreads = reader.GetInteger("model", "replica_threads", 0);
+    options.mPinReplicas = reader.GetBoolean("model", "pin_replicas", false);
+
+    const string model_path = filepath + "/" + model_filename;
+    if(file_modification_time(model_path) < 0)
+    {
+        *error = "The traced module " + model_path + " doesn't exist.";
+        return false;
+    }
+
+    options.mFeatureTransform = feature_transform;
+    options.mTransformFileName = filepath + "/" + \
+        reader.Get("model", "transform_filename", k_transform_file_name);
 
-            const int prediction_dim = reader.GetInteger("model", "prediction_dim", -1);
-            if(prediction_dim == -1)
-                LOG(FATAL) << "You need to specify a model prediction dimension.";
+    // On reloads, only add new models or the ones that changed
+    ModuleEntryPtr current = findEntry(model_name);
+    if(changed != nullptr && current != nullptr)
+    {
+        if(current->mProps.getVersion() == version &&
+           current->mFileTime == file_modification_time(model_path))
+            return true;
 
-            const int feature_dim = reader.GetInteger("model", "feature_dim", -1);
-            if(feature_dim == -1)
-                LOG(FATAL) << "You need to specify a model feature dimension.";
+        // The search indexes are built for the feature dimension
+        if(current->mProps.getFeatureDim() != feature_dim)
+        {
+            *error = "Model " + model_name + " changed its feature dimension, " +
+                     "it requires a restart to be reloaded.";
+            return false;
+        }
 
-            mModuleProp[model_name] = TorchModelProp(prediction_dim, feature_dim);
-            const string model_path = filepath + "/" + model_filename;
-            addModule(model_name, model_path);
+        // The stored and indexed vectors may be reduced by the transform
+        if(current->mOptions.mFeatureTransform != options.mFeatureTransform ||
+           current->mOptions.mTransformFileName != options.mTransformFileName)
+        {
+            *error = "Model " + model_name + " changed its feature transform, " +
+                     "it can't be reloaded.";
+            return false;
         }
     }
 
+    if(!addModule(model_name, model_path, props, options, error))
+        return false;
 
-    tinydir_close(&dir);
+    if(changed != nullptr)
+        changed->push_back(model_name);
+    return true;
+}
+
+void TorchManager::idleMonitor()
+{
+    std::unique_lock<std::mutex> lock(mIdleMutex);
+    const std::chrono::seconds check_interval(std::max(1, mIdleTimeout / 2));
+
+    while(!mIdleCondition.wait_for(lock, check_interval,
+                                   [this]{ return mStopIdleMonitor; }))
+    {
+        std::vector<std::pair<std::string, ModuleEntryPtr>> entries;
+        {
+            std::lock_guard<std::mutex> map_lock(mMutex);
+            entries.assign(mModuleMap.begin(), mModuleMap.end());
+        }
+
+        // Requests in-flight hold their own reference to the replicas,
+        // so they are only released after they finish.
+        const long now = now_seconds();
+        for(const auto &pair : entries)
+        {
+            const ModuleEntryPtr &entry = pair.second;
+            if(now - entry->mLastUsed < mIdleTimeout)
+                continue;
+
+            std::lock_guard<std::mutex> load_lock(entry->mLoadMutex);
+            if(std::atomic_load(&entry->mPool) == nullptr)
+                continue;
+
+            std::atomic_store(&entry->mPool, ModuleReplicaPool::ModuleReplicaPoolPtr());
+            LOG(INFO) << "Module " << pair.first << " unloaded after being idle.";
+        }
+    }
 }
 
 int TorchManager::size() const
 {
+    std::lock_guard<std::mutex> lock(mMutex);
     return mModuleMap.size();
 }
 
 TorchModelProp TorchManager::getModuleProps(const string &module_name) const
 {
-    moduleprop_t::const_iterator pair = mModuleProp.find(module_name);
-    if(pair == mModuleProp.end())
+    ModuleEntryPtr entry = findEntry(module_name);
+    if(entry == nullptr)
         LOG(FATAL) << "Properties for module " << module_name << " not found.";
-    return pair->second;
+    return entry->mProps;
+}
+
+FeatureTransform::FeatureTransformPtr TorchManager::getTransform(const string &module_name) const
+{
+    ModuleEntryPtr entry = findEntry(module_name);
+    if(entry == nullptr || entry->mTransform == nullptr || !entry->mTransform->isTrained())
+        return nullptr;
+    return entry->mTransform;
+}
+
+int TorchManager::getIndexDim(const string &module_name) const
+{
+    FeatureTransform::FeatureTransformPtr transform = getTransform(module_name);
+    if(transform != nullptr)
+        return transform->getOutputDim();
+    return getModuleProps(module_name).getFeatureDim();
+}
+
+void TorchManager::trainTransforms(const std::shared_ptr<DatabaseManager> &database_manager,
+                                   const std::vector<std::string> *models,
+                                   std::vector<std::string> *failures)
+{
+    std::unordered_map<string, ModuleEntryPtr> untrained;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for(const auto &pair : mModuleMap)
+        {
+            if(models != nullptr &&
+               std::find(models->begin(), models->end(), pair.first) == models->end())
+                continue;
+            if(pair.second->mTransform != nullptr && !pair.second->mTransform->isTrained())
+                untrained.insert(pair);
+        }
+    }
+
+    if(untrained.empty())
+        return;
+
+    TIMED_SCOPE(timerTrainTransforms, "TrainTransforms");
+
+    // Uniform sample of the full size features of each model
+    std::unordered_map<string, std::vector<float>> samples;
+    std::unordered_map<string, size_t> seen;
+    std::unordered_map<string, size_t> reduced;
+    std::mt19937_64 generator(std::random_device{}());
+
+    DatabaseManager::DatabaseIterator it(database_manager->newIterator(false));
+    for (it->SeekToFirst(); it->Valid(); it->Next())
+    {
+        euclidesproto::ItemData item_data;
+        item_data.ParseFromString(it->value().ToString());
+
+        for(const auto &vector : item_data.vectors())
+        {
+            std::unordered_map<string, ModuleEntryPtr>::const_iterator pair = \
+                untrained.find(vector.model());
+            if(pair == untrained.end())
+                continue;
+
+            // Vectors stored reduced by a transform whose file is gone
+            const FeatureTransform::FeatureTransformPtr &transform = pair->second->mTransform;
+            if(vector.features_size() == transform->getOutputDim())
+                reduced[vector.model()]++;
+
+            const int dim = transform->getInputDim();
+            if(vector.features_size() != dim)
+                continue;
+
+            std::vector<float> &sample = samples[vector.model()];
+            const size_t position = seen[vector.model()]++;
+            if(position < k_transform_train_size)
+            {
+                sample.insert(sample.end(), vector.features().begin(), vector.features().end());
+                continue;
+            }
+
+            const size_t replaced = std::uniform_int_distribution<size_t>(0, position)(generator);
+            if(replaced < k_transform_train_size)
+                std::copy(vector.features().begin(), vector.features().end(),
+                          sample.begin() + replaced * dim);
+        }
+    }
+    it.reset();
+
+    for(const auto &pair : untrained)
+    {
+        if(reduced[pair.first] > 0)
+        {
+            const string error = "The database has " + std::to_string(reduced[pair.first]) +
+                " reduced features of the model " + pair.first + " but its feature transform " +
+                pair.second->mOptions.mTransformFileName + " is missing, restore the file "
+                "instead of training a new transform.";
+            if(failures == nullptr)
+                LOG(FATAL) << error;
+            LOG(ERROR) << error;
+            failures->push_back(error);
+            continue;
+        }
+
+        const FeatureTransform::FeatureTransformPtr &transform = pair.second->mTransform;
+        const int n = static_cast<int>(samples[pair.first].size() / transform->getInputDim());
+        if(n < k_transform_min_factor * transform->getOutputDim())
+        {
+            LOG(WARNING) << "Not enough items to train the feature transform of the model "
+                         << pair.first << " (" << n << "), the full features are indexed.";
+            continue;
+        }
+
+        transform->train(n, samples[pair.first].data());
+        std::vector<float>().swap(samples[pair.first]);
+
+        if(!transform->save(pair.second->mOptions.mTransformFileName))
+        {
+            const string error = "Unable to save the feature transform of the model " + pair.first;
+            if(failures == nullptr)
+                LOG(FATAL) << error;
+            failures->push_back(error);
+            continue;
+        }
+
+        LOG(INFO) << "Trained the " << transform->getDescription() << " feature transform "
+                  << "of the model " << pair.first << " with " << n << " items.";
+    }
 }
 
 std::vector<std::string> TorchManager::getModuleList() const
 {
+    std::lock_guard<std::mutex> lock(mMutex);
     std::vector<std::string> keys;
-    keys.reserve(size());
+    keys.reserve(mModuleMap.size());
 
     for(auto item : mModuleMap)
         keys.push_back(item.first);
@@ -1,28 +1,218 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 #include <torch/torch.h>
 #include <torch/script.h>
 
+#include "featuretransform.hpp"
+
+class DatabaseManager;
+
+
+/**
+ * How the predictions of a model are stored in the database.
+ */
+enum class PredictionStorage
+{
+    DENSE,      // All the prediction_dim scores
+    SPARSE,     // Only the top-N (class, score) pairs
+    NONE        // Predictions are not stored
+};
+
 
 class TorchModelProp
 {
 public:
-    TorchModelProp(int prediction_dim, int feature_dim)
-    : mPredictionDim(prediction_dim), mFeatureDim(feature_dim)
+    TorchModelProp(int prediction_dim, int feature_dim, int version=1,
+                   PredictionStorage prediction_storage=PredictionStorage::DENSE,
+                   int predictions_top_n=0, bool store_reduced=false)
+    : mPredictionDim(prediction_dim), mFeatureDim(feature_dim),
+      mVersion(version), mPredictionStorage(prediction_storage),
+      mPredictionsTopN(predictions_top_n), mStoreReduced(store_reduced)
     {}
 
     TorchModelProp()
-    : mPredictionDim(-1), mFeatureDim(-1) { }
+    : mPredictionDim(-1), mFeatureDim(-1), mVersion(-1),
+      mPredictionStorage(PredictionStorage::DENSE), mPredictionsTopN(0),
+      mStoreReduced(false) { }
 
     int getPredictionDim() const { return mPredictionDim; }
     int getFeatureDim() const { return mFeatureDim; }
+    int getVersion() const { return mVersion; }
+    PredictionStorage getPredictionStorage() const { return mPredictionStorage; }
+    int getPredictionsTopN() const { return mPredictionsTopN; }
+
+    // If only the features reduced by the feature transform are stored
+    bool getStoreReduced() const { return mStoreReduced; }
 
 private:
     int mPredictionDim;
     int mFeatureDim;
+    int mVersion;
+    PredictionStorage mPredictionStorage;
+    int mPredictionsTopN;
+    bool mStoreReduced;
+};
+
+
+/**
+ * Options used when loading a module into memory.
+ */
+struct TorchModelLoadOptions
+{
+    TorchModelLoadOptions()
+    : mWarmupIterations(0), mReplicas(0),
+      mReplicaThreads(0), mPinReplicas(false)
+    { }
+
+    // Number of dummy forwards run for each warmup shape
+    int mWarmupIterations;
+
+    // Input shapes used for the warmup forwards
+    std::vector<std::vector<int64_t>> mWarmupShapes;
+
+    // The feature transform (e.g. "PCA256") and the file where it is
+    // persisted, no transform if empty
+    std::string mFeatureTransform;
+    std::string mTransformFileName;
+
+    // Number of replicas of the module, each used by one request at a
+    // time, 0 to share a single module among all the requests
+    int mReplicas;
+
+    // Intra-op threads of each replica, 0 to keep the server default
+    int mReplicaThreads;
+
+    // If each replica runs on its own subset of cores
+    bool mPinReplicas;
+};
+
+
+/**
+ * The result of checking out a module from the module manager.
+ */
+enum class ModuleCheckout
+{
+    OK,
+    NOT_FOUND,      // Unknown module, or it can't be loaded
+    TIMED_OUT       // No replica was free before the deadline, or cancelled
+};
+
+
+/**
+ * The replicas of a module. Each replica is an independent copy of the
+ * module used by one request at a time, with its own intra-op thread
+ * budget and optionally its own cores, so concurrent requests don't
+ * contend on the same module and thread pool. A pool without replicas
+ * shares a single module among all the requests.
+ */
+class ModuleReplicaPool
+{
+public:
+    typedef std::shared_ptr<torch::jit::script::Module> torchmodule_t;
+    typedef std::shared_ptr<ModuleReplicaPool> ModuleReplicaPoolPtr;
+    typedef std::chrono::steady_clock::time_point deadline_t;
+
+public:
+    /**
+     * @param modules the replicas, a single module if shared
+     * @param shared if the single module is shared among the requests
+     * @param intra_op_threads intra-op threads of each replica, 0 for the default
+     * @param cores the cores reserved for the module, split evenly among
+     *              the replicas to pin them, empty to not pin them
+     */
+    ModuleReplicaPool(const std::vector<torchmodule_t> &modules, bool shared,
+                      int intra_op_threads, const std::vector<int> &cores);
+
+    /**
+     * Check out a replica, waiting for one to be free.
+     * @param deadline time after which it stops waiting, max() for no deadline
+     * @param is_cancelled optional check for the cancellation of the request
+     * @return the index of the replica, or -1 if none was free before the
+     *         deadline or the request was cancelled
+     */
+    int checkout(const deadline_t &deadline=deadline_t::max(),
+                 const std::function<bool()> &is_cancelled=nullptr);
+
+    /**
+     * Return a replica to the pool.
+     * @param replica the index of the replica
+     */
+    void checkin(int replica);
+
+    const torchmodule_t &getModule(int replica) const;
+    int getIntraOpThreads() const;
+
+    /**
+     * @return the cores of a replica, empty if it isn't pinned
+     */
+    const std::vector<int> &getCores(int replica) const;
+
+private:
+    std::vector<torchmodule_t> mModules;
+    bool mShared;
+    int mIntraOpThreads;
+    std::vector<std::vector<int>> mCores;
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::vector<int> mFree;
+};
+
+
+/**
+ * A module replica checked out by a request, the replica runs in the
+ * calling thread with its thread budget and cores until the lease is
+ * released or destroyed.
+ */
+class ModuleLease
+{
+public:
+    ModuleLease();
+    ~ModuleLease();
+
+    ModuleLease(const ModuleLease&) = delete;
+    ModuleLease &operator=(const ModuleLease&) = delete;
+
+    /**
+     * Check out a replica of a pool, releasing the current one.
+     * @param pool the replicas of the module
+     * @param deadline time after which it stops waiting for a free replica
+     * @param is_cancelled optional check for the cancellation of the request
+     * @return true if a replica was checked out, false if it timed out
+     */
+    bool acquire(const ModuleReplicaPool::ModuleReplicaPoolPtr &pool,
+                 const ModuleReplicaPool::deadline_t &deadline=ModuleReplicaPool::deadline_t::max(),
+                 const std::function<bool()> &is_cancelled=nullptr);
+
+    /**
+     * Return the replica to its pool and restore the thread settings.
+     */
+    void release();
+
+    torch::jit::script::Module *operator->() const;
+
+private:
+    ModuleReplicaPool::ModuleReplicaPoolPtr mPool;
+    int mReplica;
+    int mPreviousThreads;
+    bool mPinned;
+#ifdef __linux__
+    cpu_set_t mPreviousCores;
+#endif
 };
 
 
@@ -30,29 +220,179 @@ class TorchManager
 {
 public:
     typedef std::shared_ptr<torch::jit::script::Module> torchmodule_t;
-    typedef std::unordered_map<std::string, torchmodule_t> modulemap_t;
-    typedef std::unordered_map<std::string, TorchModelProp> moduleprop_t;
+    typedef std::shared_ptr<TorchManager> TorchManagerPtr;
 
 public:
-    void addModule(const std::string &module_name,
-                   const std::string &file_name);
+    /**
+     * Construct the torch manager.
+     * @param lazy_loading if true, modules are only loaded on first use
+     * @param idle_timeout time in seconds after which a module that wasn't
+     *                     used is unloaded from memory, 0 to never unload
+     * @param intra_op_threads intra-op threads of each forward, applied to
+     *                         the thread running it, 0 for the default
+     */
+    TorchManager(bool lazy_loading=false, int idle_timeout=0, int intra_op_threads=0);
+    ~TorchManager();
+
+    /**
+     * Add (or replace) a module in the module manager. The module is
+     * loaded right away unless lazy loading is enabled.
+     * @param module_name the name of the module
+     * @param file_name the traced module file
+     * @param props the properties of the module
+     * @param options the options used to load the module
+     * @param error returns the reason when the module can't be added
+     * @return true if the module was added, false otherwise
+     */
+    bool addModule(const std::string &module_name,
+                   const std::string &file_name,
+                   const TorchModelProp &props,
+                   const TorchModelLoadOptions &options,
+                   std::string *error);
 
     /**
-     * Return a module from the module manager.
+     * Check out a replica of a module from the module manager, loading
+     * the module if it isn't loaded yet.
+     * @param module_name the name of the module
+     * @param module the returning lease of the replica
+     * @param deadline time after which it stops waiting for a free replica
+     * @param is_cancelled optional check for the cancellation of the request
+     * @return OK if a replica was checked out, NOT_FOUND if the module
+     *         wasn't found or loaded, TIMED_OUT if no replica was free
+     */
+    ModuleCheckout getModule(const std::string &module_name, ModuleLease &module,
+                             const ModuleReplicaPool::deadline_t &deadline=ModuleReplicaPool::deadline_t::max(),
+                             const std::function<bool()> &is_cancelled=nullptr);
+
+    /**
+     * Check if a module exists without loading it.
      * @param module_name the name of the module
-     * @param module the returning module
      * @return true if module was found, false otherwise
      */
-    bool getModule(const std::string &module_name, torchmodule_t &module) const;
+    bool hasModule(const std::string &module_name) const;
 
     TorchModelProp getModuleProps(const std::string &module_name) const;
+
+    /**
+     * Get the trained feature transform of a module.
+     * @param module_name the name of the module
+     * @return the transform, or nullptr if the module has no trained transform
+     */
+    FeatureTransform::FeatureTransformPtr getTransform(const std::string &module_name) const;
+
+    /**
+     * Get the dimension of the vectors indexed by the search engines, the
+     * reduced dimension when the module has a trained feature transform.
+     * @param module_name the name of the module
+     * @return the dimension of the indexed vectors
+     */
+    int getIndexDim(const std::string &module_name) const;
+
+    /**
+     * Train the feature transforms that weren't trained offline with a
+     * sample of the vectors in the database, and persist them. A transform
+     * is never trained again when the database has vectors reduced by a
+     * previous one, since they would mix two projections.
+     * @param database_manager the database with the training vectors
+     * @param models the models to train, nullptr for all of them
+     * @param failures if not nullptr, returns the models that can't be
+     *                 trained, otherwise they stop the server
+     */
+    void trainTransforms(const std::shared_ptr<DatabaseManager> &database_manager,
+                         const std::vector<std::string> *models=nullptr,
+                         std::vector<std::string> *failures=nullptr);
+
     void populateFromDir(const std::string &dirname);
+
+    /**
+     * Scan the models directory again, adding new models and reloading
+     * the models whose version or traced module file changed. Modules are
+     * swapped atomically, requests in-flight keep using the old module.
+     * Invalid model directories are skipped and the running models are
+     * kept.
+     * @param failures returns the model directories skipped and why
+     * @return the names of the models added or reloaded
+     */
+    std::vector<std::string> reloadFromDir(std::vector<std::string> *failures);
+
     std::vector<std::string> getModuleList() const;
     int size() const;
 
-    typedef std::shared_ptr<TorchManager> TorchManagerPtr;
-
 private:
+    struct ModuleEntry
+    {
+        std::string mFileName;
+        TorchModelProp mProps;
+        TorchModelLoadOptions mOptions;
+        long mFileTime;
+        ModuleReplicaPool::ModuleReplicaPoolPtr mPool;
+        FeatureTransform::FeatureTransformPtr mTransform;
+        std::vector<int> mCores;
+        std::mutex mLoadMutex;
+        std::atomic<long> mLastUsed;
+    };
+    typedef std::shared_ptr<ModuleEntry> ModuleEntryPtr;
+    typedef std::unordered_map<std::string, ModuleEntryPtr> modulemap_t;
+
+    /**
+     * Load the replicas of a module.
+     * @return the replicas, or nullptr with the reason in error if the
+     *         module can't be loaded
+     */
+    ModuleReplicaPool::ModuleReplicaPoolPtr loadModule(const std::string &module_name,
+                                                       const ModuleEntryPtr &entry,
+                                                       std::string *error);
+    void warmupModule(const std::string &module_name,
+                      const ModuleEntryPtr &entry,
+                      const torchmodule_t &module);
+    ModuleEntryPtr findEntry(const std::string &module_name) const;
+
+    /**
+     * Add the models of a directory, a bad model directory is fatal
+     * unless failures is set (on reloads), then it is skipped and reported.
+     */
+    void scanDir(const std::string &dirname, std::vector<std::string> *changed,
+                 std::vector<std::string> *failures);
+
+    /**
+     * Validate the model.conf of a model directory and add the model if
+     * it is new or changed.
+     * @return true if the model is valid, false with the reason in error
+     */
+    bool scanModelDir(const std::string &filepath, std::vector<std::string> *changed,
+                      std::string *error);
+    void idleMonitor();
+
+    /**
+     * Reserve the cores of the pinned replicas of a module among the cores
+     * of the process not reserved by the other modules, a module replaced
+     * can reuse its own cores.
+     * @param cores returns the cores reserved, empty if it isn't pinned
+     * @param previous returns the cores reserved before, to restore them
+     *                 with restoreCores() if the module can't be added
+     * @return true if the cores were reserved, false with the reason in
+     *         error if they don't fit
+     */
+    bool reserveCores(const std::string &module_name, const TorchModelLoadOptions &options,
+                      std::vector<int> *cores, std::vector<int> *previous, std::string *error);
+    void restoreCores(const std::string &module_name, const std::vector<int> &previous);
+
+    bool mLazyLoading;
+    int mIdleTimeout;
+    int mIntraOpThreads;
+    std::string mModelsDir;
+
+    mutable std::mutex mMutex;
     modulemap_t mModuleMap;
-    moduleprop_t mModuleProp;
+
+    // The cores of the process (its affinity mask) and the cores reserved
+    // by the pinned replicas of each module
+    std::vector<int> mProcessCores;
+    std::mutex mCoresMutex;
+    std::unordered_map<std::string, std::vector<int>> mPinnedCores;
+
+    std::mutex mIdleMutex;
+    std::condition_variable mIdleCondition;
+    bool mStopIdleMonitor;
+    std::thread mIdleThread;
 };
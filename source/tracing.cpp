@@ -0,0 +1,205 @@
+#include "tracing.hpp"
+
+#include <algorithm>
+#include <random>
+#include <sstream>
+
+#include <easylogging++.h>
+
+namespace {
+    // The trace of the request running on this thread
+    thread_local Trace *t_current_trace = nullptr;
+
+    bool slower_trace(const TracePtr &a, const TracePtr &b)
+    {
+        return a->getDurationUs() > b->getDurationUs();
+    }
+
+    /**
+     * Escape a string to be used in a JSON string.
+     * @param value the string
+     * @return the escaped string
+     */
+    std::string json_escape(const std::string &value)
+    {
+        std::string escaped;
+        escaped.reserve(value.size());
+        for(const char c : value)
+        {
+            if(c == '"' || c == '\\')
+                escaped += '\\';
+            if(static_cast<unsigned char>(c) < 0x20)
+                continue;
+            escaped += c;
+        }
+        return escaped;
+    }
+}
+
+Trace::Trace(uint64_t id, const std::string &name, timepoint_t origin, bool sampled)
+: mId(id), mName(name), mOrigin(origin), mSampled(sampled),
+  mStartUs(sinceOrigin(std::chrono::steady_clock::now())), mDurationUs(0)
+{ }
+
+int64_t Trace::sinceOrigin(timepoint_t time) const
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(time - mOrigin).count();
+}
+
+void Trace::addSpan(const std::string &name, timepoint_t start, timepoint_t end)
+{
+    TraceSpan span;
+    span.mName = name;
+    span.mStartUs = sinceOrigin(start);
+    span.mDurationUs = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    mSpans.push_back(span);
+}
+
+void Trace::finish()
+{
+    mDurationUs = sinceOrigin(std::chrono::steady_clock::now()) - mStartUs;
+}
+
+std::vector<TraceSpan> Trace::getSpans() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mSpans;
+}
+
+TraceScope::TraceScope(const std::string &name)
+: mTrace(t_current_trace)
+{
+    if(mTrace == nullptr)
+        return;
+    mName = name;
+    mStart = std::chrono::steady_clock::now();
+}
+
+TraceScope::~TraceScope()
+{
+    if(mTrace != nullptr)
+        mTrace->addSpan(mName, mStart, std::chrono::steady_clock::now());
+}
+
+Tracer::Tracer(double sample_rate, const std::string &trace_file,
+               int slow_query_log_size)
+: mSampleRate(sample_rate), mSlowQueryLogSize(slow_query_log_size),
+  mOrigin(std::chrono::steady_clock::now()), mNextId(1)
+{
+    if(!trace_file.empty() && mSampleRate > 0.0)
+    {
+        mTraceFile.open(trace_file, std::ios::out | std::ios::trunc);
+        if(!mTraceFile.is_open())
+            LOG(FATAL) << "Cannot open the trace file: " << trace_file;
+
+        // The JSON array format doesn't require the closing bracket, so
+        // the file is valid even if the server is killed.
+        mTraceFile << "[" << std::endl;
+    }
+}
+
+Tracer::~Tracer()
+{ }
+
+TracePtr Tracer::startTrace(const std::string &name)
+{
+    thread_local std::minstd_rand generator(std::random_device{}());
+    std::uniform_real_distribution<double> distribution(0.0, 1.0);
+    const bool sampled = mTraceFile.is_open() && distribution(generator) < mSampleRate;
+
+    if(!sampled && mSlowQueryLogSize <= 0)
+        return nullptr;
+
+    uint64_t id = 0;
+    {
+        std::lock_guard<std::mutex> lock(mIdMutex);
+        id = mNextId++;
+    }
+    return std::make_shared<Trace>(id, name, mOrigin, sampled);
+}
+
+void Tracer::finishTrace(const TracePtr &trace)
+{
+    trace->finish();
+
+    if(trace->isSampled())
+        exportTrace(trace);
+
+    if(mSlowQueryLogSize <= 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(mSlowMutex);
+    if(static_cast<int>(mSlowTraces.size()) < mSlowQueryLogSize)
+    {
+        mSlowTraces.push_back(trace);
+        std::push_heap(mSlowTraces.begin(), mSlowTraces.end(), slower_trace);
+    }
+    else if(trace->getDurationUs() > mSlowTraces.front()->getDurationUs())
+    {
+        // Replace the fastest of the slow requests
+        std::pop_heap(mSlowTraces.begin(), mSlowTraces.end(), slower_trace);
+        mSlowTraces.back() = trace;
+        std::push_heap(mSlowTraces.begin(), mSlowTraces.end(), slower_trace);
+    }
+}
+
+std::vector<TracePtr> Tracer::getSlowTraces() const
+{
+    std::vector<TracePtr> traces;
+    {
+        std::lock_guard<std::mutex> lock(mSlowMutex);
+        traces = mSlowTraces;
+    }
+    std::sort(traces.begin(), traces.end(), slower_trace);
+    return traces;
+}
+
+void Tracer::exportTrace(const TracePtr &trace)
+{
+    // Each request is a row (tid) of complete ("X") events
+    std::ostringstream events;
+    const std::string tid = std::to_string(trace->getId());
+    events << "{\"name\":\"" << json_escape(trace->getName()) << "\",\"ph\":\"X\","
+           << "\"ts\":" << trace->getStartUs() << ",\"dur\":" << trace->getDurationUs()
+           << ",\"pid\":1,\"tid\":" << tid << "},\n";
+
+    for(const TraceSpan &span : trace->getSpans())
+        events << "{\"name\":\"" << json_escape(span.mName) << "\",\"ph\":\"X\","
+               << "\"ts\":" << span.mStartUs << ",\"dur\":" << span.mDurationUs
+               << ",\"pid\":1,\"tid\":" << tid << "},\n";
+
+    std::lock_guard<std::mutex> lock(mExportMutex);
+    mTraceFile << events.str();
+    mTraceFile.flush();
+}
+
+Tracer::TracerPtr Tracer::build_tracer(const INIReader &conf_reader)
+{
+    const double sample_rate = conf_reader.GetReal("tracing", "sample_rate", 0.0);
+    if(sample_rate < 0.0 || sample_rate > 1.0)
+        LOG(FATAL) << "The tracing sample_rate must be between 0 and 1.";
+
+    const std::string trace_file = conf_reader.Get("tracing", "trace_file", "");
+    if(sample_rate > 0.0 && trace_file.empty())
+        LOG(FATAL) << "You need to specify a trace_file to sample traces.";
+
+    const int slow_query_log_size = \
+        static_cast<int>(conf_reader.GetInteger("tracing", "slow_query_log_size", 0));
+
+    return std::make_shared<Tracer>(sample_rate, trace_file, slow_query_log_size);
+}
+
+RequestTrace::RequestTrace(const Tracer::TracerPtr &tracer, const std::string &name)
+: mTracer(tracer), mTrace(tracer->startTrace(name)), mPreviousTrace(t_current_trace)
+{
+    t_current_trace = mTrace.get();
+}
+
+RequestTrace::~RequestTrace()
+{
+    t_current_trace = mPreviousTrace;
+    if(mTrace != nullptr)
+        mTracer->finishTrace(mTrace);
+}
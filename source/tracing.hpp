@@ -0,0 +1,166 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <INIReader.h>
+
+#define EUCLIDES_TRACE_CONCAT_IMPL(a, b) a##b
+#define EUCLIDES_TRACE_CONCAT(a, b) EUCLIDES_TRACE_CONCAT_IMPL(a, b)
+
+/**
+ * Record a span with the given name on the trace of the current request,
+ * from this point to the end of the scope. It has no effect when the
+ * request isn't traced.
+ */
+#define TRACE_SCOPE(name) TraceScope EUCLIDES_TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+
+/**
+ * A stage of a request, times are in microseconds since the tracer start.
+ */
+struct TraceSpan
+{
+    std::string mName;
+    int64_t mStartUs;
+    int64_t mDurationUs;
+};
+
+
+/**
+ * The trace of a single request with the spans of its stages.
+ */
+class Trace
+{
+public:
+    typedef std::chrono::steady_clock::time_point timepoint_t;
+
+    Trace(uint64_t id, const std::string &name, timepoint_t origin, bool sampled);
+
+    void addSpan(const std::string &name, timepoint_t start, timepoint_t end);
+    void finish();
+
+    uint64_t getId() const { return mId; }
+    const std::string &getName() const { return mName; }
+    bool isSampled() const { return mSampled; }
+    int64_t getStartUs() const { return mStartUs; }
+    int64_t getDurationUs() const { return mDurationUs; }
+    std::vector<TraceSpan> getSpans() const;
+
+private:
+    int64_t sinceOrigin(timepoint_t time) const;
+
+    uint64_t mId;
+    std::string mName;
+    timepoint_t mOrigin;
+    bool mSampled;
+    int64_t mStartUs;
+    int64_t mDurationUs;
+
+    mutable std::mutex mMutex;
+    std::vector<TraceSpan> mSpans;
+};
+typedef std::shared_ptr<Trace> TracePtr;
+
+
+/**
+ * A span of the trace bound to the current thread, see TRACE_SCOPE.
+ */
+class TraceScope
+{
+public:
+    explicit TraceScope(const std::string &name);
+    ~TraceScope();
+
+private:
+    Trace *mTrace;
+    std::string mName;
+    Trace::timepoint_t mStart;
+};
+
+
+/**
+ * The request tracer. Requests are traced when sampled (by the sample
+ * rate) or when the slow query log is enabled, since it must know the
+ * stages of the slowest requests. Sampled traces are appended to a
+ * Chrome trace event file (JSON array format), which can be opened in
+ * chrome://tracing or in Perfetto.
+ */
+class Tracer
+{
+public:
+    typedef std::shared_ptr<Tracer> TracerPtr;
+
+public:
+    /**
+     * Construct the tracer.
+     * @param sample_rate fraction of the requests exported, from 0 to 1
+     * @param trace_file the Chrome trace file, or empty to not export
+     * @param slow_query_log_size number of slowest requests kept, or zero
+     *                            to disable the slow query log
+     */
+    Tracer(double sample_rate, const std::string &trace_file,
+           int slow_query_log_size);
+    ~Tracer();
+
+    /**
+     * Start the trace of a request.
+     * @param name the name of the request
+     * @return the trace, or nullptr if the request isn't traced
+     */
+    TracePtr startTrace(const std::string &name);
+
+    /**
+     * Finish the trace of a request, exporting it when sampled and
+     * keeping it if it is one of the slowest requests.
+     * @param trace the trace of the request
+     */
+    void finishTrace(const TracePtr &trace);
+
+    /**
+     * @return the traces of the slowest requests, slowest first
+     */
+    std::vector<TracePtr> getSlowTraces() const;
+
+    static TracerPtr build_tracer(const INIReader &conf_reader);
+
+private:
+    void exportTrace(const TracePtr &trace);
+
+    double mSampleRate;
+    int mSlowQueryLogSize;
+    Trace::timepoint_t mOrigin;
+
+    std::mutex mIdMutex;
+    uint64_t mNextId;
+
+    std::mutex mExportMutex;
+    std::ofstream mTraceFile;
+
+    // Min-heap by duration with the slowest requests
+    mutable std::mutex mSlowMutex;
+    std::vector<TracePtr> mSlowTraces;
+};
+
+
+/**
+ * Trace a request for the lifetime of this object. The trace is bound to
+ * the current thread, so the TRACE_SCOPE spans of the search engines and
+ * database manager called by the request are added to it.
+ */
+class RequestTrace
+{
+public:
+    RequestTrace(const Tracer::TracerPtr &tracer, const std::string &name);
+    ~RequestTrace();
+
+private:
+    Tracer::TracerPtr mTracer;
+    TracePtr mTrace;
+    Trace *mPreviousTrace;
+};